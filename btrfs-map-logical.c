@@ -31,7 +31,8 @@
 #include "common/utils.h"
 #include "common/help.h"
 
-#define BUFFER_SIZE SZ_64K
+/* Big enough to read from all devices of striped profiles at once */
+#define BUFFER_SIZE SZ_1M
 
 /* we write the mirror info to stdout unless they are dumping the data
  * to stdout
@@ -164,21 +165,25 @@ static int print_mapping_info(struct btrfs_fs_info *fs_info, u64 logical,
 static int write_extent_content(struct btrfs_fs_info *fs_info, int out_fd,
 				u64 logical, u64 length, int mirror)
 {
-	char buffer[BUFFER_SIZE];
+	char *buffer;
 	u64 cur_offset = 0;
 	u64 cur_len;
 	int ret = 0;
 
+	buffer = malloc(BUFFER_SIZE);
+	if (!buffer)
+		return -ENOMEM;
+
 	while (cur_offset < length) {
 		cur_len = min_t(u64, length - cur_offset, BUFFER_SIZE);
-		ret = read_extent_data(fs_info, buffer,
-				       logical + cur_offset, &cur_len, mirror);
+		ret = read_data_from_disk(fs_info, buffer,
+					  logical + cur_offset, cur_len, mirror);
 		if (ret < 0) {
 			errno = -ret;
 			fprintf(stderr,
 				"Failed to read extent at [%llu, %llu]: %m\n",
 				logical, logical + length);
-			return ret;
+			break;
 		}
 		ret = write(out_fd, buffer, cur_len);
 		if (ret < 0 || ret != cur_len) {
@@ -186,10 +191,11 @@ static int write_extent_content(struct btrfs_fs_info *fs_info, int out_fd,
 				ret = -EINTR;
 			errno = -ret;
 			fprintf(stderr, "output file write failed: %m\n");
-			return ret;
+			break;
 		}
 		cur_offset += cur_len;
 	}
+	free(buffer);
 	return ret;
 }
 
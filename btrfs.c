@@ -20,14 +20,16 @@
 #include <getopt.h>
 
 #include "kernel-shared/volumes.h"
-#include "crypto/crc32c.h"
+#include "crypto/hash.h"
 #include "cmds/commands.h"
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/box.h"
+#include "common/memory-budget.h"
+#include "common/work-pool.h"
 
 static const char * const btrfs_cmd_group_usage[] = {
-	"btrfs [--help] [--version] [--format <format>] [-v|--verbose] [-q|--quiet] <group> [<group>...] <command> [<args>]",
+	"btrfs [--help] [--version] [--format <format>] [-v|--verbose] [-q|--quiet] [--cache-policy <policy>] [--memory-limit <size>] [--csum-threads <N>] [--direct-io] <group> [<group>...] <command> [<args>]",
 	NULL
 };
 
@@ -234,6 +236,44 @@ static void handle_output_format(const char *format)
 	}
 }
 
+static void handle_cache_policy(const char *policy)
+{
+	int ret;
+
+	ret = parse_extent_cache_policy(policy);
+	if (ret < 0) {
+		fprintf(stderr, "error: invalid cache policy \"%s\"\n\n", policy);
+		fputs("Options for --cache-policy are: lru, 2q\n", stderr);
+		exit(1);
+	}
+	bconf.cache_policy = ret;
+}
+
+static void handle_memory_limit(const char *limit)
+{
+	if (parse_memory_limit(limit, &bconf.memory_limit) < 0) {
+		fprintf(stderr, "error: invalid memory limit \"%s\"\n\n", limit);
+		fputs("Memory limit is a size with optional suffix (KMGT) or a percentage of available memory\n",
+		      stderr);
+		exit(1);
+	}
+}
+
+static void handle_csum_threads(const char *threads)
+{
+	int ret;
+
+	ret = work_pool_parse_threads(threads);
+	if (ret < 0) {
+		fprintf(stderr, "error: invalid number of checksum threads \"%s\"\n\n",
+			threads);
+		fputs("Number of threads is 1 for single threaded checksumming or 0 for automatic\n",
+		      stderr);
+		exit(1);
+	}
+	bconf.csum_threads = ret;
+}
+
 /*
  * Parse global options, between binary name and first non-option argument
  * after processing all valid options (including those with arguments).
@@ -242,7 +282,9 @@ static void handle_output_format(const char *format)
  */
 static int handle_global_options(int argc, char **argv)
 {
-	enum { OPT_HELP = 256, OPT_VERSION, OPT_FULL, OPT_FORMAT };
+	enum { OPT_HELP = 256, OPT_VERSION, OPT_FULL, OPT_FORMAT,
+	       OPT_CACHE_POLICY, OPT_MEMORY_LIMIT, OPT_CSUM_THREADS,
+	       OPT_DIRECT_IO };
 	static const struct option long_options[] = {
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ "version", no_argument, NULL, OPT_VERSION },
@@ -250,6 +292,10 @@ static int handle_global_options(int argc, char **argv)
 		{ "full", no_argument, NULL, OPT_FULL },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
+		{ "cache-policy", required_argument, NULL, OPT_CACHE_POLICY },
+		{ "memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT },
+		{ "csum-threads", required_argument, NULL, OPT_CSUM_THREADS },
+		{ "direct-io", no_argument, NULL, OPT_DIRECT_IO },
 		{ NULL, 0, NULL, 0}
 	};
 	int shift;
@@ -278,6 +324,18 @@ static int handle_global_options(int argc, char **argv)
 		case 'q':
 			bconf_be_quiet();
 			break;
+		case OPT_CACHE_POLICY:
+			handle_cache_policy(optarg);
+			break;
+		case OPT_MEMORY_LIMIT:
+			handle_memory_limit(optarg);
+			break;
+		case OPT_CSUM_THREADS:
+			handle_csum_threads(optarg);
+			break;
+		case OPT_DIRECT_IO:
+			bconf.direct_io = true;
+			break;
 		default:
 			fprintf(stderr, "Unknown global option: %s\n",
 					argv[optind - 1]);
@@ -398,7 +456,7 @@ int main(int argc, char **argv)
 
 	handle_help_options_next_level(cmd, argc, argv);
 
-	crc32c_optimization_init();
+	hash_init_accel();
 
 	fixup_argv0(argv, cmd->token);
 
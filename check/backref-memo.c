@@ -0,0 +1,129 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "kerncompat.h"
+#include "common/memory-budget.h"
+#include "check/backref-memo.h"
+
+/* Set up a table of at most @max_bytes, rounded down to a power of two sets */
+int backref_memo_init(struct backref_memo *memo, u64 max_bytes)
+{
+	const u64 set_size = BACKREF_MEMO_WAYS *
+			     sizeof(struct backref_memo_entry);
+	u64 nr_sets = 1;
+
+	memset(memo, 0, sizeof(*memo));
+	while (nr_sets * 2 * set_size <= max_bytes)
+		nr_sets *= 2;
+	memo->entries = calloc(nr_sets * BACKREF_MEMO_WAYS,
+			       sizeof(struct backref_memo_entry));
+	if (!memo->entries)
+		return -ENOMEM;
+	memo->nr_sets = nr_sets;
+	memo->stats.bytes = nr_sets * set_size;
+	memory_charge(memo->stats.bytes);
+	return 0;
+}
+
+static struct backref_memo_entry *memo_set(struct backref_memo *memo,
+					   u32 kind, const u64 *key)
+{
+	u64 hash = kind;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		hash = (hash ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	return &memo->entries[(hash & (memo->nr_sets - 1)) *
+			      BACKREF_MEMO_WAYS];
+}
+
+static bool entry_matches(const struct backref_memo_entry *entry, u32 kind,
+			  const u64 *key)
+{
+	return entry->kind == kind && !memcmp(entry->key, key,
+					      sizeof(entry->key));
+}
+
+/* Copy the memoized values of the key to @value, return false if not found */
+bool backref_memo_lookup(struct backref_memo *memo, u32 kind, u64 key0,
+			 u64 key1, u64 key2, u64 key3, u64 *value)
+{
+	const u64 key[4] = { key0, key1, key2, key3 };
+	struct backref_memo_entry *set;
+	int i;
+
+	if (!memo->entries)
+		return false;
+
+	set = memo_set(memo, kind, key);
+	for (i = 0; i < BACKREF_MEMO_WAYS; i++) {
+		if (entry_matches(&set[i], kind, key)) {
+			set[i].used = ++memo->clock;
+			memcpy(value, set[i].value, sizeof(set[i].value));
+			memo->stats.hits++;
+			return true;
+		}
+	}
+	memo->stats.misses++;
+	return false;
+}
+
+void backref_memo_insert(struct backref_memo *memo, u32 kind, u64 key0,
+			 u64 key1, u64 key2, u64 key3, const u64 *value)
+{
+	const u64 key[4] = { key0, key1, key2, key3 };
+	struct backref_memo_entry *set;
+	struct backref_memo_entry *entry;
+	int i;
+
+	if (!memo->entries)
+		return;
+
+	set = memo_set(memo, kind, key);
+	entry = &set[0];
+	for (i = 0; i < BACKREF_MEMO_WAYS; i++) {
+		if (!set[i].kind || entry_matches(&set[i], kind, key)) {
+			entry = &set[i];
+			break;
+		}
+		if (set[i].used < entry->used)
+			entry = &set[i];
+	}
+	if (i == BACKREF_MEMO_WAYS)
+		memo->stats.evictions++;
+	else if (!entry->kind)
+		memo->stats.entries++;
+
+	entry->kind = kind;
+	memcpy(entry->key, key, sizeof(entry->key));
+	memcpy(entry->value, value, sizeof(entry->value));
+	entry->used = ++memo->clock;
+}
+
+/* Free the table, the statistics are kept */
+void backref_memo_release(struct backref_memo *memo)
+{
+	if (!memo->entries)
+		return;
+	memory_uncharge(memo->stats.bytes);
+	free(memo->entries);
+	memo->entries = NULL;
+	memo->nr_sets = 0;
+}
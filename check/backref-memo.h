@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Memoized results of backref lookups in the extent tree.
+ *
+ * The results are keyed by the kind of lookup and up to four numbers, like
+ * (bytenr, root, owner, offset), and hold up to BACKREF_MEMO_VALUES numbers.
+ * The table has a fixed size taken from the memory budget, each key can go
+ * to one of BACKREF_MEMO_WAYS slots and the least recently used one is
+ * replaced when they're all taken.
+ *
+ * Until backref_memo_init() succeeds nothing is memoized, so the lookups
+ * work the same without the memo.
+ */
+
+#ifndef __BTRFS_CHECK_BACKREF_MEMO_H__
+#define __BTRFS_CHECK_BACKREF_MEMO_H__
+
+#include <stdbool.h>
+#include "kerncompat.h"
+#include "kernel-lib/sizes.h"
+
+#define BACKREF_MEMO_VALUES		(4)
+#define BACKREF_MEMO_WAYS		(4)
+/* Upper limit of the table, below that it takes 1/16 of the budget */
+#define BACKREF_MEMO_MAX_BYTES		(SZ_64M)
+
+struct backref_memo_entry {
+	u64 key[4];
+	u64 value[BACKREF_MEMO_VALUES];
+	/* Time of the last use, to find the least recently used one */
+	u64 used;
+	/* Kind of the lookup, 0 for an empty slot */
+	u32 kind;
+};
+
+/* Printed by check --mode=lowmem with --cache-stats */
+struct backref_memo_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	/* Results stored and size of the table */
+	u64 entries;
+	u64 bytes;
+};
+
+struct backref_memo {
+	struct backref_memo_entry *entries;
+	u64 nr_sets;
+	u64 clock;
+	struct backref_memo_stats stats;
+};
+
+int backref_memo_init(struct backref_memo *memo, u64 max_bytes);
+bool backref_memo_lookup(struct backref_memo *memo, u32 kind, u64 key0,
+			 u64 key1, u64 key2, u64 key3, u64 *value);
+void backref_memo_insert(struct backref_memo *memo, u32 kind, u64 key0,
+			 u64 key1, u64 key2, u64 key3, const u64 *value);
+void backref_memo_release(struct backref_memo *memo);
+
+#endif
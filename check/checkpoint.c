@@ -0,0 +1,319 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+#include "common/defs.h"
+#include "common/messages.h"
+#include "check/mode-common.h"
+#include "check/checkpoint.h"
+
+#define CHECKPOINT_MAGIC		"btrfs-check-checkpoint"
+#define CHECKPOINT_VERSION		(1)
+
+/* Global counters printed at the end, all computed in the extents phase */
+static u64 *const checkpoint_counters[] = {
+	&bytes_used,
+	&total_csum_bytes,
+	&total_btree_bytes,
+	&total_fs_tree_bytes,
+	&total_extent_tree_bytes,
+	&btree_space_waste,
+	&data_bytes_allocated,
+	&data_bytes_referenced,
+};
+
+#define CHECKPOINT_NR_COUNTERS		((int)ARRAY_SIZE(checkpoint_counters))
+
+struct checkpoint_file {
+	int version;
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	u64 generation;
+	int mode;
+	int data_csum;
+	u32 phases;
+	int err;
+	int transid_errors;
+	u64 counters[CHECKPOINT_NR_COUNTERS];
+	int has_root_key;
+	struct btrfs_key root_key;
+	int roots_err;
+	int shared_left;
+	size_t root_log_len;
+};
+
+/* Parse everything up to the root record log, return 0 if it's valid */
+static int read_header(FILE *fp, struct checkpoint_file *cf)
+{
+	unsigned long long generation;
+	unsigned long long objectid;
+	unsigned long long offset;
+	unsigned int type;
+	int i;
+
+	if (fscanf(fp, " generation %llu mode %d data-csum %d",
+		   &generation, &cf->mode, &cf->data_csum) != 3)
+		return -EINVAL;
+	cf->generation = generation;
+	if (fscanf(fp, " phases %u err %d transid-errors %d counters",
+		   &cf->phases, &cf->err, &cf->transid_errors) != 3)
+		return -EINVAL;
+	for (i = 0; i < CHECKPOINT_NR_COUNTERS; i++) {
+		unsigned long long counter;
+
+		if (fscanf(fp, " %llu", &counter) != 1)
+			return -EINVAL;
+		cf->counters[i] = counter;
+	}
+	if (fscanf(fp, " roots %d %llu %u %llu %d %d %zu",
+		   &cf->has_root_key, &objectid, &type, &offset,
+		   &cf->roots_err, &cf->shared_left, &cf->root_log_len) != 7)
+		return -EINVAL;
+	cf->root_key.objectid = objectid;
+	cf->root_key.type = type;
+	cf->root_key.offset = offset;
+	/* The log follows right after the newline */
+	if (fgetc(fp) != '\n')
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Load the checkpoint at @path if it's for this filesystem and options,
+ * otherwise set up an empty one to be written there.
+ *
+ * Return 1 if the check resumes, 0 if it starts over and < 0 if the file
+ * can't be read or isn't a checkpoint, it's not overwritten then.
+ */
+int checkpoint_load(struct check_checkpoint *cp, const char *path,
+		    struct btrfs_fs_info *fs_info, int mode, int data_csum)
+{
+	struct checkpoint_file cf = { 0 };
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	FILE *fp;
+	int ret;
+	int i;
+
+	memset(cp, 0, sizeof(*cp));
+	cp->path = path;
+	memcpy(cp->fsid, fs_info->super_copy->fsid, BTRFS_FSID_SIZE);
+	cp->generation = btrfs_super_generation(fs_info->super_copy);
+	cp->mode = mode;
+	cp->data_csum = data_csum;
+	cp->saved = time(NULL);
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 0;
+		ret = -errno;
+		error("cannot open checkpoint %s: %m", path);
+		return ret;
+	}
+	if (fscanf(fp, CHECKPOINT_MAGIC " %d fsid %36s", &cf.version,
+		   cf.fsid) != 2) {
+		error("%s is not a checkpoint of btrfs check", path);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (cf.version != CHECKPOINT_VERSION) {
+		warning("unsupported version %d of checkpoint %s, starting over",
+			cf.version, path);
+		ret = 0;
+		goto out;
+	}
+	ret = read_header(fp, &cf);
+	if (ret < 0) {
+		error("invalid checkpoint %s", path);
+		goto out;
+	}
+
+	uuid_unparse(cp->fsid, fsid);
+	if (strcmp(fsid, cf.fsid) || cf.generation != cp->generation ||
+	    cf.mode != mode || cf.data_csum != data_csum) {
+		warning(
+	"checkpoint %s is for another filesystem, generation or options, starting over",
+			path);
+		ret = 0;
+		goto out;
+	}
+
+	if (cf.has_root_key && cf.root_log_len) {
+		cp->root_log = malloc(cf.root_log_len);
+		if (!cp->root_log) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (fread(cp->root_log, 1, cf.root_log_len, fp) !=
+		    cf.root_log_len) {
+			error("invalid checkpoint %s", path);
+			free(cp->root_log);
+			cp->root_log = NULL;
+			ret = -EINVAL;
+			goto out;
+		}
+		cp->root_log_len = cf.root_log_len;
+	}
+
+	cp->phases = cf.phases;
+	cp->err = cf.err;
+	cp->transid_errors = cf.transid_errors;
+	cp->has_root_key = cf.has_root_key;
+	cp->root_key = cf.root_key;
+	cp->roots_err = cf.roots_err;
+	cp->shared_left = cf.shared_left;
+	for (i = 0; i < CHECKPOINT_NR_COUNTERS; i++)
+		*checkpoint_counters[i] = cf.counters[i];
+	ret = 1;
+out:
+	fclose(fp);
+	return ret;
+}
+
+static int write_checkpoint(struct check_checkpoint *cp)
+{
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	char *tmp;
+	FILE *fp;
+	int ret = 0;
+	int i;
+
+	if (asprintf(&tmp, "%s.tmp", cp->path) < 0)
+		return -ENOMEM;
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ret = -errno;
+		free(tmp);
+		return ret;
+	}
+
+	uuid_unparse(cp->fsid, fsid);
+	fprintf(fp, "%s %d\n", CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+	fprintf(fp, "fsid %s\n", fsid);
+	fprintf(fp, "generation %llu\n", cp->generation);
+	fprintf(fp, "mode %d\n", cp->mode);
+	fprintf(fp, "data-csum %d\n", cp->data_csum);
+	fprintf(fp, "phases %u\n", cp->phases);
+	fprintf(fp, "err %d\n", cp->err);
+	fprintf(fp, "transid-errors %d\n", cp->transid_errors);
+	fprintf(fp, "counters");
+	for (i = 0; i < CHECKPOINT_NR_COUNTERS; i++)
+		fprintf(fp, " %llu", *checkpoint_counters[i]);
+	fprintf(fp, "\n");
+	fprintf(fp, "roots %d %llu %u %llu %d %d %zu\n", cp->has_root_key,
+		cp->root_key.objectid, cp->root_key.type, cp->root_key.offset,
+		cp->roots_err, cp->shared_left, cp->root_log_len);
+	if (cp->root_log_len)
+		fwrite(cp->root_log, 1, cp->root_log_len, fp);
+
+	if (fflush(fp) || fsync(fileno(fp)))
+		ret = -errno;
+	if (fclose(fp) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, cp->path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+static void save_checkpoint(struct check_checkpoint *cp)
+{
+	int ret;
+
+	ret = write_checkpoint(cp);
+	if (ret < 0) {
+		errno = -ret;
+		warning("cannot write checkpoint %s: %m", cp->path);
+	}
+	cp->saved = time(NULL);
+}
+
+/* Phase @phase, numbered from 1, was done in the check being resumed */
+bool checkpoint_phase_done(const struct check_checkpoint *cp, int phase)
+{
+	return cp->phases & (1U << (phase - 1));
+}
+
+/*
+ * Save that @phase is done, with the result @err of the check so far. The
+ * progress of the fs roots phase is kept, the root records are needed until
+ * the root refs are checked.
+ */
+void checkpoint_finish_phase(struct check_checkpoint *cp, int phase, int err,
+			     bool transid_errors)
+{
+	cp->phases |= 1U << (phase - 1);
+	cp->err = err;
+	cp->transid_errors |= transid_errors;
+	save_checkpoint(cp);
+}
+
+/* It's time to save the progress of the fs roots phase again */
+bool checkpoint_due(const struct check_checkpoint *cp)
+{
+	return time(NULL) - cp->saved >= CHECKPOINT_INTERVAL;
+}
+
+/*
+ * Save the progress of the fs roots phase: all items of the tree root up to
+ * @key are done with the result @err, and @log has the updates of the root
+ * records so far.
+ */
+void checkpoint_save_roots(struct check_checkpoint *cp,
+			   const struct btrfs_key *key, int err,
+			   bool shared_left, const void *log, size_t log_len)
+{
+	void *copy = NULL;
+
+	if (log_len) {
+		copy = malloc(log_len);
+		if (!copy) {
+			warning("cannot save checkpoint %s: %m", cp->path);
+			return;
+		}
+		memcpy(copy, log, log_len);
+	}
+	/* The loaded log was replayed and is part of the new one */
+	free(cp->root_log);
+	cp->root_log = copy;
+	cp->root_log_len = log_len;
+	cp->has_root_key = true;
+	cp->root_key = *key;
+	cp->roots_err = err;
+	cp->shared_left = shared_left;
+	save_checkpoint(cp);
+}
+
+/* The check is complete, there's nothing to resume */
+void checkpoint_remove(struct check_checkpoint *cp)
+{
+	if (unlink(cp->path) && errno != ENOENT)
+		warning("cannot remove checkpoint %s: %m", cp->path);
+}
+
+void checkpoint_release(struct check_checkpoint *cp)
+{
+	free(cp->root_log);
+	cp->root_log = NULL;
+	cp->root_log_len = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Progress of check saved to a file, for --resume.
+ *
+ * The file records the phases done, the errors found so far and the global
+ * byte counters, and in the fs roots phase the key of the last item of the
+ * tree root processed. For the original mode the updates of the root records
+ * up to that item are saved too, in the format of the root record log of the
+ * check workers. The file is written after each phase and at most every
+ * CHECKPOINT_INTERVAL seconds in the fs roots phase, to a temporary file
+ * renamed over the previous one.
+ *
+ * A checkpoint is only used for the filesystem with the same fsid and super
+ * generation, checked with the same mode and data checksum option. Anything
+ * else starts a new check and overwrites the file.
+ */
+
+#ifndef __BTRFS_CHECK_CHECKPOINT_H__
+#define __BTRFS_CHECK_CHECKPOINT_H__
+
+#include <stdbool.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+
+#define CHECKPOINT_INTERVAL		(60)
+
+struct check_checkpoint {
+	const char *path;
+	/* Filesystem and options the progress is valid for */
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	int mode;
+	int data_csum;
+
+	/* Phases done, bit N - 1 for phase N */
+	u32 phases;
+	/* Result of the check so far */
+	int err;
+	bool transid_errors;
+
+	/* Progress of the fs roots phase */
+	bool has_root_key;
+	struct btrfs_key root_key;
+	int roots_err;
+	bool shared_left;
+	/* Root record log loaded from the file, original mode */
+	void *root_log;
+	size_t root_log_len;
+
+	time_t saved;
+};
+
+int checkpoint_load(struct check_checkpoint *cp, const char *path,
+		    struct btrfs_fs_info *fs_info, int mode, int data_csum);
+bool checkpoint_phase_done(const struct check_checkpoint *cp, int phase);
+void checkpoint_finish_phase(struct check_checkpoint *cp, int phase, int err,
+			     bool transid_errors);
+bool checkpoint_due(const struct check_checkpoint *cp);
+void checkpoint_save_roots(struct check_checkpoint *cp,
+			   const struct btrfs_key *key, int err,
+			   bool shared_left, const void *log, size_t log_len);
+void checkpoint_remove(struct check_checkpoint *cp);
+void checkpoint_release(struct check_checkpoint *cp);
+
+#endif
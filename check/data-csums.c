@@ -0,0 +1,456 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/extent_io.h"
+#include "common/direct-io.h"
+#include "common/internal.h"
+#include "check/data-csums.h"
+
+/* State of one verifying thread */
+struct data_csums_worker {
+	struct data_csums *dc;
+	pthread_t thread;
+	bool started;
+	u8 *data;
+	size_t data_size;
+	u8 *result;
+	size_t result_size;
+};
+
+void data_csums_init(struct data_csums *dc, struct btrfs_fs_info *fs_info,
+		     int nr_threads, u64 *progress)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->fs_info = fs_info;
+	dc->nr_threads = max(nr_threads, 1);
+	dc->progress = progress;
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->cond, NULL);
+}
+
+static int grow_array(void **array, int *alloced, int needed, size_t size)
+{
+	void *tmp;
+	int nr;
+
+	if (needed <= *alloced)
+		return 0;
+	nr = max(needed, max(16, *alloced * 2));
+	tmp = realloc(*array, nr * size);
+	if (!tmp)
+		return -ENOMEM;
+	*array = tmp;
+	*alloced = nr;
+	return 0;
+}
+
+/* Find the device and physical offset of the start of a copy */
+static void locate_read(struct data_csums *dc, struct data_csum_read *read,
+			u64 bytenr, u64 len)
+{
+	struct btrfs_multi_bio *multi = NULL;
+
+	/* Unmapped reads fail later with the usual message */
+	if (btrfs_map_block(dc->fs_info, READ, bytenr, &len, &multi,
+			    read->mirror, NULL))
+		return;
+	read->device = multi->stripes[0].dev;
+	read->physical = multi->stripes[0].physical;
+	kfree(multi);
+}
+
+/*
+ * Queue the data covered by the csum item at @slot of @leaf, @len bytes at
+ * logical address @bytenr.
+ *
+ * Return the index of the range or < 0 on error.
+ */
+int data_csums_add(struct data_csums *dc, u64 bytenr, u64 len,
+		   struct extent_buffer *leaf, int slot)
+{
+	struct btrfs_fs_info *fs_info = dc->fs_info;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	size_t csum_len = (len / fs_info->sectorsize) * csum_size;
+	struct data_csum_range *range;
+	int num_copies;
+	int mirror;
+	int ret;
+
+	num_copies = btrfs_num_copies(fs_info, bytenr, len);
+	if (dc->csums_len + csum_len > dc->csums_alloced) {
+		size_t size = max(dc->csums_len + csum_len,
+				  max_t(size_t, SZ_64K, dc->csums_alloced * 2));
+		u8 *tmp;
+
+		tmp = realloc(dc->csums, size);
+		if (!tmp)
+			return -ENOMEM;
+		dc->csums = tmp;
+		dc->csums_alloced = size;
+	}
+	ret = grow_array((void **)&dc->ranges, &dc->ranges_alloced,
+			 dc->nr_ranges + 1, sizeof(*dc->ranges));
+	if (ret < 0)
+		return ret;
+	ret = grow_array((void **)&dc->reads, &dc->reads_alloced,
+			 dc->nr_reads + max(num_copies, 0), sizeof(*dc->reads));
+	if (ret < 0)
+		return ret;
+
+	range = &dc->ranges[dc->nr_ranges];
+	range->bytenr = bytenr;
+	range->len = len;
+	range->csum_offset = dc->csums_len;
+	range->first_read = dc->nr_reads;
+	range->nr_reads = 0;
+	range->leaf_start = leaf->start;
+	range->slot = slot;
+	read_extent_buffer(leaf, dc->csums + dc->csums_len,
+			   btrfs_item_ptr_offset(leaf, slot), csum_len);
+	dc->csums_len += csum_len;
+
+	/*
+	 * Mirror 0 means 'read from any valid copy', so it's skipped.
+	 * The indexes 1-N represent the n-th copy for levels with
+	 * redundancy.
+	 */
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+		struct data_csum_read *read = &dc->reads[dc->nr_reads++];
+
+		memset(read, 0, sizeof(*read));
+		read->range = dc->nr_ranges;
+		read->mirror = mirror;
+		locate_read(dc, read, bytenr, len);
+		range->nr_reads++;
+	}
+	return dc->nr_ranges++;
+}
+
+bool data_csums_full(struct data_csums *dc)
+{
+	return dc->csums_len >= DATA_CSUMS_MAX_CSUM_BYTES ||
+	       dc->nr_ranges >= DATA_CSUMS_MAX_RANGES;
+}
+
+static int cmp_data_csum_read(const void *a, const void *b)
+{
+	const struct data_csum_read *ra = *(const struct data_csum_read **)a;
+	const struct data_csum_read *rb = *(const struct data_csum_read **)b;
+	u64 devid_a = ra->device ? ra->device->devid : 0;
+	u64 devid_b = rb->device ? rb->device->devid : 0;
+
+	if (devid_a != devid_b)
+		return devid_a < devid_b ? -1 : 1;
+	if (ra->device != rb->device)
+		return ra->device < rb->device ? -1 : 1;
+	if (ra->physical != rb->physical)
+		return ra->physical < rb->physical ? -1 : 1;
+	/* Keep the order of copies at the same place, if any */
+	return ra < rb ? -1 : ra > rb;
+}
+
+/* Sort the reads and split them to one queue per device */
+static int setup_queues(struct data_csums *dc)
+{
+	int i;
+
+	dc->order = malloc(dc->nr_reads * sizeof(*dc->order));
+	dc->queues = calloc(dc->nr_reads, sizeof(*dc->queues));
+	if (!dc->order || !dc->queues)
+		return -ENOMEM;
+	for (i = 0; i < dc->nr_reads; i++)
+		dc->order[i] = &dc->reads[i];
+	qsort(dc->order, dc->nr_reads, sizeof(*dc->order), cmp_data_csum_read);
+
+	dc->nr_queues = 0;
+	dc->next_queue = 0;
+	for (i = 0; i < dc->nr_reads; i++) {
+		if (i && dc->order[i]->device == dc->order[i - 1]->device) {
+			dc->queues[dc->nr_queues - 1].end++;
+			continue;
+		}
+		dc->queues[dc->nr_queues].device = dc->order[i]->device;
+		dc->queues[dc->nr_queues].next = i;
+		dc->queues[dc->nr_queues].end = i + 1;
+		dc->nr_queues++;
+	}
+	return 0;
+}
+
+/*
+ * Pick the next queue with reads left and no thread reading its device,
+ * taking turns. Return -EBUSY if all such devices are being read and
+ * -ENOENT if there's nothing left to read. Called under the lock.
+ */
+static int pick_queue(struct data_csums *dc)
+{
+	bool pending = false;
+	int i;
+
+	for (i = 0; i < dc->nr_queues; i++) {
+		int index = (dc->next_queue + i) % dc->nr_queues;
+		struct data_csum_queue *queue = &dc->queues[index];
+
+		if (queue->next == queue->end)
+			continue;
+		pending = true;
+		if (queue->busy)
+			continue;
+		dc->next_queue = (index + 1) % dc->nr_queues;
+		return index;
+	}
+	return pending ? -EBUSY : -ENOENT;
+}
+
+static int reserve_buffers(struct data_csums_worker *w, size_t data_size,
+			   size_t result_size)
+{
+	if (w->data_size < data_size) {
+		direct_io_free(w->data, w->data_size);
+		w->data_size = 0;
+		w->data = direct_io_alloc(data_size);
+		if (!w->data)
+			return -ENOMEM;
+		w->data_size = data_size;
+	}
+	if (w->result_size < result_size) {
+		free(w->result);
+		w->result_size = 0;
+		w->result = malloc(result_size);
+		if (!w->result)
+			return -ENOMEM;
+		w->result_size = result_size;
+	}
+	return 0;
+}
+
+/* Checksum the data of a copy read to the buffer and note the mismatches */
+static int verify_read(struct data_csums_worker *w,
+		       struct data_csum_read *read)
+{
+	struct data_csums *dc = w->dc;
+	struct btrfs_fs_info *fs_info = dc->fs_info;
+	struct data_csum_range *range = &dc->ranges[read->range];
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	u32 sectorsize = fs_info->sectorsize;
+	u32 nr = range->len / sectorsize;
+	const u8 *expected = dc->csums + range->csum_offset;
+	u32 bad = 0;
+	u32 i;
+
+	/*
+	 * A single thread can spread the checksums of a range over the pool,
+	 * with more threads each one computes its own
+	 */
+	if (dc->nr_threads == 1)
+		btrfs_csum_data_batch(fs_info, w->data, nr, w->result);
+	else
+		btrfs_csum_data_multi(btrfs_super_csum_type(fs_info->super_copy),
+				      w->data, sectorsize, nr, w->result);
+	if (!memcmp(w->result, expected, (size_t)nr * csum_size))
+		return 0;
+
+	for (i = 0; i < nr; i++)
+		if (memcmp(w->result + i * csum_size, expected + i * csum_size,
+			   csum_size))
+			bad++;
+	read->mismatches = malloc(bad * sizeof(*read->mismatches));
+	if (!read->mismatches)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		struct data_csum_mismatch *mismatch;
+
+		if (!memcmp(w->result + i * csum_size, expected + i * csum_size,
+			    csum_size))
+			continue;
+		mismatch = &read->mismatches[read->nr_mismatches++];
+		mismatch->sector = i;
+		mismatch->result = w->result[i * csum_size];
+		mismatch->expected = expected[i * csum_size];
+	}
+	return 0;
+}
+
+static int process_read(struct data_csums_worker *w,
+			struct data_csum_read *read, struct data_csum_queue *queue)
+{
+	struct data_csums *dc = w->dc;
+	struct data_csum_range *range = &dc->ranges[read->range];
+	u16 csum_size = btrfs_super_csum_size(dc->fs_info->super_copy);
+	int ret;
+
+	ret = reserve_buffers(w, range->len,
+			      (range->len / dc->fs_info->sectorsize) * csum_size);
+	if (!ret)
+		ret = read_data_from_disk(dc->fs_info, w->data, range->bytenr,
+					  range->len, read->mirror);
+
+	/* Let the next thread read from the device while this one hashes */
+	pthread_mutex_lock(&dc->lock);
+	queue->busy = false;
+	pthread_cond_broadcast(&dc->cond);
+	pthread_mutex_unlock(&dc->lock);
+
+	if (!ret)
+		ret = verify_read(w, read);
+	if (!ret && dc->progress)
+		__atomic_add_fetch(dc->progress, range->len, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static void *data_csums_worker(void *arg)
+{
+	struct data_csums_worker *w = arg;
+	struct data_csums *dc = w->dc;
+	struct data_csum_queue *queue;
+	struct data_csum_read *read;
+	int index;
+
+	pthread_mutex_lock(&dc->lock);
+	while (1) {
+		index = pick_queue(dc);
+		if (index == -ENOENT)
+			break;
+		if (index < 0) {
+			pthread_cond_wait(&dc->cond, &dc->lock);
+			continue;
+		}
+		queue = &dc->queues[index];
+		read = dc->order[queue->next++];
+		queue->busy = true;
+		pthread_mutex_unlock(&dc->lock);
+
+		read->ret = process_read(w, read, queue);
+
+		pthread_mutex_lock(&dc->lock);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return NULL;
+}
+
+/*
+ * Read and verify all copies of the queued ranges, the results are printed
+ * by data_csums_report().
+ *
+ * Return < 0 if the reads could not be set up at all, errors of the reads are
+ * reported per range.
+ */
+int data_csums_verify(struct data_csums *dc)
+{
+	struct data_csums_worker *workers;
+	int nr_workers = min(dc->nr_threads, dc->nr_reads);
+	int ret;
+	int i;
+
+	if (!dc->nr_reads)
+		return 0;
+	ret = setup_queues(dc);
+	if (ret < 0)
+		return ret;
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+	for (i = 0; i < nr_workers; i++)
+		workers[i].dc = dc;
+
+	/*
+	 * The calling thread is one of the workers, if no thread can be
+	 * started it reads everything alone
+	 */
+	for (i = 1; i < nr_workers; i++)
+		workers[i].started = !pthread_create(&workers[i].thread, NULL,
+						     data_csums_worker,
+						     &workers[i]);
+	data_csums_worker(&workers[0]);
+	for (i = 0; i < nr_workers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		direct_io_free(workers[i].data, workers[i].data_size);
+		free(workers[i].result);
+	}
+	free(workers);
+	return 0;
+}
+
+/*
+ * Print the checksum mismatches of all copies of @range.
+ *
+ * Return <0 for fatal error (failed to read or allocate memory), the copies
+ * after the failed one are not reported.
+ * Return >0 for csum mismatch for any copy.
+ * Return 0 if everything is OK.
+ */
+int data_csums_report(struct data_csums *dc, int index)
+{
+	struct data_csum_range *range = &dc->ranges[index];
+	u32 sectorsize = dc->fs_info->sectorsize;
+	bool csum_mismatch = false;
+	int i;
+	u32 j;
+
+	for (i = 0; i < range->nr_reads; i++) {
+		struct data_csum_read *read = &dc->reads[range->first_read + i];
+
+		if (read->ret < 0)
+			return read->ret;
+		for (j = 0; j < read->nr_mismatches; j++) {
+			struct data_csum_mismatch *mismatch = &read->mismatches[j];
+
+			/* FIXME: format of the checksum value */
+			fprintf(stderr,
+			"mirror %d bytenr %llu csum %u expected csum %u\n",
+				read->mirror,
+				range->bytenr + (u64)mismatch->sector * sectorsize,
+				mismatch->result, mismatch->expected);
+			csum_mismatch = true;
+		}
+	}
+	return csum_mismatch;
+}
+
+/* Forget the queued ranges and their results */
+void data_csums_reset(struct data_csums *dc)
+{
+	int i;
+
+	for (i = 0; i < dc->nr_reads; i++)
+		free(dc->reads[i].mismatches);
+	free(dc->order);
+	free(dc->queues);
+	dc->order = NULL;
+	dc->queues = NULL;
+	dc->nr_queues = 0;
+	dc->nr_reads = 0;
+	dc->nr_ranges = 0;
+	dc->csums_len = 0;
+}
+
+void data_csums_release(struct data_csums *dc)
+{
+	data_csums_reset(dc);
+	free(dc->csums);
+	free(dc->ranges);
+	free(dc->reads);
+	pthread_mutex_destroy(&dc->lock);
+	pthread_cond_destroy(&dc->cond);
+	memset(dc, 0, sizeof(*dc));
+}
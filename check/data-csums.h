@@ -0,0 +1,127 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Verification of data against the csum tree, for --check-data-csum.
+ *
+ * Csum items are queued as ranges together with a copy of their checksums.
+ * data_csums_verify() then reads every copy of all queued ranges, sorted by
+ * device and physical offset. Each device is read by one thread at a time in
+ * that order, while the other threads compute and compare the checksums of
+ * the data read before.
+ *
+ * The mismatches are kept per range and printed by data_csums_report(), so
+ * when the ranges are reported in the order they were queued, the output is
+ * the same as when verifying one range after another.
+ */
+
+#ifndef __BTRFS_CHECK_DATA_CSUMS_H__
+#define __BTRFS_CHECK_DATA_CSUMS_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "kerncompat.h"
+#include "kernel-lib/sizes.h"
+
+struct btrfs_fs_info;
+struct btrfs_device;
+struct extent_buffer;
+
+/* Limits of the queued ranges, the checksums are copied */
+#define DATA_CSUMS_MAX_CSUM_BYTES	(SZ_4M)
+#define DATA_CSUMS_MAX_RANGES		(16384)
+
+struct data_csum_mismatch {
+	u32 sector;
+	/* First bytes of the checksums, what gets reported */
+	u8 result;
+	u8 expected;
+};
+
+/* One copy of a range */
+struct data_csum_read {
+	int range;
+	int mirror;
+	/* Location of the first stripe, for sorting */
+	struct btrfs_device *device;
+	u64 physical;
+
+	int ret;
+	struct data_csum_mismatch *mismatches;
+	u32 nr_mismatches;
+};
+
+struct data_csum_range {
+	u64 bytenr;
+	u64 len;
+	/* Offset of the checksums in the copy */
+	size_t csum_offset;
+	/* Reads of the copies, in mirror order */
+	int first_read;
+	int nr_reads;
+	/* Location of the csum item */
+	u64 leaf_start;
+	int slot;
+};
+
+/* Reads of one device, sorted by physical offset */
+struct data_csum_queue {
+	struct btrfs_device *device;
+	int next;
+	int end;
+	/* A thread is reading from the device */
+	bool busy;
+};
+
+struct data_csums {
+	struct btrfs_fs_info *fs_info;
+	int nr_threads;
+	/* Bytes read and verified, updated atomically for the progress */
+	u64 *progress;
+
+	u8 *csums;
+	size_t csums_len;
+	size_t csums_alloced;
+
+	struct data_csum_range *ranges;
+	int nr_ranges;
+	int ranges_alloced;
+
+	struct data_csum_read *reads;
+	int nr_reads;
+	int reads_alloced;
+
+	/* Reads in the order they're issued */
+	struct data_csum_read **order;
+	struct data_csum_queue *queues;
+	int nr_queues;
+	/* Queue to look at first, to take turns */
+	int next_queue;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void data_csums_init(struct data_csums *dc, struct btrfs_fs_info *fs_info,
+		     int nr_threads, u64 *progress);
+int data_csums_add(struct data_csums *dc, u64 bytenr, u64 len,
+		   struct extent_buffer *leaf, int slot);
+bool data_csums_full(struct data_csums *dc);
+int data_csums_verify(struct data_csums *dc);
+int data_csums_report(struct data_csums *dc, int range);
+void data_csums_reset(struct data_csums *dc);
+void data_csums_release(struct data_csums *dc);
+
+#endif
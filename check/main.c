@@ -46,6 +46,14 @@
 #include "check/mode-original.h"
 #include "check/mode-lowmem.h"
 #include "check/qgroup-verify.h"
+#include "common/memory-budget.h"
+#include "common/cache-stats.h"
+#include "common/work-pool.h"
+#include "check/workers.h"
+#include "check/data-csums.h"
+#include "check/spill.h"
+#include "check/checkpoint.h"
+#include "kernel-lib/rbtree_augmented.h"
 
 u64 bytes_used = 0;
 u64 total_csum_bytes = 0;
@@ -74,6 +82,16 @@ enum btrfs_check_mode {
 
 static enum btrfs_check_mode check_mode = CHECK_MODE_DEFAULT;
 
+/* Processes checking the fs trees and threads verifying data, --threads */
+static int check_threads = 1;
+
+/* Directory for the extent records moved out of memory, --spill-dir */
+static const char *spill_dir;
+
+/* Progress of the check saved for --resume, used if resume_path is set */
+static const char *resume_path;
+static struct check_checkpoint checkpoint;
+
 struct device_record {
 	struct rb_node node;
 	u64 devid;
@@ -193,11 +211,14 @@ static void print_status_check_line(void *p)
 		"[7/7] checking quota groups                   ",
 	};
 	time_t elapsed;
+	time_t total;
 	int hours;
 	int minutes;
 	int seconds;
+	u64 bytes;
 
 	elapsed = time(NULL) - priv->start_time;
+	total = elapsed;
 	hours   = elapsed  / 3600;
 	elapsed -= hours   * 3600;
 	minutes = elapsed  / 60;
@@ -207,9 +228,14 @@ static void print_status_check_line(void *p)
 	printf("%s (%d:%02d:%02d elapsed", task_position_string[priv->tp],
 			hours, minutes, seconds);
 	if (priv->item_count > 0)
-		printf(", %llu items checked)\r", priv->item_count);
-	else
-		printf(")\r");
+		printf(", %llu items checked", priv->item_count);
+	bytes = __atomic_load_n(&priv->bytes_count, __ATOMIC_RELAXED);
+	if (bytes > 0) {
+		printf(", %s verified", pretty_size(bytes));
+		if (total > 0)
+			printf(" at %s/s", pretty_size(bytes / total));
+	}
+	printf(")\r");
 	fflush(stdout);
 }
 
@@ -486,6 +512,7 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	rec = malloc(sizeof(*rec));
 	if (!rec)
 		return ERR_PTR(-ENOMEM);
+	memory_charge(sizeof(*rec));
 	memcpy(rec, orig_rec, sizeof(*rec));
 	rec->refs = 1;
 	INIT_LIST_HEAD(&rec->backrefs);
@@ -561,6 +588,7 @@ cleanup:
 			free(src);
 		}
 
+	memory_uncharge(sizeof(*rec));
 	free(rec);
 
 	return ERR_PTR(ret);
@@ -727,6 +755,7 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 		rec = calloc(1, sizeof(*rec));
 		if (!rec)
 			return ERR_PTR(-ENOMEM);
+		memory_charge(sizeof(*rec));
 		rec->ino = ino;
 		rec->extent_start = (u64)-1;
 		rec->refs = 1;
@@ -737,6 +766,7 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 
 		node = malloc(sizeof(*node));
 		if (!node) {
+			memory_uncharge(sizeof(*rec));
 			free(rec);
 			return ERR_PTR(-ENOMEM);
 		}
@@ -784,6 +814,7 @@ static void free_inode_rec(struct inode_record *rec)
 		free(hash);
 	free_unaligned_extent_recs(&rec->unaligned_extent_recs);
 	free_file_extent_holes(&rec->holes);
+	memory_uncharge(sizeof(*rec));
 	free(rec);
 }
 
@@ -3176,6 +3207,44 @@ static void free_root_record(struct cache_extent *cache)
 
 FREE_EXTENT_CACHE_BASED_TREE(root_recs, free_root_record);
 
+/*
+ * In a worker process checking fs trees, see --threads, the root records are
+ * private to the worker. The updates done by check_fs_root() are logged here
+ * so the parent can apply them in the same order as a serial check.
+ *
+ * With --resume, the parent logs all updates of the fs roots phase the same
+ * way, to be saved in the checkpoint and replayed when resuming.
+ */
+static FILE *root_rec_log;
+
+enum {
+	ROOT_REC_LOG_ROOT,
+	ROOT_REC_LOG_BACKREF,
+	/* Shared nodes left over after the last tree of the worker */
+	ROOT_REC_LOG_SHARED_LEFT,
+};
+
+struct root_rec_log_entry {
+	u32 type;
+	u32 namelen;
+	u64 root_id;
+	u64 ref_root;
+	u64 dir;
+	u64 index;
+	s32 item_type;
+	s32 errors;
+	u32 found_root_item;
+	/* Followed by @namelen bytes of name */
+};
+
+static void log_root_rec(const struct root_rec_log_entry *entry,
+			 const char *name)
+{
+	fwrite(entry, sizeof(*entry), 1, root_rec_log);
+	if (entry->namelen)
+		fwrite(name, 1, entry->namelen, root_rec_log);
+}
+
 static int add_root_backref(struct cache_tree *root_cache,
 			    u64 root_id, u64 ref_root, u64 dir, u64 index,
 			    const char *name, int namelen,
@@ -3184,6 +3253,21 @@ static int add_root_backref(struct cache_tree *root_cache,
 	struct root_record *rec;
 	struct root_backref *backref;
 
+	if (root_rec_log) {
+		struct root_rec_log_entry entry = {
+			.type = ROOT_REC_LOG_BACKREF,
+			.namelen = namelen,
+			.root_id = root_id,
+			.ref_root = ref_root,
+			.dir = dir,
+			.index = index,
+			.item_type = item_type,
+			.errors = errors,
+		};
+
+		log_root_rec(&entry, name);
+	}
+
 	rec = get_root_rec(root_cache, root_id);
 	BUG_ON(IS_ERR(rec));
 	backref = get_root_backref(rec, ref_root, dir, index, name, namelen);
@@ -3579,6 +3663,15 @@ static int check_fs_root(struct btrfs_root *root,
 		BUG_ON(IS_ERR(rec));
 		if (btrfs_root_refs(root_item) > 0)
 			rec->found_root_item = 1;
+		if (root_rec_log) {
+			struct root_rec_log_entry entry = {
+				.type = ROOT_REC_LOG_ROOT,
+				.root_id = root->root_key.objectid,
+				.found_root_item = rec->found_root_item,
+			};
+
+			log_root_rec(&entry, NULL);
+		}
 	}
 
 	btrfs_init_path(&path);
@@ -3718,6 +3811,422 @@ skip_walking:
 	return ret;
 }
 
+/* An fs tree checked by a worker, in the order of the tree root */
+struct fs_root_entry {
+	struct btrfs_key key;
+	u64 last_snapshot;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u8 parent_uuid[BTRFS_UUID_SIZE];
+	bool valid_uuid;
+	/* Union-find of trees that may share blocks, the lowest index is root */
+	int group;
+	/* Next tree of the group */
+	int next;
+	/* Last tree of the group */
+	bool last;
+};
+
+struct fs_roots_workers {
+	struct check_workers workers;
+	struct fs_root_entry *roots;
+	int nr_roots;
+	/* Next tree to collect */
+	int next;
+	/* Groups with some but not all trees collected */
+	int open_groups;
+	/* Set when a worker reported leftover shared nodes */
+	bool shared_left;
+
+	/* State of the worker, fresh in each job */
+	struct cache_tree root_cache;
+	struct walk_control wc;
+};
+
+static int replay_root_rec_log(struct cache_tree *root_cache,
+			       const char *data, size_t len, bool *shared_left)
+{
+	struct root_rec_log_entry entry;
+	struct root_record *rec;
+	size_t offset = 0;
+
+	while (offset < len) {
+		if (len - offset < sizeof(entry))
+			return -EUCLEAN;
+		memcpy(&entry, data + offset, sizeof(entry));
+		offset += sizeof(entry);
+		if (len - offset < entry.namelen)
+			return -EUCLEAN;
+
+		switch (entry.type) {
+		case ROOT_REC_LOG_ROOT:
+			rec = get_root_rec(root_cache, entry.root_id);
+			if (IS_ERR(rec))
+				return PTR_ERR(rec);
+			if (entry.found_root_item)
+				rec->found_root_item = 1;
+			if (root_rec_log)
+				log_root_rec(&entry, NULL);
+			break;
+		case ROOT_REC_LOG_BACKREF:
+			add_root_backref(root_cache, entry.root_id,
+					 entry.ref_root, entry.dir, entry.index,
+					 data + offset, entry.namelen,
+					 entry.item_type, entry.errors);
+			break;
+		case ROOT_REC_LOG_SHARED_LEFT:
+			*shared_left = true;
+			if (root_rec_log)
+				log_root_rec(&entry, NULL);
+			break;
+		default:
+			return -EUCLEAN;
+		}
+		offset += entry.namelen;
+	}
+	return 0;
+}
+
+/* Check one fs tree in a worker, mirrors the serial loop in check_fs_roots() */
+static int check_fs_root_worker(void *priv, int item, FILE *data)
+{
+	struct fs_roots_workers *frw = priv;
+	struct fs_root_entry *entry = &frw->roots[item];
+	struct btrfs_key key = entry->key;
+	struct btrfs_root *root;
+	int ret;
+
+	root_rec_log = data;
+	if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+		root = btrfs_read_fs_root_no_cache(gfs_info, &key);
+	} else {
+		key.offset = (u64)-1;
+		root = btrfs_read_fs_root(gfs_info, &key);
+	}
+	if (IS_ERR(root)) {
+		ret = 1;
+		goto out;
+	}
+	ret = check_fs_root(root, &frw->root_cache, &frw->wc);
+	if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+		btrfs_free_fs_root(root);
+out:
+	if (entry->last && !cache_tree_empty(&frw->wc.shared)) {
+		struct root_rec_log_entry log = {
+			.type = ROOT_REC_LOG_SHARED_LEFT,
+		};
+
+		log_root_rec(&log, NULL);
+	}
+	root_rec_log = NULL;
+	return ret;
+}
+
+static int fs_root_group(struct fs_root_entry *roots, int i)
+{
+	while (roots[i].group != i) {
+		roots[i].group = roots[roots[i].group].group;
+		i = roots[i].group;
+	}
+	return i;
+}
+
+static void join_fs_root_groups(struct fs_root_entry *roots, int a, int b)
+{
+	a = fs_root_group(roots, a);
+	b = fs_root_group(roots, b);
+	if (a < b)
+		roots[b].group = a;
+	else if (b < a)
+		roots[a].group = b;
+}
+
+struct fs_root_uuid {
+	const u8 *uuid;
+	int index;
+};
+
+static int cmp_fs_root_uuid(const void *a, const void *b)
+{
+	const struct fs_root_uuid *ua = a;
+	const struct fs_root_uuid *ub = b;
+
+	return memcmp(ua->uuid, ub->uuid, BTRFS_UUID_SIZE);
+}
+
+/*
+ * Put trees that may share blocks into one group, they must be checked by the
+ * same worker: snapshots with their source and with each other, found by the
+ * uuids, and relocation trees with the tree being relocated. A tree that was
+ * never snapshotted shares nothing. Snapshots made by kernels that didn't set
+ * uuids can't be told apart, all such trees end up in one group then.
+ */
+static int group_fs_roots(struct fs_roots_workers *frw)
+{
+	struct fs_root_entry *roots = frw->roots;
+	struct fs_root_uuid *uuids;
+	bool no_uuids = false;
+	int first_shared = -1;
+	int nr_uuids = 0;
+	int i, j;
+
+	uuids = malloc(2 * frw->nr_roots * sizeof(*uuids));
+	if (!uuids)
+		return -ENOMEM;
+
+	for (i = 0; i < frw->nr_roots; i++)
+		roots[i].group = i;
+
+	for (i = 0; i < frw->nr_roots; i++) {
+		struct fs_root_entry *entry = &roots[i];
+
+		if (entry->key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+			for (j = 0; j < frw->nr_roots; j++) {
+				if (roots[j].key.objectid == entry->key.offset)
+					join_fs_root_groups(roots, i, j);
+			}
+		} else if (!entry->last_snapshot) {
+			continue;
+		}
+
+		if (first_shared < 0)
+			first_shared = i;
+		if (!entry->valid_uuid) {
+			no_uuids = true;
+			continue;
+		}
+		uuids[nr_uuids].uuid = entry->uuid;
+		uuids[nr_uuids++].index = i;
+		if (!uuid_is_null(entry->parent_uuid)) {
+			uuids[nr_uuids].uuid = entry->parent_uuid;
+			uuids[nr_uuids++].index = i;
+		}
+	}
+
+	if (no_uuids) {
+		for (i = first_shared + 1; i < frw->nr_roots; i++) {
+			if (roots[i].key.objectid == BTRFS_TREE_RELOC_OBJECTID ||
+			    roots[i].last_snapshot)
+				join_fs_root_groups(roots, first_shared, i);
+		}
+	} else {
+		qsort(uuids, nr_uuids, sizeof(*uuids), cmp_fs_root_uuid);
+		for (i = 1; i < nr_uuids; i++) {
+			if (!cmp_fs_root_uuid(&uuids[i - 1], &uuids[i]))
+				join_fs_root_groups(roots, uuids[i - 1].index,
+						    uuids[i].index);
+		}
+	}
+	free(uuids);
+	return 0;
+}
+
+/*
+ * Find the fs trees in the tree root after @start, in the order
+ * check_fs_roots() visits them
+ */
+static int find_fs_roots(struct fs_roots_workers *frw,
+			 const struct btrfs_key *start)
+{
+	struct btrfs_root *tree_root = gfs_info->tree_root;
+	struct btrfs_root_item root_item;
+	struct fs_root_entry *entry;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int alloc = 0;
+	int slot;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (1) {
+		leaf = path.nodes[0];
+		slot = path.slots[0];
+		if (slot >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, slot);
+		path.slots[0]++;
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    !fs_root_objectid(key.objectid))
+			continue;
+		if (start && btrfs_comp_cpu_keys(&key, start) <= 0)
+			continue;
+
+		if (frw->nr_roots == alloc) {
+			alloc = max(2 * alloc, 64);
+			entry = realloc(frw->roots, alloc * sizeof(*entry));
+			if (!entry) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			frw->roots = entry;
+		}
+		entry = &frw->roots[frw->nr_roots++];
+		memset(entry, 0, sizeof(*entry));
+		memset(&root_item, 0, sizeof(root_item));
+		read_extent_buffer(leaf, &root_item,
+				   btrfs_item_ptr_offset(leaf, slot),
+				   min_t(u32, btrfs_item_size_nr(leaf, slot),
+					 sizeof(root_item)));
+		entry->key = key;
+		entry->last_snapshot = btrfs_root_last_snapshot(&root_item);
+		memcpy(entry->uuid, root_item.uuid, BTRFS_UUID_SIZE);
+		memcpy(entry->parent_uuid, root_item.parent_uuid,
+		       BTRFS_UUID_SIZE);
+		entry->valid_uuid = !uuid_is_null(root_item.uuid) &&
+				    btrfs_root_generation(&root_item) ==
+				    btrfs_root_generation_v2(&root_item);
+	}
+	if (ret > 0)
+		ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static void release_fs_roots_workers(struct fs_roots_workers *frw)
+{
+	check_workers_release(&frw->workers);
+	free(frw->roots);
+	frw->roots = NULL;
+}
+
+/*
+ * Start checking the fs trees after @start in up to @threads worker
+ * processes, one group of trees sharing blocks per worker.
+ *
+ * Return 0 if the workers are set up, 1 if it's not worth it and < 0 on
+ * errors, the caller checks the trees serially if it's not 0.
+ */
+static int start_fs_roots_workers(struct fs_roots_workers *frw, int threads,
+				  const struct btrfs_key *start)
+{
+	int *items = NULL;
+	int *tail = NULL;
+	int nr_groups = 0;
+	int nr;
+	int ret;
+	int i, j;
+
+	memset(frw, 0, sizeof(*frw));
+	ret = find_fs_roots(frw, start);
+	if (ret < 0)
+		goto out;
+	ret = group_fs_roots(frw);
+	if (ret < 0)
+		goto out;
+
+	/* Chain the trees of each group in order */
+	tail = malloc(max(frw->nr_roots, 1) * sizeof(*tail));
+	items = malloc(max(frw->nr_roots, 1) * sizeof(*items));
+	if (!tail || !items) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < frw->nr_roots; i++) {
+		int group = fs_root_group(frw->roots, i);
+
+		frw->roots[i].next = -1;
+		frw->roots[i].last = true;
+		if (group == i) {
+			nr_groups++;
+		} else {
+			frw->roots[tail[group]].next = i;
+			frw->roots[tail[group]].last = false;
+		}
+		tail[group] = i;
+	}
+	if (nr_groups < 2) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = check_workers_init(&frw->workers, gfs_info, threads,
+				 frw->nr_roots, check_fs_root_worker, frw);
+	if (ret < 0)
+		goto out;
+	for (i = 0; i < frw->nr_roots; i++) {
+		if (fs_root_group(frw->roots, i) != i)
+			continue;
+		nr = 0;
+		for (j = i; j >= 0; j = frw->roots[j].next)
+			items[nr++] = j;
+		ret = check_workers_add_job(&frw->workers, items, nr);
+		if (ret < 0)
+			goto out;
+	}
+	cache_tree_init(&frw->root_cache);
+	memset(&frw->wc, 0, sizeof(frw->wc));
+	cache_tree_init(&frw->wc.shared);
+	ret = 0;
+out:
+	free(tail);
+	free(items);
+	if (ret) {
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot check fs trees in parallel: %m");
+		}
+		release_fs_roots_workers(frw);
+	}
+	return ret;
+}
+
+/*
+ * Apply the results of the fs tree at @key from its worker to @root_cache.
+ *
+ * Return the result of the check, or -EAGAIN if the tree must be checked
+ * here.
+ */
+static int collect_fs_root(struct fs_roots_workers *frw,
+			   const struct btrfs_key *key,
+			   struct cache_tree *root_cache)
+{
+	struct fs_root_entry *entry;
+	void *data;
+	size_t len;
+	int result = 0;
+	int ret;
+
+	if (frw->next >= frw->nr_roots ||
+	    btrfs_comp_cpu_keys(key, &frw->roots[frw->next].key))
+		return -EAGAIN;
+
+	entry = &frw->roots[frw->next];
+	if (fs_root_group(frw->roots, frw->next) == frw->next)
+		frw->open_groups++;
+	if (entry->last)
+		frw->open_groups--;
+	ret = check_workers_collect(&frw->workers, frw->next++, &result,
+				    &data, &len);
+	if (ret == -EAGAIN)
+		return ret;
+	if (ret < 0) {
+		error("failed to check tree %llu",
+		      key->objectid == BTRFS_TREE_RELOC_OBJECTID ?
+		      key->offset : key->objectid);
+		return ret;
+	}
+	ret = replay_root_rec_log(root_cache, data, len, &frw->shared_left);
+	free(data);
+	if (ret < 0) {
+		error("invalid results of tree %llu from check worker",
+		      key->objectid);
+		return ret;
+	}
+	return result;
+}
+
 static int check_fs_roots(struct cache_tree *root_cache)
 {
 	struct btrfs_path path;
@@ -3726,6 +4235,15 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	struct extent_buffer *leaf, *tree_node;
 	struct btrfs_root *tmp_root;
 	struct btrfs_root *tree_root = gfs_info->tree_root;
+	struct fs_roots_workers frw = { 0 };
+	const struct btrfs_key *resume_key = NULL;
+	struct btrfs_key done_key;
+	bool done_any = false;
+	bool parallel = false;
+	bool shared_left = false;
+	FILE *log = NULL;
+	char *log_buf = NULL;
+	size_t log_len = 0;
 	u64 skip_root = 0;
 	int ret;
 	int err = 0;
@@ -3740,6 +4258,33 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	cache_tree_init(&wc.shared);
 	btrfs_init_path(&path);
 
+	/* Log the root records for the checkpoint, repeating the saved ones */
+	if (resume_path) {
+		log = open_memstream(&log_buf, &log_len);
+		if (!log)
+			warning("cannot save the progress of fs roots: %m");
+		root_rec_log = log;
+	}
+	if (resume_path && checkpoint.has_root_key) {
+		ret = replay_root_rec_log(root_cache, checkpoint.root_log,
+					  checkpoint.root_log_len,
+					  &shared_left);
+		if (ret < 0) {
+			error("invalid root records in checkpoint %s",
+			      resume_path);
+			err = 1;
+			goto out;
+		}
+		shared_left |= checkpoint.shared_left;
+		err = checkpoint.roots_err;
+		resume_key = &checkpoint.root_key;
+	}
+
+	/* Trees are not modified, the tree root won't change under the workers */
+	if (check_threads > 1 && !repair)
+		parallel = !start_fs_roots_workers(&frw, check_threads,
+						   resume_key);
+
 again:
 	key.offset = 0;
 	if (skip_root)
@@ -3747,11 +4292,16 @@ again:
 	else
 		key.objectid = 0;
 	key.type = BTRFS_ROOT_ITEM_KEY;
+	if (resume_key)
+		key = *resume_key;
 	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
 	if (ret < 0) {
 		err = 1;
 		goto out;
 	}
+	/* Continue after the last item done */
+	if (resume_key && ret == 0)
+		path.slots[0]++;
 	tree_node = tree_root->node;
 	while (1) {
 
@@ -3773,6 +4323,14 @@ again:
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			if (parallel) {
+				ret = collect_fs_root(&frw, &key, root_cache);
+				if (ret != -EAGAIN) {
+					if (ret)
+						err = 1;
+					goto next;
+				}
+			}
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 				tmp_root = btrfs_read_fs_root_no_cache(
 						gfs_info, &key);
@@ -3822,13 +4380,45 @@ again:
 			}
 		}
 next:
+		/*
+		 * Save the progress where no tree shares blocks with the trees
+		 * still to check, nothing else is carried over
+		 */
+		if (log) {
+			btrfs_item_key_to_cpu(path.nodes[0], &done_key,
+					      path.slots[0]);
+			done_any = true;
+		}
+		if (log && checkpoint_due(&checkpoint) &&
+		    cache_tree_empty(&wc.shared) &&
+		    (!parallel || !frw.open_groups)) {
+			fflush(log);
+			checkpoint_save_roots(&checkpoint, &done_key, err,
+					      shared_left || frw.shared_left,
+					      log_buf, log_len);
+		}
 		path.slots[0]++;
 	}
+	/* All trees are done, the root records are kept for the root refs */
+	if (log && done_any && !err && cache_tree_empty(&wc.shared)) {
+		fflush(log);
+		checkpoint_save_roots(&checkpoint, &done_key, err,
+				      shared_left || frw.shared_left,
+				      log_buf, log_len);
+	}
 out:
 	btrfs_release_path(&path);
+	if (parallel)
+		release_fs_roots_workers(&frw);
+	if (log) {
+		root_rec_log = NULL;
+		fclose(log);
+		free(log_buf);
+	}
 	if (err)
 		free_extent_cache_tree(&wc.shared);
-	if (!cache_tree_empty(&wc.shared))
+	if (!cache_tree_empty(&wc.shared) ||
+	    (((parallel && frw.shared_left) || shared_left) && !err))
 		fprintf(stderr, "warning line %d\n", __LINE__);
 
 	return err;
@@ -3894,12 +4484,33 @@ static struct data_backref *find_data_backref(struct extent_record *rec,
 	return back;
 }
 
+/*
+ * The phase was done in the check being resumed, print that instead of doing
+ * it again
+ */
+static bool skip_done_phase(int phase, const char *what)
+{
+	if (!resume_path || !checkpoint_phase_done(&checkpoint, phase))
+		return false;
+	fprintf(stderr, "[%d/7] %s... done before the checkpoint\n", phase,
+		what);
+	return true;
+}
+
+static void finish_phase(int phase, int err)
+{
+	if (resume_path)
+		checkpoint_finish_phase(&checkpoint, phase, err,
+					!list_empty(&gfs_info->recow_ebs));
+}
+
 static int do_check_fs_roots(struct cache_tree *root_cache)
 {
 	int ret;
 
 	if (check_mode == CHECK_MODE_LOWMEM)
-		ret = check_fs_roots_lowmem();
+		ret = check_fs_roots_lowmem(check_threads,
+					    resume_path ? &checkpoint : NULL);
 	else
 		ret = check_fs_roots(root_cache);
 
@@ -4018,38 +4629,679 @@ out:
 	return err;
 }
 
-static void __free_one_backref(struct rb_node *node)
-{
-	struct extent_backref *back = rb_node_to_extent_backref(node);
+/*
+ * Extent records and their backrefs take most of the memory in original
+ * mode, they're accounted to the memory budget.
+ */
+static struct extent_record_stats extent_record_stats;
 
-	free(back);
-}
+/*
+ * Most records wait long for the other side of their references. Under an
+ * explicit memory limit, they're packed in memory to sorted runs of a few
+ * dozen bytes per record once they take a few megabytes, see check/spill.h.
+ * Without one, only once they take half of the memory. With --spill-dir,
+ * they're moved to runs in scratch files instead when they take half of the
+ * memory budget. They're restored when their range is looked up, and in
+ * order of their start by the final pass of check_extent_refs().
+ */
+static struct record_spill extent_pack;
+static struct record_spill extent_spill;
+/* Size of the unpacked records to pack them at, at least */
+static u64 pack_threshold;
+/* Size of the records in memory to spill them at */
+static u64 spill_threshold;
+/* Records in @extent_pack and the memory accounted for them */
+static u64 nr_packed;
+static u64 pack_accounted;
+/*
+ * First error restoring records. The records are incomplete from then on,
+ * every lookup fails with it and the check stops.
+ */
+static int restore_error;
 
-static void free_all_extent_backrefs(struct extent_record *rec)
+static void update_record_peak(void)
 {
-	rb_free_nodes(&rec->backref_tree, __free_one_backref);
+	struct extent_record_stats *stats = &extent_record_stats;
+
+	if (stats->bytes > stats->peak_bytes) {
+		stats->peak_bytes = stats->bytes;
+		stats->peak_records = stats->records;
+	}
 }
 
-static void free_extent_record_cache(struct cache_tree *extent_cache)
+/*
+ * Account @nr objects of @size bytes, @nr < 0 when they're freed, and with
+ * @is_rec count them as extent records
+ */
+static void account_records(size_t size, s64 nr, bool is_rec)
 {
-	struct cache_extent *cache;
-	struct extent_record *rec;
+	struct extent_record_stats *stats = &extent_record_stats;
 
-	while (1) {
-		cache = first_cache_extent(extent_cache);
-		if (!cache)
-			break;
-		rec = container_of(cache, struct extent_record, cache);
-		remove_cache_extent(extent_cache, cache);
-		free_all_extent_backrefs(rec);
-		free(rec);
+	if (is_rec) {
+		stats->records += nr;
+		if (nr > 0)
+			stats->allocated += nr;
 	}
+	stats->bytes += nr * (s64)size;
+	update_record_peak();
 }
 
-static int maybe_free_extent_rec(struct cache_tree *extent_cache,
-				 struct extent_record *rec)
+/*
+ * Account @nr records added to @extent_pack, @nr < 0 when they're restored,
+ * and the change of its memory
+ */
+static void account_packed(s64 nr)
 {
-	u64 super_gen = btrfs_super_generation(gfs_info->super_copy);
+	struct extent_record_stats *stats = &extent_record_stats;
+
+	nr_packed += nr;
+	stats->records += nr;
+	stats->bytes += extent_pack.memory - pack_accounted;
+	pack_accounted = extent_pack.memory;
+	update_record_peak();
+}
+
+static void *alloc_record(size_t size, bool is_rec)
+{
+	void *rec;
+
+	rec = malloc(size);
+	if (rec) {
+		memory_charge(size);
+		account_records(size, 1, is_rec);
+	}
+	return rec;
+}
+
+static void free_record(void *rec, size_t size, bool is_rec)
+{
+	memory_uncharge(size);
+	account_records(size, -1, is_rec);
+	free(rec);
+}
+
+static struct extent_record *alloc_extent_record(void)
+{
+	return alloc_record(sizeof(struct extent_record), true);
+}
+
+static void free_extent_record(struct extent_record *rec)
+{
+	free_record(rec, sizeof(*rec), true);
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		free_record(back, sizeof(struct data_backref), false);
+	else
+		free_record(back, sizeof(struct tree_backref), false);
+}
+
+static void __free_one_backref(struct rb_node *node)
+{
+	struct extent_backref *back = rb_node_to_extent_backref(node);
+
+	free_extent_backref(back);
+}
+
+static void free_all_extent_backrefs(struct extent_record *rec)
+{
+	rb_free_nodes(&rec->backref_tree, __free_one_backref);
+}
+
+static void free_one_extent_record(struct extent_record *rec)
+{
+	free_all_extent_backrefs(rec);
+	free_extent_record(rec);
+}
+
+/*
+ * Drop all extent records of @extent_cache and their backrefs, including the
+ * duplicates that are not in @extent_cache, and the packed and spilled
+ * records.
+ */
+static void free_extent_record_cache(struct cache_tree *extent_cache)
+{
+	struct cache_extent *cache;
+	struct extent_record *rec;
+	struct extent_record *dup;
+	struct extent_record *tmp;
+
+	while ((cache = first_cache_extent(extent_cache))) {
+		rec = container_of(cache, struct extent_record, cache);
+		remove_cache_extent(extent_cache, cache);
+		list_for_each_entry_safe(dup, tmp, &rec->dups, list) {
+			list_del_init(&dup->list);
+			free_one_extent_record(dup);
+		}
+		list_del_init(&rec->list);
+		free_one_extent_record(rec);
+	}
+	INIT_LIST_HEAD(&duplicate_extents);
+	record_spill_release(&extent_pack);
+	account_packed(-(s64)nr_packed);
+	record_spill_release(&extent_spill);
+	pack_threshold = 0;
+	spill_threshold = 0;
+	restore_error = 0;
+}
+
+/* Flags of a packed extent record, flag_block_full_backref is in bits 0-1 */
+#define PACKED_RECORD_FOUND_REC		(1U << 2)
+#define PACKED_RECORD_CONTENT_CHECKED	(1U << 3)
+#define PACKED_RECORD_OWNER_REF_CHECKED	(1U << 4)
+#define PACKED_RECORD_IS_ROOT		(1U << 5)
+#define PACKED_RECORD_METADATA		(1U << 6)
+#define PACKED_RECORD_BAD_FULL_BACKREF	(1U << 7)
+#define PACKED_RECORD_CROSSING_STRIPES	(1U << 8)
+#define PACKED_RECORD_WRONG_CHUNK_TYPE	(1U << 9)
+#define PACKED_RECORD_BACKREFS		(1U << 10)
+/* Followed by the members only set for tree blocks */
+#define PACKED_RECORD_TREE_BLOCK	(1U << 11)
+
+/* Flags of a packed backref, the tree of backrefs is packed in preorder */
+#define PACKED_BACKREF_LEFT		(1U << 0)
+#define PACKED_BACKREF_RIGHT		(1U << 1)
+#define PACKED_BACKREF_BLACK		(1U << 2)
+#define PACKED_BACKREF_DATA		(1U << 3)
+#define PACKED_BACKREF_FOUND_EXTENT_TREE (1U << 4)
+#define PACKED_BACKREF_FULL_BACKREF	(1U << 5)
+#define PACKED_BACKREF_FOUND_REF	(1U << 6)
+#define PACKED_BACKREF_BROKEN		(1U << 7)
+
+/*
+ * The records are packed as a sequence of numbers in LEB128 format, 7 bits per
+ * byte, so the small ones that are the most common take a byte. Signed
+ * differences are zigzag encoded, the sign in the lowest bit.
+ */
+struct pack_buffer {
+	u8 *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+struct unpack_buffer {
+	const u8 *pos;
+	const u8 *end;
+	int error;
+};
+
+static void pack_u64(struct pack_buffer *pb, u64 val)
+{
+	if (pb->error)
+		return;
+	if (pb->len + 10 > pb->size) {
+		size_t size = max_t(size_t, pb->size * 2, 256);
+		u8 *tmp = realloc(pb->data, size);
+
+		if (!tmp) {
+			pb->error = -ENOMEM;
+			return;
+		}
+		pb->data = tmp;
+		pb->size = size;
+	}
+	while (val >= 0x80) {
+		pb->data[pb->len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	pb->data[pb->len++] = val;
+}
+
+static void pack_s64(struct pack_buffer *pb, s64 val)
+{
+	pack_u64(pb, ((u64)val << 1) ^ (u64)(val >> 63));
+}
+
+static u64 unpack_u64(struct unpack_buffer *ub)
+{
+	u64 val = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && ub->pos < ub->end; shift += 7) {
+		u8 byte = *ub->pos++;
+
+		val |= (u64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return val;
+	}
+	ub->error = -EUCLEAN;
+	return 0;
+}
+
+static s64 unpack_s64(struct unpack_buffer *ub)
+{
+	u64 val = unpack_u64(ub);
+
+	return (s64)(val >> 1) ^ -(s64)(val & 1);
+}
+
+/*
+ * The shape and the colors of the tree are kept, so the backrefs are visited
+ * in the same order once the record is restored. The disk_bytenr of data
+ * backrefs is relative to the start of the record.
+ */
+static void pack_backrefs(struct pack_buffer *pb, struct extent_record *rec,
+			  struct rb_node *node)
+{
+	struct extent_backref *back = rb_node_to_extent_backref(node);
+	u8 flags = 0;
+
+	if (node->rb_left)
+		flags |= PACKED_BACKREF_LEFT;
+	if (node->rb_right)
+		flags |= PACKED_BACKREF_RIGHT;
+	if (rb_is_black(node))
+		flags |= PACKED_BACKREF_BLACK;
+	if (back->is_data)
+		flags |= PACKED_BACKREF_DATA;
+	if (back->found_extent_tree)
+		flags |= PACKED_BACKREF_FOUND_EXTENT_TREE;
+	if (back->full_backref)
+		flags |= PACKED_BACKREF_FULL_BACKREF;
+	if (back->found_ref)
+		flags |= PACKED_BACKREF_FOUND_REF;
+	if (back->broken)
+		flags |= PACKED_BACKREF_BROKEN;
+
+	pack_u64(pb, flags);
+	if (back->is_data) {
+		struct data_backref *dback = to_data_backref(back);
+
+		pack_u64(pb, dback->root);
+		pack_u64(pb, dback->owner);
+		pack_u64(pb, dback->offset);
+		pack_s64(pb, dback->disk_bytenr - rec->start);
+		pack_u64(pb, dback->bytes);
+		pack_u64(pb, dback->num_refs);
+		pack_u64(pb, dback->found_ref);
+	} else {
+		pack_u64(pb, to_tree_backref(back)->root);
+	}
+	if (node->rb_left)
+		pack_backrefs(pb, rec, node->rb_left);
+	if (node->rb_right)
+		pack_backrefs(pb, rec, node->rb_right);
+}
+
+static bool is_tree_block_record(const struct extent_record *rec)
+{
+	static const struct btrfs_disk_key zero_key;
+
+	return rec->parent_generation || rec->info_objectid ||
+	       rec->info_level ||
+	       memcmp(&rec->parent_key, &zero_key, sizeof(zero_key));
+}
+
+/*
+ * Pack a record and its backrefs to @pb, the start is relative to the start
+ * of its range in @extent_cache
+ */
+static void pack_extent_record(struct pack_buffer *pb,
+			       struct extent_record *rec)
+{
+	u32 flags = rec->flag_block_full_backref;
+
+	if (rec->found_rec)
+		flags |= PACKED_RECORD_FOUND_REC;
+	if (rec->content_checked)
+		flags |= PACKED_RECORD_CONTENT_CHECKED;
+	if (rec->owner_ref_checked)
+		flags |= PACKED_RECORD_OWNER_REF_CHECKED;
+	if (rec->is_root)
+		flags |= PACKED_RECORD_IS_ROOT;
+	if (rec->metadata)
+		flags |= PACKED_RECORD_METADATA;
+	if (rec->bad_full_backref)
+		flags |= PACKED_RECORD_BAD_FULL_BACKREF;
+	if (rec->crossing_stripes)
+		flags |= PACKED_RECORD_CROSSING_STRIPES;
+	if (rec->wrong_chunk_type)
+		flags |= PACKED_RECORD_WRONG_CHUNK_TYPE;
+	if (!RB_EMPTY_ROOT(&rec->backref_tree))
+		flags |= PACKED_RECORD_BACKREFS;
+	if (is_tree_block_record(rec))
+		flags |= PACKED_RECORD_TREE_BLOCK;
+
+	pb->len = 0;
+	pack_u64(pb, flags);
+	pack_s64(pb, rec->start - rec->cache.start);
+	pack_u64(pb, rec->max_size);
+	pack_u64(pb, rec->nr);
+	pack_u64(pb, rec->refs);
+	pack_u64(pb, rec->extent_item_refs);
+	pack_u64(pb, rec->generation);
+	pack_u64(pb, rec->num_duplicates);
+	if (flags & PACKED_RECORD_TREE_BLOCK) {
+		pack_u64(pb, rec->parent_generation);
+		pack_u64(pb, rec->info_objectid);
+		pack_u64(pb, rec->info_level);
+		pack_u64(pb, btrfs_disk_key_objectid(&rec->parent_key));
+		pack_u64(pb, btrfs_disk_key_type(&rec->parent_key));
+		pack_u64(pb, btrfs_disk_key_offset(&rec->parent_key));
+	}
+	if (flags & PACKED_RECORD_BACKREFS)
+		pack_backrefs(pb, rec, rec->backref_tree.rb_node);
+}
+
+static int unpack_backrefs(struct unpack_buffer *ub, struct extent_record *rec,
+			   struct rb_node *parent, struct rb_node **link)
+{
+	struct extent_backref *back;
+	u64 flags;
+	int ret = 0;
+
+	flags = unpack_u64(ub);
+	if (ub->error)
+		return ub->error;
+	if (flags & PACKED_BACKREF_DATA) {
+		struct data_backref *dback;
+
+		dback = alloc_record(sizeof(*dback), false);
+		if (!dback)
+			return -ENOMEM;
+		dback->root = unpack_u64(ub);
+		dback->owner = unpack_u64(ub);
+		dback->offset = unpack_u64(ub);
+		dback->disk_bytenr = rec->start + unpack_s64(ub);
+		dback->bytes = unpack_u64(ub);
+		dback->num_refs = unpack_u64(ub);
+		dback->found_ref = unpack_u64(ub);
+		back = &dback->node;
+	} else {
+		struct tree_backref *tback;
+
+		tback = alloc_record(sizeof(*tback), false);
+		if (!tback)
+			return -ENOMEM;
+		tback->root = unpack_u64(ub);
+		back = &tback->node;
+	}
+	back->is_data = !!(flags & PACKED_BACKREF_DATA);
+	back->found_extent_tree = !!(flags & PACKED_BACKREF_FOUND_EXTENT_TREE);
+	back->full_backref = !!(flags & PACKED_BACKREF_FULL_BACKREF);
+	back->found_ref = !!(flags & PACKED_BACKREF_FOUND_REF);
+	back->broken = !!(flags & PACKED_BACKREF_BROKEN);
+	rb_link_node(&back->node, parent, link);
+	rb_set_parent_color(&back->node, parent,
+			    (flags & PACKED_BACKREF_BLACK) ? RB_BLACK : RB_RED);
+	if (ub->error)
+		return ub->error;
+
+	if (flags & PACKED_BACKREF_LEFT)
+		ret = unpack_backrefs(ub, rec, &back->node,
+				      &back->node.rb_left);
+	if (!ret && (flags & PACKED_BACKREF_RIGHT))
+		ret = unpack_backrefs(ub, rec, &back->node,
+				      &back->node.rb_right);
+	return ret;
+}
+
+static int restore_extent_record(void *priv, u64 start, u64 size,
+				 const void *data, size_t len)
+{
+	struct cache_tree *extent_cache = priv;
+	struct unpack_buffer ub = { .pos = data, .end = data + len };
+	struct extent_record *rec;
+	u64 objectid;
+	u8 type;
+	u64 offset;
+	u64 flags;
+	int ret = 0;
+
+	rec = alloc_extent_record();
+	if (!rec)
+		return -ENOMEM;
+	/* Not a new record */
+	extent_record_stats.allocated--;
+	memset(rec, 0, sizeof(*rec));
+	INIT_LIST_HEAD(&rec->dups);
+	INIT_LIST_HEAD(&rec->list);
+	rec->backref_tree = RB_ROOT;
+	rec->cache.start = start;
+	rec->cache.size = size;
+
+	flags = unpack_u64(&ub);
+	rec->flag_block_full_backref = flags & 3;
+	rec->found_rec = !!(flags & PACKED_RECORD_FOUND_REC);
+	rec->content_checked = !!(flags & PACKED_RECORD_CONTENT_CHECKED);
+	rec->owner_ref_checked = !!(flags & PACKED_RECORD_OWNER_REF_CHECKED);
+	rec->is_root = !!(flags & PACKED_RECORD_IS_ROOT);
+	rec->metadata = !!(flags & PACKED_RECORD_METADATA);
+	rec->bad_full_backref = !!(flags & PACKED_RECORD_BAD_FULL_BACKREF);
+	rec->crossing_stripes = !!(flags & PACKED_RECORD_CROSSING_STRIPES);
+	rec->wrong_chunk_type = !!(flags & PACKED_RECORD_WRONG_CHUNK_TYPE);
+	rec->start = start + unpack_s64(&ub);
+	rec->max_size = unpack_u64(&ub);
+	rec->nr = unpack_u64(&ub);
+	rec->refs = unpack_u64(&ub);
+	rec->extent_item_refs = unpack_u64(&ub);
+	rec->generation = unpack_u64(&ub);
+	rec->num_duplicates = unpack_u64(&ub);
+	if (flags & PACKED_RECORD_TREE_BLOCK) {
+		rec->parent_generation = unpack_u64(&ub);
+		rec->info_objectid = unpack_u64(&ub);
+		rec->info_level = unpack_u64(&ub);
+		objectid = unpack_u64(&ub);
+		type = unpack_u64(&ub);
+		offset = unpack_u64(&ub);
+		btrfs_set_disk_key_objectid(&rec->parent_key, objectid);
+		btrfs_set_disk_key_type(&rec->parent_key, type);
+		btrfs_set_disk_key_offset(&rec->parent_key, offset);
+	}
+	ret = ub.error;
+	if (!ret && (flags & PACKED_RECORD_BACKREFS))
+		ret = unpack_backrefs(&ub, rec, NULL,
+				      &rec->backref_tree.rb_node);
+	if (!ret && ub.pos != ub.end)
+		ret = -EUCLEAN;
+	if (!ret)
+		ret = insert_cache_extent(extent_cache, &rec->cache);
+	if (ret) {
+		free_all_extent_backrefs(rec);
+		free_extent_record(rec);
+		return ret;
+	}
+	return 0;
+}
+
+static int restore_packed_extent_record(void *priv, u64 start, u64 size,
+					const void *data, size_t len)
+{
+	int ret;
+
+	ret = restore_extent_record(priv, start, size, data, len);
+	if (!ret)
+		account_packed(-1);
+	return ret;
+}
+
+static struct cache_extent *restore_failed(int ret)
+{
+	errno = -ret;
+	error("cannot restore packed extent records: %m");
+	restore_error = ret;
+	return ERR_PTR(ret);
+}
+
+/*
+ * Look up the record of a range in @extent_cache, the packed and spilled
+ * records overlapping the range are restored first
+ *
+ * Return ERR_PTR() if they can't be restored.
+ */
+static struct cache_extent *lookup_extent_record(
+		struct cache_tree *extent_cache, u64 start, u64 size)
+{
+	int ret;
+
+	if (restore_error)
+		return ERR_PTR(restore_error);
+	if (!record_spill_empty(&extent_pack)) {
+		ret = record_spill_restore_range(&extent_pack, start, size,
+						 restore_packed_extent_record,
+						 extent_cache);
+		account_packed(0);
+		if (ret < 0)
+			return restore_failed(ret);
+	}
+	if (!record_spill_empty(&extent_spill)) {
+		ret = record_spill_restore_range(&extent_spill, start, size,
+						 restore_extent_record,
+						 extent_cache);
+		if (ret < 0)
+			return restore_failed(ret);
+	}
+	return lookup_cache_extent(extent_cache, start, size);
+}
+
+/*
+ * First record by start, of the records in memory and the packed and spilled
+ * ones
+ *
+ * Return ERR_PTR() if they can't be restored.
+ */
+static struct cache_extent *first_extent_record(
+		struct cache_tree *extent_cache)
+{
+	struct cache_extent *cache = search_cache_extent(extent_cache, 0);
+	int ret;
+
+	if (restore_error)
+		return ERR_PTR(restore_error);
+	if (!record_spill_empty(&extent_pack)) {
+		ret = record_spill_restore_first(&extent_pack,
+					cache ? cache->start : (u64)-1,
+					restore_packed_extent_record,
+					extent_cache);
+		account_packed(0);
+		if (ret < 0)
+			return restore_failed(ret);
+		if (ret > 0)
+			cache = search_cache_extent(extent_cache, 0);
+	}
+	if (!record_spill_empty(&extent_spill)) {
+		ret = record_spill_restore_first(&extent_spill,
+					cache ? cache->start : (u64)-1,
+					restore_extent_record, extent_cache);
+		if (ret < 0)
+			return restore_failed(ret);
+		if (ret > 0)
+			cache = search_cache_extent(extent_cache, 0);
+	}
+	return cache;
+}
+
+/*
+ * Pack the records in @extent_cache to a new run of @extent_pack. Duplicates
+ * are linked to each other and stay as they are.
+ */
+static int pack_extent_records(struct cache_tree *extent_cache)
+{
+	struct pack_buffer pb = { 0 };
+	struct cache_extent *cache;
+	struct cache_extent *next;
+	int ret;
+
+	ret = record_spill_begin(&extent_pack);
+	if (ret < 0)
+		return ret;
+	for (cache = search_cache_extent(extent_cache, 0); cache;
+	     cache = next) {
+		struct extent_record *rec;
+
+		next = next_cache_extent(cache);
+		rec = container_of(cache, struct extent_record, cache);
+		if (!list_empty(&rec->list) || !list_empty(&rec->dups) ||
+		    !cache->size || cache->start + cache->size < cache->start)
+			continue;
+		pack_extent_record(&pb, rec);
+		ret = pb.error;
+		if (!ret)
+			ret = record_spill_add(&extent_pack, cache->start,
+					       cache->size, pb.data, pb.len);
+		if (ret)
+			break;
+		account_packed(1);
+		remove_cache_extent(extent_cache, cache);
+		free_all_extent_backrefs(rec);
+		free_extent_record(rec);
+	}
+	free(pb.data);
+	/* The records packed so far are only in the run */
+	if (!ret)
+		ret = record_spill_end(&extent_pack);
+	else
+		record_spill_end(&extent_pack);
+	account_packed(0);
+	return ret;
+}
+
+/*
+ * Pack the records in @extent_cache once the unpacked ones take more than
+ * @pack_threshold. Under an explicit memory limit that's a sixteenth of it,
+ * between a page and 4MiB. Otherwise the budget is all the memory and
+ * packing costs time for nothing until the records take half of it.
+ *
+ * With --spill-dir, all records are packed and moved to a new run in the
+ * spill directory once they take more than half of the memory budget. The
+ * repair mode modifies the records behind the lookups and packs nothing.
+ */
+static int maybe_pack_extent_records(struct cache_tree *extent_cache)
+{
+	struct extent_record_stats *stats = &extent_record_stats;
+	s64 moved;
+	int ret;
+
+	if (repair)
+		return 0;
+	if (!pack_threshold) {
+		if (memory_budget_is_explicit())
+			pack_threshold = min_t(u64, max_t(u64,
+					memory_budget() / 16, SZ_4K), SZ_4M);
+		else
+			pack_threshold = memory_budget() / 2;
+	}
+	if (spill_dir && !spill_threshold)
+		spill_threshold = memory_budget() / 2;
+
+	if (spill_dir && stats->bytes > spill_threshold) {
+		ret = pack_extent_records(extent_cache);
+		if (ret < 0)
+			goto error;
+		moved = record_spill_move(&extent_spill, &extent_pack);
+		account_packed(moved < 0 ? 0 : -moved);
+		if (moved < 0) {
+			errno = -moved;
+			error("cannot spill extent records to %s: %m",
+			      spill_dir);
+			return moved;
+		}
+		/* Don't spill again right away if what's left is big already */
+		spill_threshold = max(memory_budget() / 2,
+				      stats->bytes + memory_budget() / 8);
+		return 0;
+	}
+	/* Pack less often as the runs grow, each merge copies them all */
+	if (stats->bytes - pack_accounted <=
+	    max(pack_threshold, pack_accounted / 4))
+		return 0;
+	ret = pack_extent_records(extent_cache);
+	if (ret < 0)
+		goto error;
+	return 0;
+error:
+	errno = -ret;
+	error("cannot pack extent records: %m");
+	return ret;
+}
+
+static int maybe_free_extent_rec(struct cache_tree *extent_cache,
+				 struct extent_record *rec)
+{
+	u64 super_gen = btrfs_super_generation(gfs_info->super_copy);
 
 	if (rec->content_checked && rec->owner_ref_checked &&
 	    rec->extent_item_refs == rec->refs && rec->refs > 0 &&
@@ -4060,7 +5312,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 		remove_cache_extent(extent_cache, &rec->cache);
 		free_all_extent_backrefs(rec);
 		list_del_init(&rec->list);
-		free(rec);
+		free_extent_record(rec);
 	}
 	return 0;
 }
@@ -4155,7 +5407,9 @@ static int record_bad_block_io(struct cache_tree *extent_cache,
 	struct cache_extent *cache;
 	struct btrfs_key key;
 
-	cache = lookup_cache_extent(extent_cache, start, len);
+	cache = lookup_extent_record(extent_cache, start, len);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (!cache)
 		return 0;
 
@@ -4453,7 +5707,9 @@ static int check_block(struct btrfs_root *root,
 	int ret = 0;
 	int level;
 
-	cache = lookup_cache_extent(extent_cache, buf->start, buf->len);
+	cache = lookup_extent_record(extent_cache, buf->start, buf->len);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (!cache)
 		return 1;
 	rec = container_of(cache, struct extent_record, cache);
@@ -4509,8 +5765,9 @@ static int check_block(struct btrfs_root *root,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref;
 
+	ref = alloc_record(sizeof(*ref), false);
 	if (!ref)
 		return NULL;
 	memset(&ref->node, 0, sizeof(ref->node));
@@ -4530,8 +5787,9 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref;
 
+	ref = alloc_record(sizeof(*ref), false);
 	if (!ref)
 		return NULL;
 	memset(ref, 0, sizeof(*ref));
@@ -4617,7 +5875,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	int ret = 0;
 
 	BUG_ON(tmpl->max_size == 0);
-	rec = malloc(sizeof(*rec));
+	rec = alloc_extent_record();
 	if (!rec)
 		return -ENOMEM;
 	rec->start = tmpl->start;
@@ -4637,7 +5895,6 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->extent_item_refs = tmpl->extent_item_refs;
 	rec->parent_generation = tmpl->parent_generation;
 	rec->generation = tmpl->generation;
-	INIT_LIST_HEAD(&rec->backrefs);
 	INIT_LIST_HEAD(&rec->dups);
 	INIT_LIST_HEAD(&rec->list);
 	rec->backref_tree = RB_ROOT;
@@ -4646,7 +5903,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->cache.size = tmpl->nr;
 	ret = insert_cache_extent(extent_cache, &rec->cache);
 	if (ret) {
-		free(rec);
+		free_extent_record(rec);
 		return ret;
 	}
 	bytes_used += rec->nr;
@@ -4676,7 +5933,9 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 	int ret = 0;
 	int dup = 0;
 
-	cache = lookup_cache_extent(extent_cache, tmpl->start, tmpl->nr);
+	cache = lookup_extent_record(extent_cache, tmpl->start, tmpl->nr);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (cache) {
 		rec = container_of(cache, struct extent_record, cache);
 		if (tmpl->refs)
@@ -4704,7 +5963,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = alloc_extent_record();
 				if (!tmp)
 					return -ENOMEM;
 				tmp->start = tmpl->start;
@@ -4776,7 +6035,9 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	int ret;
 	bool insert = false;
 
-	cache = lookup_cache_extent(extent_cache, bytenr, 1);
+	cache = lookup_extent_record(extent_cache, bytenr, 1);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (!cache) {
 		struct extent_record tmpl;
 
@@ -4791,7 +6052,9 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 			return ret;
 
 		/* really a bug in cache_extent implement now */
-		cache = lookup_cache_extent(extent_cache, bytenr, 1);
+		cache = lookup_extent_record(extent_cache, bytenr, 1);
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
 		if (!cache)
 			return -ENOENT;
 	}
@@ -4849,7 +6112,9 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 	int ret;
 	bool insert = false;
 
-	cache = lookup_cache_extent(extent_cache, bytenr, 1);
+	cache = lookup_extent_record(extent_cache, bytenr, 1);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (!cache) {
 		struct extent_record tmpl;
 
@@ -4863,7 +6128,9 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 		if (ret)
 			return ret;
 
-		cache = lookup_cache_extent(extent_cache, bytenr, 1);
+		cache = lookup_extent_record(extent_cache, bytenr, 1);
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
 		if (!cache)
 			abort();
 	}
@@ -5025,6 +6292,150 @@ static int pick_next_pending(struct cache_tree *pending,
 	return ret;
 }
 
+/*
+ * The blocks of a batch picked by pick_next_pending() are processed in order
+ * of their logical address, the errors and statistics depend on that order as
+ * the scan stops at the first bad block. Their reads are issued ahead in a
+ * window of the next BLOCK_READ_WINDOW blocks to process instead, sorted by
+ * device and physical offset and sent like an elevator going up from where
+ * the previous part of the window ended. The window is refilled once half of
+ * it has been processed.
+ */
+#define BLOCK_READ_WINDOW		(64)
+
+/* Entry of the reada tree, freeing the cache extent frees it */
+struct reada_block {
+	struct cache_extent cache;
+	bool issued;
+};
+
+struct block_location {
+	u64 devid;
+	u64 physical;
+	u64 bytenr;
+};
+
+static struct {
+	/* Blocks whose reads are issued and that are not processed yet */
+	int nr_issued;
+	/* Location of the last read issued */
+	u64 devid;
+	u64 physical;
+} block_reads;
+
+static int add_reada_block(struct cache_tree *reada, u64 bytenr, u32 size)
+{
+	struct reada_block *rb;
+	int ret;
+
+	rb = calloc(1, sizeof(*rb));
+	if (!rb)
+		return -ENOMEM;
+	rb->cache.start = bytenr;
+	rb->cache.size = size;
+	ret = insert_cache_extent(reada, &rb->cache);
+	if (ret)
+		free(rb);
+	return ret;
+}
+
+static int compare_block_location(const void *a, const void *b)
+{
+	const struct block_location *la = a;
+	const struct block_location *lb = b;
+
+	if (la->devid != lb->devid)
+		return la->devid < lb->devid ? -1 : 1;
+	if (la->physical != lb->physical)
+		return la->physical < lb->physical ? -1 : 1;
+	return 0;
+}
+
+static void locate_block(struct block_location *loc, u64 bytenr)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 len = gfs_info->nodesize;
+
+	loc->bytenr = bytenr;
+	/* Unmapped blocks go last and fail to read with the usual message */
+	if (btrfs_map_block(gfs_info, READ, bytenr, &len, &multi, 0, NULL)) {
+		loc->devid = (u64)-1;
+		loc->physical = bytenr;
+		return;
+	}
+	loc->devid = multi->stripes[0].dev->devid;
+	loc->physical = multi->stripes[0].physical;
+	kfree(multi);
+}
+
+/* Issue the reads of the next blocks of @reada once half the window is free */
+static void issue_block_reads(struct cache_tree *reada)
+{
+	struct block_location locs[BLOCK_READ_WINDOW];
+	struct cache_extent *cache;
+	int nr = 0;
+	int first;
+	int i;
+
+	if (block_reads.nr_issued > BLOCK_READ_WINDOW / 2)
+		return;
+	for (cache = search_cache_extent(reada, 0);
+	     cache && block_reads.nr_issued + nr < BLOCK_READ_WINDOW;
+	     cache = next_cache_extent(cache)) {
+		struct reada_block *rb;
+
+		rb = container_of(cache, struct reada_block, cache);
+		if (rb->issued)
+			continue;
+		rb->issued = true;
+		locate_block(&locs[nr++], cache->start);
+	}
+	if (!nr)
+		return;
+
+	qsort(locs, nr, sizeof(locs[0]), compare_block_location);
+	for (first = 0; first < nr; first++) {
+		if (locs[first].devid > block_reads.devid ||
+		    (locs[first].devid == block_reads.devid &&
+		     locs[first].physical >= block_reads.physical))
+			break;
+	}
+	for (i = 0; i < nr; i++) {
+		struct block_location *loc = &locs[(first + i) % nr];
+
+		/* fixme, get the parent transid */
+		readahead_tree_block(gfs_info, loc->bytenr, 0);
+	}
+	block_reads.devid = locs[(first + nr - 1) % nr].devid;
+	block_reads.physical = locs[(first + nr - 1) % nr].physical;
+	block_reads.nr_issued += nr;
+	readahead_tree_block_submit(gfs_info);
+}
+
+/* Take the block at @bytenr off @reada before it's processed */
+static void remove_reada_block(struct cache_tree *reada, u64 bytenr,
+			       u32 size)
+{
+	struct cache_extent *cache;
+	struct reada_block *rb;
+
+	cache = lookup_cache_extent(reada, bytenr, size);
+	if (!cache)
+		return;
+	rb = container_of(cache, struct reada_block, cache);
+	if (rb->issued)
+		block_reads.nr_issued--;
+	remove_cache_extent(reada, cache);
+	free(rb);
+}
+
+/* Free the blocks of @reada, their reads complete in the background */
+static void free_reada_blocks(struct cache_tree *reada)
+{
+	free_extent_cache_tree(reada);
+	block_reads.nr_issued = 0;
+}
+
 static void free_chunk_record(struct cache_extent *cache)
 {
 	struct chunk_record *rec;
@@ -5706,86 +7117,6 @@ static int check_space_cache(struct btrfs_root *root)
 	return error ? -EINVAL : 0;
 }
 
-/*
- * Check data checksum for [@bytenr, @bytenr + @num_bytes).
- *
- * Return <0 for fatal error (fails to read checksum/data or allocate memory).
- * Return >0 for csum mismatch for any copy.
- * Return 0 if everything is OK.
- */
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb)
-{
-	u64 offset = 0;
-	u16 csum_size = btrfs_super_csum_size(gfs_info->super_copy);
-	u16 csum_type = btrfs_super_csum_type(gfs_info->super_copy);
-	u8 *data;
-	unsigned long csum_offset;
-	u8 result[BTRFS_CSUM_SIZE];
-	u8 csum_expected[BTRFS_CSUM_SIZE];
-	u64 read_len;
-	u64 data_checked = 0;
-	u64 tmp;
-	int ret = 0;
-	int mirror;
-	int num_copies;
-	bool csum_mismatch = false;
-
-	if (num_bytes % gfs_info->sectorsize)
-		return -EINVAL;
-
-	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
-
-	num_copies = btrfs_num_copies(gfs_info, bytenr, num_bytes);
-	while (offset < num_bytes) {
-		/*
-		 * Mirror 0 means 'read from any valid copy', so it's skipped.
-		 * The indexes 1-N represent the n-th copy for levels with
-		 * redundancy.
-		 */
-		for (mirror = 1; mirror <= num_copies; mirror++) {
-			read_len = num_bytes - offset;
-			/* read as much space once a time */
-			ret = read_extent_data(gfs_info, (char *)data + offset,
-					bytenr + offset, &read_len, mirror);
-			if (ret)
-				goto out;
-
-			data_checked = 0;
-			/* verify every 4k data's checksum */
-			while (data_checked < read_len) {
-				tmp = offset + data_checked;
-
-				btrfs_csum_data(csum_type, data + tmp,
-						result, gfs_info->sectorsize);
-
-				csum_offset = leaf_offset +
-					 tmp / gfs_info->sectorsize * csum_size;
-				read_extent_buffer(eb, (char *)&csum_expected,
-						   csum_offset, csum_size);
-				if (memcmp(result, csum_expected, csum_size) != 0) {
-					csum_mismatch = true;
-					/* FIXME: format of the checksum value */
-					fprintf(stderr,
-			"mirror %d bytenr %llu csum %u expected csum %u\n",
-						mirror, bytenr + tmp,
-						result[0], csum_expected[0]);
-				}
-				data_checked += gfs_info->sectorsize;
-			}
-		}
-		offset += read_len;
-	}
-out:
-	free(data);
-	if (!ret && csum_mismatch)
-		ret = 1;
-	return ret;
-}
-
 static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
 			       u64 num_bytes)
 {
@@ -5926,18 +7257,95 @@ out:
 	return ret;
 }
 
+/* Progress of the checks of consecutive csum items */
+struct csum_items_state {
+	u64 last_data_end;
+	/* Current run of contiguous csums */
+	u64 offset;
+	u64 num_bytes;
+	int errors;
+};
+
+/*
+ * Check the csum item at @slot of the leaf at @leaf_start, covering @data_len
+ * bytes from @bytenr. With @dc, its data have been verified as range @range.
+ *
+ * Return < 0 for fatal errors, other errors are counted in @state.
+ */
+static int check_csum_item(struct btrfs_root *root,
+			   struct csum_items_state *state, u64 bytenr,
+			   u64 data_len, u64 leaf_start, int slot,
+			   struct data_csums *dc, int range)
+{
+	int ret;
+
+	if (bytenr < state->last_data_end) {
+		error(
+	"csum overlap, current bytenr=%llu prev_end=%llu, eb=%llu slot=%u",
+			bytenr, state->last_data_end, leaf_start, slot);
+		state->errors++;
+	}
+	if (dc) {
+		ret = data_csums_report(dc, range);
+		/*
+		 * Only stop for fatal errors, if mismatch is found, continue
+		 * checking until all extents are checked.
+		 */
+		if (ret < 0)
+			return ret;
+		if (ret > 0)
+			state->errors++;
+	}
+	if (!state->num_bytes) {
+		state->offset = bytenr;
+	} else if (bytenr != state->offset + state->num_bytes) {
+		ret = check_extent_exists(root, state->offset,
+					  state->num_bytes);
+		if (ret) {
+			fprintf(stderr,
+		"csum exists for %llu-%llu but there is no extent record\n",
+				state->offset,
+				state->offset + state->num_bytes);
+			state->errors++;
+		}
+		state->offset = bytenr;
+		state->num_bytes = 0;
+	}
+	state->num_bytes += data_len;
+	state->last_data_end = bytenr + data_len;
+	return 0;
+}
+
+/* Verify the data of the queued csum items, then check the items in order */
+static int flush_csum_items(struct btrfs_root *root,
+			    struct csum_items_state *state,
+			    struct data_csums *dc)
+{
+	struct data_csum_range *range;
+	int ret;
+	int i;
+
+	ret = data_csums_verify(dc);
+	for (i = 0; !ret && i < dc->nr_ranges; i++) {
+		range = &dc->ranges[i];
+		ret = check_csum_item(root, state, range->bytenr, range->len,
+				      range->leaf_start, range->slot, dc, i);
+	}
+	data_csums_reset(dc);
+	return ret;
+}
+
 static int check_csums(struct btrfs_root *root)
 {
-	struct btrfs_path path;
+	struct btrfs_tree_cursor cur;
+	struct csum_items_state state = { 0 };
+	struct data_csums dc;
 	struct extent_buffer *leaf;
 	struct btrfs_key key;
-	u64 last_data_end = 0;
-	u64 offset = 0, num_bytes = 0;
+	struct btrfs_key end;
 	u16 csum_size = btrfs_super_csum_size(gfs_info->super_copy);
-	int errors = 0;
 	int ret;
 	u64 data_len;
-	unsigned long leaf_offset;
 	bool verify_csum = !!check_data_csum;
 
 	root = gfs_info->csum_root;
@@ -5946,21 +7354,19 @@ static int check_csums(struct btrfs_root *root)
 		return -ENOENT;
 	}
 
-	btrfs_init_path(&path);
 	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
 	key.type = BTRFS_EXTENT_CSUM_KEY;
 	key.offset = 0;
-	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	end.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	end.type = BTRFS_EXTENT_CSUM_KEY;
+	end.offset = (u64)-1;
+	ret = btrfs_tree_cursor_init(&cur, root->node, &key, &end, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching csum tree %d\n", ret);
-		btrfs_release_path(&path);
+		btrfs_tree_cursor_release(&cur);
 		return ret;
 	}
 
-	if (ret > 0 && path.slots[0])
-		path.slots[0]--;
-	ret = 0;
-
 	/*
 	 * For metadata dump (btrfs-image) all data is wiped so verifying data
 	 * csum is meaningless and will always report csum error.
@@ -5971,69 +7377,47 @@ static int check_csums(struct btrfs_root *root)
 		verify_csum = false;
 	}
 
+	/*
+	 * The data are verified in batches of items, the items are checked
+	 * once their data are verified so the errors keep their order
+	 */
+	data_csums_init(&dc, gfs_info, check_threads, &ctx.bytes_count);
 	while (1) {
-		ctx.item_count++;
-		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
-			ret = btrfs_next_leaf(root, &path);
-			if (ret < 0) {
+		ret = btrfs_tree_cursor_next_item(&cur);
+		if (ret < 0) {
+			if (!flush_csum_items(root, &state, &dc))
 				fprintf(stderr, "Error going to next leaf "
 					"%d\n", ret);
-				break;
-			}
-			if (ret)
-				break;
+			break;
 		}
-		leaf = path.nodes[0];
-
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-		if (key.type != BTRFS_EXTENT_CSUM_KEY) {
-			path.slots[0]++;
-			continue;
+		if (ret) {
+			flush_csum_items(root, &state, &dc);
+			break;
 		}
+		ctx.item_count++;
+		leaf = cur.eb;
+		key = cur.key;
 
-		if (key.offset < last_data_end) {
-			error(
-	"csum overlap, current bytenr=%llu prev_end=%llu, eb=%llu slot=%u",
-				key.offset, last_data_end, leaf->start,
-				path.slots[0]);
-			errors++;
-		}
-		data_len = (btrfs_item_size_nr(leaf, path.slots[0]) /
+		data_len = (btrfs_item_size_nr(leaf, cur.slot) /
 			      csum_size) * gfs_info->sectorsize;
-		if (!verify_csum)
-			goto skip_csum_check;
-		leaf_offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
-		/*
-		 * Only break for fatal errors, if mismatch is found, continue
-		 * checking until all extents are checked.
-		 */
-		if (ret < 0)
+		if (!verify_csum) {
+			check_csum_item(root, &state, key.offset, data_len,
+					leaf->start, cur.slot, NULL, 0);
+			continue;
+		}
+		ret = data_csums_add(&dc, key.offset, data_len, leaf,
+				     cur.slot);
+		if (ret < 0) {
+			flush_csum_items(root, &state, &dc);
 			break;
-		if (ret > 0)
-			errors++;
-skip_csum_check:
-		if (!num_bytes) {
-			offset = key.offset;
-		} else if (key.offset != offset + num_bytes) {
-			ret = check_extent_exists(root, offset, num_bytes);
-			if (ret) {
-				fprintf(stderr,
-		"csum exists for %llu-%llu but there is no extent record\n",
-					offset, offset+num_bytes);
-				errors++;
-			}
-			offset = key.offset;
-			num_bytes = 0;
 		}
-		num_bytes += data_len;
-		last_data_end = key.offset + data_len;
-		path.slots[0]++;
+		if (data_csums_full(&dc) && flush_csum_items(root, &state, &dc))
+			break;
 	}
 
-	btrfs_release_path(&path);
-	return errors;
+	data_csums_release(&dc);
+	btrfs_tree_cursor_release(&cur);
+	return state.errors;
 }
 
 static int is_dropped_key(struct btrfs_key *key,
@@ -6082,7 +7466,9 @@ static int calc_extent_flag(struct cache_tree *extent_cache,
 	struct tree_backref *tback;
 	u64 owner = 0;
 
-	cache = lookup_cache_extent(extent_cache, buf->start, 1);
+	cache = lookup_extent_record(extent_cache, buf->start, 1);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	/* we have added this extent before */
 	if (!cache)
 		return -ENOENT;
@@ -6208,6 +7594,11 @@ static int run_next_block(struct btrfs_root *root,
 	struct cache_extent *cache;
 	int reada_bits;
 
+	/* No record is being worked on between the blocks */
+	ret = maybe_pack_extent_records(extent_cache);
+	if (ret < 0)
+		return ret;
+
 	nritems = pick_next_pending(pending, reada, nodes, *last, bits,
 				    bits_nr, &reada_bits);
 	if (nritems == 0)
@@ -6215,15 +7606,11 @@ static int run_next_block(struct btrfs_root *root,
 
 	if (!reada_bits) {
 		for (i = 0; i < nritems; i++) {
-			ret = add_cache_extent(reada, bits[i].start,
-					       bits[i].size);
-			if (ret == -EEXIST)
-				continue;
-
-			/* fixme, get the parent transid */
-			readahead_tree_block(gfs_info, bits[i].start, 0);
+			ret = add_reada_block(reada, bits[i].start,
+					      bits[i].size);
 		}
 	}
+	issue_block_reads(reada);
 	*last = bits[0].start;
 	bytenr = bits[0].start;
 	size = bits[0].size;
@@ -6233,17 +7620,15 @@ static int run_next_block(struct btrfs_root *root,
 		remove_cache_extent(pending, cache);
 		free(cache);
 	}
-	cache = lookup_cache_extent(reada, bytenr, size);
-	if (cache) {
-		remove_cache_extent(reada, cache);
-		free(cache);
-	}
+	remove_reada_block(reada, bytenr, size);
 	cache = lookup_cache_extent(nodes, bytenr, size);
 	if (cache) {
 		remove_cache_extent(nodes, cache);
 		free(cache);
 	}
-	cache = lookup_cache_extent(extent_cache, bytenr, size);
+	cache = lookup_extent_record(extent_cache, bytenr, size);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (cache) {
 		rec = container_of(cache, struct extent_record, cache);
 		gen = rec->parent_generation;
@@ -6325,6 +7710,11 @@ static int run_next_block(struct btrfs_root *root,
 			struct btrfs_file_extent_item *fi;
 			unsigned long inline_offset;
 
+			/* Don't go on with the items once records are lost */
+			if (restore_error) {
+				ret = restore_error;
+				goto out;
+			}
 			inline_offset = offsetof(struct btrfs_file_extent_item,
 						 disk_bytenr);
 			btrfs_item_key_to_cpu(buf, &key, i);
@@ -6609,7 +7999,9 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 	struct cache_tree *extent_cache = gfs_info->fsck_extent_cache;
 
 	is_data = owner >= BTRFS_FIRST_FREE_OBJECTID;
-	cache = lookup_cache_extent(extent_cache, bytenr, num_bytes);
+	cache = lookup_extent_record(extent_cache, bytenr, num_bytes);
+	if (IS_ERR(cache))
+		return PTR_ERR(cache);
 	if (!cache)
 		return 0;
 
@@ -6638,7 +8030,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -6658,7 +8050,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -7276,6 +8668,7 @@ static int process_duplicates(struct cache_tree *extent_cache,
 	struct extent_record *good, *tmp;
 	struct cache_extent *cache;
 	int ret;
+	int err = 0;
 
 	/*
 	 * If we found a extent record for this extent then return, or if we
@@ -7300,7 +8693,6 @@ static int process_duplicates(struct cache_tree *extent_cache,
 
 	good = to_extent_record(rec->dups.next);
 	list_del_init(&good->list);
-	INIT_LIST_HEAD(&good->backrefs);
 	INIT_LIST_HEAD(&good->dups);
 	good->cache.start = good->start;
 	good->cache.size = good->nr;
@@ -7308,10 +8700,13 @@ static int process_duplicates(struct cache_tree *extent_cache,
 	good->owner_ref_checked = 0;
 	good->num_duplicates = 0;
 	good->refs = rec->refs;
-	list_splice_init(&rec->backrefs, &good->backrefs);
 	while (1) {
-		cache = lookup_cache_extent(extent_cache, good->start,
+		cache = lookup_extent_record(extent_cache, good->start,
 					    good->nr);
+		if (IS_ERR(cache)) {
+			err = PTR_ERR(cache);
+			break;
+		}
 		if (!cache)
 			break;
 		tmp = container_of(cache, struct extent_record, cache);
@@ -7338,13 +8733,14 @@ static int process_duplicates(struct cache_tree *extent_cache,
 		 * just add it to this extent and carry on like we did above.
 		 */
 		good->refs += tmp->refs;
-		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_record(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
+	free_extent_record(rec);
+	if (err)
+		return err;
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -7430,13 +8826,13 @@ out:
 		list_del_init(&tmp->list);
 		if (tmp == rec)
 			continue;
-		free(tmp);
+		free_extent_record(tmp);
 	}
 
 	while (!list_empty(&rec->dups)) {
 		tmp = to_extent_record(rec->dups.next);
 		list_del_init(&tmp->list);
-		free(tmp);
+		free_extent_record(tmp);
 	}
 
 	btrfs_release_path(&path);
@@ -7577,7 +8973,9 @@ static int find_possible_backrefs(struct btrfs_path *path,
 
 		bytenr = rec->start;
 
-		cache = lookup_cache_extent(extent_cache, bytenr, 1);
+		cache = lookup_extent_record(extent_cache, bytenr, 1);
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
 		if (cache) {
 			struct extent_record *tmp;
 
@@ -8031,7 +9429,10 @@ static int check_extent_refs(struct btrfs_root *root,
 		 * process_duplicates() will return 0, otherwise it will return
 		 * 1 and we
 		 */
-		if (process_duplicates(extent_cache, rec))
+		ret = process_duplicates(extent_cache, rec);
+		if (ret < 0)
+			return ret;
+		if (ret)
 			continue;
 		ret = delete_duplicate_records(root, rec);
 		if (ret < 0)
@@ -8053,7 +9454,9 @@ static int check_extent_refs(struct btrfs_root *root,
 		int cur_err = 0;
 		int fix = 0;
 
-		cache = search_cache_extent(extent_cache, 0);
+		cache = first_extent_record(extent_cache);
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
 		if (!cache)
 			break;
 		rec = container_of(cache, struct extent_record, cache);
@@ -8162,7 +9565,7 @@ next:
 			clear_extent_dirty(gfs_info->excluded_extents,
 					   rec->start,
 					   rec->start + rec->max_size - 1);
-		free(rec);
+		free_extent_record(rec);
 	}
 repair_abort:
 	if (repair) {
@@ -8853,6 +10256,11 @@ again:
 			goto loop;
 		goto out;
 	}
+	/* Not all the callers of the record lookups check for errors */
+	if (restore_error) {
+		ret = restore_error;
+		goto out;
+	}
 
 	ret = check_dev_extents();
 	if (ret < 0) {
@@ -8895,8 +10303,9 @@ out:
 	free_device_extent_tree(&dev_extent_cache);
 	free_extent_cache_tree(&seen);
 	free_extent_cache_tree(&pending);
-	free_extent_cache_tree(&reada);
+	free_reada_blocks(&reada);
 	free_extent_cache_tree(&nodes);
+	free_extent_record_cache(&extent_cache);
 	free_root_item_list(&normal_trees);
 	free_root_item_list(&dropping_trees);
 	return ret;
@@ -8904,7 +10313,7 @@ loop:
 	free_corrupt_blocks_tree(gfs_info->corrupt_blocks);
 	free_extent_cache_tree(&seen);
 	free_extent_cache_tree(&pending);
-	free_extent_cache_tree(&reada);
+	free_reada_blocks(&reada);
 	free_extent_cache_tree(&nodes);
 	free_chunk_cache_tree(&chunk_cache);
 	free_block_group_tree(&block_group_cache);
@@ -9321,47 +10730,130 @@ static int zero_log_tree(struct btrfs_root *root)
 	return ret;
 }
 
-static int populate_csum(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *csum_root, char *buf, u64 start,
-			 u64 len)
+/* Data read and checksummed at once when rebuilding the csum tree */
+#define CSUM_FILL_CHUNK_SIZE	(SZ_1M)
+
+/*
+ * The csum tree is rebuilt bottom-up from the data extents in increasing
+ * bytenr order, the checksums of adjacent extents are merged into one item
+ * of up to max_csums sectors.
+ */
+struct csum_fill {
+	struct btrfs_tree_builder tb;
+	char *buf;
+	u8 *csums;
+	u32 nr_csums;
+	u32 max_csums;
+	/* Start of the pending item */
+	u64 start;
+	/* End of the data checksummed so far */
+	u64 end;
+};
+
+static int csum_fill_flush(struct csum_fill *fill)
+{
+	u16 csum_size = btrfs_super_csum_size(gfs_info->super_copy);
+	struct btrfs_key key;
+	int ret;
+
+	if (!fill->nr_csums)
+		return 0;
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = fill->start;
+	ret = btrfs_tree_builder_add(&fill->tb, &key, fill->csums,
+				     fill->nr_csums * csum_size);
+	fill->start += (u64)fill->nr_csums * gfs_info->sectorsize;
+	fill->nr_csums = 0;
+	return ret;
+}
+
+static int populate_csum(struct csum_fill *fill, u64 start, u64 len)
 {
+	u32 sectorsize = gfs_info->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(gfs_info->super_copy);
 	u64 offset = 0;
-	u64 sectorsize;
-	int ret = 0;
+	u64 chunk;
+	u32 nr;
+	u32 done;
+	u32 batch;
+	int ret;
 
-	while (offset < len) {
-		sectorsize = gfs_info->sectorsize;
-		ret = read_extent_data(gfs_info, buf, start + offset,
-				       &sectorsize, 0);
+	/* The overlapping part of an extent has the checksums already */
+	if (start < fill->end) {
+		if (start + len <= fill->end)
+			return 0;
+		len -= fill->end - start;
+		start = fill->end;
+	}
+	if (fill->nr_csums && start != fill->end) {
+		ret = csum_fill_flush(fill);
 		if (ret)
-			break;
-		ret = btrfs_csum_file_block(trans, csum_root, start + len,
-					    start + offset, buf, sectorsize);
+			return ret;
+	}
+	if (!fill->nr_csums)
+		fill->start = start;
+
+	while (offset < len) {
+		chunk = min_t(u64, len - offset, CSUM_FILL_CHUNK_SIZE);
+		ret = read_data_from_disk(gfs_info, fill->buf, start + offset,
+					  chunk, 0);
 		if (ret)
-			break;
-		offset += sectorsize;
+			return ret;
+		nr = chunk / sectorsize;
+		for (done = 0; done < nr; done += batch) {
+			batch = min(nr - done, fill->max_csums - fill->nr_csums);
+			btrfs_csum_data_batch(gfs_info,
+				(u8 *)fill->buf + (u64)done * sectorsize, batch,
+				fill->csums + fill->nr_csums * csum_size);
+			fill->nr_csums += batch;
+			if (fill->nr_csums == fill->max_csums) {
+				ret = csum_fill_flush(fill);
+				if (ret)
+					return ret;
+			}
+		}
+		offset += chunk;
 	}
-	return ret;
+	fill->end = start + len;
+	return 0;
+}
+
+/*
+ * Add the data extent range [@start, @start + @len) to @ranges. Ranges that
+ * overlap are merged into one covering both, so every sector referenced by
+ * any file extent gets its checksum.
+ */
+static int add_csum_range(struct cache_tree *ranges, u64 start, u64 len)
+{
+	struct cache_extent *range;
+	u64 end = start + len;
+
+	while ((range = lookup_cache_extent(ranges, start, end - start))) {
+		start = min(start, range->start);
+		end = max(end, range->start + range->size);
+		remove_cache_extent(ranges, range);
+		free(range);
+	}
+	return add_cache_extent(ranges, start, end - start);
 }
 
-static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
-				      struct btrfs_root *csum_root,
-				      struct btrfs_root *cur_root)
+/*
+ * File extents come in no particular order and may share the data extents,
+ * collect the ranges first to have them sorted and merged.
+ */
+static int collect_csum_ranges_from_one_fs_root(struct btrfs_root *cur_root,
+						struct cache_tree *ranges)
 {
 	struct btrfs_path path;
 	struct btrfs_key key;
 	struct extent_buffer *node;
 	struct btrfs_file_extent_item *fi;
-	char *buf = NULL;
 	u64 start = 0;
 	u64 len = 0;
 	int slot = 0;
 	int ret = 0;
 
-	buf = malloc(gfs_info->sectorsize);
-	if (!buf)
-		return -ENOMEM;
-
 	btrfs_init_path(&path);
 	key.objectid = 0;
 	key.offset = 0;
@@ -9382,10 +10874,11 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 			goto next;
 		start = btrfs_file_extent_disk_bytenr(node, fi);
 		len = btrfs_file_extent_disk_num_bytes(node, fi);
+		/* Holes have no data to checksum, disk bytenr 0 isn't data */
+		if (!start || !len)
+			goto next;
 
-		ret = populate_csum(trans, csum_root, buf, start, len);
-		if (ret == -EEXIST)
-			ret = 0;
+		ret = add_csum_range(ranges, start, len);
 		if (ret < 0)
 			goto out;
 next:
@@ -9404,21 +10897,22 @@ next:
 
 out:
 	btrfs_release_path(&path);
-	free(buf);
 	return ret;
 }
 
-static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
-				  struct btrfs_root *csum_root)
+static int fill_csum_tree_from_fs(struct csum_fill *fill)
 {
 	struct btrfs_path path;
 	struct btrfs_root *tree_root = gfs_info->tree_root;
 	struct btrfs_root *cur_root;
 	struct extent_buffer *node;
+	struct cache_tree ranges;
+	struct cache_extent *range;
 	struct btrfs_key key;
 	int slot = 0;
 	int ret = 0;
 
+	cache_tree_init(&ranges);
 	btrfs_init_path(&path);
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.offset = 0;
@@ -9436,7 +10930,7 @@ static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
 		slot = path.slots[0];
 		btrfs_item_key_to_cpu(node, &key, slot);
 		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
-			goto out;
+			break;
 		if (key.type != BTRFS_ROOT_ITEM_KEY)
 			goto next;
 		if (!is_fstree(key.objectid))
@@ -9449,88 +10943,59 @@ static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
 				key.objectid);
 			goto out;
 		}
-		ret = fill_csum_tree_from_one_fs_root(trans, csum_root,
-				cur_root);
+		ret = collect_csum_ranges_from_one_fs_root(cur_root, &ranges);
 		if (ret < 0)
 			goto out;
 next:
 		ret = btrfs_next_item(tree_root, &path);
 		if (ret > 0) {
 			ret = 0;
-			goto out;
+			break;
 		}
 		if (ret < 0)
 			goto out;
 	}
 
+	for (range = first_cache_extent(&ranges); range;
+	     range = next_cache_extent(range)) {
+		ret = populate_csum(fill, range->start, range->size);
+		if (ret < 0)
+			goto out;
+	}
+
 out:
 	btrfs_release_path(&path);
+	free_extent_cache_tree(&ranges);
 	return ret;
 }
 
-static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
-				      struct btrfs_root *csum_root)
+static int fill_csum_tree_from_extent(struct csum_fill *fill)
 {
 	struct btrfs_root *extent_root = gfs_info->extent_root;
-	struct btrfs_path path;
+	struct btrfs_tree_cursor cur;
 	struct btrfs_extent_item *ei;
-	struct extent_buffer *leaf;
-	char *buf;
 	struct btrfs_key key;
 	int ret;
 
-	btrfs_init_path(&path);
 	key.objectid = 0;
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
-	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
-	if (ret < 0) {
-		btrfs_release_path(&path);
-		return ret;
-	}
-
-	buf = malloc(gfs_info->sectorsize);
-	if (!buf) {
-		btrfs_release_path(&path);
-		return -ENOMEM;
-	}
-
-	while (1) {
-		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
-			ret = btrfs_next_leaf(extent_root, &path);
-			if (ret < 0)
-				break;
-			if (ret) {
-				ret = 0;
-				break;
-			}
-		}
-		leaf = path.nodes[0];
-
-		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-		if (key.type != BTRFS_EXTENT_ITEM_KEY) {
-			path.slots[0]++;
+	ret = btrfs_tree_cursor_init(&cur, extent_root->node, &key, NULL, 0, 0);
+	while (ret == 0) {
+		ret = btrfs_tree_cursor_next_item(&cur);
+		if (ret)
+			break;
+		if (cur.key.type != BTRFS_EXTENT_ITEM_KEY)
 			continue;
-		}
 
-		ei = btrfs_item_ptr(leaf, path.slots[0],
-				    struct btrfs_extent_item);
-		if (!(btrfs_extent_flags(leaf, ei) &
-		      BTRFS_EXTENT_FLAG_DATA)) {
-			path.slots[0]++;
+		ei = btrfs_item_ptr(cur.eb, cur.slot, struct btrfs_extent_item);
+		if (!(btrfs_extent_flags(cur.eb, ei) & BTRFS_EXTENT_FLAG_DATA))
 			continue;
-		}
 
-		ret = populate_csum(trans, csum_root, buf, key.objectid,
-				    key.offset);
-		if (ret)
-			break;
-		path.slots[0]++;
+		ret = populate_csum(fill, cur.key.objectid, cur.key.offset);
 	}
-
-	btrfs_release_path(&path);
-	free(buf);
-	return ret;
+	btrfs_tree_cursor_release(&cur);
+	return ret < 0 ? ret : 0;
 }
 
 /*
@@ -9544,10 +11009,36 @@ static int fill_csum_tree(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *csum_root,
 			  int search_fs_tree)
 {
+	u16 csum_size = btrfs_super_csum_size(gfs_info->super_copy);
+	struct csum_fill fill = { 0 };
+	int ret;
+
+	fill.max_csums = MAX_CSUM_ITEMS(csum_root, csum_size);
+	fill.buf = malloc(CSUM_FILL_CHUNK_SIZE);
+	fill.csums = malloc(fill.max_csums * csum_size);
+	if (!fill.buf || !fill.csums) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = btrfs_tree_builder_init(&fill.tb, trans, csum_root);
+	if (ret < 0)
+		goto out;
 	if (search_fs_tree)
-		return fill_csum_tree_from_fs(trans, csum_root);
+		ret = fill_csum_tree_from_fs(&fill);
 	else
-		return fill_csum_tree_from_extent(trans, csum_root);
+		ret = fill_csum_tree_from_extent(&fill);
+	if (!ret)
+		ret = csum_fill_flush(&fill);
+	if (ret) {
+		btrfs_tree_builder_release(&fill.tb);
+		goto out;
+	}
+	ret = btrfs_tree_builder_finish(&fill.tb);
+out:
+	free(fill.buf);
+	free(fill.csums);
+	return ret;
 }
 
 static void free_roots_info_cache(void)
@@ -10139,6 +11630,94 @@ out:
 	return ret;
 }
 
+static const struct rowspec extent_record_rowspec[] = {
+	{ .key = "records", .fmt = "%llu", .out_text = "records allocated",
+		.out_json = "records-allocated" },
+	{ .key = "peak-records", .fmt = "%llu", .out_text = "peak records",
+		.out_json = "peak-records" },
+	{ .key = "peak-bytes", .fmt = "%llu", .out_text = "peak bytes",
+		.out_json = "peak-bytes" },
+	{ .key = "bytes-per-record", .fmt = "%.1f",
+		.out_text = "bytes per extent", .out_json = "bytes-per-extent" },
+	{ .key = "packed", .fmt = "%llu", .out_text = "records packed",
+		.out_json = "records-packed" },
+	{ .key = "restored", .fmt = "%llu", .out_text = "records restored",
+		.out_json = "records-restored" },
+	{ .key = "merges", .fmt = "%llu", .out_text = "run merges",
+		.out_json = "run-merges" },
+	{ .key = "spilled", .fmt = "%llu", .out_text = "records spilled",
+		.out_json = "records-spilled" },
+	{ .key = "spill-restored", .fmt = "%llu",
+		.out_text = "spilled restored",
+		.out_json = "spilled-records-restored" },
+	{ .key = "spill-merges", .fmt = "%llu", .out_text = "spill run merges",
+		.out_json = "spill-run-merges" },
+	ROWSPEC_END
+};
+
+static const struct rowspec backref_memo_rowspec[] = {
+	{ .key = "hits", .fmt = "%llu", .out_text = "hits",
+		.out_json = "hits" },
+	{ .key = "misses", .fmt = "%llu", .out_text = "misses",
+		.out_json = "misses" },
+	{ .key = "evictions", .fmt = "%llu", .out_text = "evictions",
+		.out_json = "evictions" },
+	{ .key = "entries", .fmt = "%llu", .out_text = "results stored",
+		.out_json = "results-stored" },
+	{ .key = "bytes", .fmt = "%llu", .out_text = "table size",
+		.out_json = "table-size" },
+	ROWSPEC_END
+};
+
+/*
+ * Print the statistics of the tree block cache, then in the original mode
+ * those of the extent records. The packing and spilling ones only if anything
+ * was packed or spilled. In the lowmem mode those of the backref lookups.
+ */
+static void print_check_cache_stats(unsigned int format)
+{
+	const struct extent_record_stats *stats = &extent_record_stats;
+	const struct record_spill_stats *pack = &extent_pack.stats;
+	const struct record_spill_stats *spill = &extent_spill.stats;
+	const struct backref_memo_stats *memo = &lowmem_backref_memo.stats;
+	struct format_ctx fctx;
+
+	cache_stats_start(&fctx, gfs_info, format);
+	if (check_mode == CHECK_MODE_LOWMEM) {
+		cache_stats_start_group(&fctx, "backref-memo-stats",
+					"Backref lookup cache statistics",
+					backref_memo_rowspec);
+		fmt_print(&fctx, "hits", memo->hits);
+		fmt_print(&fctx, "misses", memo->misses);
+		fmt_print(&fctx, "evictions", memo->evictions);
+		fmt_print(&fctx, "entries", memo->entries);
+		fmt_print(&fctx, "bytes", memo->bytes);
+		cache_stats_end_group(&fctx, "backref-memo-stats");
+	} else {
+		cache_stats_start_group(&fctx, "extent-record-stats",
+					"Extent record statistics",
+					extent_record_rowspec);
+		fmt_print(&fctx, "records", stats->allocated);
+		fmt_print(&fctx, "peak-records", stats->peak_records);
+		fmt_print(&fctx, "peak-bytes", stats->peak_bytes);
+		fmt_print(&fctx, "bytes-per-record", stats->peak_records ?
+			  (double)stats->peak_bytes / stats->peak_records :
+			  0.0);
+		if (pack->stored) {
+			fmt_print(&fctx, "packed", pack->stored);
+			fmt_print(&fctx, "restored", pack->restored);
+			fmt_print(&fctx, "merges", pack->merges);
+		}
+		if (spill->stored) {
+			fmt_print(&fctx, "spilled", spill->stored);
+			fmt_print(&fctx, "spill-restored", spill->restored);
+			fmt_print(&fctx, "spill-merges", spill->merges);
+		}
+		cache_stats_end_group(&fctx, "extent-record-stats");
+	}
+	cache_stats_end(&fctx);
+}
+
 static const char * const cmd_check_usage[] = {
 	"btrfs check [options] <device>",
 	"Check structural integrity of a filesystem (unmounted).",
@@ -10175,6 +11754,15 @@ static const char * const cmd_check_usage[] = {
 	"       -E|--subvol-extents <subvolid>",
 	"                                   print subvolume extents and sharing state",
 	"       -p|--progress               indicate progress",
+	"       --cache-stats[=text|json]   print statistics of the tree block cache",
+	"       --threads <N>               check subvolume trees in N processes (not with",
+	"                                   --repair) and verify data with N threads, 0 for",
+	"                                   one per CPU",
+	"       --spill-dir <dir>           move extent records to files in <dir> when they",
+	"                                   take half of the memory limit (original mode,",
+	"                                   not with --repair)",
+	"       --resume <file>             save the progress to <file> and continue the check",
+	"                                   saved there (not with --repair)",
 	NULL
 };
 
@@ -10199,6 +11787,7 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	int qgroup_verify_ret;
 	unsigned ctree_flags = OPEN_CTREE_EXCLUSIVE;
 	int force = 0;
+	int cache_stats = 0;
 
 	while(1) {
 		int c;
@@ -10206,7 +11795,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE };
+			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE,
+			GETOPT_VAL_CACHE_STATS, GETOPT_VAL_THREADS,
+			GETOPT_VAL_SPILL_DIR, GETOPT_VAL_RESUME };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -10231,6 +11822,14 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "clear-ino-cache", no_argument , NULL,
 				GETOPT_VAL_CLEAR_INO_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "cache-stats", optional_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
+			{ "spill-dir", required_argument, NULL,
+				GETOPT_VAL_SPILL_DIR },
+			{ "resume", required_argument, NULL,
+				GETOPT_VAL_RESUME },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -10322,6 +11921,31 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = 1;
 				break;
+			case GETOPT_VAL_CACHE_STATS:
+				cache_stats = parse_cache_stats_format(optarg);
+				if (cache_stats < 0) {
+					error("unknown cache stats format: %s",
+					      optarg);
+					exit(1);
+				}
+				break;
+			case GETOPT_VAL_THREADS:
+				check_threads = work_pool_parse_threads(optarg);
+				if (check_threads < 0) {
+					error("invalid number of threads: %s",
+					      optarg);
+					exit(1);
+				}
+				if (!check_threads)
+					check_threads =
+						work_pool_default_threads();
+				break;
+			case GETOPT_VAL_SPILL_DIR:
+				spill_dir = optarg;
+				break;
+			case GETOPT_VAL_RESUME:
+				resume_path = optarg;
+				break;
 		}
 	}
 
@@ -10333,12 +11957,25 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		ctx.info = task_init(print_status_check, print_status_return, &ctx);
 	}
 
+	if (spill_dir) {
+		if (access(spill_dir, W_OK | X_OK) < 0) {
+			error("cannot use spill directory %s: %m", spill_dir);
+			exit(1);
+		}
+		record_spill_init(&extent_spill, spill_dir);
+	}
+
 	/* This check is the only reason for --readonly to exist */
 	if (readonly && repair) {
 		error("repair options are not compatible with --readonly");
 		exit(1);
 	}
 
+	if (resume_path && repair) {
+		error("repair options are not compatible with --resume");
+		exit(1);
+	}
+
 	if (repair && !force) {
 		int delay = 10;
 
@@ -10538,7 +12175,23 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		goto close_out;
 	}
 
-	if (!init_extent_tree) {
+	if (resume_path) {
+		ret = checkpoint_load(&checkpoint, resume_path, gfs_info,
+				      check_mode, check_data_csum);
+		if (ret < 0) {
+			err |= 1;
+			goto close_out;
+		}
+		if (ret > 0) {
+			fprintf(stderr, "Resuming the check saved in %s\n",
+				resume_path);
+			err = checkpoint.err;
+		}
+	}
+
+	if (init_extent_tree) {
+		fprintf(stderr, "[1/7] checking root items... skipped\n");
+	} else if (!skip_done_phase(1, "checking root items")) {
 		if (!ctx.progress_enabled) {
 			fprintf(stderr, "[1/7] checking root items\n");
 		} else {
@@ -10573,41 +12226,50 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 				err |= ret;
 			}
 		}
-	} else {
-		fprintf(stderr, "[1/7] checking root items... skipped\n");
+		finish_phase(1, err);
 	}
 
-	if (!ctx.progress_enabled) {
-		fprintf(stderr, "[2/7] checking extents\n");
-	} else {
-		ctx.tp = TASK_EXTENTS;
-		task_start(ctx.info, &ctx.start_time, &ctx.item_count);
-	}
-	ret = do_check_chunks_and_extents();
-	task_stop(ctx.info);
-	err |= !!ret;
-	if (ret)
-		error(
+	if (!skip_done_phase(2, "checking extents")) {
+		if (!ctx.progress_enabled) {
+			fprintf(stderr, "[2/7] checking extents\n");
+		} else {
+			ctx.tp = TASK_EXTENTS;
+			task_start(ctx.info, &ctx.start_time, &ctx.item_count);
+		}
+		ret = do_check_chunks_and_extents();
+		task_stop(ctx.info);
+		err |= !!ret;
+		if (ret)
+			error(
 		"errors found in extent allocation tree or chunk allocation");
 
-	/* Only re-check super size after we checked and repaired the fs */
-	err |= !is_super_size_valid();
+		/* Only re-check super size after we checked and repaired the fs */
+		err |= !is_super_size_valid();
+		finish_phase(2, err);
+	}
 
 	is_free_space_tree = btrfs_fs_compat_ro(gfs_info, FREE_SPACE_TREE);
 
-	if (!ctx.progress_enabled) {
-		if (is_free_space_tree)
-			fprintf(stderr, "[3/7] checking free space tree\n");
-		else
-			fprintf(stderr, "[3/7] checking free space cache\n");
-	} else {
-		ctx.tp = TASK_FREE_SPACE;
-		task_start(ctx.info, &ctx.start_time, &ctx.item_count);
-	}
+	if (!skip_done_phase(3, is_free_space_tree ?
+			     "checking free space tree" :
+			     "checking free space cache")) {
+		if (!ctx.progress_enabled) {
+			if (is_free_space_tree)
+				fprintf(stderr,
+					"[3/7] checking free space tree\n");
+			else
+				fprintf(stderr,
+					"[3/7] checking free space cache\n");
+		} else {
+			ctx.tp = TASK_FREE_SPACE;
+			task_start(ctx.info, &ctx.start_time, &ctx.item_count);
+		}
 
-	ret = validate_free_space_cache(root);
-	task_stop(ctx.info);
-	err |= !!ret;
+		ret = validate_free_space_cache(root);
+		task_stop(ctx.info);
+		err |= !!ret;
+		finish_phase(3, err);
+	}
 
 	/*
 	 * We used to have to have these hole extents in between our real
@@ -10616,58 +12278,76 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	 * ignore it when this happens.
 	 */
 	no_holes = btrfs_fs_incompat(gfs_info, NO_HOLES);
-	if (!ctx.progress_enabled) {
-		fprintf(stderr, "[4/7] checking fs roots\n");
-	} else {
-		ctx.tp = TASK_FS_ROOTS;
-		task_start(ctx.info, &ctx.start_time, &ctx.item_count);
-	}
-
-	ret = do_check_fs_roots(&root_cache);
-	task_stop(ctx.info);
-	err |= !!ret;
-	if (ret) {
-		error("errors found in fs roots");
-		goto out;
-	}
-
-	if (!ctx.progress_enabled) {
-		if (check_data_csum)
-			fprintf(stderr, "[5/7] checking csums against data\n");
-		else
-			fprintf(stderr,
-		"[5/7] checking only csums items (without verifying data)\n");
-	} else {
-		ctx.tp = TASK_CSUMS;
-		task_start(ctx.info, &ctx.start_time, &ctx.item_count);
-	}
-
-	ret = check_csums(root);
-	task_stop(ctx.info);
 	/*
-	 * Data csum error is not fatal, and it may indicate more serious
-	 * corruption, continue checking.
+	 * The original mode always goes through the fs roots, the root records
+	 * are needed for the root refs, check_fs_roots() continues after the
+	 * trees done before the checkpoint.
 	 */
-	if (ret)
-		error("errors found in csum tree");
-	err |= !!ret;
-
-	/* For low memory mode, check_fs_roots_v2 handles root refs */
-        if (check_mode != CHECK_MODE_LOWMEM) {
+	if (check_mode != CHECK_MODE_LOWMEM ||
+	    !skip_done_phase(4, "checking fs roots")) {
 		if (!ctx.progress_enabled) {
-			fprintf(stderr, "[6/7] checking root refs\n");
+			fprintf(stderr, "[4/7] checking fs roots\n");
 		} else {
-			ctx.tp = TASK_ROOT_REFS;
+			ctx.tp = TASK_FS_ROOTS;
 			task_start(ctx.info, &ctx.start_time, &ctx.item_count);
 		}
 
-		ret = check_root_refs(root, &root_cache);
+		ret = do_check_fs_roots(&root_cache);
 		task_stop(ctx.info);
 		err |= !!ret;
 		if (ret) {
-			error("errors found in root refs");
+			error("errors found in fs roots");
 			goto out;
 		}
+		finish_phase(4, err);
+	}
+
+	if (!skip_done_phase(5, "checking csums")) {
+		if (!ctx.progress_enabled) {
+			if (check_data_csum)
+				fprintf(stderr,
+					"[5/7] checking csums against data\n");
+			else
+				fprintf(stderr,
+		"[5/7] checking only csums items (without verifying data)\n");
+		} else {
+			ctx.tp = TASK_CSUMS;
+			ctx.bytes_count = 0;
+			task_start(ctx.info, &ctx.start_time, &ctx.item_count);
+		}
+
+		ret = check_csums(root);
+		task_stop(ctx.info);
+		/*
+		 * Data csum error is not fatal, and it may indicate more
+		 * serious corruption, continue checking.
+		 */
+		if (ret)
+			error("errors found in csum tree");
+		err |= !!ret;
+		finish_phase(5, err);
+	}
+
+	/* For low memory mode, check_fs_roots_v2 handles root refs */
+        if (check_mode != CHECK_MODE_LOWMEM) {
+		if (!skip_done_phase(6, "checking root refs")) {
+			if (!ctx.progress_enabled) {
+				fprintf(stderr, "[6/7] checking root refs\n");
+			} else {
+				ctx.tp = TASK_ROOT_REFS;
+				task_start(ctx.info, &ctx.start_time,
+					   &ctx.item_count);
+			}
+
+			ret = check_root_refs(root, &root_cache);
+			task_stop(ctx.info);
+			err |= !!ret;
+			if (ret) {
+				error("errors found in root refs");
+				goto out;
+			}
+			finish_phase(6, err);
+		}
 	} else {
 		fprintf(stderr,
 	"[6/7] checking root refs done with fs roots in lowmem mode, skipping\n");
@@ -10699,7 +12379,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		free(bad);
 	}
 
-	if (gfs_info->quota_enabled) {
+	if (gfs_info->quota_enabled &&
+	    !skip_done_phase(7, "checking quota groups")) {
 		if (!ctx.progress_enabled) {
 			fprintf(stderr, "[7/7] checking quota groups\n");
 		} else {
@@ -10722,17 +12403,22 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		if (qgroup_verify_ret && (!qgroups_repaired || ret))
 			err |= !!qgroup_verify_ret;
 		ret = 0;
-	} else {
+		finish_phase(7, err);
+	} else if (!gfs_info->quota_enabled) {
 		fprintf(stderr,
 		"[7/7] checking quota groups skipped (not enabled on this FS)\n");
 	}
 
-	if (!list_empty(&gfs_info->recow_ebs)) {
+	if (!list_empty(&gfs_info->recow_ebs) ||
+	    (resume_path && checkpoint.transid_errors)) {
 		error("transid errors in file system");
 		ret = 1;
 		err |= !!ret;
 	}
 out:
+	/* The check is complete, a new one starts from the beginning */
+	if (resume_path)
+		checkpoint_remove(&checkpoint);
 	printf("found %llu bytes used, ",
 	       (unsigned long long)bytes_used);
 	if (err)
@@ -10755,6 +12441,10 @@ out:
 	free_qgroup_counts();
 	free_root_recs_tree(&root_cache);
 close_out:
+	if (cache_stats)
+		print_check_cache_stats(cache_stats);
+	backref_memo_release(&lowmem_backref_memo);
+	checkpoint_release(&checkpoint);
 	close_ctree(root);
 err_out:
 	if (ctx.progress_enabled)
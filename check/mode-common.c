@@ -522,6 +522,7 @@ void reada_walk_down(struct btrfs_root *root, struct extent_buffer *node,
 		ptr_gen = btrfs_node_ptr_generation(node, i);
 		readahead_tree_block(gfs_info, bytenr, ptr_gen);
 	}
+	readahead_tree_block_submit(gfs_info);
 }
 
 /*
@@ -55,6 +55,8 @@ struct task_ctx {
 	enum task_position tp;
 	time_t start_time;
 	u64 item_count;
+	/* Data read by the current task, updated atomically */
+	u64 bytes_count;
 
 	struct task_info *info;
 };
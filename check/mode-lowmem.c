@@ -26,9 +26,35 @@
 #include "kernel-shared/volumes.h"
 #include "check/mode-common.h"
 #include "check/mode-lowmem.h"
+#include "check/workers.h"
+#include "common/memory-budget.h"
 
 static u64 last_allocated_chunk;
 
+/*
+ * Results of the backref lookups repeated for blocks shared by snapshots,
+ * not used in repair mode as the extent tree changes
+ */
+struct backref_memo lowmem_backref_memo;
+
+enum lowmem_memo_kind {
+	/* refs, flags, number of roots and the smallest root of a tree block */
+	MEMO_TREE_BLOCK_REFS = 1,
+	/* Result of check_tree_block_ref() for a parent of a shared backref */
+	MEMO_PARENT_BLOCK_REF,
+	/* Data backref of the owner of a shared leaf found, its length */
+	MEMO_OWNER_DATA_REF,
+};
+
+static void init_backref_memo(void)
+{
+	if (repair || lowmem_backref_memo.entries)
+		return;
+	backref_memo_init(&lowmem_backref_memo,
+			  min_t(u64, memory_budget() / 16,
+				BACKREF_MEMO_MAX_BYTES));
+}
+
 static int calc_extent_flag(struct btrfs_root *root, struct extent_buffer *eb,
 			    u64 *flags_ret)
 {
@@ -138,31 +164,38 @@ out:
  * in every fs or file tree check. Here we find its all root ids, and only check
  * it in the fs or file tree which has the smallest root id.
  */
-static int need_check(struct btrfs_root *root, struct ulist *roots)
+static int need_check(struct btrfs_root *root, u64 nr_roots, u64 min_root)
 {
-	struct rb_node *node;
-	struct ulist_node *u;
-
 	/*
-	 * @roots can be empty if it belongs to tree reloc tree
+	 * The roots can be empty if it belongs to tree reloc tree
 	 * In that case, we should always check the leaf, as we can't use
 	 * the tree owner to ensure some other root will check it.
 	 */
-	if (roots->nnodes == 1 || roots->nnodes == 0)
+	if (nr_roots == 1 || nr_roots == 0)
 		return 1;
 
-	node = rb_first(&roots->root);
-	u = rb_entry(node, struct ulist_node, rb_node);
 	/*
 	 * current root id is not smallest, we skip it and let it be checked
 	 * in the fs or file tree who hash the smallest root id.
 	 */
-	if (root->objectid != u->val)
+	if (root->objectid != min_root)
 		return 0;
 
 	return 1;
 }
 
+/* Number of @roots and the smallest of them, 0 if there's none */
+static void count_roots(struct ulist *roots, u64 *nr_roots, u64 *min_root)
+{
+	struct rb_node *node;
+
+	*nr_roots = roots->nnodes;
+	*min_root = 0;
+	node = rb_first(&roots->root);
+	if (node)
+		*min_root = rb_entry(node, struct ulist_node, rb_node)->val;
+}
+
 /*
  * for a tree node or leaf, we record its reference count, so later if we still
  * process this node or leaf, don't need to compute its reference count again.
@@ -176,35 +209,57 @@ static int update_nodes_refs(struct btrfs_root *root, u64 bytenr,
 	struct ulist *roots;
 	u64 refs = 0;
 	u64 flags = 0;
+	u64 memo[BACKREF_MEMO_VALUES] = { 0 };
+	bool memoized;
 	int root_level = btrfs_header_level(root->node);
-	int check;
-	int ret;
+	int ret = 0;
 
 	if (nrefs->bytenr[level] == bytenr)
 		return 0;
 
 	if (bytenr != (u64)-1) {
-		/* the return value of this function seems a mistake */
-		ret = btrfs_lookup_extent_info(NULL, gfs_info, bytenr,
-					       level, 1, &refs, &flags);
-		/* temporary fix */
-		if (ret < 0 && !check_all)
-			return ret;
+		/* Shared blocks are looked up again from each root */
+		memoized = backref_memo_lookup(&lowmem_backref_memo,
+					       MEMO_TREE_BLOCK_REFS, bytenr,
+					       level, 0, 0, memo);
+		if (memoized) {
+			refs = memo[0];
+			flags = memo[1];
+		} else {
+			/* the return value of this function seems a mistake */
+			ret = btrfs_lookup_extent_info(NULL, gfs_info, bytenr,
+						       level, 1, &refs, &flags);
+			/* temporary fix */
+			if (ret < 0 && !check_all)
+				return ret;
+		}
 
 		nrefs->bytenr[level] = bytenr;
 		nrefs->refs[level] = refs;
 		nrefs->full_backref[level] = 0;
 		nrefs->checked[level] = 0;
 
-		if (refs > 1) {
-			ret = btrfs_find_all_roots(NULL, gfs_info, bytenr,
+		if (refs > 1 && !memoized) {
+			int err;
+
+			err = btrfs_find_all_roots(NULL, gfs_info, bytenr,
 						   0, &roots);
-			if (ret)
+			if (err)
 				return -EIO;
-
-			check = need_check(root, roots);
+			count_roots(roots, &memo[2], &memo[3]);
 			ulist_free(roots);
-			nrefs->need_check[level] = check;
+		}
+		if (!memoized && ret >= 0) {
+			memo[0] = refs;
+			memo[1] = flags;
+			backref_memo_insert(&lowmem_backref_memo,
+					    MEMO_TREE_BLOCK_REFS, bytenr, level,
+					    0, 0, memo);
+		}
+
+		if (refs > 1) {
+			nrefs->need_check[level] = need_check(root, memo[2],
+							      memo[3]);
 		} else {
 			if (!check_all) {
 				nrefs->need_check[level] = 1;
@@ -3010,6 +3065,14 @@ static int check_tree_block_ref(struct btrfs_root *root,
 	int ret;
 	int strict = 1;
 	int parent = 0;
+	/* Without @eb and @nrefs nothing is printed unless a parent fails */
+	bool memoize = !eb && !nrefs;
+	u64 memo[BACKREF_MEMO_VALUES] = { 0 };
+
+	if (memoize && backref_memo_lookup(&lowmem_backref_memo,
+					   MEMO_PARENT_BLOCK_REF, bytenr,
+					   root->objectid, level, owner, memo))
+		return 0;
 
 	btrfs_init_path(&path);
 	key.objectid = bytenr;
@@ -3132,6 +3195,8 @@ static int check_tree_block_ref(struct btrfs_root *root,
 				 */
 				found_ref = !check_tree_block_ref(root, NULL,
 						offset, level + 1, owner, NULL);
+				if (!found_ref)
+					memoize = false;
 			}
 		}
 
@@ -3182,6 +3247,9 @@ static int check_tree_block_ref(struct btrfs_root *root,
 		err |= BACKREF_MISSING;
 out:
 	btrfs_release_path(&path);
+	if (memoize && !err)
+		backref_memo_insert(&lowmem_backref_memo, MEMO_PARENT_BLOCK_REF,
+				    bytenr, root->objectid, level, owner, memo);
 	if (nrefs && strict &&
 	    level < root_level && nrefs->full_backref[level + 1])
 		parent = nrefs->bytenr[level + 1];
@@ -3368,6 +3436,8 @@ static int check_extent_data_item(struct btrfs_root *root,
 	int err = 0;
 	int ret;
 	int strict;
+	bool memoize;
+	u64 memo[BACKREF_MEMO_VALUES] = { 0 };
 
 	btrfs_item_key_to_cpu(eb, &fi_key, slot);
 	fi = btrfs_item_ptr(eb, slot, struct btrfs_file_extent_item);
@@ -3409,9 +3479,24 @@ static int check_extent_data_item(struct btrfs_root *root,
 		data_bytes_referenced += extent_num_bytes;
 	}
 	owner = btrfs_header_owner(eb);
+	strict = should_check_extent_strictly(root, nrefs, -1);
 
 	/* Check the extent item of the file extent in extent tree */
 	btrfs_init_path(&path);
+
+	/*
+	 * A leaf shared by snapshots is checked from each of them, the backref
+	 * of the owner found the first time is enough for the others
+	 */
+	memoize = !strict;
+	if (memoize && backref_memo_lookup(&lowmem_backref_memo,
+				MEMO_OWNER_DATA_REF, disk_bytenr, owner,
+				fi_key.objectid, fi_key.offset - offset, memo) &&
+	    memo[0] == disk_num_bytes) {
+		found_dbackref = 1;
+		goto out;
+	}
+
 	dbref_key.objectid = btrfs_file_extent_disk_bytenr(eb, fi);
 	dbref_key.type = BTRFS_EXTENT_ITEM_KEY;
 	dbref_key.offset = btrfs_file_extent_disk_num_bytes(eb, fi);
@@ -3439,7 +3524,6 @@ static int check_extent_data_item(struct btrfs_root *root,
 	iref = (struct btrfs_extent_inline_ref *)(ei + 1);
 	ptr = (unsigned long)iref;
 	end = (unsigned long)ei + item_size;
-	strict = should_check_extent_strictly(root, nrefs, -1);
 
 	while (ptr < end) {
 		u64 ref_root;
@@ -3469,10 +3553,14 @@ static int check_extent_data_item(struct btrfs_root *root,
 				found_dbackref = 1;
 			else if (!strict && owner == ref_root && match)
 				found_dbackref = 1;
+			if (found_dbackref && ref_root != owner)
+				memoize = false;
 		} else if (type == BTRFS_SHARED_DATA_REF_KEY) {
 			found_dbackref = !check_tree_block_ref(root, NULL,
 				btrfs_extent_inline_ref_offset(leaf, iref),
 				0, owner, NULL);
+			/* Depends on the root, may have printed errors */
+			memoize = false;
 		}
 
 		if (found_dbackref)
@@ -3480,6 +3568,13 @@ static int check_extent_data_item(struct btrfs_root *root,
 		ptr += btrfs_extent_inline_ref_size(type);
 	}
 
+	if (memoize && found_dbackref && !err) {
+		memo[0] = disk_num_bytes;
+		backref_memo_insert(&lowmem_backref_memo, MEMO_OWNER_DATA_REF,
+				    disk_bytenr, owner, fi_key.objectid,
+				    fi_key.offset - offset, memo);
+	}
+
 	if (!found_dbackref) {
 		btrfs_release_path(&path);
 
@@ -5356,38 +5451,272 @@ out:
 	return err;
 }
 
+/* Subvolume trees checked by workers, in the order of the tree root */
+struct fs_roots_workers {
+	struct check_workers workers;
+	struct btrfs_key *keys;
+	int nr_keys;
+	/* Next tree to collect */
+	int next;
+};
+
+/*
+ * Read and check one fs tree, return the error bits or < 0 if the tree can't
+ * be read
+ */
+static int read_check_fs_root(struct btrfs_key *key)
+{
+	struct btrfs_root *cur_root;
+	int ret;
+
+	if (key->objectid == BTRFS_TREE_RELOC_OBJECTID) {
+		cur_root = btrfs_read_fs_root_no_cache(gfs_info, key);
+	} else {
+		key->offset = (u64)-1;
+		cur_root = btrfs_read_fs_root(gfs_info, key);
+	}
+
+	if (IS_ERR(cur_root)) {
+		error("Fail to read fs/subvol tree: %lld", key->objectid);
+		return -EIO;
+	}
+
+	ret = check_fs_root(cur_root);
+
+	if (key->objectid == BTRFS_TREE_RELOC_OBJECTID)
+		btrfs_free_fs_root(cur_root);
+	return ret;
+}
+
+static int check_fs_root_worker(void *priv, int item, FILE *data)
+{
+	struct fs_roots_workers *frw = priv;
+	struct btrfs_key key = frw->keys[item];
+
+	return read_check_fs_root(&key);
+}
+
+/*
+ * Find the fs trees after @start, in the order check_fs_roots_lowmem() visits
+ * them
+ */
+static int find_fs_roots(struct fs_roots_workers *frw,
+			 const struct btrfs_key *start)
+{
+	struct btrfs_root *tree_root = gfs_info->tree_root;
+	struct btrfs_key *keys;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int alloc = 0;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = BTRFS_FS_TREE_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (1) {
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		path.slots[0]++;
+		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
+			break;
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    !fs_root_objectid(key.objectid))
+			continue;
+		if (start && btrfs_comp_cpu_keys(&key, start) <= 0)
+			continue;
+
+		if (frw->nr_keys == alloc) {
+			alloc = max(2 * alloc, 64);
+			keys = realloc(frw->keys, alloc * sizeof(*keys));
+			if (!keys) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			frw->keys = keys;
+		}
+		frw->keys[frw->nr_keys++] = key;
+	}
+	if (ret > 0)
+		ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static void release_fs_roots_workers(struct fs_roots_workers *frw)
+{
+	check_workers_release(&frw->workers);
+	free(frw->keys);
+	frw->keys = NULL;
+}
+
+/*
+ * Start checking the fs trees after @start in up to @threads worker processes.
+ *
+ * Every tree is checked on its own, shared blocks are checked from the tree
+ * with the lowest id found by the backrefs, so any tree can go to any worker.
+ * Consecutive trees are put into one job, snapshots of a subvolume are often
+ * next to each other and their worker finds the shared blocks cached. Each
+ * worker starts with the blocks cached by the parent so far.
+ *
+ * Return 0 if the workers are set up, 1 if it's not worth it and < 0 on
+ * errors, the caller checks the trees serially if it's not 0.
+ */
+static int start_fs_roots_workers(struct fs_roots_workers *frw, int threads,
+				  const struct btrfs_key *start)
+{
+	int *items = NULL;
+	int per_job;
+	int nr;
+	int ret;
+	int i, j;
+
+	memset(frw, 0, sizeof(*frw));
+	ret = find_fs_roots(frw, start);
+	if (ret < 0)
+		goto out;
+	if (frw->nr_keys < 2) {
+		ret = 1;
+		goto out;
+	}
+
+	/* A few jobs per worker so they finish at about the same time */
+	per_job = (frw->nr_keys + threads * 4 - 1) / (threads * 4);
+	items = malloc(per_job * sizeof(*items));
+	if (!items) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = check_workers_init(&frw->workers, gfs_info, threads,
+				 frw->nr_keys, check_fs_root_worker, frw);
+	if (ret < 0)
+		goto out;
+	for (i = 0; i < frw->nr_keys; i += nr) {
+		nr = min(per_job, frw->nr_keys - i);
+		for (j = 0; j < nr; j++)
+			items[j] = i + j;
+		ret = check_workers_add_job(&frw->workers, items, nr);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	free(items);
+	if (ret) {
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot check fs trees in parallel: %m");
+		}
+		release_fs_roots_workers(frw);
+	}
+	return ret;
+}
+
+/*
+ * Print the output of the fs tree at @key from its worker and return its
+ * result, -EAGAIN if the tree must be checked here
+ */
+static int collect_fs_root(struct fs_roots_workers *frw,
+			   const struct btrfs_key *key)
+{
+	void *data;
+	size_t len;
+	int result = 0;
+	int ret;
+
+	if (frw->next >= frw->nr_keys ||
+	    btrfs_comp_cpu_keys(key, &frw->keys[frw->next]))
+		return -EAGAIN;
+
+	ret = check_workers_collect(&frw->workers, frw->next++, &result,
+				    &data, &len);
+	if (ret == -EAGAIN)
+		return ret;
+	free(data);
+	if (ret < 0) {
+		error("failed to check tree %llu", key->objectid);
+		return FATAL_ERROR;
+	}
+	return result;
+}
+
 /*
  * Check all fs/file tree in low_memory mode.
  *
  * 1. for fs tree root item, call check_fs_root()
  * 2. for fs tree root ref/backref, call check_root_ref()
  *
+ * With @threads > 1 the fs trees are checked by worker processes, their
+ * output is printed when the loop gets to the tree.
+ *
+ * With @cp the progress is saved there from time to time, and the check
+ * continues after the last item saved in it.
+ *
  * Return 0 if no error occurred.
  */
-int check_fs_roots_lowmem(void)
+int check_fs_roots_lowmem(int threads, struct check_checkpoint *cp)
 {
 	struct btrfs_root *tree_root = gfs_info->tree_root;
-	struct btrfs_root *cur_root = NULL;
+	struct fs_roots_workers frw = { 0 };
+	const struct btrfs_key *resume_key = NULL;
 	struct btrfs_path path;
 	struct btrfs_key key;
+	struct btrfs_key done_key;
 	struct extent_buffer *node;
+	bool parallel = false;
 	int slot;
 	int ret;
 	int err = 0;
 
+	init_backref_memo();
+	if (cp && cp->has_root_key) {
+		resume_key = &cp->root_key;
+		err = cp->roots_err;
+	}
+	/* Repairs change the trees under the workers, keep them serialized */
+	if (threads > 1 && !repair)
+		parallel = !start_fs_roots_workers(&frw, threads, resume_key);
+
 	btrfs_init_path(&path);
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.offset = 0;
 	key.type = BTRFS_ROOT_ITEM_KEY;
+	if (resume_key)
+		key = *resume_key;
 
 	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
 	if (ret < 0) {
 		err = ret;
 		goto out;
-	} else if (ret > 0) {
+	} else if (ret > 0 && !resume_key) {
 		err = -ENOENT;
 		goto out;
 	}
+	/* Continue after the last item done */
+	if (resume_key) {
+		if (ret == 0)
+			ret = btrfs_next_item(tree_root, &path);
+		else if (path.slots[0] >= btrfs_header_nritems(path.nodes[0]))
+			ret = btrfs_next_leaf(tree_root, &path);
+		else
+			ret = 0;
+		if (ret > 0)
+			goto out;
+		if (ret < 0) {
+			err = ret;
+			goto out;
+		}
+	}
 
 	while (1) {
 		node = path.nodes[0];
@@ -5408,26 +5737,15 @@ int check_fs_roots_lowmem(void)
 		}
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
-			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
-				cur_root = btrfs_read_fs_root_no_cache(gfs_info,
-								       &key);
-			} else {
-				key.offset = (u64)-1;
-				cur_root = btrfs_read_fs_root(gfs_info, &key);
-			}
-
-			if (IS_ERR(cur_root)) {
-				error("Fail to read fs/subvol tree: %lld",
-				      key.objectid);
-				err = -EIO;
-				goto next;
-			}
-
-			ret = check_fs_root(cur_root);
-			err |= ret;
-
-			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
-				btrfs_free_fs_root(cur_root);
+			ret = -EAGAIN;
+			if (parallel)
+				ret = collect_fs_root(&frw, &key);
+			if (ret == -EAGAIN)
+				ret = read_check_fs_root(&key);
+			if (ret < 0)
+				err = ret;
+			else
+				err |= ret;
 		} else if (key.type == BTRFS_ROOT_REF_KEY ||
 				key.type == BTRFS_ROOT_BACKREF_KEY) {
 			ret = check_root_ref(tree_root, &key, node, slot);
@@ -5455,6 +5773,12 @@ next:
 				/* falls through to next leaf */
 			}
 		}
+		if (cp && checkpoint_due(cp)) {
+			btrfs_item_key_to_cpu(path.nodes[0], &done_key,
+					      path.slots[0]);
+			checkpoint_save_roots(cp, &done_key, err, false,
+					      NULL, 0);
+		}
 		ret = btrfs_next_item(tree_root, &path);
 		if (ret > 0)
 			goto out;
@@ -5466,6 +5790,8 @@ next:
 
 out:
 	btrfs_release_path(&path);
+	if (parallel)
+		release_fs_roots_workers(&frw);
 	return err;
 }
 
@@ -5482,6 +5808,7 @@ int check_chunks_and_extents_lowmem(void)
 	int err = 0;
 	int ret;
 
+	init_backref_memo();
 	root = gfs_info->chunk_root;
 	ret = check_btrfs_root(root, 1);
 	err |= ret;
@@ -21,6 +21,8 @@
 #define __BTRFS_CHECK_MODE_LOWMEM_H__
 
 #include "check/mode-common.h"
+#include "check/backref-memo.h"
+#include "check/checkpoint.h"
 
 #define ROOT_DIR_ERROR		(1<<1)	/* bad ROOT_DIR */
 #define DIR_ITEM_MISSING	(1<<2)	/* DIR_ITEM not found */
@@ -66,7 +68,9 @@
 #define ACCOUNTING_MISMATCH	(1 << 7) /* Used space accounting error */
 #define CHUNK_TYPE_MISMATCH	(1 << 8)
 
-int check_fs_roots_lowmem(void);
+extern struct backref_memo lowmem_backref_memo;
+
+int check_fs_roots_lowmem(int threads, struct check_checkpoint *cp);
 int check_chunks_and_extents_lowmem(void);
 
 #endif
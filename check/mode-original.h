@@ -47,7 +47,6 @@ struct data_backref {
 	u64 offset;
 	u64 disk_bytenr;
 	u64 bytes;
-	u64 ram_bytes;
 	u32 num_refs;
 	u32 found_ref;
 };
@@ -73,13 +72,15 @@ static inline struct tree_backref* to_tree_backref(struct extent_backref *back)
 /* Explicit initialization for extent_record::flag_block_full_backref */
 enum { FLAG_UNSET = 2 };
 
+/*
+ * There's one record per extent until it's been fully checked, so the
+ * members are ordered to leave no holes, see --cache-stats for the size
+ */
 struct extent_record {
-	struct list_head backrefs;
 	struct list_head dups;
 	struct rb_root backref_tree;
 	struct list_head list;
 	struct cache_extent cache;
-	struct btrfs_disk_key parent_key;
 	u64 start;
 	u64 max_size;
 	u64 nr;
@@ -99,6 +100,8 @@ struct extent_record {
 	unsigned int bad_full_backref:1;
 	unsigned int crossing_stripes:1;
 	unsigned int wrong_chunk_type:1;
+	/* Packed, fills the rest of the word after the bits */
+	struct btrfs_disk_key parent_key;
 };
 
 static inline struct extent_record* to_extent_record(struct list_head *entry)
@@ -106,6 +109,19 @@ static inline struct extent_record* to_extent_record(struct list_head *entry)
 	return container_of(entry, struct extent_record, list);
 }
 
+/*
+ * Memory taken by the extent records and their backrefs, printed with
+ * --cache-stats. The packed records count with the memory of their runs.
+ */
+struct extent_record_stats {
+	/* Records allocated over the whole run, not counting restored ones */
+	u64 allocated;
+	u64 records;
+	u64 bytes;
+	u64 peak_records;
+	u64 peak_bytes;
+};
+
 struct inode_backref {
 	struct list_head list;
 	unsigned int found_dir_item:1;
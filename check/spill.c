@@ -0,0 +1,469 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "kerncompat.h"
+#include "kernel-lib/sizes.h"
+#include "common/internal.h"
+#include "common/memory-budget.h"
+#include "check/spill.h"
+
+void record_spill_init(struct record_spill *rs, const char *dir)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->dir = dir;
+}
+
+static void charge(struct record_spill *rs, s64 bytes)
+{
+	if (bytes > 0)
+		memory_charge(bytes);
+	else
+		memory_uncharge(-bytes);
+	rs->memory += bytes;
+}
+
+static void close_run(struct record_spill *rs, struct record_spill_run *run)
+{
+	if (run->fp)
+		fclose(run->fp);
+	charge(rs, -(s64)(run->alloced * sizeof(*run->entries) +
+			  run->data_alloced));
+	free(run->entries);
+	free(run->data);
+	memset(run, 0, sizeof(*run));
+}
+
+static u64 entry_offset(const struct record_spill_entry *entry)
+{
+	return entry->offset & ~RECORD_SPILL_RESTORED;
+}
+
+static bool entry_restored(const struct record_spill_entry *entry)
+{
+	return entry->offset & RECORD_SPILL_RESTORED;
+}
+
+/* Start a new run, the records are then added by record_spill_add() */
+int record_spill_begin(struct record_spill *rs)
+{
+	struct record_spill_run *run = &rs->cur;
+	char *path;
+	int fd;
+	int ret;
+
+	memset(run, 0, sizeof(*run));
+	if (!rs->dir)
+		return 0;
+	if (asprintf(&path, "%s/btrfs-check-spill.XXXXXX", rs->dir) < 0)
+		return -ENOMEM;
+	fd = mkstemp(path);
+	if (fd < 0) {
+		ret = -errno;
+		free(path);
+		return ret;
+	}
+	unlink(path);
+	free(path);
+	run->fp = fdopen(fd, "w+");
+	if (!run->fp) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	return 0;
+}
+
+static int add_entry(struct record_spill *rs, u64 start, u64 size,
+		     const void *data, size_t len)
+{
+	struct record_spill_run *run = &rs->cur;
+	struct record_spill_entry *entry;
+
+	if (run->nr == run->alloced) {
+		u64 alloced = max_t(u64, run->alloced * 2,
+				    SZ_4K / sizeof(*entry));
+
+		entry = realloc(run->entries, alloced * sizeof(*entry));
+		if (!entry)
+			return -ENOMEM;
+		charge(rs, (alloced - run->alloced) * sizeof(*entry));
+		run->entries = entry;
+		run->alloced = alloced;
+	}
+	if (run->fp) {
+		if (fwrite(data, 1, len, run->fp) != len)
+			return errno ? -errno : -EIO;
+	} else {
+		if (run->size + len > run->data_alloced) {
+			u64 alloced = max_t(u64, run->data_alloced * 2,
+					    max_t(u64, run->size + len, SZ_4K));
+			u8 *tmp = realloc(run->data, alloced);
+
+			if (!tmp)
+				return -ENOMEM;
+			charge(rs, alloced - run->data_alloced);
+			run->data = tmp;
+			run->data_alloced = alloced;
+		}
+		memcpy(run->data + run->size, data, len);
+	}
+
+	entry = &run->entries[run->nr++];
+	entry->start = start;
+	entry->size = size;
+	entry->offset = run->size;
+	run->size += len;
+	run->live++;
+	return 0;
+}
+
+/* Append a record to the current run, in ascending order of the ranges */
+int record_spill_add(struct record_spill *rs, u64 start, u64 size,
+		     const void *data, size_t len)
+{
+	int ret;
+
+	ret = add_entry(rs, start, size, data, len);
+	if (!ret)
+		rs->stats.stored++;
+	return ret;
+}
+
+/* Point @data to the data of a record, valid until the next read */
+static int read_entry(struct record_spill *rs, struct record_spill_run *run,
+		      u64 index, const u8 **data, size_t *len_ret)
+{
+	u64 offset = entry_offset(&run->entries[index]);
+	u64 end;
+	ssize_t ret;
+	size_t len;
+
+	if (index + 1 < run->nr)
+		end = entry_offset(&run->entries[index + 1]);
+	else
+		end = run->size;
+	len = end - offset;
+	*len_ret = len;
+
+	if (!run->fp) {
+		*data = run->data + offset;
+		return 0;
+	}
+	if (len > rs->buf_size) {
+		u8 *buf = realloc(rs->buf, len);
+
+		if (!buf)
+			return -ENOMEM;
+		rs->buf = buf;
+		rs->buf_size = len;
+	}
+	ret = pread(fileno(run->fp), rs->buf, len, offset);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+	*data = rs->buf;
+	return 0;
+}
+
+/*
+ * Add the current run to the runs, the added records are on disk afterwards,
+ * or the run in memory is trimmed to its size
+ */
+static int finish_run(struct record_spill *rs)
+{
+	struct record_spill_run *run = &rs->cur;
+	struct record_spill_run *runs;
+	int ret;
+
+	if (run->fp && fflush(run->fp)) {
+		ret = -errno;
+		close_run(rs, run);
+		return ret;
+	}
+	if (!run->nr) {
+		close_run(rs, run);
+		return 0;
+	}
+	runs = realloc(rs->runs, (rs->nr_runs + 1) * sizeof(*runs));
+	if (!runs) {
+		close_run(rs, run);
+		return -ENOMEM;
+	}
+	if (run->nr < run->alloced) {
+		struct record_spill_entry *entries;
+
+		entries = realloc(run->entries, run->nr * sizeof(*entries));
+		if (entries) {
+			charge(rs, -(s64)((run->alloced - run->nr) *
+					  sizeof(*entries)));
+			run->entries = entries;
+			run->alloced = run->nr;
+		}
+	}
+	if (run->size < run->data_alloced) {
+		u8 *data = realloc(run->data, run->size);
+
+		if (data) {
+			charge(rs, -(s64)(run->data_alloced - run->size));
+			run->data = data;
+			run->data_alloced = run->size;
+		}
+	}
+	rs->runs = runs;
+	runs[rs->nr_runs++] = *run;
+	memset(run, 0, sizeof(*run));
+	return 0;
+}
+
+/*
+ * Merge all runs into one, leaving out the restored records. If that fails
+ * the runs are kept as they are.
+ */
+static void merge_runs(struct record_spill *rs)
+{
+	struct record_spill_run *old = rs->runs;
+	int nr_old = rs->nr_runs;
+	u64 *pos;
+	int ret;
+	int i;
+
+	pos = calloc(nr_old, sizeof(*pos));
+	if (!pos)
+		return;
+	rs->runs = NULL;
+	rs->nr_runs = 0;
+	ret = record_spill_begin(rs);
+	while (!ret) {
+		struct record_spill_entry *entry;
+		const u8 *data;
+		int first = -1;
+		size_t len;
+
+		for (i = 0; i < nr_old; i++) {
+			while (pos[i] < old[i].nr &&
+			       entry_restored(&old[i].entries[pos[i]]))
+				pos[i]++;
+			if (pos[i] == old[i].nr)
+				continue;
+			if (first < 0 || old[i].entries[pos[i]].start <
+					 old[first].entries[pos[first]].start)
+				first = i;
+		}
+		if (first < 0)
+			break;
+
+		entry = &old[first].entries[pos[first]];
+		ret = read_entry(rs, &old[first], pos[first], &data, &len);
+		if (!ret)
+			ret = add_entry(rs, entry->start, entry->size, data,
+					len);
+		pos[first]++;
+	}
+	if (!ret)
+		ret = finish_run(rs);
+	free(pos);
+
+	if (ret) {
+		close_run(rs, &rs->cur);
+		for (i = 0; i < rs->nr_runs; i++)
+			close_run(rs, &rs->runs[i]);
+		free(rs->runs);
+		rs->runs = old;
+		rs->nr_runs = nr_old;
+		return;
+	}
+	for (i = 0; i < nr_old; i++)
+		close_run(rs, &old[i]);
+	free(old);
+	rs->stats.merges++;
+}
+
+/* Finish the current run, merging the runs once there are too many */
+int record_spill_end(struct record_spill *rs)
+{
+	int ret;
+
+	ret = finish_run(rs);
+	if (ret < 0)
+		return ret;
+	if (rs->nr_runs > RECORD_SPILL_MAX_RUNS)
+		merge_runs(rs);
+	return 0;
+}
+
+static int restore_entry(struct record_spill *rs, struct record_spill_run *run,
+			 u64 index, record_restore_fn_t fn, void *priv)
+{
+	struct record_spill_entry *entry;
+	const u8 *data;
+	size_t len;
+	int ret;
+
+	ret = read_entry(rs, run, index, &data, &len);
+	if (ret < 0)
+		return ret;
+	entry = &run->entries[index];
+	entry->offset |= RECORD_SPILL_RESTORED;
+	run->live--;
+	rs->stats.restored++;
+	return fn(priv, entry->start, entry->size, data, len);
+}
+
+static void drop_empty_runs(struct record_spill *rs)
+{
+	int i;
+	int nr = 0;
+
+	for (i = 0; i < rs->nr_runs; i++) {
+		if (rs->runs[i].live)
+			rs->runs[nr++] = rs->runs[i];
+		else
+			close_run(rs, &rs->runs[i]);
+	}
+	rs->nr_runs = nr;
+}
+
+/* Restore all records overlapping the range [@start, @start + @size) */
+int record_spill_restore_range(struct record_spill *rs, u64 start, u64 size,
+			       record_restore_fn_t fn, void *priv)
+{
+	u64 end = start + min(size, (u64)-1 - start);
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < rs->nr_runs; i++) {
+		struct record_spill_run *run = &rs->runs[i];
+		u64 lo = run->next;
+		u64 hi = run->nr;
+
+		/*
+		 * First entry ending after @start, the ranges don't overlap so
+		 * the ends are in ascending order too
+		 */
+		while (lo < hi) {
+			u64 mid = lo + (hi - lo) / 2;
+			struct record_spill_entry *entry = &run->entries[mid];
+
+			if (entry->start + entry->size <= start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < run->nr && run->entries[lo].start < end; lo++) {
+			if (entry_restored(&run->entries[lo]))
+				continue;
+			ret = restore_entry(rs, run, lo, fn, priv);
+			if (ret < 0)
+				goto out;
+		}
+	}
+out:
+	drop_empty_runs(rs);
+	return ret;
+}
+
+/*
+ * Restore the record with the lowest start of all runs if it starts before
+ * @before. Return 1 if a record was restored, 0 if not and < 0 on error.
+ */
+int record_spill_restore_first(struct record_spill *rs, u64 before,
+			       record_restore_fn_t fn, void *priv)
+{
+	struct record_spill_run *first = NULL;
+	int ret;
+	int i;
+
+	for (i = 0; i < rs->nr_runs; i++) {
+		struct record_spill_run *run = &rs->runs[i];
+
+		while (run->next < run->nr &&
+		       entry_restored(&run->entries[run->next]))
+			run->next++;
+		if (run->next == run->nr)
+			continue;
+		if (!first || run->entries[run->next].start <
+			      first->entries[first->next].start)
+			first = run;
+	}
+	if (!first || first->entries[first->next].start >= before)
+		return 0;
+
+	ret = restore_entry(rs, first, first->next, fn, priv);
+	drop_empty_runs(rs);
+	if (ret < 0)
+		return ret;
+	return 1;
+}
+
+/*
+ * Move the records of all runs of @src to new runs of @dst, e.g. from memory
+ * to files. @src is empty afterwards, unless it fails. Return the number of
+ * records moved or < 0 on error.
+ */
+s64 record_spill_move(struct record_spill *dst, struct record_spill *src)
+{
+	s64 moved = 0;
+	int ret = 0;
+
+	while (src->nr_runs && !ret) {
+		struct record_spill_run *run = &src->runs[src->nr_runs - 1];
+		u64 i;
+
+		ret = record_spill_begin(dst);
+		for (i = 0; i < run->nr && !ret; i++) {
+			struct record_spill_entry *entry = &run->entries[i];
+			const u8 *data;
+			size_t len;
+
+			if (entry_restored(entry))
+				continue;
+			ret = read_entry(src, run, i, &data, &len);
+			if (!ret)
+				ret = record_spill_add(dst, entry->start,
+						       entry->size, data, len);
+		}
+		if (!ret)
+			ret = record_spill_end(dst);
+		else
+			close_run(dst, &dst->cur);
+		if (!ret) {
+			moved += run->live;
+			close_run(src, run);
+			src->nr_runs--;
+		}
+	}
+	return ret < 0 ? ret : moved;
+}
+
+/* Drop all runs and the records in them, the statistics are kept */
+void record_spill_release(struct record_spill *rs)
+{
+	struct record_spill_stats stats = rs->stats;
+	int i;
+
+	close_run(rs, &rs->cur);
+	for (i = 0; i < rs->nr_runs; i++)
+		close_run(rs, &rs->runs[i]);
+	free(rs->runs);
+	free(rs->buf);
+	record_spill_init(rs, rs->dir);
+	rs->stats = stats;
+}
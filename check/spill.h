@@ -0,0 +1,120 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Records of check packed in memory, or moved out of memory to scratch files
+ * for --spill-dir, in sorted runs.
+ *
+ * Records are written in runs, each run is written in one go in ascending
+ * order of the ranges of the records. The ranges must not overlap, neither
+ * within a run nor with the records of other runs not restored yet, which
+ * holds when the records come from one cache tree and are always restored
+ * before a lookup of their range.
+ *
+ * Only an index entry per record stays in memory, plus the data of the
+ * records for runs in memory. A record is restored by looking up its range,
+ * or in ascending order of all runs by record_spill_restore_first(), which
+ * merges the runs. Once there are more than RECORD_SPILL_MAX_RUNS runs
+ * they're merged into one, leaving out the restored records.
+ *
+ * The scratch files are unlinked right after they're created.
+ */
+
+#ifndef __BTRFS_CHECK_SPILL_H__
+#define __BTRFS_CHECK_SPILL_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "kerncompat.h"
+
+#define RECORD_SPILL_MAX_RUNS		(16)
+
+/* Flag of record_spill_entry::offset */
+#define RECORD_SPILL_RESTORED		(1ULL << 63)
+
+struct record_spill_entry {
+	u64 start;
+	u64 size;
+	/* Offset of the record in the run, the length is up to the next */
+	u64 offset;
+};
+
+struct record_spill_run {
+	/* Scratch file, NULL for a run in memory */
+	FILE *fp;
+	/* Data of a run in memory and its allocated size */
+	u8 *data;
+	u64 data_alloced;
+	struct record_spill_entry *entries;
+	u64 nr;
+	u64 alloced;
+	/* Records not restored yet */
+	u64 live;
+	/* Entries before this one are restored, for the merge */
+	u64 next;
+	/* Length of the file or of the data in memory */
+	u64 size;
+};
+
+/* Printed by check with --cache-stats */
+struct record_spill_stats {
+	/* Records added, by record_spill_add() or moved, and restored */
+	u64 stored;
+	u64 restored;
+	/* Merges of all runs into one */
+	u64 merges;
+};
+
+struct record_spill {
+	/* Directory of the scratch files, NULL to keep the runs in memory */
+	const char *dir;
+	struct record_spill_run *runs;
+	int nr_runs;
+	/* Run being written */
+	struct record_spill_run cur;
+	/* Buffer for the record being restored */
+	u8 *buf;
+	size_t buf_size;
+	/* Memory taken by the index entries and the runs in memory */
+	u64 memory;
+	struct record_spill_stats stats;
+};
+
+/*
+ * Called with each restored record and the range it was added with, the data
+ * are valid only during the call. Return < 0 to stop restoring.
+ */
+typedef int (*record_restore_fn_t)(void *priv, u64 start, u64 size,
+				   const void *data, size_t len);
+
+void record_spill_init(struct record_spill *rs, const char *dir);
+int record_spill_begin(struct record_spill *rs);
+int record_spill_add(struct record_spill *rs, u64 start, u64 size,
+		     const void *data, size_t len);
+int record_spill_end(struct record_spill *rs);
+int record_spill_restore_range(struct record_spill *rs, u64 start, u64 size,
+			       record_restore_fn_t fn, void *priv);
+int record_spill_restore_first(struct record_spill *rs, u64 before,
+			       record_restore_fn_t fn, void *priv);
+s64 record_spill_move(struct record_spill *dst, struct record_spill *src);
+void record_spill_release(struct record_spill *rs);
+
+static inline bool record_spill_empty(const struct record_spill *rs)
+{
+	return rs->nr_runs == 0;
+}
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio_ext.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "kerncompat.h"
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/disk-io.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "check/workers.h"
+
+/* Header of the results of one item, followed by the captured output */
+struct check_item_record {
+	s32 item;
+	s32 result;
+	u64 out_len;
+	u64 err_len;
+	u64 data_len;
+};
+
+int check_workers_init(struct check_workers *cw,
+		       struct btrfs_fs_info *fs_info, int max_workers,
+		       int nr_items, check_item_fn_t fn, void *priv)
+{
+	int i;
+
+	memset(cw, 0, sizeof(*cw));
+	cw->item_job = malloc(max(nr_items, 1) * sizeof(*cw->item_job));
+	if (!cw->item_job)
+		return -ENOMEM;
+	for (i = 0; i < nr_items; i++)
+		cw->item_job[i] = -1;
+	cw->nr_items = nr_items;
+	cw->fs_info = fs_info;
+	cw->max_workers = max(max_workers, 1);
+	cw->fn = fn;
+	cw->priv = priv;
+	return 0;
+}
+
+/*
+ * Add a job checking @items in the given order. Jobs are started in the order
+ * they are added, which should follow the order of their first items.
+ */
+int check_workers_add_job(struct check_workers *cw, const int *items, int nr)
+{
+	struct check_job *jobs;
+	struct check_job *job;
+	int i;
+
+	jobs = realloc(cw->jobs, (cw->nr_jobs + 1) * sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+	cw->jobs = jobs;
+	job = &jobs[cw->nr_jobs];
+	memset(job, 0, sizeof(*job));
+	job->items = malloc(nr * sizeof(*job->items));
+	if (!job->items)
+		return -ENOMEM;
+	memcpy(job->items, items, nr * sizeof(*items));
+	job->nr_items = nr;
+	job->state = CHECK_JOB_QUEUED;
+	for (i = 0; i < nr; i++)
+		cw->item_job[items[i]] = cw->nr_jobs;
+	cw->nr_jobs++;
+	return 0;
+}
+
+/* Append the @len bytes captured in @fp to @results and empty @fp */
+static int move_captured(FILE *results, FILE *fp, u64 len)
+{
+	char buf[SZ_16K];
+	u64 offset = 0;
+	ssize_t ret;
+
+	while (offset < len) {
+		ret = pread(fileno(fp), buf, min_t(u64, len - offset,
+						   sizeof(buf)), offset);
+		if (ret <= 0)
+			return -EIO;
+		if (fwrite(buf, 1, ret, results) != ret)
+			return -EIO;
+		offset += ret;
+	}
+	if (ftruncate(fileno(fp), 0) < 0)
+		return -errno;
+	rewind(fp);
+	return 0;
+}
+
+static u64 captured_size(FILE *fp)
+{
+	struct stat st;
+
+	fflush(fp);
+	if (fstat(fileno(fp), &st) < 0)
+		return 0;
+	return st.st_size;
+}
+
+/* Body of the worker process, return its exit status */
+static int run_job(struct check_workers *cw, struct check_job *job)
+{
+	struct check_item_record rec;
+	FILE *out;
+	FILE *err;
+	FILE *data;
+	int i;
+
+	/*
+	 * Output buffered in the parent before fork stays there, drop the copy
+	 * so it's not printed twice and the order of stdout and stderr doesn't
+	 * change
+	 */
+	__fpurge(stdout);
+	out = tmpfile();
+	err = tmpfile();
+	data = tmpfile();
+	if (!out || !err || !data)
+		return 1;
+	if (dup2(fileno(out), STDOUT_FILENO) < 0 ||
+	    dup2(fileno(err), STDERR_FILENO) < 0)
+		return 1;
+
+	for (i = 0; i < job->nr_items; i++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.item = job->items[i];
+		rec.result = cw->fn(cw->priv, rec.item, data);
+		rec.out_len = captured_size(stdout);
+		rec.err_len = captured_size(stderr);
+		rec.data_len = captured_size(data);
+		if (fwrite(&rec, sizeof(rec), 1, job->results) != 1)
+			return 1;
+		if (move_captured(job->results, stdout, rec.out_len) ||
+		    move_captured(job->results, stderr, rec.err_len) ||
+		    move_captured(job->results, data, rec.data_len))
+			return 1;
+	}
+	if (fflush(job->results))
+		return 1;
+	return 0;
+}
+
+static void start_job(struct check_workers *cw, struct check_job *job)
+{
+	pid_t pid;
+
+	job->results = tmpfile();
+	if (!job->results)
+		goto not_started;
+
+	btrfs_prepare_fork(cw->fs_info);
+	pid = fork();
+	if (pid < 0) {
+		fclose(job->results);
+		job->results = NULL;
+		goto not_started;
+	}
+	if (pid == 0) {
+		btrfs_after_fork_child(cw->fs_info);
+		_exit(run_job(cw, job));
+	}
+	job->pid = pid;
+	job->state = CHECK_JOB_RUNNING;
+	cw->running++;
+	cw->open++;
+	return;
+
+not_started:
+	warning("cannot start check worker, checking in the main process: %m");
+	job->state = CHECK_JOB_NOT_STARTED;
+}
+
+/*
+ * Start queued jobs while there are free workers and not too many results
+ * waiting, jobs up to @needed are started regardless of the latter
+ */
+static void start_jobs(struct check_workers *cw, int needed)
+{
+	while (cw->next_job < cw->nr_jobs && cw->running < cw->max_workers &&
+	       (cw->next_job <= needed ||
+		cw->open < cw->max_workers + CHECK_WORKERS_MAX_PENDING))
+		start_job(cw, &cw->jobs[cw->next_job++]);
+}
+
+static void job_finished(struct check_workers *cw, struct check_job *job,
+			 int status)
+{
+	job->status = status;
+	if (status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		job->state = CHECK_JOB_DONE;
+	else
+		job->state = CHECK_JOB_FAILED;
+	cw->running--;
+	rewind(job->results);
+}
+
+/* Wait for any of the running workers to exit */
+static void reap_job(struct check_workers *cw)
+{
+	int status;
+	pid_t pid;
+	int i;
+
+	do {
+		pid = waitpid(-1, &status, 0);
+	} while (pid < 0 && errno == EINTR);
+
+	for (i = 0; i < cw->next_job; i++) {
+		struct check_job *job = &cw->jobs[i];
+
+		if (job->state != CHECK_JOB_RUNNING)
+			continue;
+		if (pid < 0) {
+			/* Nothing to wait for, don't wait forever */
+			job_finished(cw, job, -1);
+		} else if (job->pid == pid) {
+			job_finished(cw, job, status);
+			break;
+		}
+	}
+}
+
+static int replay_captured(FILE *results, FILE *fp, u64 len)
+{
+	char buf[SZ_16K];
+	size_t size;
+
+	while (len) {
+		size = min_t(u64, len, sizeof(buf));
+		if (fread(buf, 1, size, results) != size)
+			return -EIO;
+		fwrite(buf, 1, size, fp);
+		len -= size;
+	}
+	return 0;
+}
+
+static void report_failed_job(struct check_job *job)
+{
+	if (job->reported)
+		return;
+	job->reported = true;
+	if (job->status < 0)
+		error("lost track of check worker %d", job->pid);
+	else if (WIFSIGNALED(job->status))
+		error("check worker %d was killed by signal %d", job->pid,
+		      WTERMSIG(job->status));
+	else
+		error("check worker %d failed with exit status %d", job->pid,
+		      WEXITSTATUS(job->status));
+}
+
+/*
+ * Wait for the results of @item, print its captured output and return its
+ * result in @result, the data saved by the item function in a buffer at
+ * @data to be freed by the caller. Items of one job must be collected in
+ * order.
+ *
+ * Return 0 if the item was checked, -EAGAIN if its worker couldn't be started
+ * and the caller has to check it, other errors < 0 if the worker failed.
+ */
+int check_workers_collect(struct check_workers *cw, int item, int *result,
+			  void **data, size_t *data_len)
+{
+	struct check_item_record rec;
+	struct check_job *job;
+	int index;
+	int ret = 0;
+
+	*data = NULL;
+	*data_len = 0;
+	if (item < 0 || item >= cw->nr_items || cw->item_job[item] < 0)
+		return -EINVAL;
+	index = cw->item_job[item];
+	job = &cw->jobs[index];
+
+	while (1) {
+		start_jobs(cw, index);
+		if (job->state != CHECK_JOB_QUEUED &&
+		    job->state != CHECK_JOB_RUNNING)
+			break;
+		reap_job(cw);
+	}
+
+	if (job->state == CHECK_JOB_NOT_STARTED)
+		return -EAGAIN;
+	if (job->next >= job->nr_items || job->items[job->next] != item)
+		return -EINVAL;
+	job->next++;
+
+	if (fread(&rec, sizeof(rec), 1, job->results) != 1 ||
+	    rec.item != item) {
+		ret = -ECHILD;
+		goto out;
+	}
+	/*
+	 * The relative order of stdout and stderr is not captured, print the
+	 * standard output of the item first like the checks that flush it
+	 * before an error
+	 */
+	if (replay_captured(job->results, stdout, rec.out_len)) {
+		ret = -ECHILD;
+		goto out;
+	}
+	if (rec.out_len && rec.err_len)
+		fflush(stdout);
+	if (replay_captured(job->results, stderr, rec.err_len)) {
+		ret = -ECHILD;
+		goto out;
+	}
+	if (rec.data_len) {
+		*data = malloc(rec.data_len);
+		if (!*data) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (fread(*data, 1, rec.data_len, job->results) !=
+		    rec.data_len) {
+			free(*data);
+			*data = NULL;
+			ret = -ECHILD;
+			goto out;
+		}
+		*data_len = rec.data_len;
+	}
+	*result = rec.result;
+
+out:
+	if (ret == -ECHILD)
+		report_failed_job(job);
+	if (job->next == job->nr_items) {
+		fclose(job->results);
+		job->results = NULL;
+		cw->open--;
+	}
+	return ret;
+}
+
+void check_workers_release(struct check_workers *cw)
+{
+	int i;
+
+	for (i = 0; i < cw->nr_jobs; i++) {
+		struct check_job *job = &cw->jobs[i];
+
+		if (job->state == CHECK_JOB_RUNNING) {
+			kill(job->pid, SIGKILL);
+			waitpid(job->pid, NULL, 0);
+		}
+		if (job->results)
+			fclose(job->results);
+		free(job->items);
+	}
+	free(cw->jobs);
+	free(cw->item_job);
+	memset(cw, 0, sizeof(*cw));
+}
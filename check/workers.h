@@ -0,0 +1,106 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Checking independent items, like subvolume trees, in forked worker
+ * processes. Each worker has its own copy of the checker state so none of
+ * the tree and cache code has to be thread safe.
+ *
+ * Items are grouped into jobs, a job is a list of items checked in order by
+ * one worker, e.g. trees sharing blocks. Up to max_workers jobs run at the
+ * same time, in the order they were added.
+ *
+ * Whatever a worker prints while checking an item is captured and replayed
+ * by check_workers_collect() in the parent, together with the result of the
+ * item and the data the item function saved for the parent. When items are
+ * collected in the order a serial check would visit them, the output doesn't
+ * depend on the number of workers.
+ */
+
+#ifndef __BTRFS_CHECK_WORKERS_H__
+#define __BTRFS_CHECK_WORKERS_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "kerncompat.h"
+
+struct btrfs_fs_info;
+
+/*
+ * Check @item in a worker, anything to be passed to the parent is written to
+ * @data. The return value is passed to the parent as the result.
+ */
+typedef int (*check_item_fn_t)(void *priv, int item, FILE *data);
+
+/*
+ * Jobs started but not fully collected yet, beyond the running ones, to
+ * bound the number of result files
+ */
+#define CHECK_WORKERS_MAX_PENDING	(64)
+
+enum check_job_state {
+	CHECK_JOB_QUEUED,
+	CHECK_JOB_RUNNING,
+	CHECK_JOB_DONE,
+	/* The worker exited before writing all results */
+	CHECK_JOB_FAILED,
+	/* The worker could not be started, the caller checks the items */
+	CHECK_JOB_NOT_STARTED,
+};
+
+struct check_job {
+	int *items;
+	int nr_items;
+	/* Next item to be collected */
+	int next;
+	enum check_job_state state;
+	pid_t pid;
+	/* Exit status of the worker, -1 if it's unknown */
+	int status;
+	bool reported;
+	/* Records of the checked items, written by the worker */
+	FILE *results;
+};
+
+struct check_workers {
+	struct btrfs_fs_info *fs_info;
+	check_item_fn_t fn;
+	void *priv;
+	int max_workers;
+	int running;
+	/* Started jobs with items left to collect */
+	int open;
+
+	struct check_job *jobs;
+	int nr_jobs;
+	/* First job not started yet */
+	int next_job;
+
+	/* Job of each item */
+	int *item_job;
+	int nr_items;
+};
+
+int check_workers_init(struct check_workers *cw,
+		       struct btrfs_fs_info *fs_info, int max_workers,
+		       int nr_items, check_item_fn_t fn, void *priv);
+int check_workers_add_job(struct check_workers *cw, const int *items, int nr);
+int check_workers_collect(struct check_workers *cw, int item, int *result,
+			  void **data, size_t *data_len);
+void check_workers_release(struct check_workers *cw);
+
+#endif
@@ -34,6 +34,7 @@
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/device-scan.h"
+#include "common/cache-stats.h"
 
 static void print_extents(struct extent_buffer *eb)
 {
@@ -207,6 +208,8 @@ static const char * const cmd_inspect_dump_tree_usage[] = {
 	"--bfs                  breadth-first traversal of the trees, print nodes, then leaves (default)",
 	"--dfs                  depth-first traversal of the trees",
 	"--hide-names           hide filenames/subvolume/xattrs and other name references",
+	"--cache-stats[=text|json]",
+	"                       print statistics of the tree block cache at the end",
 	NULL
 };
 
@@ -317,6 +320,7 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	struct btrfs_root *tree_root_scan;
 	u64 tree_id = 0;
 	bool follow = false;
+	int cache_stats = 0;
 
 	/*
 	 * For debug-tree, we care nothing about extent tree (it's just backref
@@ -331,7 +335,8 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	while (1) {
 		int c;
 		enum { GETOPT_VAL_FOLLOW = 256, GETOPT_VAL_DFS, GETOPT_VAL_BFS,
-		       GETOPT_VAL_NOSCAN, GETOPT_VAL_HIDE_NAMES };
+		       GETOPT_VAL_NOSCAN, GETOPT_VAL_HIDE_NAMES,
+		       GETOPT_VAL_CACHE_STATS };
 		static const struct option long_options[] = {
 			{ "extents", no_argument, NULL, 'e'},
 			{ "device", no_argument, NULL, 'd'},
@@ -345,6 +350,8 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 			{ "dfs", no_argument, NULL, GETOPT_VAL_DFS },
 			{ "noscan", no_argument, NULL, GETOPT_VAL_NOSCAN },
 			{ "hide-names", no_argument, NULL, GETOPT_VAL_HIDE_NAMES },
+			{ "cache-stats", optional_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -415,6 +422,13 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 		case GETOPT_VAL_HIDE_NAMES:
 			open_ctree_flags |= OPEN_CTREE_HIDE_NAMES;
 			break;
+		case GETOPT_VAL_CACHE_STATS:
+			cache_stats = parse_cache_stats_format(optarg);
+			if (cache_stats < 0) {
+				error("unknown cache stats format: %s", optarg);
+				return 1;
+			}
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -722,6 +736,8 @@ no_node:
 	uuid_unparse(info->super_copy->fsid, uuidbuf);
 	printf("uuid %s\n", uuidbuf);
 close_root:
+	if (cache_stats)
+		print_extent_cache_stats(info, cache_stats);
 	ret = close_ctree(root);
 out:
 	return !!ret;
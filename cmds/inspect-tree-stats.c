@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <getopt.h>
 #include <zlib.h>
 
 #include "kerncompat.h"
@@ -36,6 +37,7 @@
 #include "common/utils.h"
 #include "cmds/commands.h"
 #include "common/help.h"
+#include "common/cache-stats.h"
 
 static int verbose = 0;
 static int no_pretty = 0;
@@ -96,33 +98,47 @@ static int add_seek(struct rb_root *root, u64 dist)
 	return 0;
 }
 
-static int walk_leaf(struct btrfs_root *root, struct btrfs_path *path,
-		     struct root_stats *stat, int find_inline)
+static int walk_leaf(struct btrfs_root *root, struct root_stats *stat)
 {
-	struct extent_buffer *b = path->nodes[0];
-	struct btrfs_file_extent_item *fi;
-	struct btrfs_key found_key;
-	int i;
-
 	stat->total_bytes += root->fs_info->nodesize;
 	stat->total_nodes++;
 	stat->node_counts[0]++;
+	return 0;
+}
 
-	if (!find_inline)
-		return 0;
+/*
+ * Sum up the inline file extents. This is the only reason to read the
+ * leaves, do it with a cursor to have them read ahead.
+ */
+static int walk_inline(struct btrfs_root *root, struct root_stats *stat)
+{
+	struct btrfs_tree_cursor cur;
+	struct btrfs_file_extent_item *fi;
+	int ret;
 
-	for (i = 0; i < btrfs_header_nritems(b); i++) {
-		btrfs_item_key_to_cpu(b, &found_key, i);
-		if (found_key.type != BTRFS_EXTENT_DATA_KEY)
+	ret = btrfs_tree_cursor_init(&cur, root->node, NULL, NULL, 0, 0);
+	while (ret == 0) {
+		ret = btrfs_tree_cursor_next_item(&cur);
+		if (ret)
+			break;
+		if (cur.key.type != BTRFS_EXTENT_DATA_KEY)
 			continue;
 
-		fi = btrfs_item_ptr(b, i, struct btrfs_file_extent_item);
-		if (btrfs_file_extent_type(b, fi) == BTRFS_FILE_EXTENT_INLINE)
+		fi = btrfs_item_ptr(cur.eb, cur.slot,
+				    struct btrfs_file_extent_item);
+		if (btrfs_file_extent_type(cur.eb, fi) ==
+		    BTRFS_FILE_EXTENT_INLINE)
 			stat->total_inline +=
-				btrfs_file_extent_inline_item_len(b,
-							btrfs_item_nr(i));
+				btrfs_file_extent_inline_item_len(cur.eb,
+						btrfs_item_nr(cur.slot));
+	}
+	btrfs_tree_cursor_release(&cur);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read leaves of tree %llu: %m",
+		      root->root_key.objectid);
+		return ret;
 	}
-
 	return 0;
 }
 
@@ -134,7 +150,7 @@ static u64 calc_distance(u64 block1, u64 block2)
 }
 
 static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
-		      struct root_stats *stat, int level, int find_inline)
+		      struct root_stats *stat, int level)
 {
 	struct extent_buffer *b = path->nodes[level];
 	u32 nodesize = root->fs_info->nodesize;
@@ -153,7 +169,7 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		u64 cur_blocknr = btrfs_node_blockptr(b, i);
 
 		path->slots[level] = i;
-		if ((level - 1) > 0 || find_inline) {
+		if (level - 1 > 0) {
 			tmp = read_tree_block(root->fs_info, cur_blocknr,
 					      btrfs_node_ptr_generation(b, i));
 			if (!extent_buffer_uptodate(tmp)) {
@@ -164,10 +180,9 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 			path->nodes[level - 1] = tmp;
 		}
 		if (level - 1)
-			ret = walk_nodes(root, path, stat, level - 1,
-					 find_inline);
+			ret = walk_nodes(root, path, stat, level - 1);
 		else
-			ret = walk_leaf(root, path, stat, find_inline);
+			ret = walk_leaf(root, stat);
 		if (last_block + nodesize != cur_blocknr) {
 			u64 distance = calc_distance(last_block +
 						     nodesize,
@@ -342,22 +357,22 @@ static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
 		error("cannot get time: %m");
 		goto out;
 	}
-	if (!level) {
-		ret = walk_leaf(root, &path, &stat, find_inline);
+	if (!level)
+		ret = walk_leaf(root, &stat);
+	else
+		ret = walk_nodes(root, &path, &stat, level);
+	if (ret)
+		goto out;
+	if (find_inline) {
+		ret = walk_inline(root, &stat);
 		if (ret)
 			goto out;
-		goto out_print;
 	}
-
-	ret = walk_nodes(root, &path, &stat, level, find_inline);
-	if (ret)
-		goto out;
 	if (gettimeofday(&end, NULL)) {
 		error("cannot get time: %m");
 		goto out;
 	}
 	timeval_subtract(&diff, &end, &start);
-out_print:
 	if (stat.min_cluster_size == (u64)-1) {
 		stat.min_cluster_size = 0;
 		stat.total_clusters = 1;
@@ -439,6 +454,8 @@ static const char * const cmd_inspect_tree_stats_usage[] = {
 	"Print various stats for trees",
 	"",
 	"-b		raw numbers in bytes",
+	"--cache-stats[=text|json]",
+	"		print statistics of the tree block cache at the end",
 	NULL
 };
 
@@ -449,9 +466,20 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 	struct btrfs_root *root;
 	int opt;
 	int ret = 0;
+	int cache_stats = 0;
 
 	optind = 0;
-	while ((opt = getopt(argc, argv, "vb")) != -1) {
+	while (1) {
+		enum { GETOPT_VAL_CACHE_STATS = 256 };
+		static const struct option long_options[] = {
+			{ "cache-stats", optional_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		opt = getopt_long(argc, argv, "vb", long_options, NULL);
+		if (opt < 0)
+			break;
 		switch (opt) {
 		case 'v':
 			verbose++;
@@ -459,6 +487,13 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 		case 'b':
 			no_pretty = 1;
 			break;
+		case GETOPT_VAL_CACHE_STATS:
+			cache_stats = parse_cache_stats_format(optarg);
+			if (cache_stats < 0) {
+				error("unknown cache stats format: %s", optarg);
+				return 1;
+			}
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -507,6 +542,8 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 	if (ret)
 		goto out;
 out:
+	if (cache_stats)
+		print_extent_cache_stats(root->fs_info, cache_stats);
 	close_ctree(root);
 	return ret;
 }
@@ -46,6 +46,7 @@
 #include "common/utils.h"
 #include "cmds/commands.h"
 #include "common/help.h"
+#include "common/cache-stats.h"
 
 static char fs_name[PATH_MAX];
 static char path_name[PATH_MAX];
@@ -351,10 +352,8 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 	u64 ram_size;
 	u64 disk_size;
 	u64 num_bytes;
-	u64 length;
 	u64 size_left;
 	u64 offset;
-	u64 cur;
 	int compress;
 	int ret;
 	int mirror_num = 1;
@@ -404,23 +403,19 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 
 	num_copies = btrfs_num_copies(root->fs_info, bytenr, disk_size - offset);
 again:
-	cur = bytenr;
-	while (cur < bytenr + size_left) {
-		length = bytenr + size_left - cur;
-		ret = read_extent_data(root->fs_info, inbuf + cur - bytenr, cur,
-				       &length, mirror_num);
-		if (ret < 0) {
-			mirror_num++;
-			if (mirror_num > num_copies) {
-				ret = -1;
-				error("exhausted mirrors trying to read (%d > %d)",
-					mirror_num, num_copies);
-				goto out;
-			}
-			fprintf(stderr, "trying another mirror\n");
-			continue;
+	while (1) {
+		ret = read_data_from_disk(root->fs_info, inbuf, bytenr,
+					  size_left, mirror_num);
+		if (!ret)
+			break;
+		mirror_num++;
+		if (mirror_num > num_copies) {
+			ret = -1;
+			error("exhausted mirrors trying to read (%d > %d)",
+				mirror_num, num_copies);
+			goto out;
 		}
-		cur += length;
+		fprintf(stderr, "trying another mirror\n");
 	}
 
 	if (compress == BTRFS_COMPRESS_NONE) {
@@ -1400,6 +1395,8 @@ static const char * const cmd_restore_usage[] = {
 	"                     you have to use following syntax (possibly quoted):",
 	"                     ^/(|home(|/username(|/Desktop(|/.*))))$",
 	"-c                   ignore case (--path-regex only)",
+	"--cache-stats[=text|json]",
+	"                     print statistics of the tree block cache at the end",
 	"-v|--verbose         deprecated, alias for global -v option",
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -1423,11 +1420,12 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	int match_cflags = REG_EXTENDED | REG_NOSUB | REG_NEWLINE;
 	regex_t match_reg, *mreg = NULL;
 	char reg_err[256];
+	int cache_stats = 0;
 
 	optind = 0;
 	while (1) {
 		int opt;
-		enum { GETOPT_VAL_PATH_REGEX = 256 };
+		enum { GETOPT_VAL_PATH_REGEX = 256, GETOPT_VAL_CACHE_STATS };
 		static const struct option long_options[] = {
 			{ "path-regex", required_argument, NULL,
 				GETOPT_VAL_PATH_REGEX },
@@ -1442,6 +1440,8 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "super", required_argument, NULL, 'u'},
 			{ "root", required_argument, NULL, 'r'},
 			{ "list-roots", no_argument, NULL, 'l'},
+			{ "cache-stats", optional_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -1509,6 +1509,14 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			case 'x':
 				get_xattrs = 1;
 				break;
+			case GETOPT_VAL_CACHE_STATS:
+				cache_stats = parse_cache_stats_format(optarg);
+				if (cache_stats < 0) {
+					error("unknown cache stats format: %s",
+					      optarg);
+					exit(1);
+				}
+				break;
 			default:
 				usage_unknown_option(cmd, argv);
 		}
@@ -1611,6 +1619,8 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 out:
 	if (mreg)
 		regfree(mreg);
+	if (cache_stats)
+		print_extent_cache_stats(root->fs_info, cache_stats);
 	close_ctree(root);
 	return !!ret;
 }
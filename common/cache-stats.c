@@ -0,0 +1,132 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <string.h>
+#include "kernel-shared/ctree.h"
+#include "common/cache-stats.h"
+#include "common/format-output.h"
+#include "common/memory-budget.h"
+#include "common/utils.h"
+#include "cmds/commands.h"
+
+static const struct rowspec cache_stats_rowspec[] = {
+	{ .key = "hits", .fmt = "%llu", .out_text = "hits",
+		.out_json = "hits" },
+	{ .key = "misses", .fmt = "%llu", .out_text = "misses",
+		.out_json = "misses" },
+	{ .key = "hit-ratio", .fmt = "%.2f", .out_text = "hit ratio (%)",
+		.out_json = "hit-ratio" },
+	{ .key = "reada-hits", .fmt = "%llu", .out_text = "readahead hits",
+		.out_json = "readahead-hits" },
+	{ .key = "rereads", .fmt = "%llu", .out_text = "re-reads of evicted",
+		.out_json = "rereads" },
+	{ .key = "evictions", .fmt = "%llu", .out_text = "evictions",
+		.out_json = "evictions" },
+	{ .key = "bytes-read", .fmt = "%llu", .out_text = "bytes read",
+		.out_json = "bytes-read" },
+	{ .key = "cache-size", .fmt = "%llu", .out_text = "cache size",
+		.out_json = "cache-size" },
+	{ .key = "cache-max", .fmt = "%llu", .out_text = "cache size limit",
+		.out_json = "cache-size-limit" },
+	{ .key = "budget", .fmt = "%llu", .out_text = "memory budget",
+		.out_json = "memory-budget" },
+	ROWSPEC_END
+};
+
+/*
+ * Parse the optional argument of --cache-stats, return CMD_FORMAT_TEXT or
+ * CMD_FORMAT_JSON, -EINVAL for an unknown format
+ */
+int parse_cache_stats_format(const char *str)
+{
+	if (!str || strcmp(str, "text") == 0)
+		return CMD_FORMAT_TEXT;
+	if (strcmp(str, "json") == 0)
+		return CMD_FORMAT_JSON;
+	return -EINVAL;
+}
+
+/* Output format of the command while the statistics are printed */
+static unsigned int saved_format;
+
+/*
+ * Start printing the statistics of the extent buffer cache of @fs_info in
+ * the given @format, regardless of the output format of the command itself.
+ * Commands can add groups of their own statistics before cache_stats_end().
+ */
+void cache_stats_start(struct format_ctx *fctx,
+		       const struct btrfs_fs_info *fs_info,
+		       unsigned int format)
+{
+	const struct extent_io_tree *tree = &fs_info->extent_cache;
+	const struct extent_cache_stats *stats = &tree->stats;
+	const u64 total = stats->hits + stats->misses;
+
+	saved_format = bconf.output_format;
+	bconf.output_format = format;
+	if (format == CMD_FORMAT_TEXT)
+		printf("Tree block cache statistics:\n");
+	fmt_start(fctx, cache_stats_rowspec, 24, 2);
+	fmt_print_start_group(fctx, "extent-cache-stats", JSON_TYPE_MAP);
+	fmt_print(fctx, "hits", stats->hits);
+	fmt_print(fctx, "misses", stats->misses);
+	fmt_print(fctx, "hit-ratio",
+		  total ? 100.0 * stats->hits / total : 0.0);
+	fmt_print(fctx, "reada-hits", stats->reada_hits);
+	fmt_print(fctx, "rereads", stats->rereads);
+	fmt_print(fctx, "evictions", stats->evictions);
+	fmt_print(fctx, "bytes-read", stats->bytes_read);
+	fmt_print(fctx, "cache-size", tree->cache_size);
+	fmt_print(fctx, "cache-max", tree->max_cache_size);
+	fmt_print(fctx, "budget", memory_budget());
+	fmt_print_end_group(fctx, "extent-cache-stats");
+}
+
+/*
+ * Start a group of statistics of the command, under @title in text and
+ * @name in json, with the rows from @rowspec
+ */
+void cache_stats_start_group(struct format_ctx *fctx, const char *name,
+			     const char *title, const struct rowspec *rowspec)
+{
+	if (bconf.output_format == CMD_FORMAT_TEXT)
+		printf("%s:\n", title);
+	fctx->rowspec = rowspec;
+	fmt_print_start_group(fctx, name, JSON_TYPE_MAP);
+}
+
+void cache_stats_end_group(struct format_ctx *fctx, const char *name)
+{
+	fmt_print_end_group(fctx, name);
+	fctx->rowspec = cache_stats_rowspec;
+}
+
+void cache_stats_end(struct format_ctx *fctx)
+{
+	fmt_end(fctx);
+	bconf.output_format = saved_format;
+}
+
+void print_extent_cache_stats(const struct btrfs_fs_info *fs_info,
+			      unsigned int format)
+{
+	struct format_ctx fctx;
+
+	cache_stats_start(&fctx, fs_info, format);
+	cache_stats_end(&fctx);
+}
@@ -0,0 +1,35 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CACHE_STATS_H__
+#define __BTRFS_CACHE_STATS_H__
+
+#include "common/format-output.h"
+
+struct btrfs_fs_info;
+
+int parse_cache_stats_format(const char *str);
+void print_extent_cache_stats(const struct btrfs_fs_info *fs_info,
+			      unsigned int format);
+void cache_stats_start(struct format_ctx *fctx,
+		       const struct btrfs_fs_info *fs_info,
+		       unsigned int format);
+void cache_stats_start_group(struct format_ctx *fctx, const char *name,
+			     const char *title, const struct rowspec *rowspec);
+void cache_stats_end_group(struct format_ctx *fctx, const char *name);
+void cache_stats_end(struct format_ctx *fctx);
+
+#endif
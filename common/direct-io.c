@@ -0,0 +1,349 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "kernel-lib/sizes.h"
+#include "common/direct-io.h"
+#include "common/utils.h"
+#include "common/messages.h"
+#include "common/internal.h"
+
+/* Descriptors opened with O_DIRECT, at most one per device */
+#define DIRECT_IO_MAX_FDS		(64)
+
+/* Bounce buffers are pooled in power of two sizes up to this one */
+#define DIRECT_IO_POOL_MAX_SIZE		(SZ_1M)
+#define DIRECT_IO_POOL_CLASSES		(9)
+/* Free buffers kept per size class */
+#define DIRECT_IO_POOL_KEEP		(8)
+
+static int direct_fds[DIRECT_IO_MAX_FDS];
+static int nr_direct_fds;
+static int direct_io_state = -1;
+
+struct bounce_buffer {
+	struct bounce_buffer *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bounce_buffer *pool[DIRECT_IO_POOL_CLASSES];
+static int pool_count[DIRECT_IO_POOL_CLASSES];
+
+/* Whether devices should be opened with O_DIRECT, determined on first call */
+bool direct_io_enabled(void)
+{
+	const char *env;
+
+	if (direct_io_state >= 0)
+		return direct_io_state;
+
+	direct_io_state = 0;
+	if (bconf.direct_io) {
+		direct_io_state = 1;
+	} else {
+		env = getenv(BTRFS_DIRECT_IO_ENV);
+		if (env && *env && strcmp(env, "0"))
+			direct_io_state = 1;
+	}
+	return direct_io_state;
+}
+
+/*
+ * Open @path like open(2), with O_DIRECT added if direct I/O is enabled. Files
+ * that don't support it, e.g. images on tmpfs, are opened without it.
+ */
+int direct_io_open(const char *path, int flags)
+{
+	int fd;
+
+	if (!direct_io_enabled())
+		return open(path, flags);
+
+	fd = open(path, flags | O_DIRECT);
+	if (fd < 0) {
+		if (errno != EINVAL)
+			return fd;
+		warning("direct I/O not supported by %s, using buffered I/O",
+			path);
+		return open(path, flags);
+	}
+
+	if (nr_direct_fds == DIRECT_IO_MAX_FDS) {
+		/* Can't track it, switch the descriptor back to buffered I/O */
+		if (fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+			close(fd);
+			return open(path, flags);
+		}
+		return fd;
+	}
+	direct_fds[nr_direct_fds++] = fd;
+	return fd;
+}
+
+/* Close a descriptor returned by direct_io_open() */
+void direct_io_close(int fd)
+{
+	int i;
+
+	for (i = 0; i < nr_direct_fds; i++) {
+		if (direct_fds[i] == fd) {
+			direct_fds[i] = direct_fds[--nr_direct_fds];
+			break;
+		}
+	}
+	close(fd);
+}
+
+bool direct_io_fd(int fd)
+{
+	int i;
+
+	for (i = 0; i < nr_direct_fds; i++)
+		if (direct_fds[i] == fd)
+			return true;
+	return false;
+}
+
+static int pool_class(size_t size)
+{
+	int class = 0;
+
+	while (((size_t)DIRECT_IO_ALIGN << class) < size)
+		class++;
+	return class;
+}
+
+/*
+ * Allocate a buffer usable for direct I/O of @size bytes, from the pool if
+ * possible. Free it with direct_io_free() and the same size.
+ */
+void *direct_io_alloc(size_t size)
+{
+	struct bounce_buffer *buf = NULL;
+	int class;
+
+	if (size > DIRECT_IO_POOL_MAX_SIZE) {
+		if (posix_memalign((void **)&buf, DIRECT_IO_ALIGN,
+				   round_up(size, DIRECT_IO_ALIGN)))
+			return NULL;
+		return buf;
+	}
+
+	class = pool_class(size);
+	pthread_mutex_lock(&pool_lock);
+	if (pool[class]) {
+		buf = pool[class];
+		pool[class] = buf->next;
+		pool_count[class]--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (buf)
+		return buf;
+
+	if (posix_memalign((void **)&buf, DIRECT_IO_ALIGN,
+			   (size_t)DIRECT_IO_ALIGN << class))
+		return NULL;
+	return buf;
+}
+
+void direct_io_free(void *ptr, size_t size)
+{
+	struct bounce_buffer *buf = ptr;
+	int class;
+
+	if (!buf)
+		return;
+	if (size > DIRECT_IO_POOL_MAX_SIZE) {
+		free(buf);
+		return;
+	}
+
+	class = pool_class(size);
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count[class] < DIRECT_IO_POOL_KEEP) {
+		buf->next = pool[class];
+		pool[class] = buf;
+		pool_count[class]++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(buf);
+}
+
+/*
+ * Read one aligned block at @offset to @buf, the part past the end of file is
+ * zeroed
+ */
+static int read_block_for_update(int fd, char *buf, off_t offset)
+{
+	ssize_t ret;
+
+	ret = pread(fd, buf, DIRECT_IO_ALIGN, offset);
+	if (ret < 0)
+		return -errno;
+	memset(buf + ret, 0, DIRECT_IO_ALIGN - ret);
+	return 0;
+}
+
+/* Like pread(2), for any buffer, offset and length on a direct descriptor */
+ssize_t btrfs_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	off_t start;
+	size_t len;
+	size_t skip;
+	char *bounce;
+	ssize_t ret;
+
+	if (direct_io_aligned(buf, count, offset) || !direct_io_fd(fd))
+		return pread(fd, buf, count, offset);
+
+	start = round_down(offset, DIRECT_IO_ALIGN);
+	skip = offset - start;
+	len = round_up(skip + count, DIRECT_IO_ALIGN);
+	bounce = direct_io_alloc(len);
+	if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ret = pread(fd, bounce, len, start);
+	if (ret >= 0) {
+		ret = ret > skip ? min_t(size_t, ret - skip, count) : 0;
+		memcpy(buf, bounce + skip, ret);
+	}
+	direct_io_free(bounce, len);
+	return ret;
+}
+
+/*
+ * Like pwrite(2), for any buffer, offset and length on a direct descriptor.
+ * Partially written blocks at either end are read and updated first.
+ */
+ssize_t btrfs_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	off_t start;
+	size_t len;
+	size_t skip;
+	char *bounce;
+	ssize_t ret;
+	int err;
+
+	if (direct_io_aligned(buf, count, offset) || !direct_io_fd(fd))
+		return pwrite(fd, buf, count, offset);
+
+	start = round_down(offset, DIRECT_IO_ALIGN);
+	skip = offset - start;
+	len = round_up(skip + count, DIRECT_IO_ALIGN);
+	bounce = direct_io_alloc(len);
+	if (!bounce) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (skip) {
+		err = read_block_for_update(fd, bounce, start);
+		if (err < 0)
+			goto fail;
+	}
+	if (!IS_ALIGNED(skip + count, DIRECT_IO_ALIGN) &&
+	    (len > DIRECT_IO_ALIGN || !skip)) {
+		err = read_block_for_update(fd, bounce + len - DIRECT_IO_ALIGN,
+					    start + len - DIRECT_IO_ALIGN);
+		if (err < 0)
+			goto fail;
+	}
+	memcpy(bounce + skip, buf, count);
+
+	ret = pwrite(fd, bounce, len, start);
+	if (ret >= 0)
+		ret = ret > skip ? min_t(size_t, ret - skip, count) : 0;
+	direct_io_free(bounce, len);
+	return ret;
+
+fail:
+	direct_io_free(bounce, len);
+	errno = -err;
+	return -1;
+}
+
+/*
+ * Write all of @iov to a direct descriptor at @offset, gathered to aligned
+ * bounce buffers of at most DIRECT_IO_POOL_MAX_SIZE.
+ *
+ * Return 0 or a negative errno.
+ */
+int direct_io_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t total = 0;
+	size_t size;
+	size_t iov_off = 0;
+	char *bounce;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	size = min_t(size_t, total, DIRECT_IO_POOL_MAX_SIZE);
+	bounce = direct_io_alloc(size);
+	if (!bounce)
+		return -ENOMEM;
+
+	i = 0;
+	while (total) {
+		size_t len = 0;
+		size_t done = 0;
+
+		while (len < size && i < iovcnt) {
+			size_t copy = min(size - len, iov[i].iov_len - iov_off);
+
+			memcpy(bounce + len, (char *)iov[i].iov_base + iov_off,
+			       copy);
+			len += copy;
+			iov_off += copy;
+			if (iov_off == iov[i].iov_len) {
+				iov_off = 0;
+				i++;
+			}
+		}
+
+		while (done < len) {
+			ssize_t written;
+
+			written = btrfs_pwrite(fd, bounce + done, len - done,
+					       offset + done);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				goto out;
+			}
+			if (written == 0) {
+				ret = -EIO;
+				goto out;
+			}
+			done += written;
+		}
+		offset += len;
+		total -= len;
+	}
+out:
+	direct_io_free(bounce, size);
+	return ret;
+}
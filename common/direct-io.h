@@ -0,0 +1,61 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_DIRECT_IO_H__
+#define __BTRFS_DIRECT_IO_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "kerncompat.h"
+
+/* Environment variable enabling direct I/O for the standalone tools */
+#define BTRFS_DIRECT_IO_ENV		"BTRFS_DIRECT_IO"
+
+/*
+ * Alignment of buffers, offsets and lengths for direct I/O. The logical block
+ * size of the device could be smaller, but 4K works for all of them.
+ */
+#define DIRECT_IO_ALIGN			(SZ_4K)
+
+/*
+ * Devices of a filesystem can be opened with O_DIRECT, so the offline tools
+ * don't go through the page cache and don't evict everything else from it
+ * when reading a big filesystem once.
+ *
+ * The descriptors opened that way are registered here. btrfs_pread() and
+ * btrfs_pwrite() pass the I/O directly to the device if the buffer, offset
+ * and length are aligned, otherwise they go through an aligned bounce buffer
+ * from a small pool, so the callers don't need to care about the mode.
+ */
+bool direct_io_enabled(void);
+int direct_io_open(const char *path, int flags);
+void direct_io_close(int fd);
+bool direct_io_fd(int fd);
+
+void *direct_io_alloc(size_t size);
+void direct_io_free(void *buf, size_t size);
+
+static inline bool direct_io_aligned(const void *buf, size_t count, off_t offset)
+{
+	return IS_ALIGNED((unsigned long)buf | count | offset, DIRECT_IO_ALIGN);
+}
+
+ssize_t btrfs_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t btrfs_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int direct_io_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+#endif
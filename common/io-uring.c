@@ -0,0 +1,281 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "common/io-uring.h"
+#include "common/internal.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(__NR_io_uring_enter)
+
+#include <linux/io_uring.h>
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			max(ring->sq_ring_size, ring->cq_ring_size);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto out_unmap_sq;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto out_unmap_cq;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sq_tail_local = *ring->sq_tail;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+out_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+out_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+void io_ring_exit(struct io_ring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Queue a read of @len bytes at @offset of @fd into @buf, the request is
+ * not submitted to the kernel until io_ring_submit() or io_ring_reap().
+ *
+ * Return -EBUSY if there are already as many requests in flight as the ring
+ * has entries, the caller has to reap some first.
+ */
+int io_ring_prep_read(struct io_ring *ring, int fd, void *buf, u32 len,
+		      u64 offset, void *data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (io_ring_full(ring))
+		return -EBUSY;
+
+	index = ring->sq_tail_local & *ring->sq_mask;
+	sqe = (struct io_uring_sqe *)ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = (unsigned long)data;
+	ring->sq_array[index] = index;
+	ring->sq_tail_local++;
+	__atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	ring->inflight++;
+	return 0;
+}
+
+static int io_ring_enter(struct io_ring *ring, unsigned int min_complete)
+{
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			      min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	ring->to_submit -= min_t(unsigned int, ret, ring->to_submit);
+	return ret;
+}
+
+/* Hand all queued requests to the kernel without waiting for completion */
+int io_ring_submit(struct io_ring *ring)
+{
+	if (!ring->to_submit)
+		return 0;
+	return io_ring_enter(ring, 0);
+}
+
+/*
+ * Take back the requests queued but not submitted to the kernel yet, up to
+ * @nr of their @data pointers are returned in @data.
+ *
+ * Return the number of requests taken back.
+ */
+int io_ring_unqueue(struct io_ring *ring, void **data, unsigned int nr)
+{
+	unsigned int count = min(ring->to_submit, nr);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		unsigned int index;
+		struct io_uring_sqe *sqe;
+
+		index = (ring->sq_tail_local - count + i) & *ring->sq_mask;
+		sqe = (struct io_uring_sqe *)ring->sqes + index;
+		data[i] = (void *)(unsigned long)sqe->user_data;
+	}
+	ring->sq_tail_local -= count;
+	__atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+	ring->to_submit -= count;
+	ring->inflight -= count;
+	return count;
+}
+
+/*
+ * Fetch one completed request, the submitted @data pointer and the result
+ * of the read (number of bytes or -errno) are returned.
+ *
+ * Return 1 if a completion was reaped, 0 if there's none and @wait is not
+ * set or nothing is in flight, <0 for error.
+ */
+int io_ring_reap(struct io_ring *ring, void **data, int *res, bool wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int ret;
+
+	while (1) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (!wait || !ring->inflight)
+			return 0;
+		ret = io_ring_enter(ring, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+	*data = (void *)(unsigned long)cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	ring->inflight--;
+	return 1;
+}
+
+/*
+ * Block until a completion is posted, without io_uring_enter(). For callers
+ * that must wait for the requests in flight after waiting in io_ring_reap()
+ * failed, the completions are then reaped without @wait.
+ *
+ * Return 0 if a completion is ready or nothing is in flight, <0 for error.
+ */
+int io_ring_wait(struct io_ring *ring)
+{
+	struct pollfd pfd = { .fd = ring->fd, .events = POLLIN };
+
+	while (ring->inflight && *ring->cq_head ==
+	       __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+	}
+	return 0;
+}
+
+#else
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -ENOSYS;
+}
+
+void io_ring_exit(struct io_ring *ring)
+{
+}
+
+int io_ring_prep_read(struct io_ring *ring, int fd, void *buf, u32 len,
+		      u64 offset, void *data)
+{
+	return -ENOSYS;
+}
+
+int io_ring_submit(struct io_ring *ring)
+{
+	return -ENOSYS;
+}
+
+int io_ring_unqueue(struct io_ring *ring, void **data, unsigned int nr)
+{
+	return 0;
+}
+
+int io_ring_reap(struct io_ring *ring, void **data, int *res, bool wait)
+{
+	return -ENOSYS;
+}
+
+int io_ring_wait(struct io_ring *ring)
+{
+	return -ENOSYS;
+}
+
+#endif
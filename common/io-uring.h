@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_IO_URING_H__
+#define __BTRFS_IO_URING_H__
+
+#include <stdbool.h>
+#include "kerncompat.h"
+
+/*
+ * Minimal io_uring wrapper using the raw syscalls, so there's no dependency
+ * on liburing. Only reads are supported, that's all the tree block
+ * readahead needs.
+ *
+ * If the headers or the running kernel don't support io_uring,
+ * io_ring_init() fails and callers are expected to fall back to the
+ * synchronous read path.
+ */
+struct io_ring {
+	int fd;
+	unsigned int entries;
+
+	/* Submission queue, mapped from the kernel */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	void *sqes;
+	unsigned int sq_tail_local;
+	unsigned int to_submit;
+
+	/* Completion queue, mapped from the kernel */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/* Requests queued or submitted but not yet reaped */
+	unsigned int inflight;
+};
+
+int io_ring_init(struct io_ring *ring, unsigned int entries);
+void io_ring_exit(struct io_ring *ring);
+int io_ring_prep_read(struct io_ring *ring, int fd, void *buf, u32 len,
+		      u64 offset, void *data);
+int io_ring_submit(struct io_ring *ring);
+int io_ring_unqueue(struct io_ring *ring, void **data, unsigned int nr);
+int io_ring_reap(struct io_ring *ring, void **data, int *res, bool wait);
+int io_ring_wait(struct io_ring *ring);
+
+static inline bool io_ring_full(const struct io_ring *ring)
+{
+	return ring->inflight >= ring->entries;
+}
+
+#endif
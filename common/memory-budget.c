@@ -0,0 +1,218 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include "common/memory-budget.h"
+#include "common/utils.h"
+#include "common/messages.h"
+#include "common/internal.h"
+
+static u64 budget;
+static bool budget_explicit;
+static u64 charged;
+
+/* Read a limit from a cgroup file, "max" means there's no limit */
+static u64 read_cgroup_limit(const char *path)
+{
+	FILE *file;
+	char buf[64];
+	u64 limit = (u64)-1;
+
+	file = fopen(path, "r");
+	if (!file)
+		return limit;
+	if (fgets(buf, sizeof(buf), file) && strncmp(buf, "max", 3) != 0)
+		limit = strtoull(buf, NULL, 10);
+	fclose(file);
+	return limit;
+}
+
+/*
+ * Find the lowest memory limit on the way from the cgroup @cgroup to the
+ * root of the hierarchy mounted at @mnt. Parts of the path may not be
+ * visible in a container, those are skipped.
+ */
+static u64 cgroup_hierarchy_limit(const char *mnt, char *cgroup,
+				  const char *file)
+{
+	char path[PATH_MAX];
+	u64 limit = (u64)-1;
+	char *slash;
+
+	while (1) {
+		snprintf(path, sizeof(path), "%s%s/%s", mnt,
+			 strcmp(cgroup, "/") ? cgroup : "", file);
+		limit = min(limit, read_cgroup_limit(path));
+		slash = strrchr(cgroup, '/');
+		if (!slash || slash == cgroup)
+			break;
+		*slash = 0;
+	}
+	if (strcmp(cgroup, "/")) {
+		snprintf(path, sizeof(path), "%s/%s", mnt, file);
+		limit = min(limit, read_cgroup_limit(path));
+	}
+	return limit;
+}
+
+/*
+ * Return the memory limit of the cgroup of this process, either from cgroup
+ * v2 memory.max or cgroup v1 memory.limit_in_bytes, (u64)-1 if there's none.
+ */
+static u64 cgroup_memory_limit(void)
+{
+	FILE *file;
+	char line[PATH_MAX];
+	u64 limit = (u64)-1;
+
+	file = fopen("/proc/self/cgroup", "r");
+	if (!file)
+		return limit;
+
+	/* Lines are "hierarchy-ID:controller-list:cgroup-path" */
+	while (fgets(line, sizeof(line), file)) {
+		char *controllers;
+		char *cgroup;
+		char *end;
+
+		controllers = strchr(line, ':');
+		if (!controllers)
+			continue;
+		controllers++;
+		cgroup = strchr(controllers, ':');
+		if (!cgroup)
+			continue;
+		*cgroup++ = 0;
+		end = strchr(cgroup, '\n');
+		if (end)
+			*end = 0;
+
+		/* The unified hierarchy of cgroup v2 has no controller list */
+		if (!*controllers) {
+			limit = min(limit, cgroup_hierarchy_limit("/sys/fs/cgroup",
+						cgroup, "memory.max"));
+		} else {
+			char *tok;
+			char *saveptr = NULL;
+
+			for (tok = strtok_r(controllers, ",", &saveptr); tok;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (strcmp(tok, "memory"))
+					continue;
+				limit = min(limit, cgroup_hierarchy_limit(
+						"/sys/fs/cgroup/memory", cgroup,
+						"memory.limit_in_bytes"));
+				break;
+			}
+		}
+	}
+	fclose(file);
+	return limit;
+}
+
+/* Memory the process can use at most, total memory or the cgroup limit */
+static u64 system_memory_limit(void)
+{
+	u64 total = total_memory();
+
+	return min(total, cgroup_memory_limit());
+}
+
+/*
+ * Parse the memory limit from @str, either a size with an optional suffix
+ * (KMGTPE) as parsed by parse_size() or a percentage of the memory available
+ * to the process.
+ *
+ * Return 0 and the limit in bytes in @limit, -EINVAL for invalid value.
+ */
+int parse_memory_limit(const char *str, u64 *limit)
+{
+	char *end;
+	u64 value;
+
+	if (!str || !isdigit(str[0]))
+		return -EINVAL;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (end[0] == '%') {
+		if (errno || end[1] || value == 0 || value > 100)
+			return -EINVAL;
+		*limit = system_memory_limit() / 100 * value;
+		return 0;
+	}
+
+	if (parse_size(str, &value) < 0 || value == 0)
+		return -EINVAL;
+	*limit = value;
+	return 0;
+}
+
+static void memory_budget_init(void)
+{
+	const char *env;
+
+	if (bconf.memory_limit) {
+		budget = bconf.memory_limit;
+		budget_explicit = true;
+		return;
+	}
+
+	env = getenv(BTRFS_MEMORY_LIMIT_ENV);
+	if (env && *env) {
+		if (parse_memory_limit(env, &budget) == 0) {
+			budget_explicit = true;
+			return;
+		}
+		warning("ignoring invalid value of %s: %s",
+			BTRFS_MEMORY_LIMIT_ENV, env);
+	}
+	budget = system_memory_limit();
+}
+
+/* Return the memory budget in bytes, determined on the first call */
+u64 memory_budget(void)
+{
+	if (!budget)
+		memory_budget_init();
+	return budget;
+}
+
+/* Whether the budget was set by the user and not derived from the system */
+bool memory_budget_is_explicit(void)
+{
+	memory_budget();
+	return budget_explicit;
+}
+
+void memory_charge(u64 bytes)
+{
+	__atomic_add_fetch(&charged, bytes, __ATOMIC_RELAXED);
+}
+
+void memory_uncharge(u64 bytes)
+{
+	__atomic_sub_fetch(&charged, bytes, __ATOMIC_RELAXED);
+}
+
+u64 memory_charged(void)
+{
+	return __atomic_load_n(&charged, __ATOMIC_RELAXED);
+}
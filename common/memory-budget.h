@@ -0,0 +1,49 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_MEMORY_BUDGET_H__
+#define __BTRFS_MEMORY_BUDGET_H__
+
+#include <stdbool.h>
+#include "kerncompat.h"
+
+/* Environment variable with the same syntax as the --memory-limit option */
+#define BTRFS_MEMORY_LIMIT_ENV		"BTRFS_MEMORY_LIMIT"
+
+/*
+ * Memory budget shared by the long lived caches (extent buffers, records of
+ * check, pending buffers of btrfs-image).
+ *
+ * The budget is taken from the --memory-limit option, the environment
+ * variable or, by default, the smaller of the total memory and the cgroup
+ * memory limit of the process. Users of the caches charge the memory they
+ * allocate and release it once freed, the extent buffer cache gives up its
+ * buffers when the total goes over the budget.
+ */
+int parse_memory_limit(const char *str, u64 *limit);
+u64 memory_budget(void);
+bool memory_budget_is_explicit(void);
+
+void memory_charge(u64 bytes);
+void memory_uncharge(u64 bytes);
+u64 memory_charged(void);
+
+static inline bool memory_over_budget(void)
+{
+	return memory_charged() > memory_budget();
+}
+
+#endif
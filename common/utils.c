@@ -626,7 +626,7 @@ int set_label(const char *btrfs_dev, const char *label)
 
 /*
  * A not-so-good version fls64. No fascinating optimization since
- * no one except parse_size_from_string uses it
+ * no one except parse_size uses it
  */
 static int fls64(u64 x)
 {
@@ -638,7 +638,14 @@ static int fls64(u64 x)
 	return 64 - i;
 }
 
-u64 parse_size_from_string(const char *s)
+/*
+ * Parse a size with an optional suffix (KMGTPE) from @s, the errors are
+ * printed.
+ *
+ * Return 0 and the size in @size, -EINVAL for invalid value or -ERANGE if it
+ * does not fit u64.
+ */
+int parse_size(const char *s, u64 *size)
 {
 	char c;
 	char *endptr;
@@ -647,21 +654,22 @@ u64 parse_size_from_string(const char *s)
 
 	if (!s) {
 		error("size value is empty");
-		exit(1);
+		return -EINVAL;
 	}
 	if (s[0] == '-') {
 		error("size value '%s' is less equal than 0", s);
-		exit(1);
+		return -EINVAL;
 	}
+	errno = 0;
 	ret = strtoull(s, &endptr, 10);
 	if (endptr == s) {
 		error("size value '%s' is invalid", s);
-		exit(1);
+		return -EINVAL;
 	}
 	if (endptr[0] && endptr[1]) {
 		error("illegal suffix contains character '%c' in wrong position",
 			endptr[1]);
-		exit(1);
+		return -EINVAL;
 	}
 	/*
 	 * strtoll returns LLONG_MAX when overflow, if this happens,
@@ -669,7 +677,7 @@ u64 parse_size_from_string(const char *s)
 	 */
 	if (errno == ERANGE && ret == ULLONG_MAX) {
 		error("size value '%s' is too large for u64", s);
-		exit(1);
+		return -ERANGE;
 	}
 	if (endptr[0]) {
 		c = tolower(endptr[0]);
@@ -696,16 +704,25 @@ u64 parse_size_from_string(const char *s)
 			break;
 		default:
 			error("unknown size descriptor '%c'", c);
-			exit(1);
+			return -EINVAL;
 		}
 	}
 	/* Check whether ret * mult overflow */
 	if (fls64(ret) + fls64(mult) - 1 > 64) {
 		error("size value '%s' is too large for u64", s);
-		exit(1);
+		return -ERANGE;
 	}
-	ret *= mult;
-	return ret;
+	*size = ret * mult;
+	return 0;
+}
+
+u64 parse_size_from_string(const char *s)
+{
+	u64 size;
+
+	if (parse_size(s, &size) < 0)
+		exit(1);
+	return size;
 }
 
 u64 parse_qgroupid(const char *p)
@@ -1971,6 +1988,7 @@ void btrfs_config_init(void)
 {
 	bconf.output_format = CMD_FORMAT_TEXT;
 	bconf.verbose = BTRFS_BCONF_UNSET;
+	bconf.cache_policy = EXTENT_CACHE_POLICY_DEFAULT;
 }
 
 void bconf_be_verbose(void)
@@ -77,6 +77,7 @@ int pretty_size_snprintf(u64 size, char *str, size_t str_bytes, unsigned unit_mo
 const char *pretty_size_mode(u64 size, unsigned mode);
 
 enum btrfs_csum_type parse_csum_type(const char *s);
+int parse_size(const char *s, u64 *size);
 u64 parse_size_from_string(const char *s);
 u64 parse_qgroupid(const char *p);
 u64 arg_strtou64(const char *str);
@@ -149,6 +150,18 @@ struct btrfs_config {
 	 *   > 0: verbose level
 	 */
 	int verbose;
+
+	/* Eviction policy of extent buffer cache, enum extent_cache_policy */
+	int cache_policy;
+
+	/* Memory budget in bytes from --memory-limit, 0 if not set */
+	u64 memory_limit;
+
+	/* Threads computing tree block checksums, 0 if not set */
+	int csum_threads;
+
+	/* Open devices with O_DIRECT, from --direct-io */
+	bool direct_io;
 };
 extern struct btrfs_config bconf;
 
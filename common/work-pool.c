@@ -0,0 +1,184 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "common/work-pool.h"
+#include "common/internal.h"
+
+/*
+ * Parse a thread count, 0 means to determine it automatically.
+ *
+ * Return the count or -EINVAL for invalid value.
+ */
+int work_pool_parse_threads(const char *str)
+{
+	char *end;
+	unsigned long value;
+
+	if (!str || !isdigit(str[0]))
+		return -EINVAL;
+	errno = 0;
+	value = strtoul(str, &end, 10);
+	if (errno || *end || value > 1024)
+		return -EINVAL;
+	return value;
+}
+
+/* Number of online CPUs, at most WORK_POOL_MAX_AUTO_THREADS */
+int work_pool_default_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus <= 0)
+		cpus = 1;
+	return min_t(long, cpus, WORK_POOL_MAX_AUTO_THREADS);
+}
+
+static void work_pool_run_items(struct work_pool *pool, work_pool_fn_t fn,
+				void *data, int nr)
+{
+	int index;
+
+	while ((index = __atomic_fetch_add(&pool->next, 1,
+					   __ATOMIC_RELAXED)) < nr)
+		fn(data, index);
+}
+
+static void *work_pool_worker(void *arg)
+{
+	struct work_pool *pool = arg;
+	u64 seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		work_pool_fn_t fn;
+		void *data;
+		int nr;
+
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stop)
+			break;
+		/* The batch can't change until all workers are done with it */
+		seen = pool->generation;
+		fn = pool->fn;
+		data = pool->data;
+		nr = pool->nr;
+		pool->joined++;
+		pool->active++;
+		pthread_mutex_unlock(&pool->lock);
+
+		work_pool_run_items(pool, fn, data, nr);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active--;
+		if (pool->joined == pool->nr_threads && !pool->active)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Create a pool running batches on @nr_threads threads in total, including
+ * the caller of work_pool_run(). Return NULL for a single thread or if the
+ * threads can't be started, batches then run on the calling thread.
+ */
+struct work_pool *work_pool_create(int nr_threads)
+{
+	struct work_pool *pool;
+	int i;
+
+	if (nr_threads <= 1)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(nr_threads - 1, sizeof(*pool->threads));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < nr_threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, work_pool_worker,
+				   pool))
+			break;
+		pool->nr_threads++;
+	}
+	if (!pool->nr_threads) {
+		work_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void work_pool_destroy(struct work_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Call @fn for each index from 0 to @nr - 1 and wait for all of them */
+void work_pool_run(struct work_pool *pool, work_pool_fn_t fn, void *data,
+		   int nr)
+{
+	int i;
+
+	if (!pool || nr < 2) {
+		for (i = 0; i < nr; i++)
+			fn(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->data = data;
+	pool->nr = nr;
+	pool->next = 0;
+	pool->joined = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	work_pool_run_items(pool, fn, data, nr);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->joined < pool->nr_threads || pool->active)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,74 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_WORK_POOL_H__
+#define __BTRFS_WORK_POOL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "kerncompat.h"
+
+/* Upper limit of threads started when the count is determined automatically */
+#define WORK_POOL_MAX_AUTO_THREADS	(8)
+
+typedef void (*work_pool_fn_t)(void *data, int index);
+
+/*
+ * Pool of threads running batches of independent work items, e.g. checksums
+ * of a set of extent buffers.
+ *
+ * work_pool_run() calls the function for each index of the batch, spread
+ * over the pool threads and the calling thread, and returns once all items
+ * are done. Items must not depend on each other and must not print anything
+ * whose order matters.
+ *
+ * Without a pool, or with a single thread, all items run on the calling
+ * thread in index order, which keeps the behaviour deterministic for tests.
+ */
+struct work_pool {
+	pthread_mutex_t lock;
+	/* Workers wait for a new batch */
+	pthread_cond_t work_cond;
+	/* The caller waits for the workers to finish the batch */
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nr_threads;
+	bool stop;
+
+	/* Current batch, changed under @lock, bumping @generation */
+	u64 generation;
+	work_pool_fn_t fn;
+	void *data;
+	int nr;
+	/* Next item to run, taken atomically */
+	int next;
+	/*
+	 * Workers that have seen the current batch and the ones still running
+	 * its items, each worker joins every batch so none of them can pick
+	 * items of a later batch with a stale function
+	 */
+	int joined;
+	int active;
+};
+
+int work_pool_parse_threads(const char *str);
+int work_pool_default_threads(void);
+struct work_pool *work_pool_create(int nr_threads);
+void work_pool_destroy(struct work_pool *pool);
+void work_pool_run(struct work_pool *pool, work_pool_fn_t fn, void *data,
+		   int nr);
+
+#endif
@@ -102,7 +102,7 @@
 #include "mkfs/common.h"
 #include "convert/common.h"
 #include "convert/source-fs.h"
-#include "crypto/crc32c.h"
+#include "crypto/hash.h"
 #include "common/fsfeatures.h"
 #include "common/box.h"
 
@@ -165,28 +165,31 @@ static inline int convert_check_state(struct btrfs_convert_context *cctx)
 	return cctx->convert_ops->check_state(cctx);
 }
 
+/* Data read and checksummed at once */
+#define CSUM_CHUNK_SIZE		(SZ_1M)
+
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
-	u32 blocksize = root->fs_info->sectorsize;
 	u64 offset;
+	u32 len;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(min_t(u64, num_bytes, CSUM_CHUNK_SIZE));
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		ret = read_disk_extent(root, disk_bytenr + offset,
-					blocksize, buffer);
+	for (offset = 0; offset < num_bytes; offset += len) {
+		len = min_t(u64, num_bytes - offset, CSUM_CHUNK_SIZE);
+		ret = read_disk_extent(root, disk_bytenr + offset, len, buffer);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans,
-					    root->fs_info->csum_root,
-					    disk_bytenr + num_bytes,
-					    disk_bytenr + offset,
-					    buffer, blocksize);
+		ret = btrfs_csum_file_blocks(trans,
+					     root->fs_info->csum_root,
+					     disk_bytenr + num_bytes,
+					     disk_bytenr + offset,
+					     buffer, len);
 		if (ret)
 			break;
 	}
@@ -1772,7 +1775,7 @@ int BOX_MAIN(convert)(int argc, char *argv[])
 	u64 features = BTRFS_MKFS_DEFAULT_FEATURES;
 	u16 csum_type = BTRFS_CSUM_TYPE_CRC32;
 
-	crc32c_optimization_init();
+	hash_init_accel();
 
 	while(1) {
 		enum { GETOPT_VAL_NO_PROGRESS = 256, GETOPT_VAL_CHECKSUM };
@@ -21,6 +21,7 @@
 #include "kernel-shared/volumes.h"
 #include "convert/common.h"
 #include "convert/source-fs.h"
+#include "common/direct-io.h"
 
 const struct simple_range btrfs_reserved_ranges[3] = {
 	{ 0,			     SZ_1M },
@@ -197,7 +198,7 @@ int read_disk_extent(struct btrfs_root *root, u64 bytenr,
 	int ret;
 	struct btrfs_fs_devices *fs_devs = root->fs_info->fs_devices;
 
-	ret = pread(fs_devs->latest_bdev, buffer, num_bytes, bytenr);
+	ret = btrfs_pread(fs_devs->latest_bdev, buffer, num_bytes, bytenr);
 	if (ret != num_bytes)
 		goto fail;
 	ret = 0;
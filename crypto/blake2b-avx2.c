@@ -0,0 +1,296 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * BLAKE2b (RFC 7693) with 32 byte digest and no key, as used for the
+ * checksums, in two variants:
+ *
+ * - single buffer, each row of the 4x4 state matrix is in one AVX2 register,
+ *   so the four G functions of a column or diagonal step run in parallel;
+ *   the diagonals are lined up by rotating the rows with a lane permutation
+ *
+ * - multi-buffer, 4 messages of the same length are hashed in the 64bit
+ *   lanes, one register per state word
+ *
+ * The single buffer version is limited by the latency of the dependent
+ * operations in G and gains little over the portable code, the multi-buffer
+ * one is several times faster for batches of data blocks.
+ */
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <string.h>
+#include "crypto/hash-x86.h"
+#include "common/internal.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+#define BLAKE2B_BLOCK_SIZE	(128)
+#define BLAKE2B_DIGEST_SIZE	(32)
+#define BLAKE2B_AVX2_LANES	(4)
+
+static const u64 blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const u8 blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+/* Rotations by multiples of 8 are byte shuffles, 63 is a shift and add */
+#define ROTR64_32(x)	_mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR64_24(x)	_mm256_shuffle_epi8((x), rot24)
+#define ROTR64_16(x)	_mm256_shuffle_epi8((x), rot16)
+#define ROTR64_63(x)	_mm256_xor_si256(_mm256_srli_epi64((x), 63),	\
+					 _mm256_add_epi64((x), (x)))
+
+#define G_HALF1(a, b, c, d, m)						\
+	do {								\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), m);	\
+		d = ROTR64_32(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);				\
+		b = ROTR64_24(_mm256_xor_si256(b, c));			\
+	} while (0)
+
+#define G_HALF2(a, b, c, d, m)						\
+	do {								\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), m);	\
+		d = ROTR64_16(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);				\
+		b = ROTR64_63(_mm256_xor_si256(b, c));			\
+	} while (0)
+
+#define MSG(s, i0, i1, i2, i3)						\
+	_mm256_set_epi64x(m[(s)[i3]], m[(s)[i2]], m[(s)[i1]], m[(s)[i0]])
+
+__attribute__((target("avx2")))
+static void blake2b_compress_avx2(__m256i h[2], const u8 *block, u64 counter,
+				  bool last)
+{
+	const __m256i rot24 = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i rot16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i a = h[0];
+	__m256i b = h[1];
+	__m256i c = _mm256_loadu_si256((const __m256i *)&blake2b_iv[0]);
+	__m256i d = _mm256_loadu_si256((const __m256i *)&blake2b_iv[4]);
+	u64 m[16];
+	int r;
+
+	memcpy(m, block, sizeof(m));
+	/* The counter never exceeds 64 bits here, its high word is 0 */
+	d = _mm256_xor_si256(d, _mm256_set_epi64x(0, last ? ~0ULL : 0, 0,
+						  counter));
+
+	for (r = 0; r < 12; r++) {
+		const u8 *s = blake2b_sigma[r];
+
+		/* Columns */
+		G_HALF1(a, b, c, d, MSG(s, 0, 2, 4, 6));
+		G_HALF2(a, b, c, d, MSG(s, 1, 3, 5, 7));
+		/* Line up the diagonals in the columns */
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+		G_HALF1(a, b, c, d, MSG(s, 8, 10, 12, 14));
+		G_HALF2(a, b, c, d, MSG(s, 9, 11, 13, 15));
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	h[0] = _mm256_xor_si256(h[0], _mm256_xor_si256(a, c));
+	h[1] = _mm256_xor_si256(h[1], _mm256_xor_si256(b, d));
+}
+
+__attribute__((target("avx2")))
+int blake2b_avx2(const u8 *buf, size_t length, u8 *out)
+{
+	u8 block[BLAKE2B_BLOCK_SIZE];
+	__m256i h[2];
+	u64 counter = 0;
+
+	h[0] = _mm256_loadu_si256((const __m256i *)&blake2b_iv[0]);
+	h[1] = _mm256_loadu_si256((const __m256i *)&blake2b_iv[4]);
+	/* Parameter block: digest length, no key, fanout and depth 1 */
+	h[0] = _mm256_xor_si256(h[0],
+			_mm256_set_epi64x(0, 0, 0, 0x01010000 | BLAKE2B_DIGEST_SIZE));
+
+	while (length > BLAKE2B_BLOCK_SIZE) {
+		counter += BLAKE2B_BLOCK_SIZE;
+		blake2b_compress_avx2(h, buf, counter, false);
+		buf += BLAKE2B_BLOCK_SIZE;
+		length -= BLAKE2B_BLOCK_SIZE;
+	}
+
+	/* The last block, possibly empty, is zero padded */
+	memcpy(block, buf, length);
+	memset(block + length, 0, BLAKE2B_BLOCK_SIZE - length);
+	counter += length;
+	blake2b_compress_avx2(h, block, counter, true);
+
+	_mm256_storeu_si256((__m256i *)out, h[0]);
+
+	return 0;
+}
+
+#define G4(a, b, c, d, x, y)						\
+	do {								\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), x);	\
+		d = ROTR64_32(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);				\
+		b = ROTR64_24(_mm256_xor_si256(b, c));			\
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), y);	\
+		d = ROTR64_16(_mm256_xor_si256(d, a));			\
+		c = _mm256_add_epi64(c, d);				\
+		b = ROTR64_63(_mm256_xor_si256(b, c));			\
+	} while (0)
+
+/*
+ * Compress one block of each of the 4 messages at @p + @off, word i of the
+ * state of message j is in lane j of @h[i]
+ */
+__attribute__((target("avx2")))
+static void blake2b_compress_avx2_x4(__m256i h[8],
+				     const u8 *p[BLAKE2B_AVX2_LANES],
+				     size_t off, u64 counter, bool last)
+{
+	const __m256i rot24 = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i rot16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i m[16];
+	__m256i v[16];
+	int i, r;
+
+	for (i = 0; i < 16; i++) {
+		size_t o = off + i * 8;
+
+		m[i] = _mm256_set_epi64x(get_unaligned_le64(p[3] + o),
+					 get_unaligned_le64(p[2] + o),
+					 get_unaligned_le64(p[1] + o),
+					 get_unaligned_le64(p[0] + o));
+	}
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = _mm256_set1_epi64x(blake2b_iv[i]);
+	}
+	v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x(counter));
+	if (last)
+		v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(~0ULL));
+
+	for (r = 0; r < 12; r++) {
+		const u8 *s = blake2b_sigma[r];
+
+		G4(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+		G4(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+		G4(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+		G4(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+		G4(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+		G4(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+		G4(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+		G4(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+}
+
+__attribute__((target("avx2")))
+int blake2b_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride)
+{
+	u8 tail[BLAKE2B_AVX2_LANES][BLAKE2B_BLOCK_SIZE];
+	int first;
+
+	for (first = 0; first < nr; first += BLAKE2B_AVX2_LANES) {
+		int lanes = min(nr - first, BLAKE2B_AVX2_LANES);
+		const u8 *p[BLAKE2B_AVX2_LANES];
+		u64 digest[4][BLAKE2B_AVX2_LANES];
+		__m256i h[8];
+		size_t rem = length;
+		size_t off = 0;
+		u64 counter = 0;
+		int i, j;
+
+		for (i = 0; i < 8; i++)
+			h[i] = _mm256_set1_epi64x(blake2b_iv[i]);
+		h[0] = _mm256_xor_si256(h[0],
+				_mm256_set1_epi64x(0x01010000 | BLAKE2B_DIGEST_SIZE));
+		/* Unused lanes hash the last message again */
+		for (j = 0; j < BLAKE2B_AVX2_LANES; j++)
+			p[j] = buf + (size_t)(first + min(j, lanes - 1)) * length;
+
+		while (rem > BLAKE2B_BLOCK_SIZE) {
+			counter += BLAKE2B_BLOCK_SIZE;
+			blake2b_compress_avx2_x4(h, p, off, counter, false);
+			off += BLAKE2B_BLOCK_SIZE;
+			rem -= BLAKE2B_BLOCK_SIZE;
+		}
+		for (j = 0; j < BLAKE2B_AVX2_LANES; j++) {
+			memcpy(tail[j], p[j] + off, rem);
+			memset(tail[j] + rem, 0, BLAKE2B_BLOCK_SIZE - rem);
+			p[j] = tail[j];
+		}
+		counter += rem;
+		blake2b_compress_avx2_x4(h, p, 0, counter, true);
+
+		for (i = 0; i < 4; i++)
+			_mm256_storeu_si256((__m256i *)digest[i], h[i]);
+		for (j = 0; j < lanes; j++)
+			for (i = 0; i < 4; i++)
+				put_unaligned_le64(digest[i][j],
+					out + (size_t)(first + j) * stride + i * 8);
+	}
+
+	return 0;
+}
+
+#else
+
+/* Never called, hash_init_accel() finds no support on other architectures */
+int blake2b_avx2(const u8 *buf, size_t length, u8 *out)
+{
+	return -1;
+}
+
+int blake2b_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride)
+{
+	return -1;
+}
+
+#endif /* __x86_64__ */
@@ -16,6 +16,10 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include "common/internal.h"
 
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length);
 static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) = __crc32c_le;
@@ -42,6 +46,7 @@ static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) =
 
 static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -84,6 +89,108 @@ static uint32_t crc32c_intel(u32 crc, unsigned char const *data, unsigned long l
 	return crc;
 }
 
+/*
+ * Three way interleaved CRC32C for long buffers, following the approach of
+ * the kernel crc32c-pcl-intel implementation.
+ *
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one
+ * per cycle, a single dependent chain uses only a third of it. The buffer is
+ * split to three blocks of the same length whose CRCs are computed at once,
+ * the first one continuing from the initial value and the other two starting
+ * from 0. The CRCs are linear, so they're combined by shifting the CRC of the
+ * first block over the length of the other two and the second over the
+ * third:
+ *
+ *   crc = crc_a * x^(16 * len) ^ crc_b * x^(8 * len) ^ crc_c  (mod P)
+ *
+ * The multiplication by a constant K = x^(8 * n - 33) is a carry-less
+ * multiplication of the bit-reflected values, the 64 bit product reduced by
+ * a crc32 instruction on it gives crc * x^(8 * n) mod P.
+ */
+
+/* Block length of the three streams is a multiple of 8, up to this */
+#define CRC32C_3WAY_MAX_BLOCK	(4096)
+/* Shorter buffers are not worth the recombination */
+#define CRC32C_3WAY_MIN_LEN	(4096)
+
+/* Shift constants x^(8 * len - 33) and x^(16 * len - 33) per block length */
+static struct {
+	u32 k1;
+	u32 k2;
+} crc32c_shift[CRC32C_3WAY_MAX_BLOCK / 8 + 1];
+
+/* Multiply the bit-reflected @val by x^@bits modulo the CRC32C polynomial */
+static u32 crc32c_mul_xpow(u32 val, unsigned int bits)
+{
+	while (bits--)
+		val = (val & 1) ? (val >> 1) ^ 0x82F63B78 : val >> 1;
+	return val;
+}
+
+static void crc32c_3way_init(void)
+{
+	u32 k1 = crc32c_mul_xpow(0x80000000, 64 - 33);
+	u32 k2 = crc32c_mul_xpow(0x80000000, 128 - 33);
+	int i;
+
+	for (i = 1; i <= CRC32C_3WAY_MAX_BLOCK / 8; i++) {
+		crc32c_shift[i].k1 = k1;
+		crc32c_shift[i].k2 = k2;
+		k1 = crc32c_mul_xpow(k1, 64);
+		k2 = crc32c_mul_xpow(k2, 128);
+	}
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_3way(u32 crc, unsigned char const *data, size_t length)
+{
+	while (length >= 3 * 8) {
+		size_t block = min_t(size_t, length / 3 & ~7UL,
+				     CRC32C_3WAY_MAX_BLOCK);
+		const unsigned char *end = data + block;
+		u64 crc_a = crc;
+		u64 crc_b = 0;
+		u64 crc_c = 0;
+		__m128i a;
+		__m128i b;
+		u64 val;
+
+		for (; data < end; data += 8) {
+			u64 va, vb, vc;
+
+			memcpy(&va, data, 8);
+			memcpy(&vb, data + block, 8);
+			memcpy(&vc, data + 2 * block, 8);
+			crc_a = _mm_crc32_u64(crc_a, va);
+			crc_b = _mm_crc32_u64(crc_b, vb);
+			crc_c = _mm_crc32_u64(crc_c, vc);
+		}
+
+		a = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc_a),
+				_mm_cvtsi32_si128(crc32c_shift[block / 8].k2), 0);
+		b = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc_b),
+				_mm_cvtsi32_si128(crc32c_shift[block / 8].k1), 0);
+		val = _mm_cvtsi128_si64(_mm_xor_si128(a, b));
+		crc = crc_c ^ _mm_crc32_u64(0, val);
+
+		data += 2 * block;
+		length -= 3 * block;
+	}
+
+	if (length)
+		crc = crc32c_intel(crc, data, length);
+	return crc;
+}
+
+/* Pick the interleaved version for long buffers */
+static u32 crc32c_intel_pclmul(u32 crc, unsigned char const *data,
+			       unsigned long length)
+{
+	if (length >= CRC32C_3WAY_MIN_LEN)
+		return crc32c_3way(crc, data, length);
+	return crc32c_intel(crc, data, length);
+}
+
 static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
 		     unsigned int *edx)
 {
@@ -109,6 +216,8 @@ static void crc32c_intel_probe(void)
 
 		do_cpuid(&eax, &ebx, &ecx, &edx);
 		crc32c_intel_available = (ecx & (1 << 20)) != 0;
+		crc32c_pclmul_available = crc32c_intel_available &&
+					  (ecx & (1 << 1)) != 0;
 		crc32c_probed = 1;
 	}
 }
@@ -116,8 +225,40 @@ static void crc32c_intel_probe(void)
 void crc32c_optimization_init(void)
 {
 	crc32c_intel_probe();
-	if (crc32c_intel_available)
+	if (crc32c_pclmul_available) {
+		crc32c_3way_init();
+		crc_function = crc32c_intel_pclmul;
+	} else if (crc32c_intel_available) {
 		crc_function = crc32c_intel;
+	}
+}
+
+/*
+ * Run the given implementation, for benchmarks and tests. Return -1 if it's
+ * not available on this CPU.
+ */
+int crc32c_le_impl(enum crc32c_impl impl, u32 *crc, unsigned char const *data,
+		   size_t length)
+{
+	crc32c_intel_probe();
+	switch (impl) {
+	case CRC32C_IMPL_TABLE:
+		*crc = __crc32c_le(*crc, data, length);
+		return 0;
+	case CRC32C_IMPL_INTEL:
+		if (!crc32c_intel_available)
+			return -1;
+		*crc = crc32c_intel(*crc, data, length);
+		return 0;
+	case CRC32C_IMPL_PCLMUL:
+		if (!crc32c_pclmul_available)
+			return -1;
+		if (!crc32c_shift[1].k1)
+			crc32c_3way_init();
+		*crc = crc32c_intel_pclmul(*crc, data, length);
+		return 0;
+	}
+	return -1;
 }
 #else
 
@@ -125,6 +266,15 @@ void crc32c_optimization_init(void)
 {
 }
 
+int crc32c_le_impl(enum crc32c_impl impl, u32 *crc, unsigned char const *data,
+		   size_t length)
+{
+	if (impl != CRC32C_IMPL_TABLE)
+		return -1;
+	*crc = __crc32c_le(*crc, data, length);
+	return 0;
+}
+
 #endif /* __x86_64__ */
 
 /*
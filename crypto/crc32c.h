@@ -28,6 +28,19 @@
 u32 crc32c_le(u32 seed, unsigned char const *data, size_t length);
 void crc32c_optimization_init(void);
 
+/* Implementations selected by crc32c_optimization_init() */
+enum crc32c_impl {
+	/* Table driven, one byte at a time */
+	CRC32C_IMPL_TABLE,
+	/* SSE4.2 crc32 instruction, one dependent chain */
+	CRC32C_IMPL_INTEL,
+	/* Three interleaved crc32 chains combined with PCLMULQDQ */
+	CRC32C_IMPL_PCLMUL,
+};
+
+int crc32c_le_impl(enum crc32c_impl impl, u32 *crc, unsigned char const *data,
+		   size_t length);
+
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
 #define btrfs_crc32c crc32c
 #endif
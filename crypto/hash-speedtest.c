@@ -1,105 +1,478 @@
+/*
+ * Benchmark of the checksum implementations
+ *
+ * Usage:
+ *
+ * $ ./hash-speedtest [options]
+ *
+ * Each checksum type is measured with every implementation available on this
+ * CPU (reference, hardware instructions, SIMD), for buffer sizes from 512B to
+ * 1MiB, hashing one buffer or a batch of 16 per call, with the input hot in
+ * the caches or streamed from a pool bigger than the caches, in one thread
+ * and in one thread per CPU.
+ *
+ * For each combination the throughput is measured over a fixed time, then the
+ * latency of single calls is sampled for the same time and reported as
+ * percentiles. The results are printed as a table, or with --format json as a
+ * list for further processing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 #include "../kerncompat.h"
 #include "crypto/hash.h"
 #include "crypto/crc32c.h"
-#include "crypto/sha.h"
-#include "crypto/blake2.h"
+#include "kernel-lib/sizes.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "common/utils.h"
+#include "common/format-output.h"
+#include "cmds/commands.h"
+
+/* Inputs of the cold runs cycle through a pool bigger than the caches */
+#define COLD_POOL_SIZE		(SZ_256M)
+/* Bytes hashed between checks of the time limit, at least one call */
+#define TIME_CHECK_BYTES	(SZ_64K)
+/* Latency samples per thread at most */
+#define MAX_SAMPLES		(10000)
+#define MAX_BATCH		(16)
+
+struct bench_impl {
+	const char *csum;
+	const char *name;
+	int impl;
+	int (*run)(int impl, const u8 *buf, size_t length, int nr, u8 *out);
+};
+
+struct bench_params {
+	const struct bench_impl *impl;
+	size_t size;
+	int batch;
+	int threads;
+	bool cold;
+};
 
-#ifndef __x86_64__
-#error "Only x86_64 supported"
-#endif
+struct bench_thread {
+	pthread_t thread;
+	const struct bench_params *params;
+	int index;
+	u8 *hot;
+	u64 calls;
+	u64 *samples;
+	u64 nr_samples;
+};
 
-const int blocksize = 4096;
-int iterations = 100000;
+static const size_t sizes[] = {
+	512, SZ_1K, SZ_4K, SZ_16K, SZ_64K, SZ_256K, SZ_1M,
+};
 
-static __always_inline unsigned long long rdtsc(void)
+static const int batches[] = { 1, MAX_BATCH };
+
+static u64 duration_ns = 100 * 1000000ULL;
+static u8 *cold_pool;
+static pthread_barrier_t barrier;
+
+static int run_crc32c(int impl, const u8 *buf, size_t length, int nr, u8 *out)
 {
-	unsigned low, high;
+	int i;
 
-        asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	for (i = 0; i < nr; i++) {
+		u32 crc = ~0;
 
-        return (low | ((u64)(high) << 32));
+		if (crc32c_le_impl(impl, &crc, buf + i * length, length))
+			return -1;
+		put_unaligned_le32(~crc, out + i * CRYPTO_HASH_SIZE_MAX);
+	}
+	return 0;
 }
 
-static inline u64 read_tsc(void)
+static int run_xxhash(int impl, const u8 *buf, size_t length, int nr, u8 *out)
 {
-       asm volatile("mfence");
-       return rdtsc();
+	return hash_xxhash_multi(buf, length, nr, out, CRYPTO_HASH_SIZE_MAX);
 }
 
-/* Read the input and copy last bytes as the hash */
-static int hash_null_memcpy(const u8 *buf, size_t length, u8 *out)
+static int run_sha256(int impl, const u8 *buf, size_t length, int nr, u8 *out)
 {
-       const u8 *end = buf + length;
+	return hash_sha256_impl(impl, buf, length, nr, out, CRYPTO_HASH_SIZE_MAX);
+}
+
+static int run_blake2b(int impl, const u8 *buf, size_t length, int nr, u8 *out)
+{
+	return hash_blake2b_impl(impl, buf, length, nr, out, CRYPTO_HASH_SIZE_MAX);
+}
 
-       while (buf + CRYPTO_HASH_SIZE_MAX < end) {
-               memcpy(out, buf, CRYPTO_HASH_SIZE_MAX);
-               buf += CRYPTO_HASH_SIZE_MAX;
-       }
+static const struct bench_impl impls[] = {
+	{ "crc32c", "TABLE", CRC32C_IMPL_TABLE, run_crc32c },
+	{ "crc32c", "INTEL", CRC32C_IMPL_INTEL, run_crc32c },
+	{ "crc32c", "PCLMUL", CRC32C_IMPL_PCLMUL, run_crc32c },
+	{ "xxhash", "REF", 0, run_xxhash },
+	{ "sha256", "REF", HASH_IMPL_REF, run_sha256 },
+	{ "sha256", "SHA-NI", HASH_IMPL_SHA_NI, run_sha256 },
+	{ "sha256", "AVX2-MB", HASH_IMPL_AVX2_MULTI, run_sha256 },
+	{ "blake2b", "REF", HASH_IMPL_REF, run_blake2b },
+	{ "blake2b", "AVX2", HASH_IMPL_AVX2, run_blake2b },
+	{ "blake2b", "AVX2-MB", HASH_IMPL_AVX2_MULTI, run_blake2b },
+};
+
+static const struct rowspec bench_rowspec[] = {
+	{ .key = "provider", .fmt = "%s", .out_json = "provider" },
+	{ .key = "cpus", .fmt = "%d", .out_json = "cpus" },
+	{ .key = "duration-ms", .fmt = "%llu", .out_json = "duration-ms" },
+	{ .key = "csum", .fmt = "%s", .out_json = "csum" },
+	{ .key = "impl", .fmt = "%s", .out_json = "impl" },
+	{ .key = "size", .fmt = "%zu", .out_json = "size" },
+	{ .key = "batch", .fmt = "%d", .out_json = "batch" },
+	{ .key = "threads", .fmt = "%d", .out_json = "threads" },
+	{ .key = "cache", .fmt = "%s", .out_json = "cache" },
+	{ .key = "calls", .fmt = "%llu", .out_json = "calls" },
+	{ .key = "bytes-per-sec", .fmt = "%.0f", .out_json = "bytes-per-sec" },
+	{ .key = "latency-ns", .fmt = "map", .out_json = "latency-ns" },
+	{ .key = "p50", .fmt = "%llu", .out_json = "p50" },
+	{ .key = "p90", .fmt = "%llu", .out_json = "p90" },
+	{ .key = "p99", .fmt = "%llu", .out_json = "p99" },
+	{ .key = "max", .fmt = "%llu", .out_json = "max" },
+	ROWSPEC_END
+};
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
 
-       return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-/* Test overhead of the calls */
-static int hash_null_nop(const u8 *buf, size_t length, u8 *out)
+/* Input of the next call, hot inputs are always the same */
+static const u8 *next_input(struct bench_thread *bt, size_t *cold_off)
 {
-       memset(out, 0xFF, CRYPTO_HASH_SIZE_MAX);
+	const struct bench_params *p = bt->params;
+	size_t len = p->size * p->batch;
+	const u8 *buf;
 
-       return 0;
+	if (!p->cold)
+		return bt->hot;
+	if (*cold_off + len > COLD_POOL_SIZE)
+		*cold_off = 0;
+	buf = cold_pool + *cold_off;
+	*cold_off += len;
+	return buf;
 }
 
-int main(int argc, char **argv) {
-	u8 buf[blocksize];
-	u8 hash[32];
-	int idx;
-	int iter;
-	struct contestant {
-		char name[16];
-		int (*digest)(const u8 *buf, size_t length, u8 *out);
-		int digest_size;
-		u64 cycles;
-	} contestants[] = {
-		{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
-		{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
-		{ .name = "CRC32C", .digest = hash_crc32c, .digest_size = 4 },
-		{ .name = "XXHASH", .digest = hash_xxhash, .digest_size = 8 },
-		{ .name = "SHA256", .digest = hash_sha256, .digest_size = 32 },
-		{ .name = "BLAKE2b", .digest = hash_blake2b, .digest_size = 32 },
-	};
-
-	if (argc > 1) {
-		iterations = atoi(argv[1]);
-		if (iterations < 0)
-			iterations = 1;
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *bt = arg;
+	const struct bench_params *p = bt->params;
+	u8 out[MAX_BATCH * CRYPTO_HASH_SIZE_MAX];
+	/* Threads start in different parts of the cold pool */
+	size_t cold_off = round_down(COLD_POOL_SIZE / p->threads * bt->index,
+				     SZ_4K);
+	u64 check_calls = max_t(u64, 1, TIME_CHECK_BYTES / (p->size * p->batch));
+	u64 start, deadline;
+
+	/* Throughput */
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	deadline = start + duration_ns;
+	do {
+		u64 i;
+
+		for (i = 0; i < check_calls; i++)
+			p->impl->run(p->impl->impl, next_input(bt, &cold_off),
+				     p->size, p->batch, out);
+		bt->calls += check_calls;
+	} while (now_ns() < deadline);
+
+	/* Latency of single calls */
+	pthread_barrier_wait(&barrier);
+	deadline = now_ns() + duration_ns;
+	do {
+		const u8 *buf = next_input(bt, &cold_off);
+
+		start = now_ns();
+		p->impl->run(p->impl->impl, buf, p->size, p->batch, out);
+		bt->samples[bt->nr_samples++] = now_ns() - start;
+	} while (bt->nr_samples < MAX_SAMPLES && now_ns() < deadline);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const u64 *x = a;
+	const u64 *y = b;
+
+	if (*x < *y)
+		return -1;
+	return *x > *y;
+}
+
+static void print_result(struct format_ctx *fctx,
+			 const struct bench_params *p, u64 calls,
+			 double bytes_per_sec, u64 *samples, u64 nr)
+{
+	u64 p50 = samples[nr * 50 / 100];
+	u64 p90 = samples[nr * 90 / 100];
+	u64 p99 = samples[nr * 99 / 100];
+	u64 max = samples[nr - 1];
+	const char *cache = p->cold ? "cold" : "hot";
+
+	if (bconf.output_format != CMD_FORMAT_JSON) {
+		printf("%-8s %-8s %8zu %5d %7d %-5s %9.3f %10llu %10llu %10llu %10llu\n",
+		       p->impl->csum, p->impl->name, p->size, p->batch,
+		       p->threads, cache, bytes_per_sec / 1000000000.0,
+		       p50, p90, p99, max);
+		return;
 	}
 
-	crc32c_optimization_init();
-	memset(buf, 0, 4096);
+	fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+	fmt_print(fctx, "csum", p->impl->csum);
+	fmt_print(fctx, "impl", p->impl->name);
+	fmt_print(fctx, "size", p->size);
+	fmt_print(fctx, "batch", p->batch);
+	fmt_print(fctx, "threads", p->threads);
+	fmt_print(fctx, "cache", cache);
+	fmt_print(fctx, "calls", calls);
+	fmt_print(fctx, "bytes-per-sec", bytes_per_sec);
+	fmt_print(fctx, "latency-ns");
+	fmt_print(fctx, "p50", p50);
+	fmt_print(fctx, "p90", p90);
+	fmt_print(fctx, "p99", p99);
+	fmt_print(fctx, "max", max);
+	fmt_print_end_group(fctx, "latency-ns");
+	fmt_print_end_group(fctx, NULL);
+}
 
-	printf("Block size:     %d\n", blocksize);
-	printf("Iterations:     %d\n", iterations);
-	printf("Implementation: %s\n", CRYPTOPROVIDER);
-	printf("\n");
+static int run_bench(struct format_ctx *fctx, const struct bench_params *p)
+{
+	struct bench_thread *bt;
+	size_t len = p->size * p->batch;
+	u64 *samples = NULL;
+	u64 nr = 0;
+	u64 calls = 0;
+	u64 start, end;
+	u8 out[MAX_BATCH * CRYPTO_HASH_SIZE_MAX];
+	int ret = -ENOMEM;
+	int i;
 
-	for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
-		struct contestant *c = &contestants[idx];
-		u64 start, end;
+	/* Skip implementations not supported by the CPU */
+	if (p->impl->run(p->impl->impl, cold_pool, p->size, 1, out))
+		return 0;
 
-		printf("% 12s: ", c->name);
-		fflush(stdout);
+	bt = calloc(p->threads, sizeof(*bt));
+	if (!bt)
+		return -ENOMEM;
+	for (i = 0; i < p->threads; i++) {
+		bt[i].params = p;
+		bt[i].index = i;
+		bt[i].hot = malloc(len);
+		bt[i].samples = malloc(MAX_SAMPLES * sizeof(u64));
+		if (!bt[i].hot || !bt[i].samples)
+			goto out;
+		memcpy(bt[i].hot, cold_pool, len);
+	}
 
-		start = read_tsc();
-		for (iter = 0; iter < iterations; iter++) {
-			memset(buf, iter & 0xFF, blocksize);
-			memset(hash, 0, 32);
-			c->digest(buf, blocksize, hash);
+	pthread_barrier_init(&barrier, NULL, p->threads + 1);
+	for (i = 0; i < p->threads; i++) {
+		ret = pthread_create(&bt[i].thread, NULL, bench_thread_fn, &bt[i]);
+		if (ret) {
+			/* Threads already waiting at the barrier can't be stopped */
+			error("cannot start benchmark thread: %s", strerror(ret));
+			exit(1);
 		}
-		end = read_tsc();
-		c->cycles = end - start;
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	end = now_ns();
+	for (i = 0; i < p->threads; i++)
+		pthread_join(bt[i].thread, NULL);
+	pthread_barrier_destroy(&barrier);
 
-		printf("cycles: % 12llu, c/i % 8llu\n",
-				(unsigned long long)c->cycles,
-				(unsigned long long)c->cycles / iterations);
+	samples = malloc(p->threads * MAX_SAMPLES * sizeof(u64));
+	if (!samples)
+		goto out;
+	for (i = 0; i < p->threads; i++) {
+		calls += bt[i].calls;
+		memcpy(samples + nr, bt[i].samples, bt[i].nr_samples * sizeof(u64));
+		nr += bt[i].nr_samples;
 	}
+	qsort(samples, nr, sizeof(u64), cmp_u64);
 
-	return 0;
+	/* The throughput phase ends when the slowest thread reaches the barrier */
+	print_result(fctx, p, calls,
+		     (double)calls * len * 1000000000.0 / (end - start),
+		     samples, nr);
+	ret = 0;
+out:
+	for (i = 0; i < p->threads; i++) {
+		free(bt[i].hot);
+		free(bt[i].samples);
+	}
+	free(bt);
+	free(samples);
+	return ret;
+}
+
+static void print_usage(void)
+{
+	printf("usage: hash-speedtest [options]\n");
+	printf("\t-c|--csum TYPE       only this checksum type: crc32c, xxhash, sha256, blake2b\n");
+	printf("\t-s|--size SIZE       only this buffer size (default: 512 to 1M)\n");
+	printf("\t-b|--batch N         buffers hashed per call (default: 1 and 16)\n");
+	printf("\t-t|--threads N       threads of the parallel runs (default: number of CPUs)\n");
+	printf("\t-d|--duration MS     time of each measurement (default: 100)\n");
+	printf("\t--cache hot|cold     only hot or cold inputs (default: both)\n");
+	printf("\t--format text|json   output format\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct format_ctx fctx;
+	const char *csum = NULL;
+	const char *cache = NULL;
+	size_t size = 0;
+	int batch = 0;
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus;
+	int nr_threads[2];
+	int nr_thread_runs;
+	int i, b, t, c, s;
+	int ret = 0;
+
+	btrfs_config_init();
+	while (1) {
+		enum { GETOPT_VAL_CACHE = 256, GETOPT_VAL_FORMAT };
+		static const struct option long_options[] = {
+			{ "csum", required_argument, NULL, 'c' },
+			{ "size", required_argument, NULL, 's' },
+			{ "batch", required_argument, NULL, 'b' },
+			{ "threads", required_argument, NULL, 't' },
+			{ "duration", required_argument, NULL, 'd' },
+			{ "cache", required_argument, NULL, GETOPT_VAL_CACHE },
+			{ "format", required_argument, NULL, GETOPT_VAL_FORMAT },
+			{ "help", no_argument, NULL, 'h' },
+			{ NULL, 0, NULL, 0 }
+		};
+		int opt = getopt_long(argc, argv, "c:s:b:t:d:h", long_options, NULL);
+
+		if (opt < 0)
+			break;
+		switch (opt) {
+		case 'c':
+			csum = optarg;
+			break;
+		case 's':
+			size = parse_size_from_string(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > MAX_BATCH) {
+				error("batch must be 1 to %d", MAX_BATCH);
+				return 1;
+			}
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			duration_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case GETOPT_VAL_CACHE:
+			cache = optarg;
+			if (strcmp(cache, "hot") && strcmp(cache, "cold")) {
+				error("unknown cache mode: %s", cache);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_FORMAT:
+			if (strcmp(optarg, "json") == 0) {
+				bconf.output_format = CMD_FORMAT_JSON;
+			} else if (strcmp(optarg, "text")) {
+				error("unknown output format: %s", optarg);
+				return 1;
+			}
+			break;
+		default:
+			print_usage();
+		}
+	}
+	if (optind != argc || threads < 1 || !duration_ns ||
+	    (size && size * MAX_BATCH > COLD_POOL_SIZE))
+		print_usage();
+
+	hash_init_accel();
+
+	/* Random contents, the time of the hashes doesn't depend on it */
+	cold_pool = malloc(COLD_POOL_SIZE);
+	if (!cold_pool) {
+		error("not enough memory for the input pool");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < COLD_POOL_SIZE; i += sizeof(u32))
+		*(u32 *)(cold_pool + i) = rand();
+
+	nr_threads[0] = 1;
+	nr_threads[1] = threads;
+	nr_thread_runs = threads > 1 ? 2 : 1;
+
+	fmt_start(&fctx, bench_rowspec, 16, 0);
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print(&fctx, "provider", CRYPTOPROVIDER);
+		fmt_print(&fctx, "cpus", cpus);
+		fmt_print(&fctx, "duration-ms", duration_ns / 1000000ULL);
+		fmt_print_start_group(&fctx, "results", JSON_TYPE_ARRAY);
+	} else {
+		printf("Implementation: %s, CPUs: %d, %llu ms per measurement\n\n",
+		       CRYPTOPROVIDER, cpus, duration_ns / 1000000ULL);
+		printf("%-8s %-8s %8s %5s %7s %-5s %9s %10s %10s %10s %10s\n",
+		       "csum", "impl", "size", "batch", "threads", "cache",
+		       "GB/s", "p50 ns", "p90 ns", "p99 ns", "max ns");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(impls); i++) {
+		if (csum && strcmp(csum, impls[i].csum))
+			continue;
+		for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+			if (size && s > 0)
+				break;
+			for (b = 0; b < ARRAY_SIZE(batches); b++) {
+				if (batch && b > 0)
+					break;
+				for (t = 0; t < nr_thread_runs; t++) {
+					for (c = 0; c < 2; c++) {
+						struct bench_params p = {
+							.impl = &impls[i],
+							.size = size ?: sizes[s],
+							.batch = batch ?: batches[b],
+							.threads = nr_threads[t],
+							.cold = c,
+						};
+
+						if (cache && strcmp(cache, c ? "cold" : "hot"))
+							continue;
+						ret = run_bench(&fctx, &p);
+						if (ret < 0) {
+							error("not enough memory");
+							goto out;
+						}
+					}
+				}
+			}
+		}
+	}
+
+out:
+	if (bconf.output_format == CMD_FORMAT_JSON)
+		fmt_print_end_group(&fctx, "results");
+	fmt_end(&fctx);
+	free(cold_pool);
+
+	return !!ret;
 }
@@ -0,0 +1,252 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Verify the implementations of the checksum algorithms: the reference code
+ * against known digests, and each accelerated version available on this CPU
+ * against the reference code on pseudo-random buffers of various lengths and
+ * batch sizes.
+ *
+ * Usage: ./hash-vectest, exit status is 0 if all tests pass
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kerncompat.h"
+#include "crypto/hash.h"
+#include "crypto/crc32c.h"
+#include "kernel-lib/sizes.h"
+#include "common/internal.h"
+
+struct known_digest {
+	const char *input;
+	const char *sha256;
+	const char *blake2b;
+};
+
+static const struct known_digest known[] = {
+	{
+		.input = "",
+		.sha256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+		.blake2b = "0e5751c026e543b2e8ab2eb06099daa1d1e5df47778f7787faab45cdf12fe3a8",
+	}, {
+		.input = "abc",
+		.sha256 = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+		.blake2b = "bddd813c634239723171ef3fee98579b94964e3bb1cb3e427262c8c068d52319",
+	}, {
+		.input = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		.sha256 = "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+	},
+};
+
+struct impl_desc {
+	const char *name;
+	int impl;
+};
+
+/*
+ * Only the implementations built for each algorithm are listed, the reference
+ * code first. An accelerated one may still be missing on this CPU.
+ */
+static const struct impl_desc sha256_impls[] = {
+	{ "REF", HASH_IMPL_REF },
+#if CRYPTOPROVIDER_BUILTIN == 1 && defined(__x86_64__)
+	{ "SHA-NI", HASH_IMPL_SHA_NI },
+	{ "AVX2-MB", HASH_IMPL_AVX2_MULTI },
+#endif
+};
+
+static const struct impl_desc blake2b_impls[] = {
+	{ "REF", HASH_IMPL_REF },
+#if CRYPTOPROVIDER_BUILTIN == 1 && defined(__x86_64__)
+	{ "AVX2", HASH_IMPL_AVX2 },
+	{ "AVX2-MB", HASH_IMPL_AVX2_MULTI },
+#endif
+};
+
+static const struct impl_desc crc32c_impls[] = {
+	{ "TABLE", CRC32C_IMPL_TABLE },
+#ifdef __x86_64__
+	{ "INTEL", CRC32C_IMPL_INTEL },
+	{ "PCLMUL", CRC32C_IMPL_PCLMUL },
+#endif
+};
+
+struct hash_algo {
+	const char *name;
+	const struct impl_desc *impls;
+	int nr_impls;
+};
+
+static const struct hash_algo sha256 = {
+	"SHA256", sha256_impls, ARRAY_SIZE(sha256_impls)
+};
+
+static const struct hash_algo blake2b = {
+	"BLAKE2b", blake2b_impls, ARRAY_SIZE(blake2b_impls)
+};
+
+/* Lengths around the block boundaries and the usual sector sizes */
+static const size_t lengths[] = {
+	0, 1, 3, 31, 55, 56, 63, 64, 65, 111, 112, 119, 120, 127, 128, 129,
+	255, 256, 257, 1000, SZ_4K, SZ_4K + 1, SZ_16K, SZ_64K,
+};
+
+/* Batch sizes, including partial groups of the multi-buffer code */
+static const int batches[] = { 1, 2, 3, 7, 8, 9, 16, 17 };
+
+#define MAX_BATCH	17
+
+static int failures;
+
+static int hash_impl(const struct hash_algo *algo, int impl, const u8 *buf,
+		     size_t length, int nr, u8 *out)
+{
+	if (algo == &sha256)
+		return hash_sha256_impl(impl, buf, length, nr, out,
+					CRYPTO_HASH_SIZE_MAX);
+	return hash_blake2b_impl(impl, buf, length, nr, out,
+				 CRYPTO_HASH_SIZE_MAX);
+}
+
+static void hex_digest(const u8 *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < CRYPTO_HASH_SIZE_MAX; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void test_known(const struct hash_algo *algo)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(known); i++) {
+		const char *expected = algo == &sha256 ?
+				       known[i].sha256 : known[i].blake2b;
+		u8 digest[CRYPTO_HASH_SIZE_MAX];
+		char hex[2 * CRYPTO_HASH_SIZE_MAX + 1];
+
+		if (!expected)
+			continue;
+		for (j = 0; j < algo->nr_impls; j++) {
+			if (hash_impl(algo, algo->impls[j].impl,
+				      (const u8 *)known[i].input,
+				      strlen(known[i].input), 1, digest))
+				continue;
+			hex_digest(digest, hex);
+			if (strcmp(hex, expected)) {
+				fprintf(stderr, "%s %s: digest of \"%s\" is %s, expected %s\n",
+					algo->name, algo->impls[j].name,
+					known[i].input, hex, expected);
+				failures++;
+			}
+		}
+	}
+}
+
+static void test_random(const struct hash_algo *algo, const u8 *buf)
+{
+	static u8 ref[MAX_BATCH * CRYPTO_HASH_SIZE_MAX];
+	static u8 out[MAX_BATCH * CRYPTO_HASH_SIZE_MAX];
+	int i, j, k;
+
+	for (j = 1; j < algo->nr_impls; j++) {
+		int tested = 0;
+
+		for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+			for (k = 0; k < ARRAY_SIZE(batches); k++) {
+				int nr = batches[k];
+
+				hash_impl(algo, HASH_IMPL_REF, buf, lengths[i],
+					  nr, ref);
+				memset(out, 0, sizeof(out));
+				if (hash_impl(algo, algo->impls[j].impl, buf,
+					      lengths[i], nr, out))
+					break;
+				tested++;
+				if (memcmp(ref, out, nr * CRYPTO_HASH_SIZE_MAX)) {
+					fprintf(stderr,
+				"%s %s: mismatch for length %zu batch %d\n",
+						algo->name, algo->impls[j].name,
+						lengths[i], nr);
+					failures++;
+				}
+			}
+		}
+		printf("%-8s %-8s %s\n", algo->name, algo->impls[j].name,
+		       tested ? "tested" : "not available");
+	}
+}
+
+static void test_crc32c(const u8 *buf)
+{
+	int i, j;
+
+	for (j = 1; j < ARRAY_SIZE(crc32c_impls); j++) {
+		int tested = 0;
+
+		for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+			u32 ref = ~0;
+			u32 crc = ~0;
+
+			crc32c_le_impl(CRC32C_IMPL_TABLE, &ref, buf, lengths[i]);
+			if (crc32c_le_impl(crc32c_impls[j].impl, &crc, buf,
+					   lengths[i]))
+				break;
+			tested++;
+			if (crc != ref) {
+				fprintf(stderr,
+					"CRC32C %s: mismatch for length %zu\n",
+					crc32c_impls[j].name, lengths[i]);
+				failures++;
+			}
+		}
+		printf("%-8s %-8s %s\n", "CRC32C", crc32c_impls[j].name,
+		       tested ? "tested" : "not available");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = SZ_64K * MAX_BATCH;
+	u8 *buf;
+	size_t i;
+
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "not enough memory\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < size; i++)
+		buf[i] = rand();
+
+	test_known(&sha256);
+	test_known(&blake2b);
+	test_random(&sha256, buf);
+	test_random(&blake2b, buf);
+	test_crc32c(buf);
+
+	free(buf);
+	if (failures) {
+		fprintf(stderr, "%d tests failed\n", failures);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
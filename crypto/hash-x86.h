@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef CRYPTO_HASH_X86_H
+#define CRYPTO_HASH_X86_H
+
+#include "../kerncompat.h"
+
+/*
+ * Accelerated versions of the builtin SHA256 and BLAKE2b-256, producing the
+ * same digests as the reference code. The caller must check the CPU features
+ * first, see hash_init_accel().
+ */
+
+/* SHA256 using the SHA extensions (SHA-NI) */
+int sha256_ni(const u8 *buf, size_t length, u8 *out);
+
+/*
+ * SHA256 of @nr consecutive blocks of @length bytes, 8 blocks at a time in
+ * the lanes of AVX2 registers. Digests are stored @stride bytes apart.
+ */
+int sha256_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride);
+
+/* BLAKE2b with 32 byte digest, rows of the state in AVX2 registers */
+int blake2b_avx2(const u8 *buf, size_t length, u8 *out);
+
+/* BLAKE2b with 32 byte digest of @nr blocks, 4 at a time */
+int blake2b_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride);
+
+#endif
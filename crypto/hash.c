@@ -1,8 +1,10 @@
+#include <stdbool.h>
 #include "crypto/hash.h"
 #include "crypto/crc32c.h"
 #include "crypto/xxhash.h"
 #include "crypto/sha.h"
 #include "crypto/blake2.h"
+#include "crypto/hash-x86.h"
 
 /*
  * Default builtin implementations
@@ -32,7 +34,7 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out)
  */
 #if CRYPTOPROVIDER_BUILTIN == 1
 
-int hash_sha256(const u8 *buf, size_t len, u8 *out)
+static int sha256_ref(const u8 *buf, size_t len, u8 *out)
 {
 	SHA256Context context;
 
@@ -43,7 +45,7 @@ int hash_sha256(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
-int hash_blake2b(const u8 *buf, size_t len, u8 *out)
+static int blake2b_ref(const u8 *buf, size_t len, u8 *out)
 {
 	blake2b_state S;
 
@@ -54,6 +56,91 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
+/*
+ * The accelerated versions are selected by hash_init_accel() according to
+ * the CPU features. For SHA256, SHA-NI is faster than the AVX2 multi-buffer
+ * code, which is used only for batches when the SHA extensions are missing.
+ * For BLAKE2b, the multi-buffer code is used for batches, the single buffer
+ * AVX2 code otherwise.
+ */
+static bool sha256_ni_available;
+static bool sha256_avx2_available;
+static bool blake2b_avx2_available;
+
+static int (*sha256_function)(const u8 *buf, size_t len, u8 *out) = sha256_ref;
+static int (*blake2b_function)(const u8 *buf, size_t len, u8 *out) = blake2b_ref;
+static bool sha256_multi_avx2;
+static bool blake2b_multi_avx2;
+
+#ifdef __x86_64__
+
+#include <cpuid.h>
+
+static u64 read_xcr0(void)
+{
+	u32 eax, edx;
+
+	asm volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((u64)edx << 32) | eax;
+}
+
+static void hash_probe_cpu(void)
+{
+	static bool probed;
+	unsigned int eax, ebx, ecx, edx;
+	bool ssse3, sse41, avx2 = false, sha = false;
+
+	if (probed)
+		return;
+	probed = true;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+	ssse3 = ecx & bit_SSSE3;
+	sse41 = ecx & bit_SSE4_1;
+	/* The OS must save the YMM registers, bits 1 and 2 of XCR0 */
+	if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX) &&
+	    (read_xcr0() & 0x6) == 0x6 &&
+	    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		avx2 = ebx & bit_AVX2;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		sha = ebx & bit_SHA;
+
+	sha256_ni_available = sha && ssse3 && sse41;
+	sha256_avx2_available = avx2;
+	blake2b_avx2_available = avx2;
+}
+
+#else
+
+static void hash_probe_cpu(void)
+{
+}
+
+#endif
+
+int hash_sha256(const u8 *buf, size_t len, u8 *out)
+{
+	return sha256_function(buf, len, out);
+}
+
+int hash_blake2b(const u8 *buf, size_t len, u8 *out)
+{
+	return blake2b_function(buf, len, out);
+}
+
+static void hash_select_accel(void)
+{
+	hash_probe_cpu();
+	if (sha256_ni_available)
+		sha256_function = sha256_ni;
+	else if (sha256_avx2_available)
+		sha256_multi_avx2 = true;
+	if (blake2b_avx2_available) {
+		blake2b_function = blake2b_avx2;
+		blake2b_multi_avx2 = true;
+	}
+}
+
 #endif
 
 #if CRYPTOPROVIDER_LIBGCRYPT == 1
@@ -137,3 +224,151 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 }
 
 #endif
+
+/*
+ * Hash @nr consecutive blocks of @length bytes at @buf, the digests are
+ * stored @stride bytes apart at @out, e.g. in the layout of a csum item.
+ * Hashes without a multi-buffer implementation do one block at a time.
+ */
+static int hash_blocks(int (*hash)(const u8 *buf, size_t length, u8 *out),
+		       const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		ret = hash(buf + i * length, length, out + i * stride);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+int hash_crc32c_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	return hash_blocks(hash_crc32c, buf, length, nr, out, stride);
+}
+
+int hash_xxhash_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	return hash_blocks(hash_xxhash, buf, length, nr, out, stride);
+}
+
+#if CRYPTOPROVIDER_BUILTIN == 1
+
+/*
+ * Below these numbers of blocks the unused lanes of the AVX2 multi-buffer code
+ * cost more than hashing the blocks one by one
+ */
+#define SHA256_AVX2_MIN_BLOCKS		(2)
+#define BLAKE2B_AVX2_MIN_BLOCKS		(2)
+
+int hash_sha256_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	if (sha256_multi_avx2 && nr >= SHA256_AVX2_MIN_BLOCKS)
+		return sha256_avx2_multi(buf, length, nr, out, stride);
+	return hash_blocks(hash_sha256, buf, length, nr, out, stride);
+}
+
+int hash_blake2b_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride)
+{
+	if (blake2b_multi_avx2 && nr >= BLAKE2B_AVX2_MIN_BLOCKS)
+		return blake2b_avx2_multi(buf, length, nr, out, stride);
+	return hash_blocks(hash_blake2b, buf, length, nr, out, stride);
+}
+
+/*
+ * Run the given implementation, for tests and benchmarks. Return -1 if it's
+ * not available on this CPU.
+ */
+int hash_sha256_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		     int nr, u8 *out, size_t stride)
+{
+	hash_probe_cpu();
+	switch (impl) {
+	case HASH_IMPL_REF:
+		return hash_blocks(sha256_ref, buf, length, nr, out, stride);
+	case HASH_IMPL_SHA_NI:
+		if (!sha256_ni_available)
+			return -1;
+		return hash_blocks(sha256_ni, buf, length, nr, out, stride);
+	case HASH_IMPL_AVX2_MULTI:
+		if (!sha256_avx2_available)
+			return -1;
+		return sha256_avx2_multi(buf, length, nr, out, stride);
+	default:
+		return -1;
+	}
+}
+
+int hash_blake2b_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		      int nr, u8 *out, size_t stride)
+{
+	hash_probe_cpu();
+	switch (impl) {
+	case HASH_IMPL_REF:
+		return hash_blocks(blake2b_ref, buf, length, nr, out, stride);
+	case HASH_IMPL_AVX2:
+		if (!blake2b_avx2_available)
+			return -1;
+		return hash_blocks(blake2b_avx2, buf, length, nr, out, stride);
+	case HASH_IMPL_AVX2_MULTI:
+		if (!blake2b_avx2_available)
+			return -1;
+		return blake2b_avx2_multi(buf, length, nr, out, stride);
+	default:
+		return -1;
+	}
+}
+
+#else
+
+static void hash_select_accel(void)
+{
+}
+
+int hash_sha256_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	return hash_blocks(hash_sha256, buf, length, nr, out, stride);
+}
+
+int hash_blake2b_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride)
+{
+	return hash_blocks(hash_blake2b, buf, length, nr, out, stride);
+}
+
+/* The external library is the only implementation */
+int hash_sha256_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		     int nr, u8 *out, size_t stride)
+{
+	if (impl != HASH_IMPL_REF)
+		return -1;
+	return hash_blocks(hash_sha256, buf, length, nr, out, stride);
+}
+
+int hash_blake2b_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		      int nr, u8 *out, size_t stride)
+{
+	if (impl != HASH_IMPL_REF)
+		return -1;
+	return hash_blocks(hash_blake2b, buf, length, nr, out, stride);
+}
+
+#endif
+
+/*
+ * Select the fastest implementations the CPU supports, the portable code is
+ * used until this is called
+ */
+void hash_init_accel(void)
+{
+	crc32c_optimization_init();
+	hash_select_accel();
+}
@@ -10,4 +10,32 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out);
 int hash_sha256(const u8 *buf, size_t length, u8 *out);
 int hash_blake2b(const u8 *buf, size_t length, u8 *out);
 
+int hash_crc32c_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride);
+int hash_xxhash_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride);
+int hash_sha256_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride);
+int hash_blake2b_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		       size_t stride);
+
+/* Implementations of SHA256 and BLAKE2b selectable for tests and benchmarks */
+enum hash_impl {
+	/* Portable code, or the external library if configured */
+	HASH_IMPL_REF,
+	/* SHA256 with the SHA extensions */
+	HASH_IMPL_SHA_NI,
+	/* BLAKE2b with the state rows in AVX2 registers */
+	HASH_IMPL_AVX2,
+	/* Several blocks at once in the AVX2 lanes, 8 for SHA256, 4 for BLAKE2b */
+	HASH_IMPL_AVX2_MULTI,
+};
+
+int hash_sha256_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		     int nr, u8 *out, size_t stride);
+int hash_blake2b_impl(enum hash_impl impl, const u8 *buf, size_t length,
+		      int nr, u8 *out, size_t stride);
+
+void hash_init_accel(void);
+
 #endif
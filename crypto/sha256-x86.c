@@ -0,0 +1,291 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * SHA256 (FIPS 180-4) for x86_64: a single buffer version using the SHA
+ * extensions and a multi-buffer version hashing 8 messages of the same length
+ * in the 32bit lanes of AVX2 registers, for CPUs without the extensions.
+ */
+
+#include "kerncompat.h"
+#include <string.h>
+#include "crypto/hash-x86.h"
+#include "common/internal.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+#define SHA256_BLOCK_SIZE	(64)
+#define SHA256_AVX2_LANES	(8)
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const u32 sha256_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline u32 load_be32(const u8 *p)
+{
+	u32 val;
+
+	memcpy(&val, p, sizeof(val));
+	return __builtin_bswap32(val);
+}
+
+static inline void store_be32(u32 val, u8 *p)
+{
+	val = __builtin_bswap32(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+/*
+ * Copy the partial last block of a message of @length bytes to @tail and
+ * append the padding and the length. Return the number of blocks, 1 or 2.
+ */
+static int sha256_pad(const u8 *buf, size_t length, u8 tail[2 * SHA256_BLOCK_SIZE])
+{
+	size_t rem = length % SHA256_BLOCK_SIZE;
+	int blocks = rem < SHA256_BLOCK_SIZE - 8 ? 1 : 2;
+	u64 bits = __builtin_bswap64((u64)length << 3);
+
+	memcpy(tail, buf + length - rem, rem);
+	tail[rem] = 0x80;
+	memset(tail + rem + 1, 0, blocks * SHA256_BLOCK_SIZE - rem - 1 - 8);
+	memcpy(tail + blocks * SHA256_BLOCK_SIZE - 8, &bits, sizeof(bits));
+	return blocks;
+}
+
+/*
+ * Process @blocks blocks at @data with the SHA extensions. The state is kept
+ * in the ABEF/CDGH order the sha256rnds2 instruction works on.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_ni_blocks(u32 state[8], const u8 *data, size_t blocks)
+{
+	const __m128i bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+						  0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg;
+	__m128i abef_save, cdgh_save;
+	__m128i w[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			/* Four rounds per iteration, w[] holds the last 16 words */
+			if (i < 4) {
+				w[i] = _mm_loadu_si128((const __m128i *)(data + i * 16));
+				w[i] = _mm_shuffle_epi8(w[i], bswap_mask);
+			} else {
+				tmp = _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4);
+				w[i & 3] = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				w[i & 3] = _mm_add_epi32(w[i & 3], tmp);
+				w[i & 3] = _mm_sha256msg2_epu32(w[i & 3], w[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3],
+				_mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+int sha256_ni(const u8 *buf, size_t length, u8 *out)
+{
+	u8 tail[2 * SHA256_BLOCK_SIZE];
+	u32 state[8];
+	int blocks;
+	int i;
+
+	memcpy(state, sha256_h0, sizeof(state));
+	sha256_ni_blocks(state, buf, length / SHA256_BLOCK_SIZE);
+	blocks = sha256_pad(buf, length, tail);
+	sha256_ni_blocks(state, tail, blocks);
+	for (i = 0; i < 8; i++)
+		store_be32(state[i], out + i * 4);
+
+	return 0;
+}
+
+#define ROTR32(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)),	\
+					_mm256_slli_epi32((x), 32 - (n)))
+#define XOR3(a, b, c)	_mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+#define ADD3(a, b, c)	_mm256_add_epi32(_mm256_add_epi32((a), (b)), (c))
+
+/*
+ * Process @blocks blocks of each of the 8 messages at @p, the state word i
+ * of message j is in lane j of @state[i]
+ */
+__attribute__((target("avx2")))
+static void sha256_avx2_blocks(__m256i state[8], const u8 *p[SHA256_AVX2_LANES],
+			       size_t blocks)
+{
+	size_t off;
+
+	for (off = 0; off < blocks * SHA256_BLOCK_SIZE; off += SHA256_BLOCK_SIZE) {
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+		__m256i w[16];
+		__m256i t1, t2;
+		int t;
+
+		for (t = 0; t < 16; t++) {
+			size_t o = off + t * 4;
+
+			w[t] = _mm256_set_epi32(load_be32(p[7] + o), load_be32(p[6] + o),
+						load_be32(p[5] + o), load_be32(p[4] + o),
+						load_be32(p[3] + o), load_be32(p[2] + o),
+						load_be32(p[1] + o), load_be32(p[0] + o));
+		}
+
+		for (t = 0; t < 64; t++) {
+			if (t >= 16) {
+				__m256i w2 = w[(t - 2) & 15];
+				__m256i w15 = w[(t - 15) & 15];
+
+				w[t & 15] = _mm256_add_epi32(
+					ADD3(w[t & 15], w[(t - 7) & 15],
+					     XOR3(ROTR32(w15, 7), ROTR32(w15, 18),
+						  _mm256_srli_epi32(w15, 3))),
+					XOR3(ROTR32(w2, 17), ROTR32(w2, 19),
+					     _mm256_srli_epi32(w2, 10)));
+			}
+			/* Ch(e, f, g) = (e & f) ^ (~e & g) */
+			t1 = _mm256_xor_si256(_mm256_and_si256(e, f),
+					      _mm256_andnot_si256(e, g));
+			t1 = ADD3(h, t1, XOR3(ROTR32(e, 6), ROTR32(e, 11),
+					      ROTR32(e, 25)));
+			t1 = ADD3(t1, w[t & 15], _mm256_set1_epi32(sha256_k[t]));
+			/* Maj(a, b, c) = (a & b) | (c & (a | b)) */
+			t2 = _mm256_or_si256(_mm256_and_si256(a, b),
+					     _mm256_and_si256(c, _mm256_or_si256(a, b)));
+			t2 = _mm256_add_epi32(t2, XOR3(ROTR32(a, 2), ROTR32(a, 13),
+						       ROTR32(a, 22)));
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32(t1, t2);
+		}
+
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+		state[5] = _mm256_add_epi32(state[5], f);
+		state[6] = _mm256_add_epi32(state[6], g);
+		state[7] = _mm256_add_epi32(state[7], h);
+	}
+}
+
+__attribute__((target("avx2")))
+int sha256_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	u8 tail[SHA256_AVX2_LANES][2 * SHA256_BLOCK_SIZE];
+	int first;
+
+	for (first = 0; first < nr; first += SHA256_AVX2_LANES) {
+		int lanes = min(nr - first, SHA256_AVX2_LANES);
+		const u8 *p[SHA256_AVX2_LANES];
+		u32 digest[8][SHA256_AVX2_LANES];
+		__m256i state[8];
+		int blocks = 0;
+		int i, j;
+
+		for (i = 0; i < 8; i++)
+			state[i] = _mm256_set1_epi32(sha256_h0[i]);
+		/* Unused lanes hash the last message again */
+		for (j = 0; j < SHA256_AVX2_LANES; j++)
+			p[j] = buf + (size_t)(first + min(j, lanes - 1)) * length;
+
+		sha256_avx2_blocks(state, p, length / SHA256_BLOCK_SIZE);
+		for (j = 0; j < SHA256_AVX2_LANES; j++) {
+			blocks = sha256_pad(p[j], length, tail[j]);
+			p[j] = tail[j];
+		}
+		sha256_avx2_blocks(state, p, blocks);
+
+		for (i = 0; i < 8; i++)
+			_mm256_storeu_si256((__m256i *)digest[i], state[i]);
+		for (j = 0; j < lanes; j++)
+			for (i = 0; i < 8; i++)
+				store_be32(digest[i][j],
+					   out + (size_t)(first + j) * stride + i * 4);
+	}
+
+	return 0;
+}
+
+#else
+
+/* Never called, hash_init_accel() finds no support on other architectures */
+int sha256_ni(const u8 *buf, size_t length, u8 *out)
+{
+	return -1;
+}
+
+int sha256_avx2_multi(const u8 *buf, size_t length, int nr, u8 *out,
+		      size_t stride)
+{
+	return -1;
+}
+
+#endif /* __x86_64__ */
@@ -29,6 +29,7 @@
 
 #include "kerncompat.h"
 #include "crypto/crc32c.h"
+#include "crypto/hash.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
@@ -41,6 +42,9 @@
 #include "image/metadump.h"
 #include "image/sanitize.h"
 #include "common/box.h"
+#include "common/memory-budget.h"
+#include "common/cache-stats.h"
+#include "common/direct-io.h"
 
 #define MAX_WORKER_THREADS	(32)
 
@@ -351,6 +355,7 @@ static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
 	struct async_work *async;
+	size_t bound;
 	int ret;
 
 	while (1) {
@@ -379,6 +384,8 @@ static void *dump_worker(void *data)
 				pthread_mutex_unlock(&md->mutex);
 				pthread_exit(NULL);
 			}
+			bound = async->bufsize;
+			memory_charge(bound);
 
 			ret = compress2(async->buffer,
 					 (unsigned long *)&async->bufsize,
@@ -388,6 +395,7 @@ static void *dump_worker(void *data)
 				async->error = 1;
 
 			free(orig);
+			memory_uncharge(async->size + bound - async->bufsize);
 		}
 
 		pthread_mutex_lock(&md->mutex);
@@ -454,7 +462,7 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	md->compress_level = compress_level;
 	md->sanitize_names = sanitize_names;
 	if (sanitize_names == SANITIZE_COLLISIONS)
-		crc32c_optimization_init();
+		hash_init_accel();
 
 	md->name_tree.rb_node = NULL;
 	md->num_threads = num_threads;
@@ -546,6 +554,7 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 			ret = 0;
 		}
 
+		memory_uncharge(async->bufsize);
 		free(async->buffer);
 		free(async);
 	}
@@ -651,7 +660,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 		if (start == BTRFS_SUPER_INFO_OFFSET) {
 			int fd = get_dev_fd(md->root);
 
-			ret = pread64(fd, async->buffer, size, start);
+			ret = btrfs_pread(fd, async->buffer, size, start);
 			if (ret < size) {
 				free(async->buffer);
 				free(async);
@@ -663,6 +672,8 @@ static int flush_pending(struct metadump_struct *md, int done)
 			ret = 0;
 		}
 
+		if (!md->data)
+			readahead_tree_block_submit(md->root->fs_info);
 		while (!md->data && size > 0) {
 			u64 this_read = min((u64)md->root->fs_info->nodesize,
 					size);
@@ -684,6 +695,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 
 		md->pending_start = (u64)-1;
 		md->pending_size = 0;
+		memory_charge(async->bufsize);
 	} else if (!done) {
 		return 0;
 	}
@@ -699,7 +711,9 @@ static int flush_pending(struct metadump_struct *md, int done)
 			md->num_ready++;
 		}
 	}
-	if (md->num_items >= ITEMS_PER_CLUSTER || done) {
+	/* Write out a partial cluster if the buffers take too much memory */
+	if (md->num_items >= ITEMS_PER_CLUSTER || done ||
+	    memory_over_budget()) {
 		ret = write_buffers(md, &start);
 		if (ret) {
 			errno = -ret;
@@ -724,7 +738,8 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root->fs_info, start, 0);
+	if (!data)
+		readahead_tree_block(md->root->fs_info, start, 0);
 	md->pending_size += size;
 	md->data = data;
 	return 0;
@@ -962,7 +977,7 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 
 static int create_metadump(const char *input, FILE *out, int num_threads,
 			   int compress_level, enum sanitize_mode sanitize,
-			   int walk_trees)
+			   int walk_trees, int cache_stats)
 {
 	struct btrfs_root *root;
 	struct btrfs_path path;
@@ -1034,6 +1049,8 @@ out:
 	metadump_destroy(&metadump, num_threads);
 
 	btrfs_release_path(&path);
+	if (cache_stats)
+		print_extent_cache_stats(root->fs_info, cache_stats);
 	ret = close_ctree(root);
 	return err ? err : ret;
 }
@@ -2836,6 +2853,8 @@ static void print_usage(int ret)
 	printf("\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
 	printf("\t-w      \twalk all trees instead of using extent tree, do this if your extent tree is broken\n");
 	printf("\t-m	   \trestore for multiple devices\n");
+	printf("\t--cache-stats[=text|json]\n");
+	printf("\t        \tprint statistics of the tree block cache at the end of dump\n");
 	printf("\n");
 	printf("\tIn the dump mode, source is the btrfs device and target is the output file (use '-' for stdout).\n");
 	printf("\tIn the restore mode, source is the dumped image and target is the btrfs device/file.\n");
@@ -2856,11 +2875,15 @@ int BOX_MAIN(image)(int argc, char *argv[])
 	enum sanitize_mode sanitize = SANITIZE_NONE;
 	int dev_cnt = 0;
 	int usage_error = 0;
+	int cache_stats = 0;
 	FILE *out;
 
 	while (1) {
+		enum { GETOPT_VAL_CACHE_STATS = 256 };
 		static const struct option long_options[] = {
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
+			{ "cache-stats", optional_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "rc:t:oswm", long_options, NULL);
@@ -2903,6 +2926,13 @@ int BOX_MAIN(image)(int argc, char *argv[])
 			create = 0;
 			multi_devices = 1;
 			break;
+		case GETOPT_VAL_CACHE_STATS:
+			cache_stats = parse_cache_stats_format(optarg);
+			if (cache_stats < 0) {
+				error("unknown cache stats format: %s", optarg);
+				return 1;
+			}
+			break;
 		case GETOPT_VAL_HELP:
 		default:
 			print_usage(c != GETOPT_VAL_HELP);
@@ -2921,10 +2951,15 @@ int BOX_MAIN(image)(int argc, char *argv[])
 			"create and restore cannot be used at the same time");
 			usage_error++;
 		}
+		if (cache_stats && !strcmp(argv[optind + 1], "-")) {
+			error("--cache-stats cannot be used with output to stdout");
+			usage_error++;
+		}
 	} else {
-		if (walk_trees || sanitize != SANITIZE_NONE || compress_level) {
+		if (walk_trees || sanitize != SANITIZE_NONE || compress_level ||
+		    cache_stats) {
 			error(
-			"using -w, -s, -c options for restore makes no sense");
+		"using -w, -s, -c, --cache-stats options for restore makes no sense");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -2977,7 +3012,8 @@ int BOX_MAIN(image)(int argc, char *argv[])
 		}
 
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees);
+				      compress_level, sanitize, walk_trees,
+				      cache_stats);
 	} else {
 		ret = restore_metadump(source, out, old_restore, num_threads,
 				       0, target, multi_devices);
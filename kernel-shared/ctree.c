@@ -726,6 +726,37 @@ static int noinline check_block(struct btrfs_fs_info *fs_info,
 	return -EIO;
 }
 
+/*
+ * Compare a key stored in an extent buffer to @key, reading the fields in
+ * place instead of converting the whole key to a temporary first. Keys in
+ * one block mostly differ in the objectid, so the other fields are often
+ * not read at all.
+ */
+static inline int comp_disk_key_in_place(const struct btrfs_disk_key *disk,
+					 const struct btrfs_key *key)
+{
+	u64 objectid = btrfs_disk_key_objectid(disk);
+	u64 offset;
+	u8 type;
+
+	if (objectid != key->objectid)
+		return objectid < key->objectid ? -1 : 1;
+	type = btrfs_disk_key_type(disk);
+	if (type != key->type)
+		return type < key->type ? -1 : 1;
+	offset = btrfs_disk_key_offset(disk);
+	if (offset != key->offset)
+		return offset < key->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Number of remaining slots below which generic_bin_search() switches from
+ * halving the range to a linear scan. The keys are then within a few cache
+ * lines and the scan has no unpredictable branches until the end.
+ */
+#define BIN_SEARCH_LINEAR_SLOTS		8
+
 /*
  * search for key in the extent_buffer.  The items start at offset p,
  * and they are item_size apart.  There are 'max' items in p.
@@ -740,20 +771,25 @@ static int generic_bin_search(struct extent_buffer *eb, unsigned long p,
 			      int item_size, const struct btrfs_key *key,
 			      int max, int *slot)
 {
+	const char *base = eb->data + p;
 	int low = 0;
 	int high = max;
 	int mid;
 	int ret;
-	unsigned long offset;
-	struct btrfs_disk_key *tmp;
 
-	while(low < high) {
-		mid = (low + high) / 2;
-		offset = p + mid * item_size;
+	while (high - low > BIN_SEARCH_LINEAR_SLOTS) {
+		mid = low + (high - low) / 2;
 
-		tmp = (struct btrfs_disk_key *)(eb->data + offset);
-		ret = btrfs_comp_keys(tmp, key);
+		/*
+		 * The next probe is in one of the two halves, start loading
+		 * both while this one is compared.
+		 */
+		__builtin_prefetch(base + (low + (mid - low) / 2) * item_size);
+		__builtin_prefetch(base + (mid + (high - mid) / 2) * item_size);
 
+		ret = comp_disk_key_in_place(
+			(const struct btrfs_disk_key *)(base + mid * item_size),
+			key);
 		if (ret < 0)
 			low = mid + 1;
 		else if (ret > 0)
@@ -763,6 +799,17 @@ static int generic_bin_search(struct extent_buffer *eb, unsigned long p,
 			return 0;
 		}
 	}
+
+	/* Few slots left, the first key not smaller than @key is the result */
+	for (; low < high; low++) {
+		ret = comp_disk_key_in_place(
+			(const struct btrfs_disk_key *)(base + low * item_size),
+			key);
+		if (ret >= 0) {
+			*slot = low;
+			return ret == 0 ? 0 : 1;
+		}
+	}
 	*slot = low;
 	return 1;
 }
@@ -1203,6 +1250,7 @@ void reada_for_search(struct btrfs_fs_info *fs_info, struct btrfs_path *path,
 		if (search > highest_read)
 			highest_read = search;
 	}
+	readahead_tree_block_submit(fs_info);
 }
 
 int btrfs_find_item(struct btrfs_root *fs_root, struct btrfs_path *found_path,
@@ -2710,18 +2758,16 @@ int btrfs_extend_item(struct btrfs_root *root, struct btrfs_path *path,
 }
 
 /*
- * Given a key and some data, insert an item into the tree.
- * This does all the path init required, making room in the tree if needed.
+ * Make room for @nr items at the slot of @path in its leaf, which must have
+ * enough free space, and set up their keys and sizes.
  */
-int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
-			    struct btrfs_root *root,
-			    struct btrfs_path *path,
-			    struct btrfs_key *cpu_key, u32 *data_size,
-			    int nr)
+static void setup_items_for_insert(struct btrfs_root *root,
+				   struct btrfs_path *path,
+				   const struct btrfs_key *cpu_key,
+				   const u32 *data_size, int nr)
 {
 	struct extent_buffer *leaf;
 	struct btrfs_item *item;
-	int ret = 0;
 	int slot;
 	int i;
 	u32 nritems;
@@ -2733,18 +2779,7 @@ int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 	for (i = 0; i < nr; i++) {
 		total_data += data_size[i];
 	}
-
-	/* create a root if there isn't one */
-	if (!root->node)
-		BUG();
-
 	total_size = total_data + nr * sizeof(struct btrfs_item);
-	ret = btrfs_search_slot(trans, root, cpu_key, path, total_size, 1);
-	if (ret == 0) {
-		return -EEXIST;
-	}
-	if (ret < 0)
-		goto out;
 
 	leaf = path->nodes[0];
 
@@ -2806,7 +2841,6 @@ int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 	btrfs_set_header_nritems(leaf, nritems + nr);
 	btrfs_mark_buffer_dirty(leaf);
 
-	ret = 0;
 	if (slot == 0) {
 		btrfs_cpu_key_to_disk(&disk_key, cpu_key);
 		btrfs_fixup_low_keys(root, path, &disk_key, 1);
@@ -2816,11 +2850,146 @@ int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 		btrfs_print_leaf(leaf);
 		BUG();
 	}
+}
+
+/*
+ * Given a key and some data, insert an item into the tree.
+ * This does all the path init required, making room in the tree if needed.
+ */
+int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    struct btrfs_path *path,
+			    struct btrfs_key *cpu_key, u32 *data_size,
+			    int nr)
+{
+	int ret = 0;
+	int i;
+	u32 total_size = 0;
+	u32 total_data = 0;
+
+	for (i = 0; i < nr; i++) {
+		total_data += data_size[i];
+	}
+
+	/* create a root if there isn't one */
+	if (!root->node)
+		BUG();
+
+	total_size = total_data + nr * sizeof(struct btrfs_item);
+	ret = btrfs_search_slot(trans, root, cpu_key, path, total_size, 1);
+	if (ret == 0) {
+		return -EEXIST;
+	}
+	if (ret < 0)
+		goto out;
 
+	setup_items_for_insert(root, path, cpu_key, data_size, nr);
+	ret = 0;
 out:
 	return ret;
 }
 
+/*
+ * Find the lowest key in the tree after the slot of @path in the leaf, i.e.
+ * the limit for keys inserted at that slot.
+ *
+ * Return 0 if there is one, 1 if the slot is at the end of the tree.
+ */
+static int key_after_slot(struct btrfs_path *path, struct btrfs_key *key)
+{
+	int level;
+
+	if (path->slots[0] < btrfs_header_nritems(path->nodes[0])) {
+		btrfs_item_key_to_cpu(path->nodes[0], key, path->slots[0]);
+		return 0;
+	}
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		if (!path->nodes[level])
+			break;
+		if (path->slots[level] + 1 <
+		    btrfs_header_nritems(path->nodes[level])) {
+			btrfs_node_key_to_cpu(path->nodes[level], key,
+					      path->slots[level] + 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Insert the items of @batch, in increasing key order, with their data.
+ *
+ * Unlike inserting them one by one, the tree is searched once for each leaf
+ * the items end up in: the leaf found for the first item is filled with as
+ * many of the following items as fit in it and sort before the next key of
+ * the tree, and it is split only if not even the first one fits.
+ *
+ * Return 0 on success, -EEXIST if one of the keys exists, the items before
+ * it are inserted then, or another error < 0.
+ */
+int btrfs_insert_items(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root,
+		       const struct btrfs_item_batch *batch)
+{
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key limit;
+	bool has_limit;
+	u32 total_size;
+	u32 item_size;
+	int free_space;
+	int slot;
+	int done = 0;
+	int nr;
+	int i;
+	int ret = 0;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	while (done < batch->nr) {
+		item_size = batch->data_sizes[done] + sizeof(struct btrfs_item);
+		ret = btrfs_search_slot(trans, root, &batch->keys[done], path,
+					item_size, 1);
+		if (ret == 0)
+			ret = -EEXIST;
+		if (ret < 0)
+			break;
+
+		leaf = path->nodes[0];
+		slot = path->slots[0];
+		free_space = btrfs_leaf_free_space(leaf);
+		has_limit = !key_after_slot(path, &limit);
+
+		total_size = item_size;
+		for (nr = 1; done + nr < batch->nr; nr++) {
+			item_size = batch->data_sizes[done + nr] +
+				    sizeof(struct btrfs_item);
+			if (total_size + item_size > free_space)
+				break;
+			if (has_limit &&
+			    btrfs_comp_cpu_keys(&batch->keys[done + nr],
+						&limit) >= 0)
+				break;
+			total_size += item_size;
+		}
+
+		setup_items_for_insert(root, path, &batch->keys[done],
+				       &batch->data_sizes[done], nr);
+		for (i = 0; i < nr; i++)
+			write_extent_buffer(leaf, batch->data[done + i],
+					    btrfs_item_ptr_offset(leaf, slot + i),
+					    batch->data_sizes[done + i]);
+		btrfs_release_path(path);
+		done += nr;
+		ret = 0;
+	}
+
+	btrfs_free_path(path);
+	return ret;
+}
+
 /*
  * Given a key and some data, insert an item into the tree.
  * This does all the path init required, making room in the tree if needed.
@@ -2849,6 +3018,228 @@ int btrfs_insert_item(struct btrfs_trans_handle *trans, struct btrfs_root
 	return ret;
 }
 
+/*
+ * Start a tree block at @level of the tree being built, the first key in it
+ * will be @key.
+ */
+static struct extent_buffer *tree_builder_new_block(
+				struct btrfs_tree_builder *tb, int level,
+				const struct btrfs_key *key)
+{
+	struct btrfs_root *root = tb->root;
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *c;
+
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	c = btrfs_alloc_free_block(tb->trans, root, fs_info->nodesize,
+				   root->root_key.objectid, &disk_key, level,
+				   tb->hint, 0);
+	if (IS_ERR(c))
+		return c;
+
+	memset_extent_buffer(c, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_nritems(c, 0);
+	btrfs_set_header_level(c, level);
+	btrfs_set_header_bytenr(c, c->start);
+	btrfs_set_header_generation(c, tb->trans->transid);
+	btrfs_set_header_backref_rev(c, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(c, root->root_key.objectid);
+
+	root_add_used(root, fs_info->nodesize);
+
+	write_extent_buffer(c, fs_info->fs_devices->metadata_uuid,
+			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
+	write_extent_buffer(c, fs_info->chunk_tree_uuid,
+			    btrfs_header_chunk_tree_uuid(c), BTRFS_UUID_SIZE);
+
+	/* Keep the blocks of the new tree close to each other */
+	tb->hint = c->start + c->len;
+	tb->nodes[level] = c;
+	return c;
+}
+
+/*
+ * The block at @level is complete, add a pointer to it to its parent and
+ * drop it from the builder. The parent is started if needed, so a level
+ * has a parent only once it has more than one block.
+ */
+static int tree_builder_push_block(struct btrfs_tree_builder *tb, int level)
+{
+	struct extent_buffer *c = tb->nodes[level];
+	struct extent_buffer *parent = tb->nodes[level + 1];
+	struct btrfs_disk_key disk_key;
+	struct btrfs_key key;
+	u32 nritems;
+	int ret;
+
+	if (level + 1 >= BTRFS_MAX_LEVEL)
+		return -E2BIG;
+
+	if (level == 0)
+		btrfs_item_key(c, &disk_key, 0);
+	else
+		btrfs_node_key(c, &disk_key, 0);
+
+	if (parent && btrfs_header_nritems(parent) >=
+		      BTRFS_NODEPTRS_PER_BLOCK(tb->root->fs_info)) {
+		ret = tree_builder_push_block(tb, level + 1);
+		if (ret)
+			return ret;
+		parent = NULL;
+	}
+	if (!parent) {
+		btrfs_disk_key_to_cpu(&key, &disk_key);
+		parent = tree_builder_new_block(tb, level + 1, &key);
+		if (IS_ERR(parent))
+			return PTR_ERR(parent);
+	}
+
+	nritems = btrfs_header_nritems(parent);
+	btrfs_set_node_key(parent, &disk_key, nritems);
+	btrfs_set_node_blockptr(parent, nritems, c->start);
+	btrfs_set_node_ptr_generation(parent, nritems, tb->trans->transid);
+	btrfs_set_header_nritems(parent, nritems + 1);
+
+	btrfs_mark_buffer_dirty(c);
+	free_extent_buffer(c);
+	tb->nodes[level] = NULL;
+	return 0;
+}
+
+/*
+ * Prepare @tb to build the tree of @root from items in increasing key order,
+ * filling every leaf and node before starting the next one. This avoids the
+ * search from the root, the splits and the COW of the path of inserting the
+ * items one by one with btrfs_insert_item().
+ *
+ * The tree must be empty, e.g. just created or reinitialized. Until
+ * btrfs_tree_builder_finish() the tree must not be accessed otherwise.
+ */
+int btrfs_tree_builder_init(struct btrfs_tree_builder *tb,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root)
+{
+	struct extent_buffer *leaf;
+	int ret;
+
+	memset(tb, 0, sizeof(*tb));
+	if (btrfs_header_level(root->node) ||
+	    btrfs_header_nritems(root->node))
+		return -ENOTEMPTY;
+
+	/* The empty root leaf becomes the first leaf */
+	leaf = root->node;
+	extent_buffer_get(leaf);
+	ret = btrfs_cow_block(trans, root, leaf, NULL, 0, &leaf);
+	if (ret) {
+		free_extent_buffer(leaf);
+		return ret;
+	}
+	tb->trans = trans;
+	tb->root = root;
+	tb->nodes[0] = leaf;
+	tb->leaf_data_end = BTRFS_LEAF_DATA_SIZE(root->fs_info);
+	tb->hint = leaf->start + leaf->len;
+	return 0;
+}
+
+/*
+ * Append an item to the tree being built. The key must be greater than the
+ * key of the previously added item.
+ */
+int btrfs_tree_builder_add(struct btrfs_tree_builder *tb,
+			   const struct btrfs_key *key, const void *data,
+			   u32 data_size)
+{
+	struct btrfs_fs_info *fs_info = tb->root->fs_info;
+	struct extent_buffer *leaf = tb->nodes[0];
+	struct btrfs_disk_key disk_key;
+	struct btrfs_item *item;
+	u32 nritems;
+	int ret;
+
+	if (tb->nr_items && btrfs_comp_cpu_keys(key, &tb->last_key) <= 0)
+		return -EINVAL;
+	if (data_size + sizeof(struct btrfs_item) >
+	    BTRFS_LEAF_DATA_SIZE(fs_info))
+		return -EOVERFLOW;
+
+	if (leaf) {
+		nritems = btrfs_header_nritems(leaf);
+		if ((nritems + 1) * sizeof(struct btrfs_item) + data_size >
+		    tb->leaf_data_end) {
+			ret = tree_builder_push_block(tb, 0);
+			if (ret)
+				return ret;
+			leaf = NULL;
+		}
+	}
+	if (!leaf) {
+		leaf = tree_builder_new_block(tb, 0, key);
+		if (IS_ERR(leaf))
+			return PTR_ERR(leaf);
+		tb->leaf_data_end = BTRFS_LEAF_DATA_SIZE(fs_info);
+	}
+
+	nritems = btrfs_header_nritems(leaf);
+	tb->leaf_data_end -= data_size;
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	btrfs_set_item_key(leaf, &disk_key, nritems);
+	item = btrfs_item_nr(nritems);
+	btrfs_set_item_offset(leaf, item, tb->leaf_data_end);
+	btrfs_set_item_size(leaf, item, data_size);
+	btrfs_set_header_nritems(leaf, nritems + 1);
+	write_extent_buffer(leaf, data, btrfs_item_ptr_offset(leaf, nritems),
+			    data_size);
+
+	tb->last_key = *key;
+	tb->nr_items++;
+	return 0;
+}
+
+/*
+ * Link the remaining blocks of each level to their parents and make the top
+ * block the root of the tree, to be written by the transaction commit.
+ */
+int btrfs_tree_builder_finish(struct btrfs_tree_builder *tb)
+{
+	struct btrfs_root *root = tb->root;
+	struct extent_buffer *old;
+	int level;
+	int ret;
+
+	for (level = 0; level < BTRFS_MAX_LEVEL - 1; level++) {
+		if (!tb->nodes[level + 1])
+			break;
+		ret = tree_builder_push_block(tb, level);
+		if (ret) {
+			btrfs_tree_builder_release(tb);
+			return ret;
+		}
+	}
+
+	btrfs_mark_buffer_dirty(tb->nodes[level]);
+	old = root->node;
+	root->node = tb->nodes[level];
+	tb->nodes[level] = NULL;
+	/* the super has an extra ref to root->node */
+	free_extent_buffer(old);
+	add_root_to_dirty_list(root);
+	return 0;
+}
+
+/* Drop the blocks of an unfinished tree, the transaction must be aborted */
+void btrfs_tree_builder_release(struct btrfs_tree_builder *tb)
+{
+	int level;
+
+	for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+		free_extent_buffer(tb->nodes[level]);
+		tb->nodes[level] = NULL;
+	}
+}
+
 /*
  * delete the pointer from a given node.
  *
@@ -3136,6 +3527,241 @@ int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
+struct tree_cursor_reada {
+	u64 bytenr;
+	u64 gen;
+	u64 devid;
+	u64 physical;
+};
+
+static int cmp_tree_cursor_reada(const void *a, const void *b)
+{
+	const struct tree_cursor_reada *ra = a;
+	const struct tree_cursor_reada *rb = b;
+
+	if (ra->devid != rb->devid)
+		return ra->devid < rb->devid ? -1 : 1;
+	if (ra->physical != rb->physical)
+		return ra->physical < rb->physical ? -1 : 1;
+	return 0;
+}
+
+static void tree_block_first_key(struct extent_buffer *eb,
+				 struct btrfs_key *key)
+{
+	if (btrfs_header_level(eb) == 0)
+		btrfs_item_key_to_cpu(eb, key, 0);
+	else
+		btrfs_node_key_to_cpu(eb, key, 0);
+}
+
+/*
+ * Top up the blocks read ahead of the cursor to the window, once half of
+ * them have been reached. The pointers are taken from the parent nodes in
+ * key order, and the batch is sorted by device and physical offset.
+ */
+static void tree_cursor_readahead(struct btrfs_tree_cursor *cur)
+{
+	struct tree_cursor_reada blocks[BTRFS_TREE_CURSOR_MAX_WINDOW];
+	struct btrfs_fs_info *fs_info = cur->fs_info;
+	struct extent_buffer *parent;
+	struct btrfs_key key;
+	int nr = 0;
+	int i;
+
+	if (cur->ra_done || cur->ahead > cur->window / 2)
+		return;
+
+	while (nr < cur->window - cur->ahead) {
+		struct btrfs_multi_bio *multi = NULL;
+		u64 length = fs_info->nodesize;
+
+		parent = cur->ra_path.nodes[cur->level + 1];
+		if (cur->ra_slot >= btrfs_header_nritems(parent)) {
+			if (btrfs_next_sibling_tree_block(fs_info,
+							  &cur->ra_path)) {
+				cur->ra_done = true;
+				break;
+			}
+			cur->ra_slot = 0;
+			continue;
+		}
+		btrfs_node_key_to_cpu(parent, &key, cur->ra_slot);
+		if (btrfs_comp_cpu_keys(&key, &cur->end) > 0) {
+			cur->ra_done = true;
+			break;
+		}
+		blocks[nr].bytenr = btrfs_node_blockptr(parent, cur->ra_slot);
+		blocks[nr].gen = btrfs_node_ptr_generation(parent, cur->ra_slot);
+		blocks[nr].devid = 0;
+		blocks[nr].physical = 0;
+		if (!btrfs_map_block(fs_info, READ, blocks[nr].bytenr, &length,
+				     &multi, 0, NULL)) {
+			blocks[nr].devid = multi->stripes[0].dev->devid;
+			blocks[nr].physical = multi->stripes[0].physical;
+			kfree(multi);
+		}
+		cur->ra_slot++;
+		nr++;
+	}
+	if (!nr)
+		return;
+
+	qsort(blocks, nr, sizeof(blocks[0]), cmp_tree_cursor_reada);
+	for (i = 0; i < nr; i++)
+		readahead_tree_block(fs_info, blocks[i].bytenr, blocks[i].gen);
+	readahead_tree_block_submit(fs_info);
+	cur->ahead += nr;
+}
+
+/*
+ * Set up @cur to scan the blocks at @level below @top, or the items if
+ * @level is 0, from the one containing @start up to @end. A NULL @start or
+ * @end means the lowest or highest possible key, a @window of 0 the default
+ * number of blocks to read ahead.
+ *
+ * Return 0 on success, < 0 on errors reading the path down to @level. The
+ * cursor must be released by btrfs_tree_cursor_release() in both cases.
+ */
+int btrfs_tree_cursor_init(struct btrfs_tree_cursor *cur,
+			   struct extent_buffer *top,
+			   const struct btrfs_key *start,
+			   const struct btrfs_key *end, int level, int window)
+{
+	struct btrfs_key first = { 0 };
+	struct extent_buffer *b;
+	int top_level = btrfs_header_level(top);
+	int slot;
+	int ret;
+	int i;
+
+	memset(cur, 0, sizeof(*cur));
+	cur->fs_info = top->fs_info;
+	cur->level = level;
+	if (!window)
+		window = BTRFS_TREE_CURSOR_WINDOW;
+	cur->window = min(window, BTRFS_TREE_CURSOR_MAX_WINDOW);
+	if (end) {
+		cur->end = *end;
+	} else {
+		cur->end.objectid = (u64)-1;
+		cur->end.type = (u8)-1;
+		cur->end.offset = (u64)-1;
+	}
+	if (!start)
+		start = &first;
+
+	cur->ra_done = true;
+	if (top_level < level || level >= BTRFS_MAX_LEVEL - 1)
+		return 0;
+
+	b = top;
+	extent_buffer_get(b);
+	while (1) {
+		int cur_level = btrfs_header_level(b);
+
+		cur->path.nodes[cur_level] = b;
+		ret = btrfs_bin_search(b, start, &slot);
+		if (cur_level == level) {
+			cur->path.slots[cur_level] = slot;
+			break;
+		}
+		if (ret && slot > 0)
+			slot--;
+		cur->path.slots[cur_level] = slot;
+		b = read_node_slot(cur->fs_info, b, slot);
+		if (!extent_buffer_uptodate(b)) {
+			if (!IS_ERR_OR_NULL(b))
+				free_extent_buffer(b);
+			return -EIO;
+		}
+	}
+
+	if (top_level == level)
+		return 0;
+	for (i = level + 1; i <= top_level; i++) {
+		extent_buffer_get(cur->path.nodes[i]);
+		cur->ra_path.nodes[i] = cur->path.nodes[i];
+		cur->ra_path.slots[i] = cur->path.slots[i];
+	}
+	cur->ra_path.lowest_level = level + 1;
+	cur->ra_slot = cur->path.slots[level + 1] + 1;
+	cur->ra_done = false;
+	return 0;
+}
+
+/*
+ * Move to the next tree block at the level of the cursor, the first call
+ * returns the starting block. The block is in @cur->eb.
+ *
+ * Return 0 if there is a block, 1 past the end of the range and < 0 on errors.
+ */
+int btrfs_tree_cursor_next_block(struct btrfs_tree_cursor *cur)
+{
+	struct btrfs_key key;
+	int ret;
+
+	if (!cur->path.nodes[cur->level])
+		return 1;
+	if (cur->started) {
+		cur->path.lowest_level = cur->level;
+		ret = btrfs_next_sibling_tree_block(cur->fs_info, &cur->path);
+		if (ret)
+			return ret;
+		if (cur->ahead)
+			cur->ahead--;
+		if (btrfs_header_nritems(cur->path.nodes[cur->level])) {
+			tree_block_first_key(cur->path.nodes[cur->level], &key);
+			if (btrfs_comp_cpu_keys(&key, &cur->end) > 0)
+				return 1;
+		}
+	}
+	cur->started = true;
+	tree_cursor_readahead(cur);
+	cur->eb = cur->path.nodes[cur->level];
+	cur->slot = 0;
+	return 0;
+}
+
+/*
+ * Move to the next item in the range, for a cursor at level 0. The item is
+ * in slot @cur->slot of @cur->eb and its key in @cur->key. Only the slot is
+ * advanced within a leaf, the path is not updated for each item.
+ *
+ * Return 0 if there is an item, 1 past the end of the range and < 0 on errors.
+ */
+int btrfs_tree_cursor_next_item(struct btrfs_tree_cursor *cur)
+{
+	int ret;
+
+	if (cur->level)
+		return -EINVAL;
+	if (!cur->started) {
+		ret = btrfs_tree_cursor_next_block(cur);
+		if (ret)
+			return ret;
+		cur->slot = cur->path.slots[0];
+	} else {
+		cur->slot++;
+	}
+	while (cur->slot >= btrfs_header_nritems(cur->eb)) {
+		ret = btrfs_tree_cursor_next_block(cur);
+		if (ret)
+			return ret;
+	}
+	btrfs_item_key_to_cpu(cur->eb, &cur->key, cur->slot);
+	if (btrfs_comp_cpu_keys(&cur->key, &cur->end) > 0)
+		return 1;
+	return 0;
+}
+
+void btrfs_tree_cursor_release(struct btrfs_tree_cursor *cur)
+{
+	btrfs_release_path(&cur->path);
+	btrfs_release_path(&cur->ra_path);
+	cur->eb = NULL;
+}
+
 int btrfs_previous_item(struct btrfs_root *root,
 			struct btrfs_path *path, u64 min_objectid,
 			int type)
@@ -1136,6 +1136,8 @@ struct btrfs_block_group {
 
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct io_ring;
+struct work_pool;
 struct btrfs_fs_info {
 	u8 chunk_tree_uuid[BTRFS_UUID_SIZE];
 	u8 *new_chunk_tree_uuid;
@@ -1160,6 +1162,17 @@ struct btrfs_fs_info {
 	struct extent_io_tree extent_ins;
 	struct extent_io_tree *excluded_extents;
 
+	/* Asynchronous tree block readahead, allocated on first use */
+	struct io_ring *reada_ring;
+	/* Threads for batches of tree block checksums, started on first use */
+	struct work_pool *csum_pool;
+	/*
+	 * Threads reading the devices of a striped data read, started on
+	 * first use, and set while a read is using them
+	 */
+	struct work_pool *read_pool;
+	int read_pool_busy;
+
 	struct rb_root block_group_cache_tree;
 	/* logical->physical extent mapping */
 	struct btrfs_mapping_tree mapping_tree;
@@ -1198,6 +1211,9 @@ struct btrfs_fs_info {
 	unsigned int avoid_sys_chunk_alloc:1;
 	unsigned int finalize_on_close:1;
 	unsigned int hide_names:1;
+	unsigned int no_reada_ring:1;
+	unsigned int no_csum_pool:1;
+	unsigned int no_read_pool:1;
 
 	int transaction_aborted;
 
@@ -2685,6 +2701,21 @@ int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 			     struct btrfs_path *path,
 			     struct btrfs_key *cpu_key, u32 *data_size, int nr);
 
+/*
+ * Items for btrfs_insert_items(), @keys in increasing order, the data of
+ * item i is @data_sizes[i] bytes at @data[i]
+ */
+struct btrfs_item_batch {
+	const struct btrfs_key *keys;
+	const u32 *data_sizes;
+	const void * const *data;
+	int nr;
+};
+
+int btrfs_insert_items(struct btrfs_trans_handle *trans,
+		       struct btrfs_root *root,
+		       const struct btrfs_item_batch *batch);
+
 static inline int btrfs_insert_empty_item(struct btrfs_trans_handle *trans,
 					  struct btrfs_root *root,
 					  struct btrfs_path *path,
@@ -2694,6 +2725,31 @@ static inline int btrfs_insert_empty_item(struct btrfs_trans_handle *trans,
 	return btrfs_insert_empty_items(trans, root, path, key, &data_size, 1);
 }
 
+/*
+ * State of a tree being built bottom-up from sorted items, see
+ * btrfs_tree_builder_init()
+ */
+struct btrfs_tree_builder {
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	/* Block being filled on each level */
+	struct extent_buffer *nodes[BTRFS_MAX_LEVEL];
+	/* Start of the item data in the leaf being filled */
+	u32 leaf_data_end;
+	u64 hint;
+	u64 nr_items;
+	struct btrfs_key last_key;
+};
+
+int btrfs_tree_builder_init(struct btrfs_tree_builder *tb,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root);
+int btrfs_tree_builder_add(struct btrfs_tree_builder *tb,
+			   const struct btrfs_key *key, const void *data,
+			   u32 data_size);
+int btrfs_tree_builder_finish(struct btrfs_tree_builder *tb);
+void btrfs_tree_builder_release(struct btrfs_tree_builder *tb);
+
 int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 				  struct btrfs_path *path);
 
@@ -2720,6 +2776,43 @@ static inline int btrfs_next_item(struct btrfs_root *root,
 }
 
 int btrfs_prev_leaf(struct btrfs_root *root, struct btrfs_path *path);
+/*
+ * Cursor to scan the tree blocks of one level, or the items in the leaves,
+ * of a key range in order. Up to @window blocks ahead of the current one are
+ * read asynchronously, each batch queued in order of the physical location,
+ * so the scan rarely waits for a block to be read.
+ */
+struct btrfs_tree_cursor {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_path path;
+	/* Parent of the next block to read ahead, at level + 1 */
+	struct btrfs_path ra_path;
+	int ra_slot;
+	bool ra_done;
+	/* Blocks read ahead and not reached yet */
+	int ahead;
+	int window;
+	int level;
+	bool started;
+	struct btrfs_key end;
+
+	/* Current block, and item for leaves, valid after a _next call */
+	struct extent_buffer *eb;
+	int slot;
+	struct btrfs_key key;
+};
+
+#define BTRFS_TREE_CURSOR_WINDOW	64
+#define BTRFS_TREE_CURSOR_MAX_WINDOW	256
+
+int btrfs_tree_cursor_init(struct btrfs_tree_cursor *cur,
+			   struct extent_buffer *top,
+			   const struct btrfs_key *start,
+			   const struct btrfs_key *end, int level, int window);
+int btrfs_tree_cursor_next_block(struct btrfs_tree_cursor *cur);
+int btrfs_tree_cursor_next_item(struct btrfs_tree_cursor *cur);
+void btrfs_tree_cursor_release(struct btrfs_tree_cursor *cur);
+
 int btrfs_leaf_free_space(struct extent_buffer *leaf);
 void btrfs_fixup_low_keys(struct btrfs_root *root, struct btrfs_path *path,
 			  struct btrfs_disk_key *key, int level);
@@ -2809,6 +2902,9 @@ int btrfs_del_inode_ref(struct btrfs_trans_handle *trans,
 			u64 ino, u64 parent_ino, u64 *index);
 
 /* file-item.c */
+#define MAX_CSUM_ITEMS(r, size) ((((BTRFS_LEAF_DATA_SIZE(r->fs_info) - \
+			       sizeof(struct btrfs_item) * 2) / \
+			       size) - 1))
 int btrfs_del_csums(struct btrfs_trans_handle *trans, u64 bytenr, u64 len);
 int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
@@ -2821,6 +2917,9 @@ int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 alloc_end,
 			  u64 bytenr, char *data, size_t len);
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 alloc_end,
+			   u64 bytenr, char *data, size_t len);
 int btrfs_csum_truncate(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, struct btrfs_path *path,
 			u64 isize);
@@ -22,6 +22,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "kernel-lib/radix-tree.h"
@@ -34,8 +37,18 @@
 #include "kernel-shared/print-tree.h"
 #include "common/rbtree-utils.h"
 #include "common/device-scan.h"
+#include "common/io-uring.h"
+#include "common/work-pool.h"
+#include "common/direct-io.h"
 #include "crypto/hash.h"
 
+/* Maximum number of tree block reads in flight for readahead */
+#define BTRFS_READA_RING_ENTRIES	(128)
+/* Smaller batches of checksums are not worth waking the threads */
+#define BTRFS_CSUM_BATCH_MIN		(8)
+/* Data sectors checksummed by one thread at a time in a batch */
+#define BTRFS_CSUM_SECTORS_PER_ITEM	(16)
+
 /* specified errno for check_tree_block */
 #define BTRFS_BAD_BYTENR		(-1)
 #define BTRFS_BAD_FSID			(-2)
@@ -229,17 +242,459 @@ int csum_tree_block(struct btrfs_fs_info *fs_info,
 	return csum_tree_block_size(buf, csum_size, verify, csum_type);
 }
 
+static struct work_pool *get_csum_pool(struct btrfs_fs_info *fs_info)
+{
+	const char *env;
+	int threads = bconf.csum_threads;
+
+	if (fs_info->csum_pool || fs_info->no_csum_pool)
+		return fs_info->csum_pool;
+
+	if (!threads) {
+		env = getenv(BTRFS_CSUM_THREADS_ENV);
+		if (env && *env) {
+			threads = work_pool_parse_threads(env);
+			if (threads < 0) {
+				warning("ignoring invalid value of %s: %s",
+					BTRFS_CSUM_THREADS_ENV, env);
+				threads = 0;
+			}
+		}
+	}
+	if (!threads)
+		threads = work_pool_default_threads();
+
+	fs_info->csum_pool = work_pool_create(threads);
+	if (!fs_info->csum_pool)
+		fs_info->no_csum_pool = 1;
+	return fs_info->csum_pool;
+}
+
+struct csum_batch {
+	struct extent_buffer **ebs;
+	u16 csum_size;
+	u16 csum_type;
+};
+
+static void csum_batch_fill(void *data, int index)
+{
+	struct csum_batch *batch = data;
+
+	csum_tree_block_size(batch->ebs[index], batch->csum_size, 0,
+			     batch->csum_type);
+}
+
+static void csum_batch_verify(void *data, int index)
+{
+	struct csum_batch *batch = data;
+	struct extent_buffer *eb = batch->ebs[index];
+
+	if (!verify_tree_block_csum_silent(eb, batch->csum_size,
+					   batch->csum_type))
+		eb->flags |= EXTENT_BUFFER_CSUM_OK;
+}
+
+/*
+ * Compute the checksums of a batch of tree blocks, or with @verify check them
+ * and mark the good ones EXTENT_BUFFER_CSUM_OK. Mismatches are not reported
+ * here, read_tree_block() verifies the unmarked blocks again the usual way.
+ *
+ * Batches big enough are spread over the checksum threads.
+ */
+static void csum_tree_blocks(struct btrfs_fs_info *fs_info,
+			     struct extent_buffer **ebs, int nr, bool verify)
+{
+	struct csum_batch batch = {
+		.ebs = ebs,
+		.csum_size = btrfs_super_csum_size(fs_info->super_copy),
+		.csum_type = btrfs_super_csum_type(fs_info->super_copy),
+	};
+	struct work_pool *pool = NULL;
+
+	if (nr >= BTRFS_CSUM_BATCH_MIN)
+		pool = get_csum_pool(fs_info);
+	work_pool_run(pool, verify ? csum_batch_verify : csum_batch_fill,
+		      &batch, nr);
+}
+
+/*
+ * Compute the checksums of @nr data sectors at @data to @out on the calling
+ * thread, for callers running their own threads
+ */
+int btrfs_csum_data_multi(u16 csum_type, const u8 *data, u32 sectorsize,
+			  int nr, u8 *out)
+{
+	u16 csum_size = btrfs_csum_type_size(csum_type);
+
+	switch (csum_type) {
+	case BTRFS_CSUM_TYPE_CRC32:
+		return hash_crc32c_multi(data, sectorsize, nr, out, csum_size);
+	case BTRFS_CSUM_TYPE_XXHASH:
+		return hash_xxhash_multi(data, sectorsize, nr, out, csum_size);
+	case BTRFS_CSUM_TYPE_SHA256:
+		return hash_sha256_multi(data, sectorsize, nr, out, csum_size);
+	case BTRFS_CSUM_TYPE_BLAKE2:
+		return hash_blake2b_multi(data, sectorsize, nr, out, csum_size);
+	default:
+		fprintf(stderr, "ERROR: unknown csum type: %d\n", csum_type);
+		ASSERT(0);
+	}
+
+	return -1;
+}
+
+struct csum_sectors_batch {
+	const u8 *data;
+	u8 *out;
+	u32 nr;
+	u32 sectorsize;
+	u16 csum_size;
+	u16 csum_type;
+};
+
+static void csum_sectors_batch_fn(void *data, int index)
+{
+	struct csum_sectors_batch *batch = data;
+	u32 first = index * BTRFS_CSUM_SECTORS_PER_ITEM;
+	u32 nr = min_t(u32, batch->nr - first, BTRFS_CSUM_SECTORS_PER_ITEM);
+
+	btrfs_csum_data_multi(batch->csum_type,
+			      batch->data + (size_t)first * batch->sectorsize,
+			      batch->sectorsize, nr,
+			      batch->out + (size_t)first * batch->csum_size);
+}
+
+/*
+ * Compute the checksums of @nr data sectors at @data to @out, one after
+ * another in the layout of a csum item (csum size bytes each).
+ *
+ * Batches big enough are spread over the checksum threads.
+ */
+void btrfs_csum_data_batch(struct btrfs_fs_info *fs_info, const u8 *data,
+			   u32 nr, u8 *out)
+{
+	struct csum_sectors_batch batch = {
+		.data = data,
+		.out = out,
+		.nr = nr,
+		.sectorsize = fs_info->sectorsize,
+		.csum_size = btrfs_super_csum_size(fs_info->super_copy),
+		.csum_type = btrfs_super_csum_type(fs_info->super_copy),
+	};
+	int items = (nr + BTRFS_CSUM_SECTORS_PER_ITEM - 1) /
+		    BTRFS_CSUM_SECTORS_PER_ITEM;
+	struct work_pool *pool = NULL;
+
+	if (items >= 2)
+		pool = get_csum_pool(fs_info);
+	work_pool_run(pool, csum_sectors_batch_fn, &batch, items);
+}
+
+/*
+ * With direct I/O the data of extent buffers are not aligned for the device,
+ * each read goes to an aligned bounce buffer and is copied once complete.
+ * The request then replaces the extent buffer as the ring data, for all
+ * requests so that they can be told apart.
+ */
+struct tree_block_reada {
+	struct extent_buffer *eb;
+	void *buf;
+};
+
+/*
+ * Finish the asynchronous readahead with the ring data @data and result
+ * @res. The data of a successful read are kept in the cached extent buffer
+ * marked as EXTENT_BUFFER_FILLED, the verification is left to
+ * read_tree_block() so it's done exactly the same way as for a synchronous
+ * read.
+ *
+ * With @filled, a successfully read buffer is returned there together with
+ * the reference held by the ring, otherwise the reference is dropped.
+ */
+static void complete_tree_block_reada(struct btrfs_fs_info *fs_info,
+				      void *data, int res,
+				      struct extent_buffer **filled)
+{
+	struct extent_buffer *eb;
+
+	if (direct_io_enabled()) {
+		struct tree_block_reada *req = data;
+
+		eb = req->eb;
+		if (req->buf) {
+			if (res == eb->len)
+				memcpy(eb->data, req->buf, res);
+			direct_io_free(req->buf, eb->len);
+		}
+		free(req);
+	} else {
+		eb = data;
+	}
+	eb->flags &= ~EXTENT_READAHEAD;
+	if (res > 0)
+		fs_info->extent_cache.stats.bytes_read += res;
+	if (res == eb->len) {
+		eb->flags |= EXTENT_BUFFER_FILLED;
+		if (filled) {
+			*filled = eb;
+			return;
+		}
+	}
+	/* Drop the reference held by the ring */
+	free_extent_buffer(eb);
+}
+
+/* Reap one completed asynchronous readahead, see complete_tree_block_reada() */
+static int reap_tree_block_reada(struct btrfs_fs_info *fs_info, bool wait,
+				 struct extent_buffer **filled)
+{
+	void *data;
+	int res;
+	int ret;
+
+	ret = io_ring_reap(fs_info->reada_ring, &data, &res, wait);
+	if (ret <= 0)
+		return ret;
+	complete_tree_block_reada(fs_info, data, res, filled);
+	return 1;
+}
+
+/*
+ * Tear the readahead ring down after waiting for completions failed, tree
+ * blocks are read synchronously from then on.
+ *
+ * The buffers of the reads the kernel got can't be read into again or freed
+ * before the reads complete, so this blocks until all of them are reaped.
+ * When waiting in io_uring_enter() fails again, it blocks in poll() on the
+ * ring instead. The reads not submitted yet are taken back.
+ */
+static void abort_tree_block_reada(struct btrfs_fs_info *fs_info)
+{
+	struct io_ring *ring = fs_info->reada_ring;
+	void *data[BTRFS_READA_RING_ENTRIES];
+	int nr;
+	int i;
+
+	nr = io_ring_unqueue(ring, data, ARRAY_SIZE(data));
+	for (i = 0; i < nr; i++)
+		complete_tree_block_reada(fs_info, data[i], -ECANCELED, NULL);
+	while (ring->inflight) {
+		if (reap_tree_block_reada(fs_info, true, NULL) < 0)
+			io_ring_wait(ring);
+	}
+	io_ring_exit(ring);
+	free(ring);
+	fs_info->reada_ring = NULL;
+	fs_info->no_reada_ring = 1;
+}
+
+/*
+ * Reap all completed readahead, waiting for the first one with @wait, and
+ * verify the checksums of the filled buffers in one batch.
+ *
+ * Return the number of reaped reads, 0 if there were none, or a negative
+ * errno.
+ */
+static int reap_tree_block_reada_batch(struct btrfs_fs_info *fs_info,
+				       bool wait)
+{
+	struct extent_buffer *filled[BTRFS_READA_RING_ENTRIES];
+	int nr_filled = 0;
+	int reaped = 0;
+	int ret;
+	int i;
+
+	do {
+		struct extent_buffer *eb = NULL;
+
+		ret = reap_tree_block_reada(fs_info, wait && !reaped, &eb);
+		if (ret <= 0)
+			break;
+		reaped++;
+		if (eb)
+			filled[nr_filled++] = eb;
+	} while (nr_filled < BTRFS_READA_RING_ENTRIES);
+
+	csum_tree_blocks(fs_info, filled, nr_filled, true);
+	for (i = 0; i < nr_filled; i++)
+		free_extent_buffer(filled[i]);
+	return reaped ? reaped : ret;
+}
+
+static void wait_tree_block_reada(struct extent_buffer *eb)
+{
+	int ret;
+
+	while (eb->flags & EXTENT_READAHEAD) {
+		ret = reap_tree_block_reada_batch(eb->fs_info, true);
+		if (ret <= 0) {
+			errno = -ret;
+			warning(
+	"failed to wait for readahead of %llu, reading synchronously: %m",
+				eb->start);
+			/* Completes the read of @eb too */
+			abort_tree_block_reada(eb->fs_info);
+			break;
+		}
+	}
+}
+
+static struct io_ring *get_reada_ring(struct btrfs_fs_info *fs_info)
+{
+	struct io_ring *ring;
+
+	if (fs_info->reada_ring || fs_info->no_reada_ring)
+		return fs_info->reada_ring;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring || io_ring_init(ring, BTRFS_READA_RING_ENTRIES) < 0) {
+		free(ring);
+		fs_info->no_reada_ring = 1;
+		return NULL;
+	}
+	fs_info->reada_ring = ring;
+	return ring;
+}
+
+/*
+ * Queue an asynchronous read of the whole tree block at @bytenr, located on
+ * @device at @physical, into the extent buffer cache.
+ *
+ * Return 0 if the read was queued or the block is already cached or being
+ * read, 1 if the caller should fall back to a plain readahead hint.
+ */
+static int queue_tree_block_reada(struct btrfs_fs_info *fs_info,
+				  struct extent_buffer *eb, u64 bytenr,
+				  struct btrfs_device *device, u64 physical)
+{
+	struct tree_block_reada *req = NULL;
+	struct io_ring *ring;
+	void *buf;
+	int ret;
+
+	ring = get_reada_ring(fs_info);
+	if (!ring || fs_info->on_restoring)
+		return 1;
+	if (eb && eb->flags & (EXTENT_READAHEAD | EXTENT_BUFFER_FILLED))
+		return 0;
+
+	while (io_ring_full(ring)) {
+		ret = reap_tree_block_reada_batch(fs_info, true);
+		if (ret <= 0) {
+			abort_tree_block_reada(fs_info);
+			return 1;
+		}
+	}
+
+	if (eb)
+		extent_buffer_get(eb);
+	else
+		eb = alloc_extent_buffer(fs_info, bytenr, fs_info->nodesize);
+	if (!eb)
+		return 1;
+
+	eb->fd = device->fd;
+	eb->dev_bytenr = physical;
+	buf = eb->data;
+	if (direct_io_enabled()) {
+		req = calloc(1, sizeof(*req));
+		if (!req)
+			goto fail;
+		req->eb = eb;
+		if (direct_io_fd(eb->fd)) {
+			req->buf = direct_io_alloc(eb->len);
+			if (!req->buf)
+				goto fail;
+			buf = req->buf;
+		}
+	}
+	ret = io_ring_prep_read(ring, eb->fd, buf, eb->len, physical,
+				req ? (void *)req : eb);
+	if (ret < 0)
+		goto fail;
+	eb->flags |= EXTENT_READAHEAD;
+	return 0;
+
+fail:
+	if (req) {
+		direct_io_free(req->buf, eb->len);
+		free(req);
+	}
+	free_extent_buffer(eb);
+	return 1;
+}
+
+/*
+ * Start all tree block reads queued by readahead_tree_block() and collect
+ * the ones already finished. Callers issuing a batch of readahead should
+ * call this at the end, otherwise the reads are started only once the
+ * first of the blocks is needed.
+ */
+void readahead_tree_block_submit(struct btrfs_fs_info *fs_info)
+{
+	if (!fs_info->reada_ring)
+		return;
+	io_ring_submit(fs_info->reada_ring);
+	reap_tree_block_reada_batch(fs_info, false);
+}
+
+static void drain_tree_block_reada(struct btrfs_fs_info *fs_info)
+{
+	if (!fs_info->reada_ring)
+		return;
+	while (fs_info->reada_ring->inflight) {
+		if (reap_tree_block_reada(fs_info, true, NULL) <= 0) {
+			abort_tree_block_reada(fs_info);
+			/* It's not an error, the ring can be set up again */
+			fs_info->no_reada_ring = 0;
+			return;
+		}
+	}
+	io_ring_exit(fs_info->reada_ring);
+	free(fs_info->reada_ring);
+	fs_info->reada_ring = NULL;
+}
+
+/*
+ * Quiesce the asynchronous machinery of @fs_info before fork(): the readahead
+ * ring is shared memory, a child must not see completions of the parent's
+ * reads. The ring is set up again on the next readahead.
+ */
+void btrfs_prepare_fork(struct btrfs_fs_info *fs_info)
+{
+	drain_tree_block_reada(fs_info);
+}
+
+/*
+ * In the child after fork(), only the calling thread exists, forget the
+ * checksum and read threads of the parent so new ones get started on first use
+ */
+void btrfs_after_fork_child(struct btrfs_fs_info *fs_info)
+{
+	fs_info->csum_pool = NULL;
+	fs_info->read_pool = NULL;
+}
+
 struct extent_buffer *btrfs_find_tree_block(struct btrfs_fs_info *fs_info,
 					    u64 bytenr, u32 blocksize)
 {
-	return find_extent_buffer(&fs_info->extent_cache,
-				  bytenr, blocksize);
+	struct extent_buffer *eb;
+
+	eb = find_extent_buffer(&fs_info->extent_cache, bytenr, blocksize);
+	if (eb)
+		wait_tree_block_reada(eb);
+	return eb;
 }
 
 struct extent_buffer* btrfs_find_create_tree_block(
 		struct btrfs_fs_info *fs_info, u64 bytenr)
 {
-	return alloc_extent_buffer(fs_info, bytenr, fs_info->nodesize);
+	struct extent_buffer *eb;
+
+	eb = alloc_extent_buffer(fs_info, bytenr, fs_info->nodesize);
+	if (eb)
+		wait_tree_block_reada(eb);
+	return eb;
 }
 
 void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
@@ -250,16 +705,25 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 
-	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+	eb = find_extent_buffer(&fs_info->extent_cache, bytenr,
+				fs_info->nodesize);
+	if (eb && eb->flags & EXTENT_READAHEAD)
+		goto out;
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
 	    !btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
 			     NULL)) {
 		device = multi->stripes[0].dev;
 		device->total_ios++;
-		readahead(device->fd, multi->stripes[0].physical,
-				fs_info->nodesize);
+		/* The page cache is bypassed with direct I/O, no hint then */
+		if ((length < fs_info->nodesize || device->fd <= 0 ||
+		     queue_tree_block_reada(fs_info, eb, bytenr, device,
+					    multi->stripes[0].physical)) &&
+		    !direct_io_fd(device->fd))
+			readahead(device->fd, multi->stripes[0].physical,
+				  fs_info->nodesize);
 	}
 
+out:
 	free_extent_buffer(eb);
 	kfree(multi);
 }
@@ -348,6 +812,7 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 		ret = read_extent_from_disk(eb, offset, read_len);
 		if (ret)
 			return -EIO;
+		info->extent_cache.stats.bytes_read += read_len;
 		offset += read_len;
 		bytes_left -= read_len;
 	}
@@ -366,6 +831,7 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	int candidate_mirror = 0;
 	int num_copies;
 	int ignore = 0;
+	bool csum_ok;
 
 	/*
 	 * Don't even try to create tree block for unaligned tree block
@@ -383,13 +849,34 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	if (!eb)
 		return ERR_PTR(-ENOMEM);
 
-	if (btrfs_buffer_uptodate(eb, parent_transid))
+	if (btrfs_buffer_uptodate(eb, parent_transid)) {
+		fs_info->extent_cache.stats.hits++;
 		return eb;
+	}
+
+	fs_info->extent_cache.stats.misses++;
+	if (eb->flags & EXTENT_BUFFER_FILLED)
+		fs_info->extent_cache.stats.reada_hits++;
+	if (eb->flags & EXTENT_BUFFER_EVICTED) {
+		fs_info->extent_cache.stats.rereads++;
+		eb->flags &= ~EXTENT_BUFFER_EVICTED;
+	}
 
 	num_copies = btrfs_num_copies(fs_info, eb->start, eb->len);
 	while (1) {
-		ret = read_whole_eb(fs_info, eb, mirror_num);
-		if (ret == 0 && csum_tree_block(fs_info, eb, 1) == 0 &&
+		/* The first mirror could have been read by readahead already */
+		if (mirror_num == 1 && eb->flags & EXTENT_BUFFER_FILLED) {
+			/* Checksum could have been verified in a batch */
+			csum_ok = eb->flags & EXTENT_BUFFER_CSUM_OK;
+			eb->flags &= ~(EXTENT_BUFFER_FILLED |
+				       EXTENT_BUFFER_CSUM_OK);
+			ret = 0;
+		} else {
+			csum_ok = false;
+			ret = read_whole_eb(fs_info, eb, mirror_num);
+		}
+		if (ret == 0 &&
+		    (csum_ok || csum_tree_block(fs_info, eb, 1) == 0) &&
 		    check_tree_block(fs_info, eb) == 0 &&
 		    verify_parent_transid(&fs_info->extent_cache, eb,
 					  parent_transid, ignore) == 0) {
@@ -485,7 +972,7 @@ int read_extent_data(struct btrfs_fs_info *fs_info, char *data, u64 logical,
 		goto err;
 	}
 
-	ret = pread64(device->fd, data, *len, multi->stripes[0].physical);
+	ret = btrfs_pread(device->fd, data, *len, multi->stripes[0].physical);
 	if (ret != *len)
 		ret = -EIO;
 	else
@@ -546,9 +1033,10 @@ out:
 	return 0;
 }
 
-int write_tree_block(struct btrfs_trans_handle *trans,
-		     struct btrfs_fs_info *fs_info,
-		     struct extent_buffer *eb)
+/* Verify @eb and finalize its header before it's written and checksummed */
+static void prepare_tree_block_write(struct btrfs_trans_handle *trans,
+				     struct btrfs_fs_info *fs_info,
+				     struct extent_buffer *eb)
 {
 	if (check_tree_block(fs_info, eb)) {
 		print_tree_block_error(fs_info, eb,
@@ -560,11 +1048,240 @@ int write_tree_block(struct btrfs_trans_handle *trans,
 		BUG();
 
 	btrfs_set_header_flag(eb, BTRFS_HEADER_FLAG_WRITTEN);
-	csum_tree_block(fs_info, eb, 0);
+}
 
+int write_tree_block(struct btrfs_trans_handle *trans,
+		     struct btrfs_fs_info *fs_info,
+		     struct extent_buffer *eb)
+{
+	prepare_tree_block_write(trans, fs_info, eb);
+	csum_tree_block(fs_info, eb, 0);
 	return write_and_map_eb(fs_info, eb);
 }
 
+/* One copy of a tree block to be written to @device at @physical */
+struct tree_block_write {
+	struct btrfs_device *device;
+	u64 physical;
+	struct extent_buffer *eb;
+};
+
+/* Writes to one device, sorted by physical offset */
+struct device_writeback {
+	pthread_t thread;
+	bool started;
+	struct tree_block_write *writes;
+	int nr;
+	int ret;
+};
+
+static int cmp_tree_block_write(const void *a, const void *b)
+{
+	const struct tree_block_write *wa = a;
+	const struct tree_block_write *wb = b;
+
+	if (wa->device->devid != wb->device->devid)
+		return wa->device->devid < wb->device->devid ? -1 : 1;
+	if (wa->device != wb->device)
+		return wa->device < wb->device ? -1 : 1;
+	if (wa->physical != wb->physical)
+		return wa->physical < wb->physical ? -1 : 1;
+	return 0;
+}
+
+/* Write all of @iov to @fd at @offset, retrying short writes */
+static int pwritev_full(int fd, struct iovec *iov, int iovcnt, u64 offset)
+{
+	ssize_t ret;
+
+	if (direct_io_fd(fd))
+		return direct_io_pwritev(fd, iov, iovcnt, offset);
+
+	while (iovcnt) {
+		ret = pwritev(fd, iov, iovcnt, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the sorted tree blocks of one device, blocks that are adjacent on the
+ * device are merged into one vectored write
+ */
+static void *device_writeback_worker(void *data)
+{
+	struct device_writeback *dw = data;
+	struct iovec iov[IOV_MAX];
+	int i = 0;
+	int ret;
+
+	while (i < dw->nr) {
+		struct tree_block_write *first = &dw->writes[i];
+		u64 len = 0;
+		int cnt = 0;
+
+		while (i < dw->nr && cnt < IOV_MAX &&
+		       dw->writes[i].physical == first->physical + len) {
+			iov[cnt].iov_base = dw->writes[i].eb->data;
+			iov[cnt].iov_len = dw->writes[i].eb->len;
+			len += dw->writes[i].eb->len;
+			cnt++;
+			i++;
+		}
+		ret = pwritev_full(first->device->fd, iov, cnt,
+				   first->physical);
+		if (ret < 0) {
+			errno = -ret;
+			error(
+	"failed to write tree blocks from %llu length %llu devid %llu dev_bytenr %llu: %m",
+				first->eb->start, len, first->device->devid,
+				first->physical);
+			dw->ret = ret;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write a batch of tree blocks, like write_tree_block() for each of them.
+ *
+ * The checksums are computed as one batch, on the checksum threads. Copies of
+ * all the blocks are sorted by device and physical offset, copies adjacent on a
+ * device are merged into one pwritev() and the devices are written in
+ * parallel. RAID56 blocks are written one by one as they need the
+ * read-modify-write of the full stripe.
+ *
+ * Return 0 if all blocks were written, or the last error.
+ */
+int write_tree_blocks(struct btrfs_trans_handle *trans,
+		      struct btrfs_fs_info *fs_info,
+		      struct extent_buffer **ebs, int nr)
+{
+	struct tree_block_write *writes = NULL;
+	struct device_writeback *dws = NULL;
+	int nr_writes = 0;
+	int alloced = 0;
+	int nr_dws = 0;
+	int err = 0;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		prepare_tree_block_write(trans, fs_info, ebs[i]);
+	csum_tree_blocks(fs_info, ebs, nr, false);
+
+	for (i = 0; i < nr; i++) {
+		struct extent_buffer *eb = ebs[i];
+		struct btrfs_multi_bio *multi = NULL;
+		u64 *raid_map = NULL;
+		u64 length = eb->len;
+		int dev_nr;
+
+		ret = btrfs_map_block(fs_info, WRITE, eb->start, &length,
+				      &multi, 0, &raid_map);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to map bytenr %llu length %u: %m",
+			      eb->start, eb->len);
+			err = ret;
+			continue;
+		}
+		if (raid_map) {
+			ret = write_raid56_with_parity(fs_info, eb, multi,
+						       length, raid_map);
+			if (ret < 0) {
+				errno = -ret;
+				error(
+		"failed to write raid56 stripe for bytenr %llu length %llu: %m",
+					eb->start, length);
+				err = ret;
+			}
+			kfree(raid_map);
+			kfree(multi);
+			continue;
+		}
+
+		if (nr_writes + multi->num_stripes > alloced) {
+			struct tree_block_write *tmp;
+
+			alloced = max(alloced * 2, nr_writes + multi->num_stripes);
+			tmp = realloc(writes, alloced * sizeof(*writes));
+			if (!tmp) {
+				kfree(multi);
+				err = -ENOMEM;
+				goto out;
+			}
+			writes = tmp;
+		}
+		for (dev_nr = 0; dev_nr < multi->num_stripes; dev_nr++) {
+			struct tree_block_write *write = &writes[nr_writes++];
+
+			write->device = multi->stripes[dev_nr].dev;
+			write->physical = multi->stripes[dev_nr].physical;
+			write->eb = eb;
+			write->device->total_ios++;
+			eb->fd = write->device->fd;
+			eb->dev_bytenr = write->physical;
+		}
+		kfree(multi);
+	}
+	if (!nr_writes)
+		goto out;
+
+	qsort(writes, nr_writes, sizeof(*writes), cmp_tree_block_write);
+	for (i = 0; i < nr_writes; i++)
+		if (i == 0 || writes[i].device != writes[i - 1].device)
+			nr_dws++;
+	dws = calloc(nr_dws, sizeof(*dws));
+	if (!dws) {
+		err = -ENOMEM;
+		goto out;
+	}
+	nr_dws = 0;
+	for (i = 0; i < nr_writes; i++) {
+		if (i == 0 || writes[i].device != writes[i - 1].device)
+			dws[nr_dws++].writes = &writes[i];
+		dws[nr_dws - 1].nr++;
+	}
+
+	/* The first device is written by this thread */
+	for (i = 1; i < nr_dws; i++) {
+		ret = pthread_create(&dws[i].thread, NULL,
+				     device_writeback_worker, &dws[i]);
+		if (ret)
+			device_writeback_worker(&dws[i]);
+		else
+			dws[i].started = true;
+	}
+	device_writeback_worker(&dws[0]);
+	for (i = 0; i < nr_dws; i++) {
+		if (dws[i].started)
+			pthread_join(dws[i].thread, NULL);
+		if (dws[i].ret)
+			err = dws[i].ret;
+	}
+out:
+	free(dws);
+	free(writes);
+	return err;
+}
+
 void btrfs_setup_root(struct btrfs_root *root, struct btrfs_fs_info *fs_info,
 		      u64 objectid)
 {
@@ -803,6 +1520,8 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 	free(fs_info->uuid_root);
 	free(fs_info->super_copy);
 	free(fs_info->log_root_tree);
+	work_pool_destroy(fs_info->csum_pool);
+	work_pool_destroy(fs_info->read_pool);
 	free(fs_info);
 }
 
@@ -1101,6 +1820,7 @@ FREE_EXTENT_CACHE_BASED_TREE(mapping_cache, free_map_lookup);
 
 void btrfs_cleanup_all_caches(struct btrfs_fs_info *fs_info)
 {
+	drain_tree_block_reada(fs_info);
 	while (!list_empty(&fs_info->recow_ebs)) {
 		struct extent_buffer *eb;
 		eb = list_first_entry(&fs_info->recow_ebs,
@@ -1597,7 +2317,7 @@ int btrfs_read_dev_super(int fd, struct btrfs_super_block *sb, u64 sb_bytenr,
 	u64 bytenr;
 
 	if (sb_bytenr != BTRFS_SUPER_INFO_OFFSET) {
-		ret = pread64(fd, buf, BTRFS_SUPER_INFO_SIZE, sb_bytenr);
+		ret = btrfs_pread(fd, buf, BTRFS_SUPER_INFO_SIZE, sb_bytenr);
 		/* real error */
 		if (ret < 0)
 			return -errno;
@@ -1625,7 +2345,7 @@ int btrfs_read_dev_super(int fd, struct btrfs_super_block *sb, u64 sb_bytenr,
 
 	for (i = 0; i < max_super; i++) {
 		bytenr = btrfs_sb_offset(i);
-		ret = pread64(fd, buf, BTRFS_SUPER_INFO_SIZE, bytenr);
+		ret = btrfs_pread(fd, buf, BTRFS_SUPER_INFO_SIZE, bytenr);
 		if (ret < BTRFS_SUPER_INFO_SIZE)
 			break;
 
@@ -1697,9 +2417,9 @@ static int write_dev_supers(struct btrfs_fs_info *fs_info,
 		 * super_copy is BTRFS_SUPER_INFO_SIZE bytes and is
 		 * zero filled, we can use it directly
 		 */
-		ret = pwrite64(device->fd, fs_info->super_copy,
-				BTRFS_SUPER_INFO_SIZE,
-				fs_info->super_bytenr);
+		ret = btrfs_pwrite(device->fd, fs_info->super_copy,
+				   BTRFS_SUPER_INFO_SIZE,
+				   fs_info->super_bytenr);
 		if (ret != BTRFS_SUPER_INFO_SIZE) {
 			errno = EIO;
 			error(
@@ -1732,8 +2452,8 @@ static int write_dev_supers(struct btrfs_fs_info *fs_info,
 		 * super_copy is BTRFS_SUPER_INFO_SIZE bytes and is
 		 * zero filled, we can use it directly
 		 */
-		ret = pwrite64(device->fd, fs_info->super_copy,
-				BTRFS_SUPER_INFO_SIZE, bytenr);
+		ret = btrfs_pwrite(device->fd, fs_info->super_copy,
+				   BTRFS_SUPER_INFO_SIZE, bytenr);
 		if (ret != BTRFS_SUPER_INFO_SIZE) {
 			errno = EIO;
 			error(
@@ -135,6 +135,9 @@ int read_extent_data(struct btrfs_fs_info *fs_info, char *data, u64 logical,
 		     u64 *len, int mirror);
 void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 			  u64 parent_transid);
+void readahead_tree_block_submit(struct btrfs_fs_info *fs_info);
+void btrfs_prepare_fork(struct btrfs_fs_info *fs_info);
+void btrfs_after_fork_child(struct btrfs_fs_info *fs_info);
 struct extent_buffer* btrfs_find_create_tree_block(
 		struct btrfs_fs_info *fs_info, u64 bytenr);
 
@@ -190,6 +193,10 @@ void btrfs_mark_buffer_dirty(struct extent_buffer *buf);
 int btrfs_buffer_uptodate(struct extent_buffer *buf, u64 parent_transid);
 int btrfs_set_buffer_uptodate(struct extent_buffer *buf);
 int btrfs_csum_data(u16 csum_type, const u8 *data, u8 *out, size_t len);
+int btrfs_csum_data_multi(u16 csum_type, const u8 *data, u32 sectorsize,
+			  int nr, u8 *out);
+void btrfs_csum_data_batch(struct btrfs_fs_info *fs_info, const u8 *data,
+			   u32 nr, u8 *out);
 
 int btrfs_open_device(struct btrfs_device *dev);
 int csum_tree_block_size(struct extent_buffer *buf, u16 csum_sectorsize,
@@ -197,10 +204,16 @@ int csum_tree_block_size(struct extent_buffer *buf, u16 csum_sectorsize,
 int verify_tree_block_csum_silent(struct extent_buffer *buf, u16 csum_size,
 				  u16 csum_type);
 int btrfs_read_buffer(struct extent_buffer *buf, u64 parent_transid);
+/* Environment variable with the number of checksum threads, 1 to disable */
+#define BTRFS_CSUM_THREADS_ENV		"BTRFS_CSUM_THREADS"
+
 int write_tree_block(struct btrfs_trans_handle *trans,
 		     struct btrfs_fs_info *fs_info,
 		     struct extent_buffer *eb);
 int write_and_map_eb(struct btrfs_fs_info *fs_info, struct extent_buffer *eb);
+int write_tree_blocks(struct btrfs_trans_handle *trans,
+		      struct btrfs_fs_info *fs_info,
+		      struct extent_buffer **ebs, int nr);
 int btrfs_fs_roots_compare_roots(struct rb_node *node1, struct rb_node *node2);
 struct btrfs_root *btrfs_create_tree(struct btrfs_trans_handle *trans,
 				     struct btrfs_fs_info *fs_info,
@@ -30,14 +30,45 @@
 #include "kernel-shared/volumes.h"
 #include "common/utils.h"
 #include "common/internal.h"
+#include "common/memory-budget.h"
+#include "common/direct-io.h"
+#include "common/work-pool.h"
 
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
 	cache_tree_init(&tree->state);
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
+	INIT_LIST_HEAD(&tree->hot_lru);
+	cache_tree_init(&tree->ghost);
+	INIT_LIST_HEAD(&tree->ghost_lru);
+	tree->index = NULL;
+	tree->index_bits = 0;
+	tree->index_count = 0;
 	tree->cache_size = 0;
-	tree->max_cache_size = (u64)total_memory() / 4;
+	tree->hot_size = 0;
+	tree->ghost_size = 0;
+	/*
+	 * Without an explicit budget leave the rest of the memory to the other
+	 * users, the cache is trimmed anyway once the total goes over budget.
+	 */
+	tree->max_cache_size = memory_budget();
+	if (!memory_budget_is_explicit())
+		tree->max_cache_size /= 4;
+	tree->cache_policy = bconf.cache_policy;
+	if (tree->cache_policy == EXTENT_CACHE_POLICY_DEFAULT)
+		tree->cache_policy = EXTENT_CACHE_POLICY_LRU;
+	memset(&tree->stats, 0, sizeof(tree->stats));
+}
+
+/* Return the policy value for the name @str or -EINVAL */
+int parse_extent_cache_policy(const char *str)
+{
+	if (!strcmp(str, "lru"))
+		return EXTENT_CACHE_POLICY_LRU;
+	if (!strcmp(str, "2q"))
+		return EXTENT_CACHE_POLICY_2Q;
+	return -EINVAL;
 }
 
 void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
@@ -77,22 +108,160 @@ static void free_extent_state_func(struct cache_extent *cache)
 	btrfs_free_extent_state(es);
 }
 
+#define EXTENT_BUFFER_INDEX_MIN_BITS	(10)
+
+static inline u64 eb_index_hash(const struct extent_io_tree *tree, u64 bytenr)
+{
+	/* Tree blocks are at least sector aligned, the low bits are zero */
+	return ((bytenr >> 12) * 0x9E3779B97F4A7C15ULL) >>
+		(64 - tree->index_bits);
+}
+
+static struct extent_buffer *eb_index_lookup(struct extent_io_tree *tree,
+					     u64 bytenr)
+{
+	u64 mask = (1ULL << tree->index_bits) - 1;
+	u64 i;
+
+	if (!tree->index)
+		return NULL;
+	for (i = eb_index_hash(tree, bytenr); tree->index[i];
+	     i = (i + 1) & mask) {
+		if (tree->index[i]->start == bytenr)
+			return tree->index[i];
+	}
+	return NULL;
+}
+
+static void eb_index_add(struct extent_io_tree *tree, struct extent_buffer *eb)
+{
+	u64 mask = (1ULL << tree->index_bits) - 1;
+	u64 i;
+
+	for (i = eb_index_hash(tree, eb->start); tree->index[i];
+	     i = (i + 1) & mask)
+		;
+	tree->index[i] = eb;
+	tree->index_count++;
+}
+
+/* Resize the index to keep it at most half full */
+static int eb_index_grow(struct extent_io_tree *tree)
+{
+	struct extent_buffer **old = tree->index;
+	unsigned int old_bits = tree->index_bits;
+	unsigned int bits;
+	u64 i;
+
+	if (old && (tree->index_count + 1) * 2 <= (1ULL << old_bits))
+		return 0;
+
+	bits = old ? old_bits + 1 : EXTENT_BUFFER_INDEX_MIN_BITS;
+	tree->index = calloc(1ULL << bits, sizeof(*tree->index));
+	if (!tree->index) {
+		tree->index = old;
+		return -ENOMEM;
+	}
+	tree->index_bits = bits;
+	tree->index_count = 0;
+	if (old) {
+		for (i = 0; i < (1ULL << old_bits); i++)
+			if (old[i])
+				eb_index_add(tree, old[i]);
+		free(old);
+	}
+	return 0;
+}
+
+static int eb_index_insert(struct extent_io_tree *tree,
+			   struct extent_buffer *eb)
+{
+	int ret;
+
+	ret = eb_index_grow(tree);
+	if (ret < 0)
+		return ret;
+	eb_index_add(tree, eb);
+	return 0;
+}
+
+/*
+ * Remove @eb and move the following entries of the probe sequence back, so
+ * no tombstones are needed.
+ */
+static void eb_index_remove(struct extent_io_tree *tree,
+			    struct extent_buffer *eb)
+{
+	u64 mask = (1ULL << tree->index_bits) - 1;
+	u64 i;
+	u64 j;
+	u64 home;
+
+	for (i = eb_index_hash(tree, eb->start); tree->index[i] != eb;
+	     i = (i + 1) & mask)
+		BUG_ON(!tree->index[i]);
+
+	for (j = (i + 1) & mask; tree->index[j]; j = (j + 1) & mask) {
+		home = eb_index_hash(tree, tree->index[j]->start);
+		/* Entry at j can be moved to i if i is between home and j */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			tree->index[i] = tree->index[j];
+			i = j;
+		}
+	}
+	tree->index[i] = NULL;
+	tree->index_count--;
+}
+
+/*
+ * Remembers the range of an evicted buffer, to count the blocks read again
+ * and to find the ones to promote to the 2Q main list
+ */
+struct extent_buffer_ghost {
+	struct cache_extent cache_node;
+	struct list_head lru;
+	/* Evicted from the 2Q probation list */
+	bool promote;
+};
+
 static void free_extent_buffer_final(struct extent_buffer *eb);
-void extent_io_tree_cleanup(struct extent_io_tree *tree)
+static void free_extent_buffer_list(struct list_head *lru)
 {
 	struct extent_buffer *eb;
 
-	while(!list_empty(&tree->lru)) {
-		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
+	while(!list_empty(lru)) {
+		eb = list_entry(lru->next, struct extent_buffer, lru);
 		if (eb->refs) {
 			fprintf(stderr,
 				"extent buffer leak: start %llu len %u\n",
 				(unsigned long long)eb->start, eb->len);
+			eb->refs = 1;
 			free_extent_buffer_nocache(eb);
 		} else {
 			free_extent_buffer_final(eb);
 		}
 	}
+}
+
+static void free_ghost_func(struct cache_extent *cache)
+{
+	struct extent_buffer_ghost *ghost;
+
+	ghost = container_of(cache, struct extent_buffer_ghost, cache_node);
+	free(ghost);
+}
+
+void extent_io_tree_cleanup(struct extent_io_tree *tree)
+{
+	free_extent_buffer_list(&tree->lru);
+	free_extent_buffer_list(&tree->hot_lru);
+	free(tree->index);
+	tree->index = NULL;
+	tree->index_bits = 0;
+	tree->index_count = 0;
+	cache_tree_free_extents(&tree->ghost, free_ghost_func);
+	INIT_LIST_HEAD(&tree->ghost_lru);
+	tree->ghost_size = 0;
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
 }
@@ -648,8 +817,14 @@ static void free_extent_buffer_final(struct extent_buffer *eb)
 		struct extent_io_tree *tree = &eb->fs_info->extent_cache;
 
 		remove_cache_extent(&tree->cache, &eb->cache_node);
+		eb_index_remove(tree, eb);
 		BUG_ON(tree->cache_size < eb->len);
 		tree->cache_size -= eb->len;
+		memory_uncharge(eb->len);
+		if (eb->flags & EXTENT_BUFFER_HOT) {
+			BUG_ON(tree->hot_size < eb->len);
+			tree->hot_size -= eb->len;
+		}
 	}
 	free(eb);
 }
@@ -683,19 +858,98 @@ void free_extent_buffer_nocache(struct extent_buffer *eb)
 	free_extent_buffer_internal(eb, 1);
 }
 
-struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
-					 u64 bytenr, u32 blocksize)
+/*
+ * Update position of @eb in the cache after it's been found by a lookup,
+ * according to the cache policy.
+ *
+ * For 2Q the buffers on the probation list are not moved, a block is
+ * typically looked up several times in a row (readahead, read, search) and
+ * that must not count as reuse.
+ */
+static void touch_extent_buffer(struct extent_io_tree *tree,
+				struct extent_buffer *eb)
 {
-	struct extent_buffer *eb = NULL;
+	if (eb->flags & EXTENT_BUFFER_HOT)
+		list_move_tail(&eb->lru, &tree->hot_lru);
+	else if (tree->cache_policy == EXTENT_CACHE_POLICY_LRU)
+		list_move_tail(&eb->lru, &tree->lru);
+}
+
+/* Add a newly allocated @eb to the cache lists */
+static void insert_extent_buffer_lru(struct extent_io_tree *tree,
+				     struct extent_buffer *eb)
+{
+	struct extent_buffer_ghost *ghost;
 	struct cache_extent *cache;
+	bool promote;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+	cache = lookup_cache_extent(&tree->ghost, eb->start, eb->len);
+	if (cache && cache->start == eb->start && cache->size == eb->len) {
+		ghost = container_of(cache, struct extent_buffer_ghost,
+				     cache_node);
+		promote = ghost->promote;
+		remove_cache_extent(&tree->ghost, cache);
+		list_del(&ghost->lru);
+		tree->ghost_size -= cache->size;
+		free(ghost);
+
+		/* Counted as a re-read once the data are read */
+		eb->flags |= EXTENT_BUFFER_EVICTED;
+		if (promote) {
+			eb->flags |= EXTENT_BUFFER_HOT;
+			tree->hot_size += eb->len;
+			list_add_tail(&eb->lru, &tree->hot_lru);
+			return;
+		}
 	}
+	list_add_tail(&eb->lru, &tree->lru);
+}
+
+/* Remember an evicted buffer, @promote if it was on the 2Q probation list */
+static void add_extent_buffer_ghost(struct extent_io_tree *tree,
+				    struct extent_buffer *eb, bool promote)
+{
+	struct extent_buffer_ghost *ghost;
+
+	/*
+	 * The ghost list covers twice the cache size, check comes back to
+	 * blocks after it went through other trees that don't fit in the
+	 * cache. An entry is about 1/200 of a 16K buffer.
+	 */
+	while (tree->ghost_size &&
+	       tree->ghost_size + eb->len > tree->max_cache_size * 2) {
+		ghost = list_first_entry(&tree->ghost_lru,
+					 struct extent_buffer_ghost, lru);
+		remove_cache_extent(&tree->ghost, &ghost->cache_node);
+		list_del(&ghost->lru);
+		tree->ghost_size -= ghost->cache_node.size;
+		free(ghost);
+	}
+
+	ghost = malloc(sizeof(*ghost));
+	if (!ghost)
+		return;
+	ghost->cache_node.start = eb->start;
+	ghost->cache_node.size = eb->len;
+	ghost->promote = promote;
+	if (insert_cache_extent(&tree->ghost, &ghost->cache_node)) {
+		free(ghost);
+		return;
+	}
+	list_add_tail(&ghost->lru, &tree->ghost_lru);
+	tree->ghost_size += eb->len;
+}
+
+struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
+					 u64 bytenr, u32 blocksize)
+{
+	struct extent_buffer *eb;
+
+	eb = eb_index_lookup(tree, bytenr);
+	if (!eb || eb->len != blocksize)
+		return NULL;
+	touch_extent_buffer(tree, eb);
+	eb->refs++;
 	return eb;
 }
 
@@ -708,22 +962,68 @@ struct extent_buffer *find_first_extent_buffer(struct extent_io_tree *tree,
 	cache = search_cache_extent(&tree->cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
+		touch_extent_buffer(tree, eb);
 		eb->refs++;
 	}
 	return eb;
 }
 
-static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+/*
+ * Evict unreferenced buffers from @lru in list order until size of the
+ * cache drops to @target, or size of the buffers on @lru drops to @min.
+ */
+static void evict_extent_buffers(struct extent_io_tree *tree,
+				 struct list_head *lru, u64 target, u64 min)
 {
 	struct extent_buffer *eb, *tmp;
+	bool hot = (lru == &tree->hot_lru);
 
-	list_for_each_entry_safe(eb, tmp, &tree->lru, lru) {
-		if (eb->refs == 0)
-			free_extent_buffer_final(eb);
-		if (tree->cache_size <= ((tree->max_cache_size * 9) / 10))
+	list_for_each_entry_safe(eb, tmp, lru, lru) {
+		if (tree->cache_size <= target)
 			break;
+		if ((hot ? tree->hot_size :
+			   tree->cache_size - tree->hot_size) <= min)
+			break;
+		if (eb->refs)
+			continue;
+		add_extent_buffer_ghost(tree, eb, !hot &&
+				tree->cache_policy == EXTENT_CACHE_POLICY_2Q);
+		tree->stats.evictions++;
+		free_extent_buffer_final(eb);
+	}
+}
+
+static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+{
+	u64 target = (tree->max_cache_size * 9) / 10;
+	u64 charged = memory_charged();
+	u64 budget = memory_budget();
+
+	/*
+	 * Give back what the other users of the budget need, but keep a
+	 * minimum so the cache doesn't thrash on the current path.
+	 */
+	if (charged > budget) {
+		u64 over = charged - budget;
+		u64 floor = tree->max_cache_size / 16;
+
+		if (tree->cache_size > over)
+			target = min(target, max(tree->cache_size - over, floor));
+		else
+			target = min(target, floor);
 	}
+
+	/*
+	 * For 2Q evict from the probation list while it's over its share,
+	 * then from the main list. Fall back to everything that's not in use
+	 * in case the preferred list is pinned. The share is relative to the
+	 * target, when the other users of the budget squeeze the cache it must
+	 * not empty the main list first.
+	 */
+	if (tree->cache_policy == EXTENT_CACHE_POLICY_2Q)
+		evict_extent_buffers(tree, &tree->lru, target, target / 8);
+	evict_extent_buffers(tree, &tree->hot_lru, target, 0);
+	evict_extent_buffers(tree, &tree->lru, target, 0);
 }
 
 struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
@@ -733,15 +1033,11 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 	struct extent_io_tree *tree = &fs_info->extent_cache;
 	struct cache_extent *cache;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
-	} else {
+	eb = find_extent_buffer(tree, bytenr, blocksize);
+	if (!eb) {
 		int ret;
 
+		cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
@@ -751,13 +1047,21 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 		if (!eb)
 			return NULL;
 		ret = insert_cache_extent(&tree->cache, &eb->cache_node);
+		if (!ret) {
+			ret = eb_index_insert(tree, eb);
+			if (ret)
+				remove_cache_extent(&tree->cache,
+						    &eb->cache_node);
+		}
 		if (ret) {
 			free(eb);
 			return NULL;
 		}
-		list_add_tail(&eb->lru, &tree->lru);
+		insert_extent_buffer_lru(tree, eb);
 		tree->cache_size += blocksize;
-		if (tree->cache_size >= tree->max_cache_size)
+		memory_charge(blocksize);
+		if (tree->cache_size >= tree->max_cache_size ||
+		    memory_over_budget())
 			trim_extent_buffer_cache(tree);
 	}
 	return eb;
@@ -792,7 +1096,7 @@ int read_extent_from_disk(struct extent_buffer *eb,
 			  unsigned long offset, unsigned long len)
 {
 	int ret;
-	ret = pread(eb->fd, eb->data + offset, len, eb->dev_bytenr);
+	ret = btrfs_pread(eb->fd, eb->data + offset, len, eb->dev_bytenr);
 	if (ret < 0) {
 		ret = -errno;
 		goto out;
@@ -809,7 +1113,7 @@ out:
 int write_extent_to_disk(struct extent_buffer *eb)
 {
 	int ret;
-	ret = pwrite(eb->fd, eb->data, eb->len, eb->dev_bytenr);
+	ret = btrfs_pwrite(eb->fd, eb->data, eb->len, eb->dev_bytenr);
 	if (ret < 0)
 		goto out;
 	if (ret != eb->len) {
@@ -821,53 +1125,249 @@ out:
 	return ret;
 }
 
-int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
-			u64 bytes, int mirror)
+/* One contiguous piece of a data read, located on a single device */
+struct data_read {
+	struct btrfs_device *device;
+	u64 physical;
+	u64 logical;
+	u64 len;
+	char *buf;
+};
+
+/*
+ * Reads spread over several devices smaller than this are done by the calling
+ * thread, handing them to the read threads would cost more than it saves
+ */
+#define BTRFS_READ_PARALLEL_MIN		(SZ_1M)
+
+/* Pieces of a data read located on one device, sorted by physical offset */
+struct device_read {
+	struct data_read *reads;
+	int nr;
+	/* The piece that failed and the result of its read */
+	struct data_read *failed;
+	int ret;
+};
+
+static int cmp_data_read(const void *a, const void *b)
+{
+	const struct data_read *ra = a;
+	const struct data_read *rb = b;
+
+	if (ra->device->devid != rb->device->devid)
+		return ra->device->devid < rb->device->devid ? -1 : 1;
+	if (ra->device != rb->device)
+		return ra->device < rb->device ? -1 : 1;
+	if (ra->physical != rb->physical)
+		return ra->physical < rb->physical ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Map the whole range of a data read to pieces on the devices, one per
+ * stripe
+ */
+static int map_data_read(struct btrfs_fs_info *info, void *buf, u64 offset,
+			 u64 bytes, int mirror, struct data_read **reads_ret,
+			 int *nr_ret)
 {
 	struct btrfs_multi_bio *multi = NULL;
-	struct btrfs_device *device;
-	u64 bytes_left = bytes;
-	u64 read_len;
+	struct data_read *reads = NULL;
 	u64 total_read = 0;
+	u64 read_len;
+	int alloced = 0;
+	int nr = 0;
 	int ret;
 
-	while (bytes_left) {
-		read_len = bytes_left;
-		ret = btrfs_map_block(info, READ, offset, &read_len, &multi,
-				      mirror, NULL);
+	while (total_read < bytes) {
+		read_len = bytes - total_read;
+		ret = btrfs_map_block(info, READ, offset + total_read,
+				      &read_len, &multi, mirror, NULL);
 		if (ret) {
 			fprintf(stderr, "Couldn't map the block %Lu\n",
-				offset);
-			return -EIO;
+				offset + total_read);
+			ret = -EIO;
+			goto fail;
 		}
-		device = multi->stripes[0].dev;
-
-		read_len = min(bytes_left, read_len);
-		if (device->fd <= 0) {
+		if (multi->stripes[0].dev->fd <= 0) {
 			kfree(multi);
-			return -EIO;
+			ret = -EIO;
+			goto fail;
 		}
 
-		ret = pread(device->fd, buf + total_read, read_len,
-			    multi->stripes[0].physical);
-		kfree(multi);
-		if (ret < 0) {
-			fprintf(stderr, "Error reading %Lu, %d\n", offset,
-				ret);
-			return ret;
+		if (nr == alloced) {
+			struct data_read *tmp;
+
+			alloced = max(16, alloced * 2);
+			tmp = realloc(reads, alloced * sizeof(*reads));
+			if (!tmp) {
+				kfree(multi);
+				ret = -ENOMEM;
+				goto fail;
+			}
+			reads = tmp;
 		}
-		if (ret != read_len) {
-			fprintf(stderr, "Short read for %Lu, read %d, "
-				"read_len %Lu\n", offset, ret, read_len);
-			return -EIO;
+		read_len = min(bytes - total_read, read_len);
+		reads[nr].device = multi->stripes[0].dev;
+		reads[nr].physical = multi->stripes[0].physical;
+		reads[nr].logical = offset + total_read;
+		reads[nr].len = read_len;
+		reads[nr].buf = buf + total_read;
+		nr++;
+		kfree(multi);
+		multi = NULL;
+		total_read += read_len;
+	}
+	*reads_ret = reads;
+	*nr_ret = nr;
+	return 0;
+
+fail:
+	free(reads);
+	return ret;
+}
+
+static void read_device_pieces(struct device_read *dr)
+{
+	int i;
+
+	for (i = 0; i < dr->nr; i++) {
+		struct data_read *read = &dr->reads[i];
+
+		dr->ret = btrfs_pread(read->device->fd, read->buf, read->len,
+				      read->physical);
+		if (dr->ret < 0)
+			dr->ret = -errno;
+		if (dr->ret != read->len) {
+			dr->failed = read;
+			return;
 		}
+	}
+	dr->ret = 0;
+}
 
-		bytes_left -= read_len;
-		offset += read_len;
-		total_read += read_len;
+static void read_device_fn(void *data, int index)
+{
+	struct device_read *devs = data;
+
+	read_device_pieces(&devs[index]);
+}
+
+static int report_device_read(struct device_read *dr)
+{
+	struct data_read *read = dr->failed;
+
+	if (!read)
+		return 0;
+	if (dr->ret < 0) {
+		fprintf(stderr, "Error reading %Lu, %d\n", read->logical,
+			dr->ret);
+		return dr->ret;
 	}
+	fprintf(stderr, "Short read for %Lu, read %d, read_len %Lu\n",
+		read->logical, dr->ret, read->len);
+	return -EIO;
+}
 
-	return 0;
+/*
+ * Take the read threads, started with one per device on first use. Returns
+ * NULL if there are none or another read is using them, the caller then
+ * reads all devices itself.
+ */
+static struct work_pool *get_read_pool(struct btrfs_fs_info *fs_info)
+{
+	if (__atomic_exchange_n(&fs_info->read_pool_busy, 1, __ATOMIC_ACQUIRE))
+		return NULL;
+	if (!fs_info->read_pool && !fs_info->no_read_pool) {
+		int threads = min_t(u64,
+				btrfs_super_num_devices(fs_info->super_copy),
+				WORK_POOL_MAX_AUTO_THREADS);
+
+		fs_info->read_pool = work_pool_create(threads);
+		if (!fs_info->read_pool)
+			fs_info->no_read_pool = 1;
+	}
+	if (!fs_info->read_pool)
+		__atomic_store_n(&fs_info->read_pool_busy, 0, __ATOMIC_RELEASE);
+	return fs_info->read_pool;
+}
+
+static void put_read_pool(struct btrfs_fs_info *fs_info)
+{
+	__atomic_store_n(&fs_info->read_pool_busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read @bytes of data at logical address @offset from copy @mirror to @buf.
+ *
+ * The whole range is mapped first and each device reads its pieces in the
+ * order of the physical offsets. A big enough range spread over several
+ * devices (RAID0, RAID10, RAID5/6) is read from all of them at once on the
+ * read threads. Errors are reported here once all devices are done, in the
+ * order of the devices.
+ */
+int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
+			u64 bytes, int mirror)
+{
+	struct work_pool *pool = NULL;
+	struct device_read *devs;
+	struct data_read *reads;
+	int nr_devs = 1;
+	int nr;
+	int ret;
+	int i;
+
+	if (!bytes)
+		return 0;
+	ret = map_data_read(info, buf, offset, bytes, mirror, &reads, &nr);
+	if (ret < 0)
+		return ret;
+
+	qsort(reads, nr, sizeof(*reads), cmp_data_read);
+	for (i = 1; i < nr; i++)
+		if (reads[i].device != reads[i - 1].device)
+			nr_devs++;
+
+	if (nr_devs == 1) {
+		struct device_read dr = { .reads = reads, .nr = nr };
+
+		read_device_pieces(&dr);
+		ret = report_device_read(&dr);
+		goto out;
+	}
+
+	devs = calloc(nr_devs, sizeof(*devs));
+	if (!devs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	nr_devs = 0;
+	for (i = 0; i < nr; i++) {
+		if (i && reads[i].device == reads[i - 1].device) {
+			devs[nr_devs - 1].nr++;
+			continue;
+		}
+		devs[nr_devs].reads = &reads[i];
+		devs[nr_devs].nr = 1;
+		nr_devs++;
+	}
+
+	if (bytes >= BTRFS_READ_PARALLEL_MIN)
+		pool = get_read_pool(info);
+	work_pool_run(pool, read_device_fn, devs, nr_devs);
+	if (pool)
+		put_read_pool(info);
+
+	for (i = 0; i < nr_devs; i++) {
+		int err = report_device_read(&devs[i]);
+
+		if (err < 0 && !ret)
+			ret = err;
+	}
+	free(devs);
+out:
+	free(reads);
+	return ret;
 }
 
 int write_data_to_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
@@ -932,7 +1432,8 @@ int write_data_to_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 			this_len = min(this_len, bytes_left);
 			dev_nr++;
 
-			ret = pwrite(device->fd, buf + total_write, this_len, dev_bytenr);
+			ret = btrfs_pwrite(device->fd, buf + total_write, this_len,
+					  dev_bytenr);
 			if (ret != this_len) {
 				if (ret < 0) {
 					fprintf(stderr, "Error writing to "
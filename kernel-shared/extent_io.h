@@ -41,6 +41,10 @@
 #define EXTENT_CSUM		(1U << 9)
 #define EXTENT_BAD_TRANSID	(1U << 10)
 #define EXTENT_BUFFER_DUMMY	(1U << 11)
+#define EXTENT_READAHEAD	(1U << 12)
+#define EXTENT_BUFFER_HOT	(1U << 13)
+#define EXTENT_BUFFER_EVICTED	(1U << 14)
+#define EXTENT_BUFFER_CSUM_OK	(1U << 15)
 #define EXTENT_IOBITS (EXTENT_LOCKED | EXTENT_WRITEBACK)
 
 #define BLOCK_GROUP_DATA	(1U << 1)
@@ -68,12 +72,66 @@ static inline int le_test_bit(int nr, const u8 *addr)
 
 struct btrfs_fs_info;
 
+/*
+ * Eviction policy of the extent buffer cache:
+ *
+ * LRU: all buffers on one list, evicted in least recently used order
+ * 2Q:  scan resistant, new buffers go to a FIFO probation list (at least an
+ *      eighth of the cache) and only blocks read again after they've been
+ *      evicted from it are moved to the main LRU list. A full sweep of a big
+ *      tree then does not flush the upper levels that every search needs.
+ */
+enum extent_cache_policy {
+	EXTENT_CACHE_POLICY_DEFAULT = 0,
+	EXTENT_CACHE_POLICY_LRU,
+	EXTENT_CACHE_POLICY_2Q,
+};
+
+/*
+ * Statistics of the extent buffer cache, counted from opening the filesystem
+ *
+ * hits:       tree block reads satisfied from the cache
+ * misses:     tree block reads that needed data from the disk, either read
+ *             synchronously or waited for from readahead
+ * reada_hits: misses that found the data already read by readahead
+ * rereads:    misses of blocks that were evicted recently, i.e. would have
+ *             been hits with a bigger cache
+ * evictions:  buffers dropped from the cache to keep it within its size
+ * bytes_read: bytes of tree blocks read from the disk, including readahead
+ */
+struct extent_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 reada_hits;
+	u64 rereads;
+	u64 evictions;
+	u64 bytes_read;
+};
+
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
+	/*
+	 * Hash index of the buffers in @cache by start for exact lookups,
+	 * open addressing with linear probing, 1 << index_bits slots
+	 */
+	struct extent_buffer **index;
+	unsigned int index_bits;
+	u64 index_count;
+	/* LRU list, or the probation FIFO for 2Q */
 	struct list_head lru;
+	/* Main LRU list of 2Q */
+	struct list_head hot_lru;
+	/* Recently evicted buffers, for 2Q and the re-read statistics */
+	struct cache_tree ghost;
+	struct list_head ghost_lru;
 	u64 cache_size;
+	u64 hot_size;
+	u64 ghost_size;
 	u64 max_cache_size;
+	enum extent_cache_policy cache_policy;
+
+	struct extent_cache_stats stats;
 };
 
 struct extent_state {
@@ -105,6 +163,7 @@ static inline void extent_buffer_get(struct extent_buffer *eb)
 }
 
 void extent_io_tree_init(struct extent_io_tree *tree);
+int parse_extent_cache_policy(const char *str);
 void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
 				   u64 max_cache_size);
 void extent_io_tree_cleanup(struct extent_io_tree *tree);
@@ -119,12 +178,13 @@ int clear_extent_dirty(struct extent_io_tree *tree, u64 start, u64 end);
 static inline int set_extent_buffer_uptodate(struct extent_buffer *eb)
 {
 	eb->flags |= EXTENT_UPTODATE;
+	eb->flags &= ~EXTENT_BUFFER_FILLED;
 	return 0;
 }
 
 static inline int clear_extent_buffer_uptodate(struct extent_buffer *eb)
 {
-	eb->flags &= ~EXTENT_UPTODATE;
+	eb->flags &= ~(EXTENT_UPTODATE | EXTENT_BUFFER_FILLED);
 	return 0;
 }
 
@@ -27,9 +27,6 @@
 #include "crypto/crc32c.h"
 #include "common/internal.h"
 
-#define MAX_CSUM_ITEMS(r, size) ((((BTRFS_LEAF_DATA_SIZE(r->fs_info) - \
-			       sizeof(struct btrfs_item) * 2) / \
-			       size) - 1))
 int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     u64 objectid, u64 pos, u64 offset,
@@ -182,9 +179,10 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root, u64 alloc_end,
-			  u64 bytenr, char *data, size_t len)
+/* Store the checksum @csum of the data sector at @bytenr to the csum tree */
+static int insert_data_csum(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, u64 alloc_end,
+			    u64 bytenr, const u8 *csum)
 {
 	int ret = 0;
 	struct btrfs_key file_key;
@@ -195,16 +193,12 @@ int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 	struct btrfs_csum_item *item;
 	struct extent_buffer *leaf = NULL;
 	u64 csum_offset;
-	u8 csum_result[BTRFS_CSUM_SIZE];
 	u32 sectorsize = root->fs_info->sectorsize;
 	u32 nritems;
 	u32 ins_size;
 	u16 csum_size =
 		btrfs_super_csum_size(root->fs_info->super_copy);
 
-	u16 csum_type =
-		btrfs_super_csum_type(root->fs_info->super_copy);
-
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
@@ -315,21 +309,208 @@ csum:
 	item = (struct btrfs_csum_item *)((unsigned char *)item +
 					  csum_offset * csum_size);
 found:
-	btrfs_csum_data(csum_type, (u8 *)data, csum_result, len);
-	/* FIXME: does not make sense for non-crc32c */
-	if (csum_result == 0) {
-		printk("csum result is 0 for block %llu\n",
-		       (unsigned long long)bytenr);
-	}
-
-	write_extent_buffer(leaf, csum_result, (unsigned long)item,
-			    csum_size);
+	write_extent_buffer(leaf, csum, (unsigned long)item, csum_size);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 fail:
 	btrfs_free_path(path);
 	return ret;
 }
 
+int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, u64 alloc_end,
+			  u64 bytenr, char *data, size_t len)
+{
+	u8 csum_result[BTRFS_CSUM_SIZE];
+	u16 csum_type = btrfs_super_csum_type(root->fs_info->super_copy);
+
+	btrfs_csum_data(csum_type, (u8 *)data, csum_result, len);
+	return insert_data_csum(trans, root, alloc_end, bytenr, csum_result);
+}
+
+/*
+ * Store the checksums @csums of the @nr data sectors from @bytenr, if none of
+ * them has one yet. The csum item ending at @bytenr is extended as far as it
+ * can grow and the rest goes to new items inserted in one batch.
+ *
+ * Return 0 on success, 1 if some of the sectors have a checksum already and
+ * the caller has to insert them one by one, < 0 on errors.
+ */
+static int insert_data_csums(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, u64 bytenr, u32 nr,
+			     const u8 *csums)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_item_batch batch;
+	struct btrfs_path path;
+	struct btrfs_key file_key;
+	struct btrfs_key found_key;
+	struct extent_buffer *leaf;
+	struct btrfs_key *keys = NULL;
+	u32 *sizes = NULL;
+	const void **data = NULL;
+	u32 sectorsize = fs_info->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	u32 max_csums = MAX_CSUM_ITEMS(root, csum_size);
+	u64 end = bytenr + (u64)nr * sectorsize;
+	u64 item_end;
+	u32 item_size;
+	u32 extend = 0;
+	u32 start;
+	int nr_items;
+	int slot;
+	int i;
+	int ret;
+
+	btrfs_init_path(&path);
+	file_key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	file_key.type = BTRFS_EXTENT_CSUM_KEY;
+	file_key.offset = bytenr;
+
+	ret = btrfs_search_slot(NULL, root, &file_key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret == 0) {
+		ret = 1;
+		goto out;
+	}
+
+	/* The previous item must end before @bytenr, grow it if it ends at it */
+	leaf = path.nodes[0];
+	slot = path.slots[0];
+	if (slot > 0) {
+		btrfs_item_key_to_cpu(leaf, &found_key, slot - 1);
+		item_size = btrfs_item_size_nr(leaf, slot - 1) / csum_size;
+		item_end = found_key.offset + (u64)item_size * sectorsize;
+		if (found_key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    found_key.type == BTRFS_EXTENT_CSUM_KEY) {
+			if (item_end > bytenr)
+				goto out;
+			if (item_end == bytenr && item_size < max_csums)
+				extend = min(nr, max_csums - item_size);
+		}
+	}
+
+	/* And the next one must start after the range */
+	ret = 0;
+	if (slot >= btrfs_header_nritems(leaf)) {
+		ret = btrfs_next_leaf(root, &path);
+		if (ret < 0)
+			goto out;
+		slot = 0;
+	}
+	if (ret == 0) {
+		btrfs_item_key_to_cpu(path.nodes[0], &found_key, slot);
+		if (found_key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    found_key.type == BTRFS_EXTENT_CSUM_KEY &&
+		    found_key.offset < end) {
+			ret = 1;
+			goto out;
+		}
+	}
+	btrfs_release_path(&path);
+
+	if (extend) {
+		ret = btrfs_search_slot(trans, root, &file_key, &path,
+					extend * csum_size, 1);
+		if (ret < 0)
+			goto out;
+		BUG_ON(ret == 0);
+
+		/* Splitting the leaf may have moved the previous item away */
+		leaf = path.nodes[0];
+		slot = path.slots[0] - 1;
+		item_size = 0;
+		item_end = 0;
+		if (slot >= 0) {
+			btrfs_item_key_to_cpu(leaf, &found_key, slot);
+			item_size = btrfs_item_size_nr(leaf, slot);
+			item_end = found_key.offset +
+				   (u64)(item_size / csum_size) * sectorsize;
+		}
+		if (slot >= 0 &&
+		    found_key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    found_key.type == BTRFS_EXTENT_CSUM_KEY &&
+		    item_end == bytenr) {
+			path.slots[0] = slot;
+			btrfs_extend_item(root, &path, extend * csum_size);
+			write_extent_buffer(leaf, csums,
+					btrfs_item_ptr_offset(leaf, slot) +
+					item_size, extend * csum_size);
+			btrfs_mark_buffer_dirty(leaf);
+		} else {
+			extend = 0;
+		}
+		btrfs_release_path(&path);
+	}
+
+	ret = 0;
+	if (extend == nr)
+		goto out;
+
+	nr_items = (nr - extend + max_csums - 1) / max_csums;
+	keys = malloc(nr_items * sizeof(*keys));
+	sizes = malloc(nr_items * sizeof(*sizes));
+	data = malloc(nr_items * sizeof(*data));
+	if (!keys || !sizes || !data) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr_items; i++) {
+		start = extend + i * max_csums;
+		keys[i] = file_key;
+		keys[i].offset = bytenr + (u64)start * sectorsize;
+		sizes[i] = min(nr - start, max_csums) * csum_size;
+		data[i] = csums + start * csum_size;
+	}
+	batch.keys = keys;
+	batch.data_sizes = sizes;
+	batch.data = data;
+	batch.nr = nr_items;
+	ret = btrfs_insert_items(trans, root, &batch);
+out:
+	btrfs_release_path(&path);
+	free(keys);
+	free(sizes);
+	free(data);
+	return ret;
+}
+
+/*
+ * Like btrfs_csum_file_block() for all data sectors in [@bytenr,
+ * @bytenr + @len), the checksums are computed in one batch and inserted
+ * with as few tree searches as possible
+ */
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 alloc_end,
+			   u64 bytenr, char *data, size_t len)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	u32 nr = len / fs_info->sectorsize;
+	u8 *csums;
+	int ret = 0;
+	u32 i;
+
+	csums = malloc(nr * csum_size);
+	if (!csums)
+		return -ENOMEM;
+
+	btrfs_csum_data_batch(fs_info, (u8 *)data, nr, csums);
+	ret = insert_data_csums(trans, root, bytenr, nr, csums);
+	if (ret <= 0)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		ret = insert_data_csum(trans, root, alloc_end,
+				       bytenr + (u64)i * fs_info->sectorsize,
+				       csums + i * csum_size);
+		if (ret)
+			break;
+	}
+out:
+	free(csums);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
@@ -19,6 +19,7 @@
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/delayed-ref.h"
 #include "common/messages.h"
+#include "common/internal.h"
 
 struct btrfs_trans_handle* btrfs_start_transaction(struct btrfs_root *root,
 		int num_blocks)
@@ -127,32 +128,51 @@ int commit_tree_roots(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
+/*
+ * Write all dirty tree blocks. They're collected first and written in one
+ * batch, so the writes can be sorted and merged per device.
+ */
 int __commit_transaction(struct btrfs_trans_handle *trans,
 				struct btrfs_root *root)
 {
 	u64 start;
 	u64 end;
+	u64 cursor = 0;
 	struct btrfs_fs_info *fs_info = root->fs_info;
 	struct extent_buffer *eb;
+	struct extent_buffer **ebs = NULL;
 	struct extent_io_tree *tree = &fs_info->extent_cache;
+	int nr = 0;
+	int alloced = 0;
 	int ret;
+	int i;
 
-	while(1) {
-		ret = find_first_extent_bit(tree, 0, &start, &end,
-					    EXTENT_DIRTY);
-		if (ret)
-			break;
-		while(start <= end) {
+	while (!find_first_extent_bit(tree, cursor, &start, &end,
+				      EXTENT_DIRTY)) {
+		while (start <= end) {
 			eb = find_first_extent_buffer(tree, start);
 			BUG_ON(!eb || eb->start != start);
-			ret = write_tree_block(trans, fs_info, eb);
-			BUG_ON(ret);
+			if (nr == alloced) {
+				struct extent_buffer **tmp;
+
+				alloced = max(alloced * 2, 1024);
+				tmp = realloc(ebs, alloced * sizeof(*ebs));
+				BUG_ON(!tmp);
+				ebs = tmp;
+			}
+			ebs[nr++] = eb;
 			start += eb->len;
-			clear_extent_buffer_dirty(eb);
-			free_extent_buffer(eb);
 		}
+		cursor = end + 1;
 	}
-	return 0;
+
+	ret = write_tree_blocks(trans, fs_info, ebs, nr);
+	for (i = 0; i < nr; i++) {
+		clear_extent_buffer_dirty(ebs[i]);
+		free_extent_buffer(ebs[i]);
+	}
+	free(ebs);
+	return ret;
 }
 
 int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
@@ -210,7 +230,7 @@ commit_tree:
 		if (ret < 0)
 			goto error;
 	}
-	__commit_transaction(trans, root);
+	ret = __commit_transaction(trans, root);
 	if (ret < 0)
 		goto error;
 
@@ -28,6 +28,7 @@
 #include "kernel-shared/print-tree.h"
 #include "kernel-shared/volumes.h"
 #include "common/utils.h"
+#include "common/direct-io.h"
 #include "kernel-lib/raid56.h"
 
 const struct btrfs_raid_attr btrfs_raid_array[BTRFS_NR_RAID_TYPES] = {
@@ -343,7 +344,7 @@ again:
 			}
 			if (posix_fadvise(device->fd, 0, 0, POSIX_FADV_DONTNEED))
 				fprintf(stderr, "Warning, could not drop caches\n");
-			close(device->fd);
+			direct_io_close(device->fd);
 			device->fd = -1;
 		}
 		device->writeable = 0;
@@ -395,7 +396,7 @@ int btrfs_open_devices(struct btrfs_fs_devices *fs_devices, int flags)
 			continue;
 		}
 
-		fd = open(device->name, flags);
+		fd = direct_io_open(device->name, flags);
 		if (fd < 0) {
 			ret = -errno;
 			error("cannot open device '%s': %m", device->name);
@@ -46,7 +46,7 @@
 #include "common/rbtree-utils.h"
 #include "mkfs/common.h"
 #include "mkfs/rootdir.h"
-#include "crypto/crc32c.h"
+#include "crypto/hash.h"
 #include "common/fsfeatures.h"
 #include "common/box.h"
 #include "check/qgroup-verify.h"
@@ -952,7 +952,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	struct btrfs_mkfs_config mkfs_cfg;
 	enum btrfs_csum_type csum_type = BTRFS_CSUM_TYPE_CRC32;
 
-	crc32c_optimization_init();
+	hash_init_accel();
 
 	while(1) {
 		int c;
@@ -312,6 +312,7 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	u64 cur_bytes;
 	u64 total_bytes;
 	struct extent_buffer *eb = NULL;
+	char *buffer = NULL;
 	int fd;
 
 	if (st->st_size == 0)
@@ -329,7 +330,7 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 
 	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root->fs_info) &&
 	    st->st_size < sectorsize) {
-		char *buffer = malloc(st->st_size);
+		buffer = malloc(st->st_size);
 
 		if (!buffer) {
 			ret = -ENOMEM;
@@ -341,13 +342,11 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 			error("cannot read %s at offset %llu length %llu: %m",
 				path_name, (unsigned long long)bytes_read,
 				(unsigned long long)st->st_size);
-			free(buffer);
 			goto end;
 		}
 
 		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
 						 buffer, st->st_size);
-		free(buffer);
 		goto end;
 	}
 
@@ -359,7 +358,8 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	 * against any raid type
 	 */
 	eb = calloc(1, sizeof(*eb) + sectorsize);
-	if (!eb) {
+	buffer = malloc(SZ_1M);
+	if (!eb || !buffer) {
 		ret = -ENOMEM;
 		goto end;
 	}
@@ -379,34 +379,30 @@ again:
 	first_block = key.objectid;
 	bytes_read = 0;
 
-	while (bytes_read < cur_bytes) {
-
-		memset(eb->data, 0, sectorsize);
+	memset(buffer, 0, cur_bytes);
+	ret_read = pread64(fd, buffer, cur_bytes, file_pos);
+	if (ret_read == -1) {
+		error("cannot read %s at offset %llu length %llu: %m",
+			path_name, (unsigned long long)file_pos,
+			(unsigned long long)cur_bytes);
+		goto end;
+	}
 
-		ret_read = pread64(fd, eb->data, sectorsize, file_pos +
-				   bytes_read);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %llu length %llu: %m",
-				path_name,
-				(unsigned long long)file_pos + bytes_read,
-				(unsigned long long)sectorsize);
-			goto end;
-		}
+	/*
+	 * we're doing the csum before we record the extent, but
+	 * that's ok
+	 */
+	ret = btrfs_csum_file_blocks(trans, root->fs_info->csum_root,
+				     first_block + cur_bytes, first_block,
+				     buffer, cur_bytes);
+	if (ret)
+		goto end;
 
+	while (bytes_read < cur_bytes) {
+		memcpy(eb->data, buffer + bytes_read, sectorsize);
 		eb->start = first_block + bytes_read;
 		eb->len = sectorsize;
 
-		/*
-		 * we're doing the csum before we record the extent, but
-		 * that's ok
-		 */
-		ret = btrfs_csum_file_block(trans, root->fs_info->csum_root,
-				first_block + bytes_read + sectorsize,
-				first_block + bytes_read,
-				eb->data, sectorsize);
-		if (ret)
-			goto end;
-
 		ret = write_and_map_eb(root->fs_info, eb);
 		if (ret) {
 			error("failed to write %s", path_name);
@@ -431,6 +427,7 @@ again:
 		goto again;
 
 end:
+	free(buffer);
 	free(eb);
 	close(fd);
 	return ret;
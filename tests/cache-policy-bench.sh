@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Compare the extent buffer cache policies on the tree block reads of check
+#
+# Usage:
+#
+# $ ./cache-policy-bench.sh <image> [<memory limit>...]
+#
+# The image is a filesystem image or a metadump made by btrfs-image, which is
+# restored to a temporary file first. Check runs in both modes with each
+# policy and memory limit (default: 32M 64M 128M 256M) and prints from the
+# tree block cache statistics:
+#
+# misses:    tree blocks read from the disk
+# rereads:   reads of blocks read before, the misses over those of a check
+#            with the default memory limit, where nothing is evicted on
+#            small filesystems
+# evictions: buffers dropped from the cache
+#
+# The 'rereads' of the statistics count only blocks evicted recently, they
+# depend on the policy and are not used here.
+#
+# Which buffers are still in use when the cache is trimmed depends on the
+# timing of the readahead, so the counts vary between runs. Each is the median
+# of $RUNS runs (default: 3). The binaries are taken from the top of the source
+# tree, or from $TOP.
+
+TOP=${TOP:-$(readlink -f "$(dirname "$0")/..")}
+BTRFS="$TOP/btrfs"
+BTRFS_IMAGE="$TOP/btrfs-image"
+RUNS=${RUNS:-3}
+
+if [ "$#" -lt 1 ]; then
+	echo "usage: $0 <image> [<memory limit>...]" >&2
+	exit 1
+fi
+image=$1
+shift
+limits=${*:-32M 64M 128M 256M}
+
+# Metadumps start with the cluster header magic
+magic=$(od -An -tx8 -N8 "$image" | tr -d ' ')
+if [ "$magic" = "bd5c25e27295668b" ]; then
+	restored=$(mktemp --tmpdir btrfs-bench.XXXXXX)
+	trap 'rm -f -- "$restored"' EXIT
+	if ! "$BTRFS_IMAGE" -r "$image" "$restored"; then
+		echo "cannot restore $image" >&2
+		exit 1
+	fi
+	image=$restored
+fi
+
+# Print value of the key $1 of the tree block cache statistics on stdin
+stat()
+{
+	local section='/"extent-cache-stats"/,/}/'
+
+	sed -n "${section}s/^ *\"$1\": \"\([0-9.]*\)\",\?$/\1/p"
+}
+
+# Run check with the options in "$@" $RUNS times, print the median misses and
+# evictions
+check_stats()
+{
+	local i
+	local stats
+
+	for ((i = 0; i < RUNS; i++)); do
+		stats=$("$BTRFS" "$@" --cache-stats=json "$image" 2> /dev/null)
+		echo "$(stat misses <<< "$stats") $(stat evictions <<< "$stats")"
+	done | sort -n | sed -n "$((RUNS / 2 + 1))p"
+}
+
+printf "%-8s %-9s %-7s %10s %10s %10s\n" limit mode policy misses rereads \
+	evictions
+for mode in original lowmem; do
+	read -r cold evictions < <(check_stats check --mode "$mode")
+	for limit in $limits; do
+		for policy in lru 2q; do
+			read -r misses evictions < <(check_stats \
+				--memory-limit "$limit" --cache-policy "$policy" \
+				check --mode "$mode")
+			printf "%-8s %-9s %-7s %10s %10s %10s\n" "$limit" \
+				"$mode" "$policy" "$misses" \
+				"$((misses - cold))" "$evictions"
+		done
+	done
+done
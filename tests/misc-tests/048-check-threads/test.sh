@@ -0,0 +1,55 @@
+#!/bin/bash
+# Verify that check prints the same when the subvolume trees are checked by
+# several worker processes, in both modes, and the data are verified by
+# several threads as when it's all done serially
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+check_prereq btrfs-map-logical
+
+compare_threads()
+{
+	local serial
+	local parallel
+
+	serial=$(run_check_stdout "$TOP/btrfs" check "$@")
+	parallel=$(run_check_stdout "$TOP/btrfs" check --threads 4 "$@")
+	if [ "$serial" != "$parallel" ]; then
+		_fail "different output with --threads for $*"
+	fi
+}
+
+for src in "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.img \
+	   "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.raw.xz; do
+	image=$(extract_image "$src")
+	compare_threads "$image"
+	compare_threads --mode=lowmem "$image"
+	rm -f -- "$image"
+done
+
+# Two copies of the data, one of them damaged
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f -d dup -r "$TOP/Documentation" "$TEST_DEV"
+compare_threads --check-data-csum "$TEST_DEV"
+
+logical=$(run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t csum \
+	"$TEST_DEV" | sed -n 's/.*key (EXTENT_CSUM EXTENT_CSUM \([0-9]*\)).*/\1/p' |
+	head -n 1)
+[ -n "$logical" ] || _fail "no data checksums found"
+physical=$(run_check_stdout "$TOP/btrfs-map-logical" -l "$logical" -b 4096 \
+	"$TEST_DEV" | sed -n 's/^mirror 1 logical [0-9]* physical \([0-9]*\) .*/\1/p')
+[ -n "$physical" ] || _fail "cannot map data at $logical"
+run_check dd if=/dev/zero of="$TEST_DEV" bs=1 count=16 seek="$physical" \
+	conv=notrunc
+serial=$(run_mustfail_stdout "data csum mismatch not detected" \
+	"$TOP/btrfs" check --check-data-csum "$TEST_DEV")
+parallel=$(run_mustfail_stdout "data csum mismatch not detected" \
+	"$TOP/btrfs" check --check-data-csum --threads 4 "$TEST_DEV")
+if ! echo "$serial" | grep -q "^mirror 1 bytenr $logical "; then
+	_fail "data csum mismatch at $logical not reported"
+fi
+if [ "$serial" != "$parallel" ]; then
+	_fail "different output with --threads for damaged data"
+fi
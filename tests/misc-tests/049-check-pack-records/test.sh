@@ -0,0 +1,53 @@
+#!/bin/bash
+# Verify that check prints the same when the extent records are packed in
+# memory and restored as when they're all kept as they are, and that they're
+# packed only under a memory limit
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+
+# The records are packed once they take a sixteenth of the memory limit, at
+# least a page, which is a few blocks with a tiny limit. All packed records
+# are restored by the end.
+compare_packed()
+{
+	local unpacked
+	local packed
+	local stats
+
+	unpacked=$(run_check_stdout "$TOP/btrfs" check "$@")
+	stats=$(run_check_stdout "$TOP/btrfs" check --cache-stats=json "$@")
+	if [ -n "$(cache_stats_value "$stats" records-packed)" ]; then
+		_fail "extent records packed without a memory limit for $*"
+	fi
+
+	packed=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check "$@")
+	if [ "$unpacked" != "$packed" ]; then
+		_fail "different output with packed extent records for $*"
+	fi
+	stats=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check \
+		--cache-stats=json "$@")
+	nr_packed=$(cache_stats_value "$stats" records-packed)
+	nr_restored=$(cache_stats_value "$stats" records-restored)
+	if [ "${nr_packed:-0}" != "${nr_restored:-0}" ]; then
+		_fail "$nr_packed extent records packed, $nr_restored restored for $*"
+	fi
+}
+
+for src in "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.img \
+	   "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.raw.xz; do
+	image=$(extract_image "$src")
+	compare_packed "$image"
+	rm -f -- "$image"
+done
+
+# Enough extents to pack them several times
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f -r "$TOP/Documentation" "$TEST_DEV"
+compare_packed "$TEST_DEV"
+if [ -z "$nr_packed" ] || [ "$nr_packed" -eq 0 ]; then
+	_fail "no extent records packed with a memory limit"
+fi
+compare_packed --threads 2 "$TEST_DEV"
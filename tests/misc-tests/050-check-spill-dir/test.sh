@@ -0,0 +1,61 @@
+#!/bin/bash
+# Verify that check prints the same when the extent records are spilled to
+# files and restored as when they're all kept in memory, and that the runs in
+# the files are merged once there are too many of them
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+
+spill_dir=$(mktemp --tmpdir -d btrfs-progs-050-check-spill-dir.XXXXXXXXXX)
+
+# With a tiny memory limit the records are spilled before every block
+compare_spill()
+{
+	local in_memory
+	local spilled
+
+	in_memory=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check "$@")
+	spilled=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check \
+		--spill-dir "$spill_dir" "$@")
+	if [ "$in_memory" != "$spilled" ]; then
+		_fail "different output with --spill-dir for $*"
+	fi
+}
+
+for src in "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.img \
+	   "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.raw.xz; do
+	image=$(extract_image "$src")
+	compare_spill "$image"
+	rm -f -- "$image"
+done
+
+# Enough data extents in small leaves for more than 16 runs, so they're merged
+src_dir=$(mktemp --tmpdir -d btrfs-progs-050-check-spill-src.XXXXXXXXXX)
+for i in $(seq 3000); do
+	head -c 5000 /dev/urandom > "$src_dir/file$i"
+done
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f -n 4096 -r "$src_dir" "$TEST_DEV"
+rm -rf -- "$src_dir"
+compare_spill "$TEST_DEV"
+stats=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check \
+	--spill-dir "$spill_dir" --cache-stats=json "$TEST_DEV")
+spilled=$(cache_stats_value "$stats" records-spilled)
+restored=$(cache_stats_value "$stats" spilled-records-restored)
+merges=$(cache_stats_value "$stats" spill-run-merges)
+if [ -z "$spilled" ] || [ "$spilled" -eq 0 ]; then
+	_fail "no extent records spilled"
+fi
+if [ "$spilled" != "$restored" ]; then
+	_fail "$spilled extent records spilled, $restored restored"
+fi
+if [ -z "$merges" ] || [ "$merges" -eq 0 ]; then
+	_fail "spilled runs not merged"
+fi
+
+if [ -n "$(ls -A "$spill_dir")" ]; then
+	_fail "files left in the spill directory"
+fi
+rmdir "$spill_dir"
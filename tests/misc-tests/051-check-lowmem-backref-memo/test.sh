@@ -0,0 +1,61 @@
+#!/bin/bash
+# Verify that the lowmem check prints the same when most of the memoized
+# backref lookups are evicted from a tiny table as with the default one, and
+# that the tiny table really evicts them
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+
+# The table takes 1/16 of the memory limit, with 1 byte it has one set of
+# four entries
+compare_memo()
+{
+	local default
+	local tiny
+	local stats
+	local evictions
+	local stored
+
+	default=$(run_check_stdout "$TOP/btrfs" check --mode=lowmem "$@")
+	tiny=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check \
+		--mode=lowmem "$@")
+	if [ "$default" != "$tiny" ]; then
+		_fail "different output with a tiny backref memo for $*"
+	fi
+
+	stats=$(run_check_stdout "$TOP/btrfs" check --mode=lowmem \
+		--cache-stats=json "$@")
+	evictions=$(cache_stats_value "$stats" evictions backref-memo-stats)
+	if [ "$evictions" != 0 ]; then
+		_fail "backref lookups evicted from the default table for $*"
+	fi
+
+	stats=$(run_check_stdout "$TOP/btrfs" --memory-limit 1 check \
+		--mode=lowmem --cache-stats=json "$@")
+	evictions=$(cache_stats_value "$stats" evictions backref-memo-stats)
+	if [ "$evictions" -eq 0 ]; then
+		_fail "no backref lookups evicted from a tiny table for $*"
+	fi
+	stored=$(cache_stats_value "$stats" results-stored backref-memo-stats)
+	if [ "$stored" -gt 4 ]; then
+		_fail "more results stored than fit in a tiny table for $*"
+	fi
+}
+
+for src in "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.img \
+	   "$TEST_TOP"/fsck-tests/020-extent-ref-cases/*.raw.xz; do
+	image=$(extract_image "$src")
+	compare_memo "$image"
+	rm -f -- "$image"
+done
+
+image=$(extract_image \
+	"$TEST_TOP/fsck-tests/020-extent-ref-cases/keyed_data_ref_with_shared_leaf.img")
+stats=$(run_check_stdout "$TOP/btrfs" check --mode=lowmem --cache-stats=json \
+	"$image")
+hits=$(cache_stats_value "$stats" hits backref-memo-stats)
+if [ "$hits" -eq 0 ]; then
+	_fail "no memoized backref lookups hit"
+fi
+rm -f -- "$image"
@@ -0,0 +1,83 @@
+#!/bin/bash
+# Verify that check saves its progress with --resume, continues from a saved
+# checkpoint and starts over with one of another filesystem or generation
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+
+checkpoint=$(mktemp --tmpdir btrfs-progs-052-check-resume.XXXXXXXXXX)
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f -r "$TOP/Documentation" "$TEST_DEV"
+
+full=$(run_check_stdout "$TOP/btrfs" check "$TEST_DEV")
+
+# A new check with a missing file, it's removed once the check is complete
+rm -f -- "$checkpoint"
+resumed=$(run_check_stdout "$TOP/btrfs" check --resume "$checkpoint" \
+	"$TEST_DEV")
+if [ "$full" != "$resumed" ]; then
+	_fail "different output with --resume and no checkpoint"
+fi
+if [ -e "$checkpoint" ]; then
+	_fail "checkpoint left after a complete check"
+fi
+
+# Anything else than a checkpoint is not overwritten
+echo "not a checkpoint" > "$checkpoint"
+run_mustfail "used a file that is not a checkpoint" \
+	"$TOP/btrfs" check --resume "$checkpoint" "$TEST_DEV"
+grep -q "not a checkpoint" "$checkpoint" || _fail "file overwritten"
+
+# Checkpoint after the free space phase of the original mode, the counters
+# are taken from the full check
+write_checkpoint()
+{
+	local generation="$1"
+
+	echo "btrfs-check-checkpoint 1"
+	echo "$full" | awk '/^UUID:/ { print "fsid", $2 }'
+	echo "generation $generation"
+	echo "mode 0"
+	echo "data-csum 0"
+	echo "phases 7"
+	echo "err 0"
+	echo "transid-errors 0"
+	echo "$full" | awk '
+		/^found .* bytes used/ { c[0] = $2 }
+		/^total csum bytes:/ { c[1] = $4 }
+		/^total tree bytes:/ { c[2] = $4 }
+		/^total fs tree bytes:/ { c[3] = $5 }
+		/^total extent tree bytes:/ { c[4] = $5 }
+		/^btree space waste bytes:/ { c[5] = $5 }
+		/^file data blocks allocated:/ { c[6] = $5 }
+		/^ referenced/ { c[7] = $2 }
+		END { print "counters", c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7] }'
+	echo "roots 0 0 0 0 0 0 0"
+}
+
+generation=$(run_check_stdout "$TOP/btrfs" inspect-internal dump-super \
+	"$TEST_DEV" | awk '/^generation/ { print $2 }')
+
+write_checkpoint "$generation" > "$checkpoint"
+resumed=$(run_check_stdout "$TOP/btrfs" check --resume "$checkpoint" \
+	"$TEST_DEV")
+echo "$resumed" | grep -q "checking extents... done before the checkpoint" ||
+	_fail "extents checked again after resuming"
+if [ "$(echo "$full" | sed -n '/^found/,$p')" != \
+     "$(echo "$resumed" | sed -n '/^found/,$p')" ]; then
+	_fail "different summary after resuming"
+fi
+
+write_checkpoint $((generation + 1)) > "$checkpoint"
+resumed=$(run_check_stdout "$TOP/btrfs" check --resume "$checkpoint" \
+	"$TEST_DEV")
+echo "$resumed" | grep -q "starting over" ||
+	_fail "checkpoint of another generation used"
+if [ -e "$checkpoint" ]; then
+	_fail "checkpoint left after a complete check"
+fi
+
+rm -f -- "$checkpoint"
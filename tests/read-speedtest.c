@@ -0,0 +1,213 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Measure throughput of read_data_from_disk() on all data extents
+ *
+ * Usage:
+ *
+ * $ ./read-speedtest [-b bufsize] [-m mirror] <device> [<device>...]
+ *
+ * The data extents are read in the order of their logical addresses, in
+ * pieces of at most the buffer size (default: 1MiB). All devices of a
+ * filesystem on several devices, e.g. RAID0 on loop devices, are given on
+ * the command line, there's no device scanning. Set BTRFS_DIRECT_IO=1 so
+ * the page cache doesn't serve the reads, or drop the caches before each
+ * run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/utils.h"
+
+static int read_data_extents(struct btrfs_fs_info *fs_info, char *buf,
+			     u64 bufsize, int mirror, u64 *extents_ret,
+			     u64 *bytes_ret)
+{
+	struct btrfs_root *root = fs_info->extent_root;
+	struct btrfs_path path;
+	struct btrfs_key key = { 0 };
+	u64 extents = 0;
+	u64 bytes = 0;
+	int ret;
+
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_extent_item *ei;
+		u64 offset;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.type != BTRFS_EXTENT_ITEM_KEY)
+			goto next;
+		ei = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_extent_item);
+		if (!(btrfs_extent_flags(leaf, ei) & BTRFS_EXTENT_FLAG_DATA))
+			goto next;
+
+		for (offset = 0; offset < key.offset; offset += bufsize) {
+			u64 len = min(bufsize, key.offset - offset);
+
+			ret = read_data_from_disk(fs_info, buf,
+						  key.objectid + offset, len,
+						  mirror);
+			if (ret < 0) {
+				errno = -ret;
+				error("cannot read data at %llu: %m",
+				      key.objectid + offset);
+				goto out;
+			}
+		}
+		extents++;
+		bytes += key.offset;
+next:
+		path.slots[0]++;
+	}
+	ret = 0;
+	*extents_ret = extents;
+	*bytes_ret = bytes;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static int scan_device(const char *path)
+{
+	struct btrfs_fs_devices *fs_devices;
+	u64 total_devs;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		error("cannot open %s: %m", path);
+		return -errno;
+	}
+	ret = btrfs_scan_one_device(fd, path, &fs_devices, &total_devs,
+				    BTRFS_SUPER_INFO_OFFSET, 0);
+	close(fd);
+	if (ret < 0)
+		error("no valid btrfs found on %s", path);
+	return ret;
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	struct btrfs_fs_info *fs_info;
+	struct timespec start, end;
+	u64 bufsize = SZ_1M;
+	u64 extents = 0;
+	u64 bytes = 0;
+	char *buf;
+	int mirror = 0;
+	unsigned int flags = 0;
+	double secs;
+	int ret;
+	int i;
+
+	while (1) {
+		int c = getopt(argc, argv, "b:m:");
+
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'b':
+			bufsize = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			mirror = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+		"usage: read-speedtest [-b bufsize] [-m mirror] <device> [<device>...]\n");
+			return 1;
+		}
+	}
+	if (optind == argc || !bufsize) {
+		fprintf(stderr,
+		"usage: read-speedtest [-b bufsize] [-m mirror] <device> [<device>...]\n");
+		return 1;
+	}
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		error("not enough memory");
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (scan_device(argv[i]) < 0) {
+			free(buf);
+			return 1;
+		}
+	}
+	if (argc - optind > 1)
+		flags |= OPEN_CTREE_NO_DEVICES;
+
+	fs_info = open_ctree_fs_info(argv[optind], 0, 0, 0, flags);
+	if (!fs_info) {
+		error("cannot open %s", argv[optind]);
+		free(buf);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = read_data_extents(fs_info, buf, bufsize, mirror, &extents, &bytes);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		ret = 1;
+		goto out;
+	}
+	secs = elapsed(&start, &end);
+
+	printf("Devices:    %llu\n",
+	       btrfs_super_num_devices(fs_info->super_copy));
+	printf("Extents:    %llu\n", extents);
+	printf("Bytes:      %llu\n", bytes);
+	printf("Buffer:     %llu\n", bufsize);
+	printf("Time:       %.3f s\n", secs);
+	printf("Throughput: %.1f MiB/s\n", bytes / secs / SZ_1M);
+	ret = 0;
+out:
+	close_ctree_fs_info(fs_info);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,223 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Measure throughput of btrfs_search_slot() with a warm extent buffer cache
+ *
+ * Usage:
+ *
+ * $ ./search-speedtest [-s] [-t treeid] [-n searches] <device>
+ *
+ * All keys of the tree (default: the FS tree) are collected and searched
+ * once to read every block to the cache, then the given number of searches
+ * for keys in random order is timed.
+ *
+ * With -s the tree block checks done on each level are skipped, so the time
+ * is mostly spent in the key search inside the extent buffers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "common/messages.h"
+#include "common/utils.h"
+
+static int collect_keys(struct btrfs_root *root, struct btrfs_key **keys_ret,
+			u64 *nr_ret)
+{
+	struct btrfs_path path;
+	struct btrfs_key key = { 0 };
+	struct btrfs_key *keys = NULL;
+	u64 nr = 0;
+	u64 alloced = 0;
+	int ret;
+
+	btrfs_init_path(&path);
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		if (nr == alloced) {
+			struct btrfs_key *tmp;
+
+			alloced = max_t(u64, 1024, alloced * 2);
+			tmp = realloc(keys, alloced * sizeof(*keys));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			keys = tmp;
+		}
+		btrfs_item_key_to_cpu(leaf, &keys[nr++], path.slots[0]);
+		path.slots[0]++;
+	}
+	ret = 0;
+	*keys_ret = keys;
+	*nr_ret = nr;
+out:
+	btrfs_release_path(&path);
+	if (ret < 0)
+		free(keys);
+	return ret;
+}
+
+static int search_keys(struct btrfs_root *root, struct btrfs_key *keys,
+		       u64 nr, u64 count, bool skip_check)
+{
+	struct btrfs_path path;
+	u64 i;
+	int ret;
+
+	btrfs_init_path(&path);
+	for (i = 0; i < count; i++) {
+		path.skip_check_block = skip_check;
+		ret = btrfs_search_slot(NULL, root, &keys[i % nr], &path, 0, 0);
+		btrfs_release_path(&path);
+		if (ret) {
+			error("key (%llu %u %llu) not found: %d",
+			      keys[i % nr].objectid, keys[i % nr].type,
+			      keys[i % nr].offset, ret);
+			return ret < 0 ? ret : -ENOENT;
+		}
+	}
+	return 0;
+}
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_root *root;
+	struct btrfs_key key;
+	struct btrfs_key *keys = NULL;
+	struct timespec start, end;
+	u64 treeid = BTRFS_FS_TREE_OBJECTID;
+	u64 searches = 1000000;
+	u64 nr;
+	u64 i;
+	bool skip_check = false;
+	double secs;
+	int ret;
+
+	while (1) {
+		int c = getopt(argc, argv, "st:n:");
+
+		if (c < 0)
+			break;
+		switch (c) {
+		case 's':
+			skip_check = true;
+			break;
+		case 't':
+			treeid = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			searches = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr,
+		"usage: search-speedtest [-s] [-t treeid] [-n searches] <device>\n");
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		fprintf(stderr,
+		"usage: search-speedtest [-s] [-t treeid] [-n searches] <device>\n");
+		return 1;
+	}
+
+	fs_info = open_ctree_fs_info(argv[optind], 0, 0, 0, 0);
+	if (!fs_info) {
+		error("cannot open %s", argv[optind]);
+		return 1;
+	}
+
+	key.objectid = treeid;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = (u64)-1;
+	root = btrfs_read_fs_root(fs_info, &key);
+	if (IS_ERR(root)) {
+		error("cannot read tree %llu: %ld", treeid, PTR_ERR(root));
+		ret = 1;
+		goto out;
+	}
+
+	ret = collect_keys(root, &keys, &nr);
+	if (ret < 0 || !nr) {
+		error("cannot collect keys of tree %llu: %d", treeid, ret);
+		ret = 1;
+		goto out;
+	}
+
+	/* Random order, but the same for each run */
+	srand(1);
+	for (i = nr - 1; i > 0; i--) {
+		u64 j = ((u64)rand() * RAND_MAX + rand()) % (i + 1);
+		struct btrfs_key tmp = keys[i];
+
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+
+	/* Warm up, all blocks of the tree are read to the cache */
+	ret = search_keys(root, keys, nr, nr, skip_check);
+	if (ret < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = search_keys(root, keys, nr, searches, skip_check);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		ret = 1;
+		goto out;
+	}
+	secs = elapsed(&start, &end);
+
+	printf("Tree:       %llu\n", treeid);
+	printf("Keys:       %llu\n", nr);
+	printf("Levels:     %d\n", btrfs_header_level(root->node) + 1);
+	printf("Checks:     %s\n", skip_check ? "skipped" : "on");
+	printf("Searches:   %llu\n", searches);
+	printf("Time:       %.3f s\n", secs);
+	printf("Throughput: %.0f searches/s\n", searches / secs);
+	printf("Latency:    %.1f ns/search\n", secs * 1000000000.0 / searches);
+	ret = 0;
+out:
+	free(keys);
+	close_ctree_fs_info(fs_info);
+	return ret;
+}